@@ -22,6 +22,9 @@
  * You should now have a new /dev/mydevice character device. To "unmount" it,
  * kill the "cuse" process.
  *
+ * With --splice, read replies and write requests are spliced, so
+ * that the data is not copied on its way through the device.
+ *
  * To compile this example, run
  *
  *     gcc -Wall cuse.c `pkg-config fuse3 --cflags --libs` -o cuse
@@ -46,6 +49,7 @@
 
 static void *cusexmp_buf;
 static size_t cusexmp_size;
+static int cusexmp_splice;
 
 static const char *usage =
 "usage: cusexmp [options]\n"
@@ -55,6 +59,7 @@ static const char *usage =
 "    --maj=MAJ|-M MAJ      device major number\n"
 "    --min=MIN|-m MIN      device minor number\n"
 "    --name=NAME|-n NAME   device name (mandatory)\n"
+"    --splice              splice the data of reads and writes\n"
 "    -d   -o debug         enable debug output (implies -f)\n"
 "    -f                    foreground operation\n"
 "    -s                    disable multi-threaded operation\n"
@@ -87,6 +92,15 @@ static int cusexmp_expand(size_t new_size)
 	return 0;
 }
 
+static void cusexmp_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void)userdata;
+
+	/* Reading with splice is asked for by having write_buf */
+	if (cusexmp_splice)
+		conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+}
+
 static void cusexmp_open(fuse_req_t req, struct fuse_file_info *fi)
 {
 	fuse_reply_open(req, fi);
@@ -102,6 +116,14 @@ static void cusexmp_read(fuse_req_t req, size_t size, off_t off,
 	if (size > cusexmp_size - off)
 		size = cusexmp_size - off;
 
+	if (cusexmp_splice) {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+		bufv.buf[0].mem = cusexmp_buf + off;
+		fuse_reply_data(req, &bufv, 0);
+		return;
+	}
+
 	fuse_reply_buf(req, cusexmp_buf + off, size);
 }
 
@@ -119,6 +141,28 @@ static void cusexmp_write(fuse_req_t req, const char *buf, size_t size,
 	fuse_reply_write(req, size);
 }
 
+static void cusexmp_write_buf(fuse_req_t req, struct fuse_bufvec *bufv,
+			      off_t off, struct fuse_file_info *fi)
+{
+	size_t size = fuse_buf_size(bufv);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	ssize_t res;
+
+	(void)fi;
+
+	if (cusexmp_expand(off + size)) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	dst.buf[0].mem = cusexmp_buf + off;
+	res = fuse_buf_copy(&dst, bufv, 0);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
+}
+
 static void fioc_do_rw(fuse_req_t req, void *addr, const void *in_buf,
 		       size_t in_bufsz, size_t out_bufsz, int is_read)
 {
@@ -245,6 +289,7 @@ struct cusexmp_param {
 	unsigned		major;
 	unsigned		minor;
 	char			*dev_name;
+	int			splice;
 	int			is_help;
 };
 
@@ -257,6 +302,7 @@ static const struct fuse_opt cusexmp_opts[] = {
 	CUSEXMP_OPT("--min=%u",		minor),
 	CUSEXMP_OPT("-n %s",		dev_name),
 	CUSEXMP_OPT("--name=%s",	dev_name),
+	CUSEXMP_OPT("--splice",		splice),
 	FUSE_OPT_KEY("-h",		0),
 	FUSE_OPT_KEY("--help",		0),
 	FUSE_OPT_END
@@ -280,7 +326,8 @@ static int cusexmp_process_arg(void *data, const char *arg, int key,
 	}
 }
 
-static const struct cuse_lowlevel_ops cusexmp_clop = {
+static struct cuse_lowlevel_ops cusexmp_clop = {
+	.init		= cusexmp_init,
 	.open		= cusexmp_open,
 	.read		= cusexmp_read,
 	.write		= cusexmp_write,
@@ -290,7 +337,7 @@ static const struct cuse_lowlevel_ops cusexmp_clop = {
 int main(int argc, char **argv)
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	struct cusexmp_param param = { 0, 0, NULL, 0 };
+	struct cusexmp_param param = { 0, 0, NULL, 0, 0 };
 	char dev_name[128] = "DEVNAME=";
 	const char *dev_info_argv[] = { dev_name };
 	struct cuse_info ci;
@@ -311,6 +358,11 @@ int main(int argc, char **argv)
 		free(param.dev_name);
 	}
 
+	if (param.splice) {
+		cusexmp_splice = 1;
+		cusexmp_clop.write_buf = cusexmp_write_buf;
+	}
+
 	memset(&ci, 0, sizeof(ci));
 	ci.dev_major = param.major;
 	ci.dev_minor = param.minor;
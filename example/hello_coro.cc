@@ -0,0 +1,227 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/** @file
+ *
+ * hello_ll.c with request handlers written as C++20 coroutines
+ *
+ * The read handler does not answer the request itself. It starts a
+ * coroutine that moves to a thread pool for the (pretend) expensive
+ * part and replies from there, while the session loop goes on with
+ * the next request.
+ *
+ * Compile with:
+ *
+ *     g++ -std=c++20 -Wall hello_coro.cc `pkg-config fuse3 --cflags --libs` -o hello_coro
+ *
+ * ## Source code ##
+ * \include hello_coro.cc
+ */
+
+#define FUSE_USE_VERSION 35
+
+#include <fuse_lowlevel.h>
+#include <fuse_coro.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static const std::string hello_str = "Hello World!\n";
+static const char *hello_name = "hello";
+
+static fuse::thread_pool pool(4);
+
+static int hello_stat(fuse_ino_t ino, struct stat *stbuf) {
+    stbuf->st_ino = ino;
+    switch (ino) {
+    case 1:
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        break;
+
+    case 2:
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = hello_str.size();
+        break;
+
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static void sfs_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
+    (void) fi;
+    struct stat stbuf {};
+
+    if (hello_stat(ino, &stbuf) == -1)
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_attr(req, &stbuf, 1.0);
+}
+
+static void sfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_entry_param e {};
+
+    if (parent != 1 || strcmp(name, hello_name) != 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    e.ino = 2;
+    e.attr_timeout = 1.0;
+    e.entry_timeout = 1.0;
+    hello_stat(e.ino, &e.attr);
+    fuse_reply_entry(req, &e);
+}
+
+static void dirbuf_add(fuse_req_t req, std::vector<char> &buf,
+                       const char *name, fuse_ino_t ino) {
+    struct stat stbuf {};
+    size_t oldsize = buf.size();
+
+    stbuf.st_ino = ino;
+    buf.resize(oldsize + fuse_add_direntry(req, nullptr, 0, name, nullptr, 0));
+    fuse_add_direntry(req, buf.data() + oldsize, buf.size() - oldsize, name,
+                      &stbuf, buf.size());
+}
+
+static void sfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, fuse_file_info *fi) {
+    (void) fi;
+    std::vector<char> buf;
+
+    if (ino != 1) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    dirbuf_add(req, buf, ".", 1);
+    dirbuf_add(req, buf, "..", 1);
+    dirbuf_add(req, buf, hello_name, 2);
+    if (static_cast<size_t>(off) < buf.size())
+        fuse_reply_buf(req, buf.data() + off,
+                       std::min(buf.size() - off, size));
+    else
+        fuse_reply_buf(req, nullptr, 0);
+}
+
+static void sfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
+    if (ino != 2)
+        fuse_reply_err(req, EISDIR);
+    else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        fuse_reply_err(req, EACCES);
+    else
+        fuse_reply_open(req, fi);
+}
+
+// Only the request and plain values are passed in, fi would be gone
+// after the first co_await.
+static fuse::task do_read(fuse::request req, size_t size, off_t off) {
+    std::string data = co_await fuse::run_on(pool, [size, off] {
+        if (static_cast<size_t>(off) >= hello_str.size())
+            return std::string();
+        return hello_str.substr(off, size);
+    });
+
+    if (req.interrupted())
+        req.reply_err(EINTR);
+    else
+        req.reply_buf(data.data(), data.size());
+}
+
+static void sfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                     fuse_file_info *fi) {
+    (void) ino;
+    (void) fi;
+    do_read(fuse::request(req), size, off);
+}
+
+static fuse_lowlevel_ops make_ops() {
+    fuse_lowlevel_ops ops {};
+
+    ops.lookup = sfs_lookup;
+    ops.getattr = sfs_getattr;
+    ops.readdir = sfs_readdir;
+    ops.open = sfs_open;
+    ops.read = sfs_read;
+    return ops;
+}
+
+int main(int argc, char *argv[]) {
+    fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    fuse_cmdline_opts opts;
+    fuse_loop_config config {};
+    fuse_lowlevel_ops ops = make_ops();
+    fuse_session *se;
+    int ret = -1;
+
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto err_out1;
+    } else if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        ret = 0;
+        goto err_out1;
+    }
+
+    if (opts.mountpoint == nullptr) {
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+        printf("       %s --help\n", argv[0]);
+        ret = 1;
+        goto err_out1;
+    }
+
+    se = fuse_session_new(&args, &ops, sizeof(ops), nullptr);
+    if (se == nullptr)
+        goto err_out1;
+
+    if (fuse_set_signal_handlers(se) != 0)
+        goto err_out2;
+
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+        goto err_out3;
+
+    // The pool starts its threads on first use, so forking here is fine
+    fuse_daemonize(opts.foreground);
+
+    if (opts.singlethread)
+        ret = fuse_session_loop(se);
+    else {
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        config.min_threads = opts.min_threads;
+        config.max_threads = opts.max_threads;
+        config.idle_timeout_ms = opts.idle_timeout_ms;
+        config.affinity = opts.affinity;
+        config.bulk_threads = opts.bulk_threads;
+        config.receivers = opts.receivers;
+        ret = fuse_session_loop_mt(se, &config);
+    }
+
+    fuse_session_unmount(se);
+err_out3:
+    fuse_remove_signal_handlers(se);
+err_out2:
+    fuse_session_destroy(se);
+err_out1:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return ret ? 1 : 0;
+}
@@ -94,6 +94,8 @@ static int lookup_cnt = 0;
 /* Command line parsing */
 struct options {
     int no_notify;
+    int batch;
+    int queue;
     float timeout;
     int update_interval;
 };
@@ -107,6 +109,8 @@ static struct options options = {
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("--no-notify", no_notify),
+    OPTION("--batch", batch),
+    OPTION("--queue", queue),
     OPTION("--update-interval=%d", update_interval),
     OPTION("--timeout=%f", timeout),
     FUSE_OPT_END
@@ -250,7 +254,21 @@ static void* update_fs_loop(void *data) {
     while(1) {
         old_name = strdup(file_name);
         update_fs();
-        if (!options.no_notify && lookup_cnt)
+        if (!options.no_notify && lookup_cnt && options.batch) {
+            /* The attributes of the file are dropped along with the name */
+            struct fuse_notify_entry entries[2] = {
+                { .type = FUSE_NOTIFY_TYPE_INVAL_ENTRY, .ino = FUSE_ROOT_ID,
+                  .name = old_name, .namelen = strlen(old_name) },
+                { .type = FUSE_NOTIFY_TYPE_INVAL_INODE, .ino = file_ino },
+            };
+            fuse_lowlevel_notify_batch(se, entries, 2);
+            assert(entries[0].error == 0);
+        } else if (!options.no_notify && lookup_cnt && options.queue) {
+            struct fuse_notify_entry entry = {
+                .type = FUSE_NOTIFY_TYPE_INVAL_ENTRY, .ino = FUSE_ROOT_ID,
+                .name = old_name, .namelen = strlen(old_name) };
+            assert(fuse_lowlevel_notify_queue(se, &entry) == 0);
+        } else if (!options.no_notify && lookup_cnt)
             assert(fuse_lowlevel_notify_inval_entry
                    (se, FUSE_ROOT_ID, old_name, strlen(old_name)) == 0);
         free(old_name);
@@ -266,6 +284,8 @@ static void show_help(const char *progname)
                "    --timeout=<secs>       Timeout for kernel caches\n"
                "    --update-interval=<secs>  Update-rate of file system contents\n"
                "    --no-notify            Disable kernel notifications\n"
+               "    --batch                Send notifications as a batch\n"
+               "    --queue                Queue notifications for sending\n"
                "\n");
 }
 
@@ -273,7 +293,7 @@ int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fuse_session *se;
     struct fuse_cmdline_opts opts;
-    struct fuse_loop_config config;
+    struct fuse_loop_config config = { 0 };
     pthread_t updater;
     int ret = -1;
 
@@ -325,6 +345,12 @@ int main(int argc, char *argv[]) {
     else {
         config.clone_fd = opts.clone_fd;
         config.max_idle_threads = opts.max_idle_threads;
+        config.min_threads = opts.min_threads;
+        config.max_threads = opts.max_threads;
+        config.idle_timeout_ms = opts.idle_timeout_ms;
+        config.affinity = opts.affinity;
+        config.bulk_threads = opts.bulk_threads;
+        config.receivers = opts.receivers;
         ret = fuse_session_loop_mt(se, &config);
     }
 
@@ -289,7 +289,7 @@ int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fuse_session *se;
     struct fuse_cmdline_opts opts;
-    struct fuse_loop_config config;
+    struct fuse_loop_config config = { 0 };
     pthread_t updater;
     int ret = -1;
 
@@ -344,6 +344,12 @@ int main(int argc, char *argv[]) {
     else {
         config.clone_fd = opts.clone_fd;
         config.max_idle_threads = opts.max_idle_threads;
+        config.min_threads = opts.min_threads;
+        config.max_threads = opts.max_threads;
+        config.idle_timeout_ms = opts.idle_timeout_ms;
+        config.affinity = opts.affinity;
+        config.bulk_threads = opts.bulk_threads;
+        config.receivers = opts.receivers;
         ret = fuse_session_loop_mt(se, &config);
     }
 
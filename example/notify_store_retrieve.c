@@ -89,6 +89,7 @@ static int retrieve_status = 0;
 /* Command line parsing */
 struct options {
     int no_notify;
+    int store_fd;
     int update_interval;
 };
 static struct options options = {
@@ -100,6 +101,7 @@ static struct options options = {
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("--no-notify", no_notify),
+    OPTION("--store-fd", store_fd),
     OPTION("--update-interval=%d", update_interval),
     FUSE_OPT_END
 };
@@ -291,6 +293,24 @@ static void update_fs(void) {
     assert(file_size != 0);
 }
 
+/* Stores the contents by way of a temporary file */
+static int store_from_file(struct fuse_session *se) {
+    char name[] = "/tmp/notify_store.XXXXXX";
+    int fd = mkstemp(name);
+    int ret;
+
+    if (fd == -1)
+        return -errno;
+    unlink(name);
+    if (write(fd, file_contents, file_size) != (ssize_t) file_size)
+        ret = -EIO;
+    else
+        ret = fuse_lowlevel_notify_store_fd(se, FILE_INO, fd, 0,
+                                            file_size, NULL);
+    close(fd);
+    return ret;
+}
+
 static void* update_fs_loop(void *data) {
     struct fuse_session *se = (struct fuse_session*) data;
     struct fuse_bufvec bufv;
@@ -310,7 +330,10 @@ static void* update_fs_loop(void *data) {
 
             /* This shouldn't fail, but apparently it sometimes
                does - see https://github.com/libfuse/libfuse/issues/105 */
-            ret = fuse_lowlevel_notify_store(se, FILE_INO, 0, &bufv, 0);
+            if (options.store_fd)
+                ret = store_from_file(se);
+            else
+                ret = fuse_lowlevel_notify_store(se, FILE_INO, 0, &bufv, 0);
             if (-ret == ENODEV) {
                 // File system was unmounted
                 break;
@@ -343,6 +366,7 @@ static void show_help(const char *progname)
     printf("File-system specific options:\n"
                "    --update-interval=<secs>  Update-rate of file system contents\n"
                "    --no-notify            Disable kernel notifications\n"
+               "    --store-fd             Store the contents from a file\n"
                "\n");
 }
 
@@ -350,7 +374,7 @@ int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fuse_session *se;
     struct fuse_cmdline_opts opts;
-    struct fuse_loop_config config;
+    struct fuse_loop_config config = { 0 };
     pthread_t updater;
     int ret = -1;
 
@@ -402,6 +426,12 @@ int main(int argc, char *argv[]) {
     else {
         config.clone_fd = opts.clone_fd;
         config.max_idle_threads = opts.max_idle_threads;
+        config.min_threads = opts.min_threads;
+        config.max_threads = opts.max_threads;
+        config.idle_timeout_ms = opts.idle_timeout_ms;
+        config.affinity = opts.affinity;
+        config.bulk_threads = opts.bulk_threads;
+        config.receivers = opts.receivers;
         ret = fuse_session_loop_mt(se, &config);
     }
 
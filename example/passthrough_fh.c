@@ -15,6 +15,10 @@
  * libc functions. This implementation is a little more sophisticated
  * than the one in passthrough.c, so performance is not quite as bad.
  *
+ * With --async, reads and writes are handed to a few I/O threads
+ * through the read_async and write_buf_async operations, and are
+ * completed from there.
+ *
  * Compile with:
  *
  *     gcc -Wall passthrough_fh.c `pkg-config fuse3 --cflags --libs` -lulockmgr -o passthrough_fh
@@ -50,6 +54,85 @@
 #include <sys/xattr.h>
 #endif
 #include <sys/file.h> /* flock(2) */
+#include <pthread.h>
+
+#define IO_THREADS 4
+
+struct io_job {
+	struct io_job *next;
+	fuse_async_t async;
+	int fd;
+	int write;
+	off_t off;
+	size_t size;
+	char *data;
+};
+
+static int async_io = 0;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static struct io_job *io_head;
+static struct io_job **io_tail = &io_head;
+
+static void *io_thread(void *arg)
+{
+	(void) arg;
+
+	while (1) {
+		struct io_job *job;
+		ssize_t res;
+
+		pthread_mutex_lock(&io_lock);
+		while (!io_head)
+			pthread_cond_wait(&io_cond, &io_lock);
+		job = io_head;
+		io_head = job->next;
+		if (!io_head)
+			io_tail = &io_head;
+		pthread_mutex_unlock(&io_lock);
+
+		if (job->write)
+			res = pwrite(job->fd, job->data, job->size, job->off);
+		else
+			res = pread(job->fd, job->data, job->size, job->off);
+
+		if (res == -1)
+			fuse_async_reply_err(job->async, errno);
+		else if (job->write)
+			fuse_async_reply_write(job->async, res);
+		else
+			fuse_async_reply_buf(job->async, job->data, res);
+
+		free(job->data);
+		free(job);
+	}
+	return NULL;
+}
+
+static int queue_io(fuse_async_t async, int fd, int write, off_t off,
+		    size_t size, char *data)
+{
+	struct io_job *job = malloc(sizeof(struct io_job));
+
+	if (job == NULL)
+		return -ENOMEM;
+
+	job->next = NULL;
+	job->async = async;
+	job->fd = fd;
+	job->write = write;
+	job->off = off;
+	job->size = size;
+	job->data = data;
+
+	pthread_mutex_lock(&io_lock);
+	*io_tail = job;
+	io_tail = &job->next;
+	pthread_cond_signal(&io_cond);
+	pthread_mutex_unlock(&io_lock);
+
+	return 0;
+}
 
 static void *xmp_init(struct fuse_conn_info *conn,
 		      struct fuse_config *cfg)
@@ -69,6 +152,17 @@ static void *xmp_init(struct fuse_conn_info *conn,
 	cfg->attr_timeout = 0;
 	cfg->negative_timeout = 0;
 
+	/* Started here, after fuse_main() has forked into the background */
+	if (async_io) {
+		pthread_t thread;
+		int i;
+
+		for (i = 0; i < IO_THREADS; i++) {
+			if (pthread_create(&thread, NULL, io_thread, NULL) == 0)
+				pthread_detach(thread);
+		}
+	}
+
 	return NULL;
 }
 
@@ -447,6 +541,44 @@ static int xmp_write_buf(const char *path, struct fuse_bufvec *buf,
 	return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
 }
 
+static int xmp_read_async(const char *path, size_t size, off_t offset,
+			  struct fuse_file_info *fi, fuse_async_t async)
+{
+	char *data = malloc(size ? size : 1);
+	int res;
+
+	(void) path;
+	if (data == NULL)
+		return -ENOMEM;
+
+	res = queue_io(async, fi->fh, 0, offset, size, data);
+	if (res)
+		free(data);
+	return res;
+}
+
+static int xmp_write_buf_async(const char *path, struct fuse_bufvec *buf,
+			       off_t offset, struct fuse_file_info *fi,
+			       fuse_async_t async)
+{
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	ssize_t res;
+
+	(void) path;
+	dst.buf[0].mem = malloc(size ? size : 1);
+	if (dst.buf[0].mem == NULL)
+		return -ENOMEM;
+
+	/* buf is only valid until we return */
+	res = fuse_buf_copy(&dst, buf, 0);
+	if (res >= 0)
+		res = queue_io(async, fi->fh, 1, offset, res, dst.buf[0].mem);
+	if (res)
+		free(dst.buf[0].mem);
+	return res;
+}
+
 static int xmp_statfs(const char *path, struct statvfs *stbuf)
 {
 	int res;
@@ -660,6 +792,21 @@ static const struct fuse_operations xmp_oper = {
 
 int main(int argc, char *argv[])
 {
+	enum { MAX_ARGS = 10 };
+	int i,new_argc;
+	char *new_argv[MAX_ARGS];
+	struct fuse_operations oper = xmp_oper;
+
 	umask(0);
-	return fuse_main(argc, argv, &xmp_oper, NULL);
+			/* Process the "--async" option apart */
+	for (i=0, new_argc=0; (i<argc) && (new_argc<MAX_ARGS); i++) {
+		if (!strcmp(argv[i], "--async")) {
+			async_io = 1;
+			oper.read_async = xmp_read_async;
+			oper.write_buf_async = xmp_write_buf_async;
+		} else {
+			new_argv[new_argc++] = argv[i];
+		}
+	}
+	return fuse_main(new_argc, new_argv, &oper, NULL);
 }
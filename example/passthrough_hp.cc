@@ -73,7 +73,12 @@
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <condition_variable>
+#include <functional>
 #include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include "cxxopts.hpp"
 #include <mutex>
 #include <fstream>
@@ -106,18 +111,19 @@ static void forget_one(fuse_ino_t ino, uint64_t n);
 // right inode number).
 typedef std::pair<ino_t, dev_t> SrcId;
 
-// Define a hash function for SrcId
-namespace std {
-    template<>
-    struct hash<SrcId> {
-        size_t operator()(const SrcId& id) const {
-            return hash<ino_t>{}(id.first) ^ hash<dev_t>{}(id.second);
-        }
-    };
-}
-
-// Maps files in the source directory tree to inodes
-typedef std::unordered_map<SrcId, Inode> InodeMap;
+// Hash function for SrcId. Inode numbers are often sequential and all
+// share one dev_t, so the bits are mixed to spread them over both the
+// shards and the buckets of each shard.
+struct SrcIdHash {
+    uint64_t operator()(const SrcId& id) const {
+        uint64_t h = static_cast<uint64_t>(id.first) * 0x9e3779b97f4a7c15ULL
+            ^ static_cast<uint64_t>(id.second);
+        h ^= h >> 32;
+        h *= 0xd6e8feb86659fd93ULL;
+        h ^= h >> 32;
+        return h;
+    }
+};
 
 struct Inode {
     int fd {-1};
@@ -140,12 +146,79 @@ struct Inode {
         if(fd > 0)
             close(fd);
     }
+
+    // Returns the inode to its default constructed state
+    void reset() {
+        if(fd > 0)
+            close(fd);
+        fd = -1;
+        src_dev = 0;
+        src_ino = 0;
+        generation = 0;
+        nopen = 0;
+        nlookup = 0;
+    }
+};
+
+// Maps files in the source directory tree to inodes. The map is split
+// into shards with a mutex each, so that lookups of different files
+// rarely contend. Inodes are allocated in slabs and recycled through a
+// per-shard free list, since their addresses are used as fuse_ino_t
+// they never move.
+class InodeMap {
+public:
+    struct Shard {
+        std::mutex m;
+
+        // Returns the inode for id, creating it if needed. Must be
+        // called with m held. Throws std::bad_alloc.
+        Inode* get(const SrcId& id) {
+            auto it = map.find(id);
+            if (it != map.end())
+                return it->second;
+            if (free.empty())
+                grow();
+            auto inode = free.back();
+            map.emplace(id, inode);
+            free.pop_back();
+            return inode;
+        }
+
+        // Drops an inode that was returned by get(). Must be called
+        // with m held.
+        void put(Inode* inode) {
+            map.erase({inode->src_ino, inode->src_dev});
+            inode->reset();
+            free.push_back(inode);
+        }
+
+    private:
+        static constexpr size_t slab_size = 256;
+
+        void grow() {
+            free.reserve(free.size() + slab_size);
+            slabs.emplace_back(new Inode[slab_size]);
+            for (size_t i = 0; i < slab_size; i++)
+                free.push_back(&slabs.back()[i]);
+        }
+
+        std::unordered_map<SrcId, Inode*, SrcIdHash> map;
+        std::vector<std::unique_ptr<Inode[]>> slabs;
+        std::vector<Inode*> free;
+    };
+
+    Shard& shard(const SrcId& id) {
+        return shards[SrcIdHash{}(id) >> (64 - shard_bits)];
+    }
+
+private:
+    static constexpr int shard_bits = 6;
+    Shard shards[1 << shard_bits];
 };
 
 struct Fs {
-    // Must be acquired *after* any Inode.m locks.
-    std::mutex mutex;
-    InodeMap inodes; // protected by mutex
+    // Shard locks must be acquired *after* any Inode.m locks.
+    InodeMap inodes;
     Inode root;
     double timeout;
     bool debug;
@@ -154,6 +227,8 @@ struct Fs {
     dev_t src_dev;
     bool nosplice;
     bool nocache;
+    unsigned readdirplus_threads;
+    unsigned fsync_threads;
 };
 static Fs fs{};
 
@@ -333,12 +408,27 @@ static int do_lookup(fuse_ino_t parent, const char *name,
     }
 
     SrcId id {e->attr.st_ino, e->attr.st_dev};
-    unique_lock<mutex> fs_lock {fs.mutex};
+    auto& shard = fs.inodes.shard(id);
     Inode* inode_p;
-    try {
-        inode_p = &fs.inodes[id];
-    } catch (std::bad_alloc&) {
-        return ENOMEM;
+    unique_lock<mutex> g;
+    while (true) {
+        unique_lock<mutex> shard_lock {shard.m};
+        try {
+            inode_p = shard.get(id);
+        } catch (std::bad_alloc&) {
+            close(newfd);
+            return ENOMEM;
+        }
+        // Shard locks come after inode locks, so only try here. Once
+        // the inode is locked, it cannot be dropped by forget_one().
+        g = unique_lock<mutex> {inode_p->m, try_to_lock};
+        if (g.owns_lock())
+            break;
+        // Wait for the current holder and start over. The inode may
+        // have been recycled in the meantime, but inodes are never
+        // freed so its mutex is still there.
+        shard_lock.unlock();
+        lock_guard<mutex> wait {inode_p->m};
     }
     e->ino = reinterpret_cast<fuse_ino_t>(inode_p);
     Inode& inode {*inode_p};
@@ -352,24 +442,16 @@ static int do_lookup(fuse_ino_t parent, const char *name,
     }
 
     if (inode.fd > 0) { // found existing inode
-        fs_lock.unlock();
         if (fs.debug)
             cerr << "DEBUG: lookup(): inode " << e->attr.st_ino
                  << " (userspace) already known; fd = " << inode.fd << endl;
-        lock_guard<mutex> g {inode.m};
         inode.nlookup++;
         close(newfd);
     } else { // no existing inode
-        /* This is just here to make Helgrind happy. It violates the
-           lock ordering requirement (inode.m must be acquired before
-           fs.mutex), but this is of no consequence because at this
-           point no other thread has access to the inode mutex */
-        lock_guard<mutex> g {inode.m};
         inode.src_ino = e->attr.st_ino;
         inode.src_dev = e->attr.st_dev;
         inode.nlookup++;
         inode.fd = newfd;
-        fs_lock.unlock();
 
         if (fs.debug)
             cerr << "DEBUG: lookup(): created userspace inode " << e->attr.st_ino
@@ -523,7 +605,6 @@ static void sfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
 			    if (fs.debug)
 				    cerr << "DEBUG: unlink: release inode " << e.attr.st_ino
 					    << "; fd=" << inode.fd << endl;
-			    lock_guard<mutex> g_fs {fs.mutex};
 			    close(inode.fd);
 			    inode.fd = -ENOENT;
 			    inode.generation++;
@@ -548,11 +629,9 @@ static void forget_one(fuse_ino_t ino, uint64_t n) {
     if (!inode.nlookup) {
         if (fs.debug)
             cerr << "DEBUG: forget: cleaning up inode " << inode.src_ino << endl;
-        {
-            lock_guard<mutex> g_fs {fs.mutex};
-            l.unlock();
-            fs.inodes.erase({inode.src_ino, inode.src_dev});
-        }
+        auto& shard = fs.inodes.shard({inode.src_ino, inode.src_dev});
+        lock_guard<mutex> g_shard {shard.m};
+        shard.put(&inode);
     } else if (fs.debug)
             cerr << "DEBUG: forget: inode " << inode.src_ino
                  << " lookup count now " << inode.nlookup << endl;
@@ -655,6 +734,159 @@ static bool is_dot_or_dotdot(const char *name) {
 }
 
 
+// Runs the lookups for readdirplus on several threads. The threads are
+// started on first use.
+class LookupPool {
+public:
+    ~LookupPool() {
+        {
+            lock_guard<mutex> g {m};
+            stop = true;
+        }
+        work_cond.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+
+    // Calls fn(i) for every i < n and returns once all calls are done.
+    // The calling thread does its share of the work.
+    void run(size_t n, const function<void(size_t)>& fn) {
+        if (n == 0)
+            return;
+        Batch b {fn, n};
+        unique_lock<mutex> l {m};
+        if (threads.empty()) {
+            for (unsigned i = 0; i < fs.readdirplus_threads; i++)
+                threads.emplace_back([this] { worker(); });
+        }
+        batches.push_back(&b);
+        work_cond.notify_all();
+        while (b.next < n)
+            run_one(l);
+        done_cond.wait(l, [&b] { return b.done == b.n; });
+    }
+
+private:
+    struct Batch {
+        Batch(const function<void(size_t)>& fn, size_t n) : fn(fn), n(n) {}
+
+        const function<void(size_t)>& fn;
+        size_t n;
+        size_t next {0};
+        size_t done {0};
+    };
+
+    // Runs the next call of the first batch. Must be called with m
+    // held and a batch queued.
+    void run_one(unique_lock<mutex>& l) {
+        auto b = batches.front();
+        auto i = b->next++;
+        if (b->next == b->n)
+            batches.pop_front();
+        l.unlock();
+        b->fn(i);
+        l.lock();
+        if (++b->done == b->n)
+            done_cond.notify_all();
+    }
+
+    void worker() {
+        unique_lock<mutex> l {m};
+        while (true) {
+            work_cond.wait(l, [this] { return stop || !batches.empty(); });
+            if (stop)
+                return;
+            run_one(l);
+        }
+    }
+
+    mutex m;
+    condition_variable work_cond;
+    condition_variable done_cond;
+    list<Batch*> batches;
+    vector<thread> threads;
+    bool stop {false};
+};
+static LookupPool lookup_pool;
+
+
+// Fills a readdirplus reply with as many entries as fit, looking them up
+// in parallel. Stops at the first error, which is returned.
+static int readdirplus_parallel(fuse_req_t req, fuse_ino_t ino,
+                                DirHandle *d, char *&p, size_t &rem,
+                                int &count) {
+    struct Entry {
+        string name;
+        off_t off;
+        fuse_entry_param e;
+        int err;
+    };
+    vector<Entry> entries;
+    int err = 0;
+
+    // First collect the entries that fit into the buffer
+    auto avail = rem;
+    while (true) {
+        errno = 0;
+        auto entry = readdir(d->dp);
+        if (!entry) {
+            err = errno;
+            if (err && fs.debug)
+                warn("DEBUG: readdir(): readdir failed with");
+            break;
+        }
+        d->offset = entry->d_off;
+        if (is_dot_or_dotdot(entry->d_name))
+            continue;
+
+        auto entsize = fuse_add_direntry_plus(req, nullptr, 0, entry->d_name,
+                                              nullptr, 0);
+        if (entsize > avail) {
+            if (fs.debug)
+                cerr << "DEBUG: readdir(): buffer full, returning data. " << endl;
+            break;
+        }
+        avail -= entsize;
+        try {
+            entries.push_back({entry->d_name, entry->d_off, {}, 0});
+        } catch (std::bad_alloc&) {
+            err = ENOMEM;
+            break;
+        }
+    }
+
+    lookup_pool.run(entries.size(), [&entries, ino](size_t i) {
+        auto& ent = entries[i];
+        ent.err = do_lookup(ino, ent.name.c_str(), &ent.e);
+    });
+
+    // Everything after a failed lookup has to be dropped again, so
+    // that the lookup counts stay right.
+    size_t i;
+    for (i = 0; i < entries.size() && !entries[i].err; i++) {
+        auto& ent = entries[i];
+        auto entsize = fuse_add_direntry_plus(req, p, rem, ent.name.c_str(),
+                                              &ent.e, ent.off);
+        p += entsize;
+        rem -= entsize;
+        count++;
+        if (fs.debug) {
+            cerr << "DEBUG: readdir(): added to buffer: " << ent.name
+                 << ", ino " << ent.e.attr.st_ino << ", offset " << ent.off << endl;
+        }
+    }
+    if (i < entries.size()) {
+        err = entries[i].err;
+        d->offset = -1; // make the next readdir seek
+        for (; i < entries.size(); i++) {
+            if (!entries[i].err)
+                forget_one(entries[i].e.ino, 1);
+        }
+    }
+    return err;
+}
+
+
 static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                     off_t offset, fuse_file_info *fi, int plus) {
     auto d = get_dir_handle(fi);
@@ -682,6 +914,11 @@ static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
         d->offset = offset;
     }
 
+    if (plus && fs.readdirplus_threads) {
+        err = readdirplus_parallel(req, ino, d, p, rem, count);
+        goto error;
+    }
+
     while (1) {
         struct dirent *entry;
         errno = 0;
@@ -808,11 +1045,107 @@ static void sfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 }
 
 
+// Runs fsync() and fdatasync() on a pool of threads, so that the request
+// threads are not tied up while data is flushed. Requests that come in
+// while all threads are busy are answered together by a single syncfs()
+// of the source file system instead of one flush per file. The threads
+// are started on first use.
+class SyncPool {
+public:
+    ~SyncPool() {
+        stop();
+    }
+
+    // Replies to req once fd has been synced
+    void sync(fuse_req_t req, int fd, bool datasync) {
+        lock_guard<mutex> g {m};
+        if (threads.empty()) {
+            for (unsigned i = 0; i < fs.fsync_threads; i++)
+                threads.emplace_back([this] { worker(); });
+        }
+        pending.push_back({req, fd, datasync});
+        nreqs++;
+        work_cond.notify_one();
+    }
+
+    // Answers everything that is queued and ends the threads. Must be
+    // called before the session is destroyed.
+    void stop() {
+        if (threads.empty())
+            return;
+        {
+            lock_guard<mutex> g {m};
+            stopping = true;
+        }
+        work_cond.notify_all();
+        for (auto& t : threads)
+            t.join();
+        threads.clear();
+        if (fs.debug && nreqs)
+            cerr << "DEBUG: fsync: " << nreqs << " requests answered by "
+                 << nflushes << " flushes" << endl;
+    }
+
+private:
+    struct Waiter {
+        fuse_req_t req;
+        int fd;
+        bool datasync;
+    };
+
+    static int sync_one(const Waiter& w) {
+        auto res = w.datasync ? fdatasync(w.fd) : fsync(w.fd);
+        return res == -1 ? errno : 0;
+    }
+
+    void worker() {
+        unique_lock<mutex> l {m};
+        while (true) {
+            work_cond.wait(l, [this] { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return;
+            auto batch = std::move(pending);
+            pending.clear();
+            nflushes++;
+            l.unlock();
+
+            if (batch.size() == 1) {
+                fuse_reply_err(batch[0].req, sync_one(batch[0]));
+            } else {
+                // Writes back the data and metadata of all files. Each file
+                // is synced again afterwards, which has nothing left to
+                // write but reports the write-back errors of that file.
+                // syncfs() itself may fail because of any file of the
+                // source file system, so its result is not passed on.
+                (void) syncfs(batch[0].fd);
+                for (auto& w : batch)
+                    fuse_reply_err(w.req, sync_one(w));
+            }
+
+            l.lock();
+        }
+    }
+
+    mutex m;
+    condition_variable work_cond;
+    vector<Waiter> pending;
+    vector<thread> threads;
+    bool stopping {false};
+    uint64_t nreqs {0};
+    uint64_t nflushes {0};
+};
+static SyncPool sync_pool;
+
+
 static void sfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
                          fuse_file_info *fi) {
     (void) ino;
     int res;
     int fd = dirfd(get_dir_handle(fi)->dp);
+    if (fs.fsync_threads) {
+        sync_pool.sync(req, fd, datasync);
+        return;
+    }
     if (datasync)
         res = fdatasync(fd);
     else
@@ -881,6 +1214,10 @@ static void sfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
                       fuse_file_info *fi) {
     (void) ino;
     int res;
+    if (fs.fsync_threads) {
+        sync_pool.sync(req, fi->fh, datasync);
+        return;
+    }
     if (datasync)
         res = fdatasync(fi->fh);
     else
@@ -942,7 +1279,16 @@ static void sfs_statfs(fuse_req_t req, fuse_ino_t ino) {
 }
 
 
-#ifdef HAVE_POSIX_FALLOCATE
+#ifdef HAVE_FALLOCATE
+// Passes the mode on, so that FALLOC_FL_PUNCH_HOLE and friends work
+// whenever the backing file system supports them.
+static void sfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                          off_t offset, off_t length, fuse_file_info *fi) {
+    (void) ino;
+    auto res = fallocate(fi->fh, mode, offset, length);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+#elif defined(HAVE_POSIX_FALLOCATE)
 static void sfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
                           off_t offset, off_t length, fuse_file_info *fi) {
     (void) ino;
@@ -956,6 +1302,37 @@ static void sfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
 }
 #endif
 
+
+#ifdef HAVE_COPY_FILE_RANGE
+static void sfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+                                off_t off_in, fuse_file_info *fi_in,
+                                fuse_ino_t ino_out, off_t off_out,
+                                fuse_file_info *fi_out, size_t len,
+                                int flags) {
+    (void) ino_in;
+    (void) ino_out;
+    auto res = copy_file_range(fi_in->fh, &off_in, fi_out->fh, &off_out,
+                               len, flags);
+    if (res == -1)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_write(req, res);
+}
+#endif
+
+
+// SEEK_DATA and SEEK_HOLE are answered by the backing file, so holes
+// punched with fallocate() show up here as well.
+static void sfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                      fuse_file_info *fi) {
+    (void) ino;
+    auto res = lseek(fi->fh, off, whence);
+    if (res == -1)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_lseek(req, res);
+}
+
 static void sfs_flock(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi,
                       int op) {
     (void) ino;
@@ -1110,9 +1487,13 @@ static void assign_operations(fuse_lowlevel_ops &sfs_oper) {
     sfs_oper.read = sfs_read;
     sfs_oper.write_buf = sfs_write_buf;
     sfs_oper.statfs = sfs_statfs;
-#ifdef HAVE_POSIX_FALLOCATE
+#if defined(HAVE_FALLOCATE) || defined(HAVE_POSIX_FALLOCATE)
     sfs_oper.fallocate = sfs_fallocate;
 #endif
+#ifdef HAVE_COPY_FILE_RANGE
+    sfs_oper.copy_file_range = sfs_copy_file_range;
+#endif
+    sfs_oper.lseek = sfs_lseek;
     sfs_oper.flock = sfs_flock;
 #ifdef HAVE_SETXATTR
     sfs_oper.setxattr = sfs_setxattr;
@@ -1141,11 +1522,24 @@ static cxxopts::ParseResult parse_wrapper(cxxopts::Options& parser, int& argc, c
 static cxxopts::ParseResult parse_options(int argc, char **argv) {
     cxxopts::Options opt_parser(argv[0]);
     opt_parser.add_options()
+        ("bulk-threads", "Process at most <n> data transfers at once "
+         "(0: no limit)",
+         cxxopts::value<unsigned>()->default_value("0"), "n")
         ("debug", "Enable filesystem debug messages")
         ("debug-fuse", "Enable libfuse debug messages")
+        ("fsync-threads", "Run fsync() on <n> threads, answering "
+         "requests that wait for a thread with one syncfs() (0: in the "
+         "request thread)",
+         cxxopts::value<unsigned>()->default_value("0"), "n")
         ("help", "Print help")
         ("nocache", "Disable all caching")
         ("nosplice", "Do not use splice(2) to transfer data")
+        ("readdirplus-threads", "Look up readdirplus entries on <n> "
+         "threads (0: in the request thread)",
+         cxxopts::value<unsigned>()->default_value("0"), "n")
+        ("receivers", "Read requests on <n> threads and process them "
+         "on others (0: workers do both)",
+         cxxopts::value<unsigned>()->default_value("0"), "n")
         ("single", "Run single-threaded");
 
     // FIXME: Find a better way to limit the try clause to just
@@ -1169,6 +1563,8 @@ static cxxopts::ParseResult parse_options(int argc, char **argv) {
 
     fs.debug = options.count("debug") != 0;
     fs.nosplice = options.count("nosplice") != 0;
+    fs.readdirplus_threads = options["readdirplus-threads"].as<unsigned>();
+    fs.fsync_threads = options["fsync-threads"].as<unsigned>();
     char* resolved_path = realpath(argv[1], NULL);
     if (resolved_path == NULL)
         warn("WARNING: realpath() failed with");
@@ -1225,7 +1621,10 @@ int main(int argc, char *argv[]) {
     if (fuse_opt_add_arg(&args, argv[0]) ||
         fuse_opt_add_arg(&args, "-o") ||
         fuse_opt_add_arg(&args, "default_permissions,fsname=hpps") ||
-        (options.count("debug-fuse") && fuse_opt_add_arg(&args, "-odebug")))
+        (options.count("debug-fuse") && fuse_opt_add_arg(&args, "-odebug")) ||
+        // Without splice, files opened with O_DIRECT are written from
+        // the request buffer
+        (fs.nosplice && fuse_opt_add_arg(&args, "-oalign_write")))
         errx(3, "ERROR: Out of memory");
 
     fuse_lowlevel_ops sfs_oper {};
@@ -1242,8 +1641,11 @@ int main(int argc, char *argv[]) {
 
     // Mount and run main loop
     struct fuse_loop_config loop_config;
+    memset(&loop_config, 0, sizeof(loop_config));
     loop_config.clone_fd = 0;
     loop_config.max_idle_threads = 10;
+    loop_config.bulk_threads = options["bulk-threads"].as<unsigned>();
+    loop_config.receivers = options["receivers"].as<unsigned>();
     if (fuse_session_mount(se, argv[2]) != 0)
         goto err_out3;
     if (options.count("single"))
@@ -1251,6 +1653,8 @@ int main(int argc, char *argv[]) {
     else
         ret = fuse_session_loop_mt(se, &loop_config);
 
+    // Syncs still running have to be answered while the session exists
+    sync_pool.stop();
     fuse_session_unmount(se);
 
 err_out3:
@@ -26,6 +26,10 @@
  * passthrough filesystem cannot satisfy if it can't read the file in
  * the underlying filesystem).
  *
+ * With -o mmap, reads are answered from a mapping of the file with
+ * fuse_reply_pinned(), instead of having the library read (or splice)
+ * from the file descriptor.
+ *
  * Compile with:
  *
  *     gcc -Wall passthrough_ll.c `pkg-config fuse3 --cflags --libs` -o passthrough_ll
@@ -53,6 +57,8 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/xattr.h>
 
 #include "passthrough_helpers.h"
@@ -95,6 +101,7 @@ struct lo_data {
 	double timeout;
 	int cache;
 	int timeout_set;
+	int mmap;
 	struct lo_inode root; /* protected by lo->mutex */
 };
 
@@ -123,6 +130,8 @@ static const struct fuse_opt lo_opts[] = {
 	  offsetof(struct lo_data, cache), CACHE_NORMAL },
 	{ "cache=always",
 	  offsetof(struct lo_data, cache), CACHE_ALWAYS },
+	{ "mmap",
+	  offsetof(struct lo_data, mmap), 1 },
 
 	FUSE_OPT_END
 };
@@ -847,6 +856,57 @@ static void lo_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 	fuse_reply_err(req, res == -1 ? errno : 0);
 }
 
+struct lo_map {
+	void *addr;
+	size_t len;
+};
+
+static void lo_unmap(void *arg)
+{
+	struct lo_map *map = arg;
+
+	munmap(map->addr, map->len);
+	free(map);
+}
+
+/*
+ * Returns -1 if the data has to be read with fuse_reply_data(). The
+ * mapping is clamped to the file size, pages beyond EOF can not be
+ * read.
+ */
+static int lo_read_mmap(fuse_req_t req, int fd, size_t size, off_t offset)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t start = offset & ~((off_t) pagesize - 1);
+	struct lo_map *map;
+	struct iovec iov;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return -1;
+	if (offset >= st.st_size) {
+		fuse_reply_buf(req, NULL, 0);
+		return 0;
+	}
+	if (size > st.st_size - offset)
+		size = st.st_size - offset;
+
+	map = malloc(sizeof(struct lo_map));
+	if (map == NULL)
+		return -1;
+	map->len = offset - start + size;
+	map->addr = mmap(NULL, map->len, PROT_READ, MAP_SHARED, fd, start);
+	if (map->addr == MAP_FAILED) {
+		free(map);
+		return -1;
+	}
+
+	iov.iov_base = (char *) map->addr + (offset - start);
+	iov.iov_len = size;
+	fuse_reply_pinned(req, &iov, 1, lo_unmap, map);
+	return 0;
+}
+
 static void lo_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 		    off_t offset, struct fuse_file_info *fi)
 {
@@ -856,6 +916,10 @@ static void lo_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 		fuse_log(FUSE_LOG_DEBUG, "lo_read(ino=%" PRIu64 ", size=%zd, "
 			"off=%lu)\n", ino, size, (unsigned long) offset);
 
+	if (lo_data(req)->mmap && size &&
+	    lo_read_mmap(req, fi->fh, size, offset) == 0)
+		return;
+
 	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
 	buf.buf[0].fd = fi->fh;
 	buf.buf[0].pos = offset;
@@ -1168,7 +1232,7 @@ int main(int argc, char *argv[])
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct fuse_session *se;
 	struct fuse_cmdline_opts opts;
-	struct fuse_loop_config config;
+	struct fuse_loop_config config = { 0 };
 	struct lo_data lo = { .debug = 0,
 	                      .writeback = 0 };
 	int ret = -1;
@@ -1271,6 +1335,12 @@ int main(int argc, char *argv[])
 	else {
 		config.clone_fd = opts.clone_fd;
 		config.max_idle_threads = opts.max_idle_threads;
+		config.min_threads = opts.min_threads;
+		config.max_threads = opts.max_threads;
+		config.idle_timeout_ms = opts.idle_timeout_ms;
+		config.affinity = opts.affinity;
+		config.bulk_threads = opts.bulk_threads;
+		config.receivers = opts.receivers;
 		ret = fuse_session_loop_mt(se, &config);
 	}
 
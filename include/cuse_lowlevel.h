@@ -45,6 +45,12 @@ struct cuse_info {
  * init_done	: called after initialization is complete
  * read/write	: always direct IO, simultaneous operations allowed
  * ioctl	: might be in unrestricted mode depending on ci->flags
+ * write_buf	: used instead of write if set; if FUSE_CAP_SPLICE_READ
+ *		  is wanted, the data is still in the pipe it was
+ *		  spliced into (see fuse_lowlevel_ops.write_buf)
+ *
+ * Replies to read may be sent with fuse_reply_data(), which splices
+ * file descriptor buffers if init() asks for FUSE_CAP_SPLICE_WRITE.
  */
 struct cuse_lowlevel_ops {
 	void (*init) (void *userdata, struct fuse_conn_info *conn);
@@ -63,8 +69,11 @@ struct cuse_lowlevel_ops {
 		       const void *in_buf, size_t in_bufsz, size_t out_bufsz);
 	void (*poll) (fuse_req_t req, struct fuse_file_info *fi,
 		      struct fuse_pollhandle *ph);
+	void (*write_buf) (fuse_req_t req, struct fuse_bufvec *bufv, off_t off,
+			   struct fuse_file_info *fi);
 };
 
+#if (!defined(__UCLIBC__) && !defined(__APPLE__))
 struct fuse_session *cuse_lowlevel_new(struct fuse_args *args,
 				       const struct cuse_info *ci,
 				       const struct cuse_lowlevel_ops *clop,
@@ -74,11 +83,53 @@ struct fuse_session *cuse_lowlevel_setup(int argc, char *argv[],
 					 const struct cuse_info *ci,
 					 const struct cuse_lowlevel_ops *clop,
 					 int *multithreaded, void *userdata);
+#else
+struct fuse_session *cuse_lowlevel_new_311(struct fuse_args *args,
+					   const struct cuse_info *ci,
+					   const struct cuse_lowlevel_ops *clop,
+					   void *userdata);
+#define cuse_lowlevel_new(args, ci, clop, userdata) \
+	cuse_lowlevel_new_311(args, ci, clop, userdata)
+
+struct fuse_session *cuse_lowlevel_setup_311(int argc, char *argv[],
+					     const struct cuse_info *ci,
+					     const struct cuse_lowlevel_ops *clop,
+					     int *multithreaded, void *userdata);
+#define cuse_lowlevel_setup(argc, argv, ci, clop, multithreaded, userdata) \
+	cuse_lowlevel_setup_311(argc, argv, ci, clop, multithreaded, userdata)
+#endif
 
 void cuse_lowlevel_teardown(struct fuse_session *se);
 
+/*
+ * Sets up the device and serves it until it is released. The loop is
+ * configured from the command line the same way as by fuse_main(),
+ * e.g. with -s or -o max_threads=N. -o clone_fd is ignored, as the
+ * kernel only clones /dev/fuse channels, not /dev/cuse ones.
+ */
+#if (!defined(__UCLIBC__) && !defined(__APPLE__))
 int cuse_lowlevel_main(int argc, char *argv[], const struct cuse_info *ci,
 		       const struct cuse_lowlevel_ops *clop, void *userdata);
+#else
+int cuse_lowlevel_main_311(int argc, char *argv[], const struct cuse_info *ci,
+			   const struct cuse_lowlevel_ops *clop,
+			   void *userdata);
+#define cuse_lowlevel_main(argc, argv, ci, clop, userdata) \
+	cuse_lowlevel_main_311(argc, argv, ci, clop, userdata)
+#endif
+
+/*
+ * Like cuse_lowlevel_main(), but the multi-threaded loop uses @config
+ * rather than the loop options of the command line. -s still selects
+ * the single-threaded loop.
+ *
+ * config->clone_fd is ignored, the workers always share the channel.
+ */
+int cuse_lowlevel_main_config(int argc, char *argv[],
+			      const struct cuse_info *ci,
+			      const struct cuse_lowlevel_ops *clop,
+			      struct fuse_loop_config *config,
+			      void *userdata);
 
 #ifdef __cplusplus
 }
@@ -36,6 +36,9 @@ extern "C" {
 /** Handle for a FUSE filesystem */
 struct fuse;
 
+/** Handle of an asynchronous operation, see fuse_operations.read_async */
+typedef struct fuse_async *fuse_async_t;
+
 /**
  * Readdir flags, passed to ->readdir()
  */
@@ -274,6 +277,19 @@ struct fuse_config {
 	int show_help;
 	char *modules;
 	int debug;
+	int path_cache;
+	unsigned int remember_max;
+	unsigned int slab_size;
+	int slab_hugepage;
+	unsigned long node_mem_max;
+	int readdir_cache;
+	double ac_refresh;
+	double negative_cache;
+	unsigned int write_coalesce;
+	double write_coalesce_delay;
+	unsigned int readahead;
+	unsigned int readahead_threads;
+	double attr_cache;
 };
 
 
@@ -790,6 +806,42 @@ struct fuse_operations {
 	 * Find next data or hole after the specified offset
 	 */
 	off_t (*lseek) (const char *, off_t off, int whence, struct fuse_file_info *);
+
+	/**
+	 * Read data from an open file without blocking
+	 *
+	 * If set, this is used instead of read and read_buf. Returning
+	 * zero means that the read has been started, and that it will
+	 * be completed by passing `async` to fuse_async_reply_data(),
+	 * fuse_async_reply_buf() or fuse_async_reply_err(). This may
+	 * be done from any thread, and also before returning. The
+	 * worker thread that called read_async can meanwhile go on with
+	 * other requests. A negative error value fails the read at
+	 * once, `async` must not be used then.
+	 *
+	 * The path stays valid until the read is completed, `fi` only
+	 * until read_async returns.
+	 *
+	 * Asynchronous operations are only used for the topmost
+	 * filesystem, and are not passed through modules.
+	 */
+	int (*read_async) (const char *, size_t size, off_t off,
+			   struct fuse_file_info *fi, fuse_async_t async);
+
+	/**
+	 * Write data to an open file without blocking
+	 *
+	 * If set, this is used instead of write and write_buf, and is
+	 * completed with fuse_async_reply_write() or
+	 * fuse_async_reply_err(), like read_async.
+	 *
+	 * The data in `buf` may live in a buffer or pipe that is reused
+	 * after write_buf_async returns, so it has to be consumed (for
+	 * example copied with fuse_buf_copy()) before returning.
+	 */
+	int (*write_buf_async) (const char *, struct fuse_bufvec *buf,
+				off_t off, struct fuse_file_info *fi,
+				fuse_async_t async);
 };
 
 /** Extra context that may be needed by some filesystems
@@ -1022,7 +1074,12 @@ int fuse_loop_mt_31(struct fuse *f, int clone_fd);
  *
  * See also: fuse_loop()
  */
+#if (!defined(__UCLIBC__) && !defined(__APPLE__))
 int fuse_loop_mt(struct fuse *f, struct fuse_loop_config *config);
+#else
+int fuse_loop_mt_311(struct fuse *f, struct fuse_loop_config *config);
+#define fuse_loop_mt(f, config) fuse_loop_mt_311(f, config)
+#endif
 #endif
 
 /**
@@ -1065,7 +1122,8 @@ int fuse_interrupted(void);
 /**
  * Invalidates cache for the given path.
  *
- * This calls fuse_lowlevel_notify_inval_inode internally.
+ * This calls fuse_lowlevel_notify_inval_inode internally, and drops
+ * the attributes kept by the attr_cache option.
  *
  * @return 0 on successful invalidation, negative error value otherwise.
  *         This routine may return -ENOENT to indicate that there was
@@ -1241,6 +1299,45 @@ int fuse_notify_poll(struct fuse_pollhandle *ph);
 struct fuse_fs *fuse_fs_new(const struct fuse_operations *op, size_t op_size,
 			    void *private_data);
 
+/**
+ * Reserve room in front of the paths passed to a filesystem
+ *
+ * A module that rewrites paths by prepending a fixed string can call
+ * this from its factory. The library then builds the paths of every
+ * operation with *len* spare bytes in front of them, which
+ * fuse_fs_path_prepend() fills in place instead of allocating a new
+ * path. Reservations of stacked modules add up.
+ *
+ * @param fs the filesystem object returned by fuse_fs_new()
+ * @param len the length of the prefix the module prepends
+ */
+void fuse_fs_reserve_path(struct fuse_fs *fs, size_t len);
+
+/**
+ * Prepend a string to a path passed to a filesystem operation
+ *
+ * If *path* was built by the library for the current operation and
+ * there is enough room reserved in front of it, the prefix is written
+ * there and no memory is allocated. Otherwise a new string is
+ * allocated. Either way the result must be released with
+ * fuse_fs_path_release().
+ *
+ * @param path the path the operation was called with
+ * @param prefix the string to prepend
+ * @param len the length of *prefix*
+ * @param newpathp the resulting path is stored here
+ * @return 0 on success or -ENOMEM
+ */
+int fuse_fs_path_prepend(const char *path, const char *prefix, size_t len,
+			 char **newpathp);
+
+/**
+ * Release a path returned by fuse_fs_path_prepend()
+ *
+ * @param path the path to release, may be NULL
+ */
+void fuse_fs_path_release(char *path);
+
 /**
  * Factory for creating filesystem objects
  *
@@ -1273,6 +1370,128 @@ typedef struct fuse_fs *(*fuse_module_factory_t)(struct fuse_args *args,
 /** Get session from fuse object */
 struct fuse_session *fuse_get_session(struct fuse *f);
 
+/**
+ * Complete an asynchronous read with data
+ *
+ * Depending on the flags of the buffers, the data may be moved or
+ * copied with splice. The buffers can be reused once this returns.
+ *
+ * @param async the handle passed to read_async
+ * @param bufv buffer vector with the data
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_async_reply_data(fuse_async_t async, struct fuse_bufvec *bufv);
+
+/**
+ * Complete an asynchronous read with data in a buffer
+ *
+ * @param async the handle passed to read_async
+ * @param buf the data
+ * @param size number of bytes read
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_async_reply_buf(fuse_async_t async, const char *buf, size_t size);
+
+/**
+ * Complete an asynchronous write
+ *
+ * @param async the handle passed to write_buf_async
+ * @param count the number of bytes written
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_async_reply_write(fuse_async_t async, size_t count);
+
+/**
+ * Fail an asynchronous operation
+ *
+ * @param async the handle passed to the operation
+ * @param err the positive error value
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_async_reply_err(fuse_async_t async, int err);
+
+/**
+ * Check if an asynchronous operation has been interrupted
+ *
+ * @param async the handle passed to the operation
+ * @return 1 if the request was interrupted, 0 otherwise
+ */
+int fuse_async_interrupted(fuse_async_t async);
+
+/**
+ * Memory usage and lock statistics of a fuse object
+ *
+ * Inodes are allocated from slabs of slab_size bytes. Of all node
+ * slots in the mapped slabs, free_nodes are unused, so the share of
+ * slab memory lost to fragmentation is free_nodes / (nodes +
+ * free_nodes). If inodes are not allocated from slabs, the slab
+ * fields are zero.
+ *
+ * The size of the struct is fixed: counters that are added later take
+ * the place of reserved entries, which read as zero until then.
+ */
+struct fuse_stats {
+	/** Number of inodes in memory */
+	uint64_t nodes;
+
+	/** Bytes used by each inode, not counting its name */
+	uint64_t node_size;
+
+	/** Inodes only kept in memory by the remember option */
+	uint64_t remembered;
+
+	/** Remembered inodes evicted early to stay below node_mem_max */
+	uint64_t nodes_reclaimed;
+
+	/** Number of slabs currently mapped */
+	uint64_t slabs;
+
+	/** Size of each slab in bytes */
+	uint64_t slab_size;
+
+	/** Mapped slabs that are backed by huge pages */
+	uint64_t hugetlb_slabs;
+
+	/** Unused inode slots in the mapped slabs */
+	uint64_t free_nodes;
+
+	/** Number of slabs mapped and unmapped so far */
+	uint64_t slab_allocs;
+	uint64_t slab_frees;
+
+	/** Requests that had to wait for a path lock, and their retries */
+	uint64_t lock_waits;
+	uint64_t lock_retries;
+
+	/**
+	 * With the readahead option, reads served from and not served
+	 * from a read ahead window, and the bytes read ahead
+	 */
+	uint64_t readahead_hits;
+	uint64_t readahead_misses;
+	uint64_t readahead_bytes;
+
+	/**
+	 * With the attr_cache option, getattr requests answered from
+	 * and not answered from the library's attribute cache
+	 */
+	uint64_t attr_cache_hits;
+	uint64_t attr_cache_misses;
+
+	/**
+	 * For future use.
+	 */
+	uint64_t reserved[15];
+};
+
+/**
+ * Get memory usage and lock statistics
+ *
+ * @param f the FUSE handle
+ * @param stats the statistics are stored here
+ */
+void fuse_get_stats(struct fuse *f, struct fuse_stats *stats);
+
 /**
  * Open a FUSE file descriptor and set up the mount for the given
  * mountpoint and flags.
@@ -103,6 +103,10 @@ struct fuse_file_info {
 /**
  * Configuration parameters passed to fuse_session_loop_mt() and
  * fuse_loop_mt().
+ *
+ * Fields that have been added after the first two should be
+ * zero-initialized if not used, zero always selects the historic
+ * behavior.
  */
 struct fuse_loop_config {
 	/**
@@ -122,8 +126,94 @@ struct fuse_loop_config {
 	 * thread will be created to service every operation.
 	 */
 	unsigned int max_idle_threads;
+
+	/**
+	 * The number of worker threads that are started when the
+	 * loop is entered. The pool never shrinks below this size, so
+	 * these threads are never destroyed while the loop runs. If
+	 * zero, a single thread is started.
+	 */
+	unsigned int min_threads;
+
+	/**
+	 * The maximum number of worker threads. Once this limit is
+	 * reached, no new threads are created and further requests
+	 * are queued in the kernel until a worker becomes available.
+	 * If zero, the number of threads is not limited.
+	 *
+	 * Setting min_threads and max_threads to the same value gives
+	 * a fixed-size pool that does not create or destroy threads
+	 * at all once the loop is running.
+	 */
+	unsigned int max_threads;
+
+	/**
+	 * Time in milliseconds that a worker thread above
+	 * min_threads may stay idle (waiting for a request) before it
+	 * exits. When set, this replaces the max_idle_threads logic
+	 * which destroys surplus threads as soon as they finish a
+	 * request. If zero, max_idle_threads is used.
+	 */
+	unsigned int idle_timeout_ms;
+
+	/**
+	 * Partition the workers by CPU (FUSE_LOOP_AFFINITY_CPU) or by
+	 * NUMA node (FUSE_LOOP_AFFINITY_NODE). Each partition gets its
+	 * own cloned device fd and its own set of worker threads, which
+	 * are pinned to the CPUs of the partition. min_threads and
+	 * max_threads then apply to every partition separately.
+	 *
+	 * The kernel hands out requests from a single queue, so a
+	 * request may still be read on any CPU, but it is processed and
+	 * replied to on the CPU (or node) that read it, and each
+	 * worker's request buffer and splice pipe are allocated there.
+	 *
+	 * If zero (FUSE_LOOP_AFFINITY_NONE), workers are not pinned.
+	 */
+	int affinity;
+
+	/**
+	 * The maximum number of workers (per partition, see affinity)
+	 * that process bulk data requests at the same time: READ,
+	 * WRITE, FSYNC, FALLOCATE and COPY_FILE_RANGE. Further bulk
+	 * requests are queued and picked up by those workers once they
+	 * are done, so that the others stay free for metadata requests
+	 * like LOOKUP and GETATTR. To be useful, max_threads (if set)
+	 * should be larger.
+	 *
+	 * If zero, every request is processed by the worker that read
+	 * it.
+	 */
+	unsigned int bulk_threads;
+
+	/**
+	 * If non-zero, reading and processing requests is done by
+	 * different threads: this many receivers per partition (see
+	 * affinity) only read requests and queue them for a fixed set
+	 * of executors, which take requests from each other's queues
+	 * when they run out of their own. A handler that blocks then
+	 * only holds up its executor, never the reading of further
+	 * requests.
+	 *
+	 * The number of executors is max_threads, or the number of
+	 * online CPUs (but at least four) if that is zero. min_threads, max_idle_threads,
+	 * idle_timeout_ms and bulk_threads do not apply.
+	 */
+	unsigned int receivers;
+
+	/**
+	 * Only for fuse_multi_loop_new(): the number of workers that
+	 * may serve one session while other sessions are waiting for a
+	 * worker. If zero, half of the workers.
+	 */
+	unsigned int session_threads;
 };
 
+/** Values for fuse_loop_config.affinity */
+#define FUSE_LOOP_AFFINITY_NONE		0
+#define FUSE_LOOP_AFFINITY_CPU		1
+#define FUSE_LOOP_AFFINITY_NODE		2
+
 /**************************************************************************
  * Capability bits for 'fuse_conn_info.capable' and 'fuse_conn_info.want' *
  **************************************************************************/
@@ -394,6 +484,32 @@ struct fuse_loop_config {
  */
 #define FUSE_CAP_EXPLICIT_INVAL_DATA    (1 << 25)
 
+/**
+ * Indicates that the kernel maps file data into a DAX window that is
+ * shared with the filesystem (virtio-fs mounted with `-o dax`), and
+ * sends setupmapping() and removemapping() requests for it.
+ *
+ * By setting this flag in the `want` field of the `fuse_conn_info`
+ * structure, the filesystem tells the kernel to align the file and
+ * window offsets of these requests to `1 << map_alignment` bytes.
+ *
+ * This feature is disabled by default.
+ */
+#define FUSE_CAP_MAP_ALIGNMENT		(1 << 26)
+
+/**
+ * Indicates that the kernel lets the filesystem choose which files use
+ * DAX (virtio-fs mounted with `-o dax=inode`).
+ *
+ * By setting this flag in the `want` field of the `fuse_conn_info`
+ * structure, the filesystem marks files to be accessed through the DAX
+ * window with FUSE_ENTRY_ATTR_DAX in the `attr_flags` field of
+ * `struct fuse_entry_param`, or with fuse_reply_attr_flags().
+ *
+ * This feature is disabled by default.
+ */
+#define FUSE_CAP_DAX_INODE		(1 << 27)
+
 /**
  * Ioctl flags
  *
@@ -523,10 +639,18 @@ struct fuse_conn_info {
 	 */
 	unsigned time_gran;
 
+	/**
+	 * With FUSE_CAP_MAP_ALIGNMENT, log2 of the alignment in bytes
+	 * that the filesystem requires for DAX mappings. The kernel
+	 * refuses values above its own mapping granularity (21, i.e.
+	 * 2 MiB).
+	 */
+	unsigned map_alignment;
+
 	/**
 	 * For future use.
 	 */
-	unsigned reserved[22];
+	unsigned reserved[21];
 };
 
 struct fuse_session;
@@ -796,6 +920,30 @@ size_t fuse_buf_size(const struct fuse_bufvec *bufv);
 ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src,
 		      enum fuse_buf_copy_flags flags);
 
+/**
+ * Copy data from one buffer vector to several others
+ *
+ * Each destination receives the same data, as if fuse_buf_copy() was
+ * called for it with its own copy of *src*. File descriptors without
+ * FUSE_BUF_FD_SEEK in *src*, such as pipes, are only read once: if
+ * all destinations are file descriptors, the data is duplicated with
+ * tee(2) unless FUSE_BUF_NO_SPLICE is given, otherwise it is read into
+ * memory first.
+ *
+ * Each destination is advanced by the amount of data it received,
+ * *src* by the amount that all of them received.
+ *
+ * @param dst array of destination buffer vectors
+ * @param count number of destinations
+ * @param src source buffer vector
+ * @param flags flags controlling the copy
+ * @return number of bytes copied to every destination, or -errno if
+ *         nothing could be copied to one of them
+ */
+ssize_t fuse_buf_copy_fanout(struct fuse_bufvec *dst[], size_t count,
+			     struct fuse_bufvec *src,
+			     enum fuse_buf_copy_flags flags);
+
 /* ----------------------------------------------------------- *
  * Signal handling					       *
  * ----------------------------------------------------------- */
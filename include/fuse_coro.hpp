@@ -0,0 +1,342 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/** @file
+ *
+ * C++20 coroutine helpers for the low level API
+ *
+ * A low level handler that has to wait for I/O can hand the request to
+ * a coroutine and return right away. The coroutine suspends while the
+ * I/O is in progress, and answers the request when it resumes:
+ *
+ *     static fuse::thread_pool pool;
+ *
+ *     static fuse::task do_read(fuse::request req, int fd, size_t size,
+ *                               off_t off) {
+ *         std::vector<char> buf(size);
+ *         ssize_t res = co_await fuse::run_on(pool, [&] {
+ *             ssize_t n = pread(fd, buf.data(), size, off);
+ *             return n == -1 ? -errno : n;
+ *         });
+ *         if (res < 0)
+ *             req.reply_err(-res);
+ *         else
+ *             req.reply_buf(buf.data(), res);
+ *     }
+ *
+ *     static void my_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+ *                         off_t off, fuse_file_info *fi) {
+ *         do_read(fuse::request(req), fi->fh, size, off);
+ *     }
+ *
+ * The request is taken by value, so that it lives in the coroutine
+ * frame. Everything else that the handler was passed by pointer (names,
+ * fuse_file_info, write buffers) is only valid until the handler
+ * returns, i.e. until the first suspension. It has to be copied if it
+ * is needed afterwards.
+ *
+ * Requests that are not answered when the coroutine finishes, for
+ * instance because of an exception, are answered with EIO.
+ */
+
+#ifndef FUSE_CORO_HPP_
+#define FUSE_CORO_HPP_
+
+#if !defined(__cplusplus) || __cplusplus < 202002L
+#error "fuse_coro.hpp requires C++20"
+#endif
+
+#include "fuse_lowlevel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace fuse {
+
+/**
+ * Owner of a request that still has to be answered
+ *
+ * Each reply function hands the request to the corresponding
+ * fuse_reply_*() function, after which the object is empty. Only one
+ * reply may be sent. If the object is destroyed without a reply, EIO
+ * is sent.
+ */
+class request {
+public:
+    explicit request(fuse_req_t req) noexcept : req_(req) {}
+    request(request&& other) noexcept
+        : req_(std::exchange(other.req_, nullptr)) {}
+    request(const request&) = delete;
+    request& operator=(const request&) = delete;
+    request& operator=(request&&) = delete;
+
+    ~request() {
+        if (req_)
+            fuse_reply_err(req_, EIO);
+    }
+
+    fuse_req_t get() const noexcept { return req_; }
+    bool replied() const noexcept { return req_ == nullptr; }
+    bool interrupted() const { return fuse_req_interrupted(req_); }
+    const fuse_ctx* ctx() const { return fuse_req_ctx(req_); }
+    void* userdata() const { return fuse_req_userdata(req_); }
+
+    int reply_err(int err) { return fuse_reply_err(release(), err); }
+    void reply_none() { fuse_reply_none(release()); }
+    int reply_entry(const fuse_entry_param& e) {
+        return fuse_reply_entry(release(), &e);
+    }
+    int reply_create(const fuse_entry_param& e, const fuse_file_info& fi) {
+        return fuse_reply_create(release(), &e, &fi);
+    }
+    int reply_attr(const struct stat& attr, double attr_timeout) {
+        return fuse_reply_attr(release(), &attr, attr_timeout);
+    }
+    int reply_readlink(const char* link) {
+        return fuse_reply_readlink(release(), link);
+    }
+    int reply_open(const fuse_file_info& fi) {
+        return fuse_reply_open(release(), &fi);
+    }
+    int reply_write(size_t count) {
+        return fuse_reply_write(release(), count);
+    }
+    int reply_buf(const char* buf, size_t size) {
+        return fuse_reply_buf(release(), buf, size);
+    }
+    int reply_data(fuse_bufvec& bufv, fuse_buf_copy_flags flags) {
+        return fuse_reply_data(release(), &bufv, flags);
+    }
+    int reply_iov(const struct iovec* iov, int count) {
+        return fuse_reply_iov(release(), iov, count);
+    }
+    int reply_statfs(const struct statvfs& stbuf) {
+        return fuse_reply_statfs(release(), &stbuf);
+    }
+    int reply_xattr(size_t count) {
+        return fuse_reply_xattr(release(), count);
+    }
+    int reply_lock(const struct flock& lock) {
+        return fuse_reply_lock(release(), &lock);
+    }
+    int reply_lseek(off_t off) {
+        return fuse_reply_lseek(release(), off);
+    }
+
+private:
+    fuse_req_t release() noexcept { return std::exchange(req_, nullptr); }
+
+    fuse_req_t req_;
+};
+
+/**
+ * Return type of request handling coroutines
+ *
+ * The coroutine starts running right away in the calling thread and
+ * frees itself when it finishes. Nothing waits for it.
+ */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {
+            try {
+                throw;
+            } catch (const std::exception& e) {
+                fuse_log(FUSE_LOG_ERR, "fuse: exception in handler: %s\n",
+                         e.what());
+            } catch (...) {
+                fuse_log(FUSE_LOG_ERR, "fuse: exception in handler\n");
+            }
+        }
+    };
+};
+
+/** Something that runs functions, typically on other threads */
+class executor {
+public:
+    virtual ~executor() = default;
+    virtual void post(std::function<void()> fn) = 0;
+};
+
+/**
+ * Fixed size pool of threads
+ *
+ * The threads are only started by the first post(), so that a pool
+ * can be created before fuse_daemonize() forks.
+ */
+class thread_pool : public executor {
+public:
+    explicit thread_pool(unsigned nthreads = 0)
+        : nthreads_(nthreads ? nthreads
+                             : std::max(1u, std::thread::hardware_concurrency())) {}
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> g(lock_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    void post(std::function<void()> fn) override {
+        {
+            std::lock_guard<std::mutex> g(lock_);
+            if (threads_.empty()) {
+                for (unsigned i = 0; i < nthreads_; i++)
+                    threads_.emplace_back([this] { run(); });
+            }
+            queue_.push_back(std::move(fn));
+        }
+        cond_.notify_one();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> l(lock_);
+        while (true) {
+            cond_.wait(l, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty())
+                return;
+            auto fn = std::move(queue_.front());
+            queue_.pop_front();
+            l.unlock();
+            fn();
+            l.lock();
+        }
+    }
+
+    unsigned nthreads_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> queue_;
+    std::vector<std::thread> threads_;
+    bool stop_ {false};
+};
+
+/** Awaitable that continues the coroutine on an executor */
+inline auto resume_on(executor& ex) {
+    struct awaiter {
+        executor& ex;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            ex.post([h] { h.resume(); });
+        }
+        void await_resume() const noexcept {}
+    };
+    return awaiter{ex};
+}
+
+/**
+ * Awaitable that calls fn() on an executor
+ *
+ * The coroutine continues on the executor thread with the result of
+ * fn(), or with the exception that it threw.
+ */
+template <typename F>
+auto run_on(executor& ex, F fn) {
+    using result_type = std::invoke_result_t<F&>;
+    using value_type = std::conditional_t<std::is_void_v<result_type>,
+                                          std::monostate, result_type>;
+
+    struct awaiter {
+        executor& ex;
+        F fn;
+        std::optional<value_type> value;
+        std::exception_ptr error;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            ex.post([this, h] {
+                try {
+                    if constexpr (std::is_void_v<result_type>) {
+                        fn();
+                        value.emplace();
+                    } else {
+                        value.emplace(fn());
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                h.resume();
+            });
+        }
+        result_type await_resume() {
+            if (error)
+                std::rethrow_exception(error);
+            if constexpr (!std::is_void_v<result_type>)
+                return std::move(*value);
+        }
+    };
+    return awaiter{ex, std::move(fn), std::nullopt, nullptr};
+}
+
+/**
+ * Result that is delivered by a callback
+ *
+ * For backends with completion callbacks: the callback calls set(),
+ * and a coroutine that does co_await on the object continues in the
+ * thread that called set(). set() may also be called before the
+ * co_await, the coroutine then does not suspend at all.
+ *
+ *     fuse::async_result<ssize_t> res;
+ *     backend_read(obj, buf, size, [&res](ssize_t n) { res.set(n); });
+ *     ssize_t n = co_await res;
+ */
+template <typename T>
+class async_result {
+public:
+    async_result() = default;
+    async_result(const async_result&) = delete;
+    async_result& operator=(const async_result&) = delete;
+
+    void set(T value) {
+        value_.emplace(std::move(value));
+        if (state_.exchange(done, std::memory_order_acq_rel) == waiting)
+            handle_.resume();
+    }
+
+    bool await_ready() const noexcept {
+        return state_.load(std::memory_order_acquire) == done;
+    }
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        int expected = idle;
+        handle_ = h;
+        return state_.compare_exchange_strong(expected, waiting,
+                                              std::memory_order_acq_rel);
+    }
+    T await_resume() { return std::move(*value_); }
+
+private:
+    enum { idle, waiting, done };
+
+    std::atomic<int> state_ {idle};
+    std::coroutine_handle<> handle_;
+    std::optional<T> value_;
+};
+
+} // namespace fuse
+
+#endif /* FUSE_CORO_HPP_ */
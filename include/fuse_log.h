@@ -15,6 +15,7 @@
  */
 
 #include <stdarg.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -75,6 +76,29 @@ void fuse_set_log_func(fuse_log_func_t func);
  */
 void fuse_log(enum fuse_log_level level, const char *fmt, ...);
 
+/**
+ * Log asynchronously
+ *
+ * From then on fuse_log() only formats the message into a buffer of
+ * the calling thread, and a background thread passes it on to the log
+ * handler. A thread whose buffer is full drops its messages instead of
+ * waiting; the number of dropped messages is logged later. Messages
+ * longer than 1 KiB are truncated.
+ *
+ * Calls nest: logging is synchronous again after as many calls to
+ * fuse_log_stop_async(). The low-level session does this for the
+ * `log_async` option.
+ *
+ * @param size buffer space per thread in bytes, or 0 for the default
+ * @return 0 on success, -errno on failure
+ */
+int fuse_log_start_async(size_t size);
+
+/**
+ * Pass on all pending messages and log synchronously again
+ */
+void fuse_log_stop_async(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -98,6 +98,30 @@ struct fuse_entry_param {
 	    that come through the kernel, this should be set to a very
 	    large value. */
 	double entry_timeout;
+
+	/** Flags of the inode, FUSE_ENTRY_ATTR_*.
+	 *
+	 * Only looked at if FUSE_CAP_DAX_INODE is enabled, so that
+	 * filesystems built against older headers do not need to set
+	 * it. */
+	uint32_t attr_flags;
+};
+
+/** Access the file through the DAX window, see FUSE_CAP_DAX_INODE */
+#define FUSE_ENTRY_ATTR_DAX	(1 << 1)
+
+/** Flags for the setupmapping() operation */
+#define FUSE_DAX_MAP_WRITE	(1 << 0)
+#define FUSE_DAX_MAP_READ	(1 << 1)
+
+/**
+ * A range of the DAX window, see the removemapping() operation
+ */
+struct fuse_dax_range {
+	/** Offset into the window */
+	uint64_t moffset;
+	/** Length of the range */
+	uint64_t len;
 };
 
 /**
@@ -524,6 +548,7 @@ struct fuse_lowlevel_ops {
 	 *   fuse_reply_buf
 	 *   fuse_reply_iov
 	 *   fuse_reply_data
+	 *   fuse_reply_pinned
 	 *   fuse_reply_err
 	 *
 	 * @param req request handle
@@ -1245,6 +1270,63 @@ struct fuse_lowlevel_ops {
 	 */
 	void (*lseek) (fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
 		       struct fuse_file_info *fi);
+
+	/**
+	 * Map a range of a file into the DAX window
+	 *
+	 * Only sent when file data is accessed through a DAX window
+	 * that the kernel shares with the filesystem, see
+	 * FUSE_CAP_MAP_ALIGNMENT. The filesystem, or the transport it
+	 * runs on, maps the range so that the guest reads and writes
+	 * it directly instead of sending read and write requests.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param foffset offset of the range in the file
+	 * @param len length of the range
+	 * @param moffset offset in the DAX window to map it at
+	 * @param flags FUSE_DAX_MAP_READ and/or FUSE_DAX_MAP_WRITE
+	 * @param fi file information
+	 */
+	void (*setupmapping) (fuse_req_t req, fuse_ino_t ino, uint64_t foffset,
+			      uint64_t len, uint64_t moffset, uint64_t flags,
+			      struct fuse_file_info *fi);
+
+	/**
+	 * Remove ranges of the DAX window mapped by setupmapping()
+	 *
+	 * Valid replies:
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number, may be zero if the ranges belong to
+	 *            several files
+	 * @param ranges the ranges to unmap
+	 * @param count the number of ranges
+	 */
+	void (*removemapping) (fuse_req_t req, fuse_ino_t ino,
+			       const struct fuse_dax_range *ranges,
+			       size_t count);
+
+	/**
+	 * Synchronize the whole filesystem
+	 *
+	 * Sent for syncfs(2) by kernels that support it, on virtio-fs
+	 * only so far. If this request is answered with an error code
+	 * of ENOSYS, this is treated as success and future calls to
+	 * syncfs() will succeed automatically without being sent to
+	 * the filesystem process.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number of the root
+	 */
+	void (*syncfs) (fuse_req_t req, fuse_ino_t ino);
 };
 
 /**
@@ -1331,6 +1413,24 @@ int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e,
 int fuse_reply_attr(fuse_req_t req, const struct stat *attr,
 		    double attr_timeout);
 
+/**
+ * Reply with attributes and inode flags
+ *
+ * Like fuse_reply_attr(), but also passes the FUSE_ENTRY_ATTR_* flags
+ * of the inode, which must match the ones it was looked up with.
+ *
+ * Possible requests:
+ *   getattr, setattr
+ *
+ * @param req request handle
+ * @param attr the attributes
+ * @param attr_timeout	validity timeout (in seconds) for the attributes
+ * @param attr_flags FUSE_ENTRY_ATTR_* flags
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_attr_flags(fuse_req_t req, const struct stat *attr,
+			  double attr_timeout, uint32_t attr_flags);
+
 /**
  * Reply with the contents of a symbolic link
  *
@@ -1429,6 +1529,33 @@ int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size);
 int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv,
 		    enum fuse_buf_copy_flags flags);
 
+/**
+ * Reply with data in memory that is kept valid until released
+ *
+ * Like fuse_reply_iov(), but for data that lives in long-lived
+ * buffers, for instance a region of a memory mapped cache file. The
+ * data is not copied by the library: it is either written to the
+ * device directly, or, when the request is answered from the io_uring
+ * session loop, left in place until the queued write has completed.
+ *
+ * release(arg) is called exactly once when the library no longer
+ * needs the memory, also if the reply could not be sent. This may
+ * happen before fuse_reply_pinned() returns, or later from the thread
+ * running the session loop, so the callback must not block.
+ *
+ * Possible requests:
+ *   read, readdir, getxattr, listxattr
+ *
+ * @param req request handle
+ * @param iov the vector containing the data
+ * @param count the size of vector
+ * @param release called when the memory may be reused or unmapped
+ * @param arg argument passed to release
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_pinned(fuse_req_t req, const struct iovec *iov, int count,
+		      void (*release)(void *arg), void *arg);
+
 /**
  * Reply with data vector
  *
@@ -1542,6 +1669,72 @@ size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
 			      const char *name,
 			      const struct fuse_entry_param *e, off_t off);
 
+/**
+ * Directory entry for fuse_add_direntries()
+ */
+struct fuse_direntry {
+	/** Name of the entry, needs no terminating zero if namelen is set */
+	const char *name;
+
+	/** Length of the name, or zero to have it computed */
+	size_t namelen;
+
+	/**
+	 * Inode number and file type (the S_IFMT bits), as st_ino and
+	 * st_mode of the *stbuf* argument of fuse_add_direntry().
+	 * Ignored by fuse_add_direntries_plus().
+	 */
+	ino_t ino;
+	mode_t mode;
+
+	/** The offset of the next entry */
+	off_t off;
+};
+
+/**
+ * Add several directory entries to the buffer
+ *
+ * Entries are added in order until one doesn't fit. The result is
+ * the same as that of calling fuse_add_direntry() for each of them,
+ * but the whole array is packed in a single pass.
+ *
+ * If *buf* is NULL, nothing is written, and *used* is set to the
+ * space that all entries need.
+ *
+ * @param req request handle
+ * @param buf the point where the entries will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param ents the entries
+ * @param count the number of entries
+ * @param used set to the space taken up by the entries that were added
+ * @return the number of entries that were added
+ */
+size_t fuse_add_direntries(fuse_req_t req, char *buf, size_t bufsize,
+			   const struct fuse_direntry *ents, size_t count,
+			   size_t *used);
+
+/**
+ * Add several directory entries to the buffer with the attributes
+ *
+ * Like fuse_add_direntries(), but for readdirplus. The names and
+ * offsets are taken from *ents*, everything else from the entry
+ * parameters at the same index of *e*. Timeouts are converted only
+ * when they differ from those of the previous entry.
+ *
+ * @param req request handle
+ * @param buf the point where the entries will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param ents the names and offsets of the entries
+ * @param e the entry parameters
+ * @param count the number of entries
+ * @param used set to the space taken up by the entries that were added
+ * @return the number of entries that were added
+ */
+size_t fuse_add_direntries_plus(fuse_req_t req, char *buf, size_t bufsize,
+				const struct fuse_direntry *ents,
+				const struct fuse_entry_param *e,
+				size_t count, size_t *used);
+
 /**
  * Reply to ask for data fetch and output buffer preparation.  ioctl
  * will be retried with the specified input data fetched and output
@@ -1707,6 +1900,101 @@ int fuse_lowlevel_notify_delete(struct fuse_session *se,
 				fuse_ino_t parent, fuse_ino_t child,
 				const char *name, size_t namelen);
 
+/** Kind of a notification in fuse_lowlevel_notify_batch() */
+enum fuse_notify_type {
+	FUSE_NOTIFY_TYPE_INVAL_INODE,
+	FUSE_NOTIFY_TYPE_INVAL_ENTRY,
+	FUSE_NOTIFY_TYPE_DELETE,
+	FUSE_NOTIFY_TYPE_STORE,
+};
+
+/**
+ * One notification in fuse_lowlevel_notify_batch() and
+ * fuse_lowlevel_notify_queue(). The fields are the arguments of the
+ * notify function of the same type.
+ */
+struct fuse_notify_entry {
+	enum fuse_notify_type type;
+
+	/** The inode for INVAL_INODE, the parent otherwise */
+	fuse_ino_t ino;
+
+	/** The child inode, for DELETE */
+	fuse_ino_t child;
+
+	/** The range to invalidate, for INVAL_INODE, or to store */
+	off_t off;
+	off_t len;
+
+	/** The name, for INVAL_ENTRY and DELETE */
+	const char *name;
+	size_t namelen;
+
+	/** The len bytes to store, for STORE */
+	const void *data;
+
+	/** Set to zero for success, -errno for failure */
+	int error;
+};
+
+/**
+ * Send many notifications at once
+ *
+ * Behaves like calling fuse_lowlevel_notify_inval_inode(),
+ * fuse_lowlevel_notify_inval_entry(), fuse_lowlevel_notify_delete()
+ * or fuse_lowlevel_notify_store() for each of the *count* entries,
+ * but where io_uring is available,
+ * the notifications are written to the device in groups, with a
+ * single system call per group. The same restrictions as for the
+ * individual functions apply.
+ *
+ * The outcome of every notification is stored in its *error* field.
+ *
+ * @param se the session object
+ * @param entries the notifications
+ * @param count the number of entries
+ * @return the number of failed notifications, or -errno if none
+ *         could be sent
+ */
+int fuse_lowlevel_notify_batch(struct fuse_session *se,
+			       struct fuse_notify_entry *entries,
+			       size_t count);
+
+/**
+ * Queue a notification for sending in the background
+ *
+ * The notification is copied, along with its name or data, and sent
+ * by a thread of the session, so the caller never blocks on the
+ * kernel. This makes it safe to notify from within a filesystem
+ * operation. Notifications are sent in the order they were queued,
+ * several at a time as with fuse_lowlevel_notify_batch().
+ *
+ * An inode invalidation is merged into one still waiting for the
+ * same inode, which then covers both ranges, unless a store to that
+ * inode has been queued in between. An entry invalidation or
+ * deletion is dropped if the same one is already waiting.
+ *
+ * At most as many notifications as given with the notify_queue=N
+ * option (1024 by default) wait at any time. The outcome of queued
+ * notifications is not reported. Those still waiting when the file
+ * system is unmounted are dropped.
+ *
+ * @param se the session object
+ * @param entry the notification, its error field is ignored
+ * @return zero for success, -EAGAIN if the queue is full, -errno for
+ *         other failures
+ */
+int fuse_lowlevel_notify_queue(struct fuse_session *se,
+			       const struct fuse_notify_entry *entry);
+
+/**
+ * Wait until all queued notifications have been sent
+ *
+ * @param se the session object
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_queue_flush(struct fuse_session *se);
+
 /**
  * Store data to the kernel buffers
  *
@@ -1735,6 +2023,100 @@ int fuse_lowlevel_notify_delete(struct fuse_session *se,
 int fuse_lowlevel_notify_store(struct fuse_session *se, fuse_ino_t ino,
 			       off_t offset, struct fuse_bufvec *bufv,
 			       enum fuse_buf_copy_flags flags);
+
+/**
+ * Progress of fuse_lowlevel_notify_store_fd() and of a background
+ * store
+ */
+struct fuse_store_stats {
+	/** Bytes stored so far */
+	uint64_t bytes;
+
+	/** Number of store notifications sent */
+	uint64_t chunks;
+
+	/** Time spent, in nanoseconds */
+	uint64_t ns;
+
+	/** Set once the whole range has been stored, or the store failed */
+	int done;
+};
+
+/**
+ * Store the contents of a file in the kernel buffers
+ *
+ * Sends *size* bytes of the regular file *fd*, starting at *offset*,
+ * as the data of the inode at the same offset, in chunks of 512 KiB
+ * sent with fuse_lowlevel_notify_store(). If FUSE_CAP_SPLICE_WRITE is
+ * enabled the data is spliced from the file into the device rather
+ * than copied through memory. With *size* zero, or beyond the end of
+ * the file, the file is stored up to its end.
+ *
+ * The same restrictions as for fuse_lowlevel_notify_store() apply.
+ *
+ * Added in FUSE protocol version 7.15. If the kernel does not support
+ * this (or a newer) version, the function will return -ENOSYS and do
+ * nothing.
+ *
+ * @param se the session object
+ * @param ino the inode number
+ * @param fd the file to read the data from
+ * @param offset the starting offset in the file and the inode
+ * @param size the number of bytes to store
+ * @param stats if not NULL, receives what was done
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_store_fd(struct fuse_session *se, fuse_ino_t ino,
+				  int fd, off_t offset, off_t size,
+				  struct fuse_store_stats *stats);
+
+/** A store running in the background */
+struct fuse_store;
+
+/**
+ * Start fuse_lowlevel_notify_store_fd() in a separate thread
+ *
+ * *fd* must stay open until the store has been waited for with
+ * fuse_store_wait(), and that must happen before the session is
+ * unmounted.
+ *
+ * @param se the session object
+ * @param ino the inode number
+ * @param fd the file to read the data from
+ * @param offset the starting offset in the file and the inode
+ * @param size the number of bytes to store
+ * @return the store, or NULL on failure
+ */
+struct fuse_store *fuse_lowlevel_notify_store_fd_start(struct fuse_session *se,
+							fuse_ino_t ino, int fd,
+							off_t offset, off_t size);
+
+/**
+ * Get the progress of a background store
+ *
+ * @param st the store
+ * @param stats receives the progress so far
+ */
+void fuse_store_progress(struct fuse_store *st, struct fuse_store_stats *stats);
+
+/**
+ * Stop a background store after the chunk being sent
+ *
+ * fuse_store_wait() then returns -ECANCELED, unless the store had
+ * already completed.
+ *
+ * @param st the store
+ */
+void fuse_store_cancel(struct fuse_store *st);
+
+/**
+ * Wait for a background store to finish and free it
+ *
+ * @param st the store
+ * @param stats if not NULL, receives what was done
+ * @return zero for success, -errno for failure
+ */
+int fuse_store_wait(struct fuse_store *st, struct fuse_store_stats *stats);
 /**
  * Retrieve data from the kernel buffers
  *
@@ -1878,6 +2260,12 @@ struct fuse_cmdline_opts {
 	int show_help;
 	int clone_fd;
 	unsigned int max_idle_threads;
+	unsigned int min_threads;
+	unsigned int max_threads;
+	unsigned int idle_timeout_ms;
+	int affinity;
+	unsigned int bulk_threads;
+	unsigned int receivers;
 };
 
 /**
@@ -1898,8 +2286,14 @@ struct fuse_cmdline_opts {
  * @param opts output argument for parsed options
  * @return 0 on success, -1 on failure
  */
+#if (!defined(__UCLIBC__) && !defined(__APPLE__))
 int fuse_parse_cmdline(struct fuse_args *args,
 		       struct fuse_cmdline_opts *opts);
+#else
+int fuse_parse_cmdline_311(struct fuse_args *args,
+			   struct fuse_cmdline_opts *opts);
+#define fuse_parse_cmdline(args, opts) fuse_parse_cmdline_311(args, opts)
+#endif
 
 /**
  * Create a low level session.
@@ -1943,6 +2337,74 @@ struct fuse_session *fuse_session_new(struct fuse_args *args,
  **/
 int fuse_session_mount(struct fuse_session *se, const char *mountpoint);
 
+/**
+ * Transport of a session that is not connected to /dev/fuse
+ *
+ * The transport carries the same messages as the FUSE device, e.g.
+ * over a virtio queue, a vhost-user connection or a shared memory
+ * ring. Requests are decoded and replies are built by the library as
+ * usual. The @fd passed to the callbacks is the one given to
+ * fuse_session_custom_io(). @userdata is the user data of the session.
+ */
+struct fuse_custom_io {
+	/**
+	 * Send one message, given in @count pieces. Works like
+	 * writev(2): returns the number of bytes sent, or -1 with errno
+	 * set. ENOENT means that the request was interrupted.
+	 */
+	ssize_t (*writev)(int fd, struct iovec *iov, int count,
+			  void *userdata);
+
+	/**
+	 * Receive one request into @buf, which has room for @buf_len
+	 * bytes. Works like read(2) on the device: returns the size of
+	 * the request, 0 once the transport is closed, or -1 with errno
+	 * set. EINTR and EAGAIN are passed on to the session loop,
+	 * ENODEV ends the session.
+	 */
+	ssize_t (*read)(int fd, void *buf, size_t buf_len, void *userdata);
+
+	/**
+	 * Optional: receive one request without copying it. Sets
+	 * @buf->mem to memory of the transport holding the request and
+	 * returns its size, with the same return values as read(). The
+	 * library's session loops then process the request in place,
+	 * and hand the memory back with release_buf() once they are done
+	 * with it. Other callers of fuse_session_receive_buf() still go
+	 * through read().
+	 */
+	ssize_t (*receive_buf)(int fd, struct fuse_buf *buf, void *userdata);
+
+	/**
+	 * Give back memory from receive_buf(). Required if receive_buf()
+	 * is given; may be called from any thread.
+	 */
+	void (*release_buf)(int fd, struct fuse_buf *buf, void *userdata);
+};
+
+/**
+ * Connect a session to a custom transport.
+ *
+ * This is called instead of fuse_session_mount(). The messages are
+ * exchanged with the callbacks of @io rather than with read(2) and
+ * writev(2) on a FUSE device, so splice and io_uring are not used,
+ * and neither is the clone_fd option. Sessions on a custom transport
+ * cannot be handed over to another process.
+ *
+ * @fd has to become readable when a request is waiting, as the
+ * session loops poll it. The session takes it over and closes it in
+ * fuse_session_destroy(). The callbacks are copied.
+ *
+ * @param se the session
+ * @param io the transport callbacks
+ * @param io_size sizeof(struct fuse_custom_io)
+ * @param fd file descriptor passed to the callbacks
+ * @return 0 on success, or -errno
+ */
+int fuse_session_custom_io(struct fuse_session *se,
+			   const struct fuse_custom_io *io, size_t io_size,
+			   int fd);
+
 /**
  * Enter a single threaded, blocking event loop.
  *
@@ -1967,6 +2429,28 @@ int fuse_session_mount(struct fuse_session *se, const char *mountpoint);
  */
 int fuse_session_loop(struct fuse_session *se);
 
+/**
+ * Enter a single threaded event loop that uses io_uring to talk to
+ * the kernel.
+ *
+ * Up to `depth` reads are kept posted on the device, and replies
+ * that are sent while a request is processed are queued on the ring
+ * and linked in front of the next read. A single io_uring_enter(2)
+ * call thus submits the replies of all requests that were processed
+ * and waits for new ones. Replies sent from other threads are
+ * written directly.
+ *
+ * This is also used by fuse_session_loop() if the session was
+ * created with the ``-o io_uring`` option.
+ *
+ * @param se the session
+ * @param depth the number of requests that can be read ahead,
+ *        zero selects a default
+ * @return see fuse_session_loop(), -ENOSYS if io_uring is not
+ *         available
+ */
+int fuse_session_loop_uring(struct fuse_session *se, unsigned int depth);
+
 #if FUSE_USE_VERSION < 32
 int fuse_session_loop_mt_31(struct fuse_session *se, int clone_fd);
 #define fuse_session_loop_mt(se, clone_fd) fuse_session_loop_mt_31(se, clone_fd)
@@ -1985,11 +2469,110 @@ int fuse_session_loop_mt_31(struct fuse_session *se, int clone_fd);
  */
 int fuse_session_loop_mt(struct fuse_session *se, struct fuse_loop_config *config);
 #else
-int fuse_session_loop_mt_32(struct fuse_session *se, struct fuse_loop_config *config);
-#define fuse_session_loop_mt(se, config) fuse_session_loop_mt_32(se, config)
+int fuse_session_loop_mt_311(struct fuse_session *se, struct fuse_loop_config *config);
+#define fuse_session_loop_mt(se, config) fuse_session_loop_mt_311(se, config)
 #endif
 #endif
 
+/**
+ * A loop that serves many sessions with one pool of worker threads.
+ *
+ * A single thread waits for requests on the devices of all sessions
+ * with epoll(7), and a fixed number of workers read and process them.
+ * The workers take turns between the sessions that have requests, one
+ * request at a time, so that a busy session does not hold up the
+ * others. A session only gets more than
+ * fuse_loop_config.session_threads workers while no other session is
+ * waiting for one, and never the last idle worker. Requests are read
+ * into buffers from the pool of their session, which is emptied
+ * whenever the session runs out of requests, so that an idle mount
+ * costs no threads and next to no memory.
+ *
+ * fuse_session_exit() wakes up the loop, which lets the session go
+ * once the requests in progress are done.
+ *
+ * The sessions do not splice requests or replies, as that would need
+ * a pipe for every combination of worker and session. Sessions with a
+ * custom transport (fuse_session_custom_io()) cannot be served.
+ */
+struct fuse_multi_loop;
+
+/**
+ * Create a loop for many sessions.
+ *
+ * The number of workers is config->max_threads, or the number of
+ * online CPUs (but at least four) if that is zero. The share of a
+ * session is config->session_threads workers, half of them if that
+ * is zero. The other fields of the configuration do not apply.
+ *
+ * @param config the loop configuration, may be NULL for defaults
+ * @return the loop, or NULL on failure
+ */
+struct fuse_multi_loop *fuse_multi_loop_new(const struct fuse_loop_config *config);
+
+/**
+ * Add a mounted session to the loop, which may already be running.
+ *
+ * The session should be added right after it was mounted, before
+ * INIT was answered, so that splice is not negotiated. Once the
+ * session has ended (it was unmounted, fuse_multi_loop_remove() was
+ * called, or the loop has ended) and none of its requests is being
+ * processed any more, done() is called with what fuse_session_loop()
+ * would have returned. From then on the loop does not touch the
+ * session, and done() may unmount and destroy it. done() is called
+ * from one of the loop's threads, or from fuse_multi_loop_remove().
+ *
+ * @param ml the loop
+ * @param se the session
+ * @param done called when the session has left the loop
+ * @param data passed to done()
+ * @return 0 on success, -errno on failure
+ */
+int fuse_multi_loop_add(struct fuse_multi_loop *ml, struct fuse_session *se,
+			void (*done)(struct fuse_session *se, int err,
+				     void *data),
+			void *data);
+
+/**
+ * Take a session out of the loop. Requests that are being processed
+ * are answered, those that wait in the kernel stay there. The
+ * session's done() callback is called once that is over, possibly
+ * before this returns.
+ *
+ * @param ml the loop
+ * @param se a session added with fuse_multi_loop_add()
+ */
+void fuse_multi_loop_remove(struct fuse_multi_loop *ml,
+			    struct fuse_session *se);
+
+/**
+ * Serve the sessions of the loop until fuse_multi_loop_exit() is
+ * called. Sessions that are still in the loop then leave it, their
+ * done() callbacks have been called when this returns.
+ *
+ * The calling thread waits for requests, the workers are started and
+ * stopped by this function.
+ *
+ * @param ml the loop
+ * @return 0 on success, -errno on failure
+ */
+int fuse_multi_loop_run(struct fuse_multi_loop *ml);
+
+/**
+ * Make fuse_multi_loop_run() return. This is async-signal-safe.
+ *
+ * @param ml the loop
+ */
+void fuse_multi_loop_exit(struct fuse_multi_loop *ml);
+
+/**
+ * Destroy a loop that is not running. Sessions that were added while
+ * it did not run are not called back.
+ *
+ * @param ml the loop
+ */
+void fuse_multi_loop_destroy(struct fuse_multi_loop *ml);
+
 /**
  * Flag a session as terminated.
  *
@@ -2016,6 +2599,95 @@ void fuse_session_reset(struct fuse_session *se);
  */
 int fuse_session_exited(struct fuse_session *se);
 
+/**
+ * Number of opcodes covered by struct fuse_session_stats. Part of its
+ * layout, so this does not change.
+ */
+#define FUSE_STATS_MAX_OPCODE 64
+
+/** Number of buckets in the latency histograms, fixed like the above */
+#define FUSE_STATS_LATENCY_BUCKETS 32
+
+/**
+ * Statistics of the requests with one opcode
+ */
+struct fuse_opcode_stats {
+	/** Number of requests received */
+	uint64_t count;
+
+	/** Number of requests that have not been answered yet */
+	uint64_t in_flight;
+
+	/** Bytes received, including the request headers */
+	uint64_t bytes_in;
+
+	/** Bytes sent in replies, including the reply headers */
+	uint64_t bytes_out;
+
+	/**
+	 * Time from receiving a request to replying to it. Bucket 0
+	 * counts requests answered within 1us, bucket i (i > 0) those
+	 * that took at least 2^(i-1) but less than 2^i us. The last
+	 * bucket also counts everything slower.
+	 */
+	uint64_t latency[FUSE_STATS_LATENCY_BUCKETS];
+
+	/**
+	 * For future use.
+	 */
+	uint64_t reserved[4];
+};
+
+/**
+ * Runtime statistics of a session
+ *
+ * The size of the struct is fixed: counters that are added later take
+ * the place of reserved entries, which read as zero until then.
+ */
+struct fuse_session_stats {
+	/** Number of request objects that were allocated */
+	uint64_t req_allocs;
+
+	/** Number of request allocations served from a per-thread cache */
+	uint64_t req_cache_hits;
+
+	/**
+	 * Per-opcode statistics, indexed by the opcode numbers of the
+	 * kernel protocol (FUSE_LOOKUP, FUSE_READ, ...). Opcodes from
+	 * FUSE_STATS_MAX_OPCODE up are not counted.
+	 */
+	struct fuse_opcode_stats opcodes[FUSE_STATS_MAX_OPCODE];
+
+	/**
+	 * Requests that were received but not answered yet, and their
+	 * size in bytes. These are only counted if a budget was set
+	 * with -o max_inflight or -o max_inflight_bytes, and never
+	 * include SETLKW and INTERRUPT requests.
+	 */
+	uint64_t inflight_reqs;
+	uint64_t inflight_bytes;
+
+	/** Number of times reading requests paused for the budget */
+	uint64_t admission_waits;
+
+	/**
+	 * For future use.
+	 */
+	uint64_t reserved[27];
+};
+
+/**
+ * Get the runtime statistics of a session
+ *
+ * The counters are collected without synchronizing with the threads
+ * processing requests, so they may be slightly out of date.
+ *
+ * @param se the session
+ * @param stats the statistics are stored here
+ */
+void fuse_session_get_stats(struct fuse_session *se,
+			    struct fuse_session_stats *stats);
+
 /**
  * Ensure that file system is unmounted.
  *
@@ -2042,6 +2714,52 @@ int fuse_session_exited(struct fuse_session *se);
  */
 void fuse_session_unmount(struct fuse_session *se);
 
+/**
+ * Hand a mounted session over to another process.
+ *
+ * This is meant for restarting a file system daemon without
+ * unmounting it: the kernel keeps its caches, and requests that it
+ * has not passed on yet are answered by the successor.
+ *
+ * The session loop must have returned after fuse_session_exit(), so
+ * that every request that was read has been answered (should one have
+ * been lost anyway, the kernel fails it once this process no longer
+ * has the device open). The device file
+ * descriptor and the state negotiated by INIT are then sent over the
+ * connected unix domain socket @sock to a process that calls
+ * fuse_session_takeover() on the other end.
+ *
+ * Afterwards the session no longer refers to the mount:
+ * fuse_session_unmount() does nothing, and fuse_session_destroy() only
+ * releases the resources of this process (it still calls the destroy
+ * handler). The inode numbers and file handles known to the kernel
+ * stay in use, so the successor has to be able to resolve them. For
+ * this reason only the low-level API supports this, and mounts using
+ * the auto_unmount option cannot be handed over.
+ *
+ * @param se the session
+ * @param sock connected unix domain socket
+ * @return 0 on success, or -errno
+ */
+int fuse_session_handoff(struct fuse_session *se, int sock);
+
+/**
+ * Take over a mounted session from another process.
+ *
+ * This is called instead of fuse_session_mount(), and receives what
+ * fuse_session_handoff() sends over @sock. There is no INIT request;
+ * instead the init handler is called right away with the connection
+ * parameters that were negotiated before. It may not ask for
+ * capabilities that were not negotiated, and other changes to the
+ * connection parameters are ignored. The session loop can be started
+ * afterwards, and fuse_session_unmount() unmounts the file system.
+ *
+ * @param se the session
+ * @param sock connected unix domain socket
+ * @return 0 on success, or -errno
+ */
+int fuse_session_takeover(struct fuse_session *se, int sock);
+
 /**
  * Destroy a session
  *
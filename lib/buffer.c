@@ -15,9 +15,28 @@
 #include "fuse_i.h"
 #include "fuse_lowlevel.h"
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/* Memory buffers gathered into one writev() */
+#define FUSE_BUF_IOV_MAX 64
+
+/*
+ * Largest per-thread buffer for copies between file descriptors. Every
+ * thread that copies keeps one, so it is only as large as a pipe,
+ * which is as much as a read from one returns at a time.
+ */
+#define FUSE_BUF_BOUNCE_MAX (64 * 1024)
 
 size_t fuse_buf_size(const struct fuse_bufvec *bufv)
 {
@@ -73,6 +92,74 @@ static ssize_t fuse_buf_write(const struct fuse_buf *dst, size_t dst_off,
 	return copied;
 }
 
+#ifdef HAVE_PWRITEV
+/*
+ * Write up to *lenp bytes from the consecutive memory buffers of srcv,
+ * starting at its current position, with a single pwritev()/writev()
+ * (or more with FUSE_BUF_FD_RETRY). *lenp is set to the number of
+ * bytes that fit into the iovec.
+ */
+static ssize_t fuse_buf_writev(const struct fuse_buf *dst, size_t dst_off,
+			       const struct fuse_bufvec *srcv, size_t *lenp)
+{
+	size_t len = *lenp;
+	struct iovec iovbuf[FUSE_BUF_IOV_MAX];
+	struct iovec *iov = iovbuf;
+	size_t off = srcv->off;
+	size_t copied = 0;
+	size_t idx;
+	ssize_t res;
+	int cnt = 0;
+
+	for (idx = srcv->idx; idx < srcv->count && cnt < FUSE_BUF_IOV_MAX &&
+		     copied < len; idx++) {
+		const struct fuse_buf *src = &srcv->buf[idx];
+
+		if (src->flags & FUSE_BUF_IS_FD)
+			break;
+		iov[cnt].iov_base = (char *) src->mem + off;
+		iov[cnt].iov_len = min_size(src->size - off, len - copied);
+		copied += iov[cnt].iov_len;
+		cnt++;
+		off = 0;
+	}
+	*lenp = len = copied;
+	copied = 0;
+
+	while (len) {
+		if (dst->flags & FUSE_BUF_FD_SEEK)
+			res = pwritev(dst->fd, iov, cnt, dst->pos + dst_off);
+		else
+			res = writev(dst->fd, iov, cnt);
+		if (res == -1) {
+			if (!copied)
+				return -errno;
+			break;
+		}
+		if (res == 0)
+			break;
+
+		copied += res;
+		if (!(dst->flags & FUSE_BUF_FD_RETRY))
+			break;
+
+		dst_off += res;
+		len -= res;
+		while (cnt && (size_t) res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *) iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+
+	return copied;
+}
+#endif
+
 static ssize_t fuse_buf_read(const struct fuse_buf *dst, size_t dst_off,
 			     const struct fuse_buf *src, size_t src_off,
 			     size_t len)
@@ -107,11 +194,179 @@ static ssize_t fuse_buf_read(const struct fuse_buf *dst, size_t dst_off,
 	return copied;
 }
 
+struct fuse_bounce_buf {
+	size_t size;
+	char *mem;
+};
+
+static pthread_key_t fuse_bounce_key;
+static pthread_once_t fuse_bounce_once = PTHREAD_ONCE_INIT;
+static int fuse_bounce_key_ok;
+
+static void fuse_bounce_free(void *data)
+{
+	struct fuse_bounce_buf *b = data;
+
+	free(b->mem);
+	free(b);
+}
+
+static void fuse_bounce_init(void)
+{
+	fuse_bounce_key_ok =
+		pthread_key_create(&fuse_bounce_key, fuse_bounce_free) == 0;
+}
+
+/*
+ * The calling thread's bounce buffer, grown to hold len bytes if
+ * possible. Returns NULL if there is none.
+ */
+static struct fuse_bounce_buf *fuse_bounce_get(size_t len)
+{
+	struct fuse_bounce_buf *b;
+	char *mem;
+
+	pthread_once(&fuse_bounce_once, fuse_bounce_init);
+	if (!fuse_bounce_key_ok)
+		return NULL;
+
+	b = pthread_getspecific(fuse_bounce_key);
+	if (b == NULL) {
+		b = calloc(1, sizeof(*b));
+		if (b == NULL)
+			return NULL;
+		if (pthread_setspecific(fuse_bounce_key, b) != 0) {
+			free(b);
+			return NULL;
+		}
+	}
+
+	len = min_size(len, FUSE_BUF_BOUNCE_MAX);
+	if (b->size < len) {
+		mem = malloc(len);
+		if (mem != NULL) {
+			free(b->mem);
+			b->mem = mem;
+			b->size = len;
+		}
+	}
+
+	return b->mem ? b : NULL;
+}
+
+static int fuse_buf_is_reg(const struct fuse_buf *buf)
+{
+	struct stat st;
+
+	return fstat(buf->fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static ssize_t fuse_buf_copy_file_range(int fd_in, off_t *off_in,
+					int fd_out, off_t *off_out, size_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	return copy_file_range(fd_in, off_in, fd_out, off_out, len, 0);
+#else
+	(void) fd_in;
+	(void) off_in;
+	(void) fd_out;
+	(void) off_out;
+	(void) len;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static ssize_t fuse_buf_sendfile(int fd_out, int fd_in, off_t *off_in,
+				 size_t len)
+{
+#ifdef __linux__
+	return sendfile(fd_out, fd_in, off_in, len);
+#else
+	(void) fd_out;
+	(void) fd_in;
+	(void) off_in;
+	(void) len;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Copy from a regular file in the kernel, with copy_file_range() if
+ * the destination is a regular file too, or else with sendfile().
+ * Returns -ENOSYS before copying anything if neither works for these
+ * file descriptors.
+ */
+static ssize_t fuse_buf_fd_copy(const struct fuse_buf *dst, size_t dst_off,
+				const struct fuse_buf *src, size_t src_off,
+				size_t len)
+{
+	int retry = (src->flags & FUSE_BUF_FD_RETRY) ||
+		(dst->flags & FUSE_BUF_FD_RETRY);
+	off_t srcpos_val = src->pos + src_off;
+	off_t dstpos_val = dst->pos + dst_off;
+	off_t *srcpos = NULL;
+	off_t *dstpos = NULL;
+	int use_cfr;
+	int use_sendfile;
+	size_t copied = 0;
+	ssize_t res;
+
+	if (!fuse_buf_is_reg(src))
+		return -ENOSYS;
+	if (src->flags & FUSE_BUF_FD_SEEK)
+		srcpos = &srcpos_val;
+	if (dst->flags & FUSE_BUF_FD_SEEK)
+		dstpos = &dstpos_val;
+
+	use_cfr = fuse_buf_is_reg(dst);
+	/* sendfile() can only write at the current file offset */
+	use_sendfile = !dstpos;
+
+	while (len) {
+		if (use_cfr)
+			res = fuse_buf_copy_file_range(src->fd, srcpos,
+						       dst->fd, dstpos, len);
+		else if (use_sendfile)
+			res = fuse_buf_sendfile(dst->fd, src->fd, srcpos, len);
+		else
+			return -ENOSYS;
+
+		if (res == -1 && !copied &&
+		    (errno == ENOSYS || errno == EINVAL || errno == EXDEV ||
+		     errno == EOPNOTSUPP || errno == EBADF)) {
+			/* Not supported for this pair (of filesystems) */
+			if (use_cfr)
+				use_cfr = 0;
+			else
+				use_sendfile = 0;
+			continue;
+		}
+		if (res == -1) {
+			if (!copied)
+				return -errno;
+			break;
+		}
+		if (res == 0)
+			break;
+
+		copied += res;
+		if (!retry)
+			break;
+
+		len -= res;
+	}
+
+	return copied;
+}
+
 static ssize_t fuse_buf_fd_to_fd(const struct fuse_buf *dst, size_t dst_off,
 				 const struct fuse_buf *src, size_t src_off,
 				 size_t len)
 {
 	char buf[4096];
+	struct fuse_bounce_buf *bounce;
 	struct fuse_buf tmp = {
 		.size = sizeof(buf),
 		.flags = 0,
@@ -119,7 +374,17 @@ static ssize_t fuse_buf_fd_to_fd(const struct fuse_buf *dst, size_t dst_off,
 	ssize_t res;
 	size_t copied = 0;
 
-	tmp.mem = buf;
+	res = fuse_buf_fd_copy(dst, dst_off, src, src_off, len);
+	if (res != -ENOSYS)
+		return res;
+
+	bounce = fuse_bounce_get(len);
+	if (bounce) {
+		tmp.mem = bounce->mem;
+		tmp.size = bounce->size;
+	} else {
+		tmp.mem = buf;
+	}
 
 	while (len) {
 		size_t this_len = min_size(tmp.size, len);
@@ -281,6 +546,42 @@ static int fuse_bufvec_advance(struct fuse_bufvec *bufv, size_t len)
 	return 1;
 }
 
+/* Like fuse_bufvec_advance(), but len may span several buffers */
+static int fuse_bufvec_skip(struct fuse_bufvec *bufv, size_t len)
+{
+	const struct fuse_buf *buf;
+	size_t this_len;
+
+	do {
+		buf = fuse_bufvec_current(bufv);
+		if (!buf)
+			return 0;
+		this_len = min_size(buf->size - bufv->off, len);
+		if (!fuse_bufvec_advance(bufv, this_len))
+			return 0;
+		len -= this_len;
+	} while (len);
+
+	return 1;
+}
+
+/* Bytes left from the current position, SIZE_MAX if unknown */
+static size_t fuse_bufvec_left(const struct fuse_bufvec *bufv)
+{
+	size_t left = 0;
+	size_t idx;
+
+	for (idx = bufv->idx; idx < bufv->count; idx++) {
+		if (bufv->buf[idx].size == SIZE_MAX)
+			return SIZE_MAX;
+		left += bufv->buf[idx].size;
+		if (idx == bufv->idx)
+			left -= bufv->off;
+	}
+
+	return left;
+}
+
 ssize_t fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
 		      enum fuse_buf_copy_flags flags)
 {
@@ -304,6 +605,16 @@ ssize_t fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
 		dst_len = dst->size - dstv->off;
 		len = min_size(src_len, dst_len);
 
+#ifdef HAVE_PWRITEV
+		/* Gather memory buffers that go into the same fd buffer */
+		if (!(src->flags & FUSE_BUF_IS_FD) &&
+		    (dst->flags & FUSE_BUF_IS_FD) && src_len < dst_len &&
+		    srcv->idx + 1 < srcv->count &&
+		    !(srcv->buf[srcv->idx + 1].flags & FUSE_BUF_IS_FD)) {
+			len = min_size(fuse_bufvec_left(srcv), dst_len);
+			res = fuse_buf_writev(dst, dstv->off, srcv, &len);
+		} else
+#endif
 		res = fuse_buf_copy_one(dst, dstv->off, src, srcv->off, len, flags);
 		if (res < 0) {
 			if (!copied)
@@ -312,7 +623,7 @@ ssize_t fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
 		}
 		copied += res;
 
-		if (!fuse_bufvec_advance(srcv, res) ||
+		if (!fuse_bufvec_skip(srcv, res) ||
 		    !fuse_bufvec_advance(dstv, res))
 			break;
 
@@ -322,3 +633,233 @@ ssize_t fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
 
 	return copied;
 }
+
+/* Whether each destination can be given its own pass over bufv */
+static int fuse_bufvec_rereadable(const struct fuse_bufvec *bufv)
+{
+	size_t idx;
+
+	for (idx = bufv->idx; idx < bufv->count; idx++) {
+		const struct fuse_buf *buf = &bufv->buf[idx];
+
+		if ((buf->flags & FUSE_BUF_IS_FD) &&
+		    !(buf->flags & FUSE_BUF_FD_SEEK))
+			return 0;
+	}
+
+	return 1;
+}
+
+static ssize_t fuse_buf_copy_replay(struct fuse_bufvec *dstv[], size_t count,
+				    struct fuse_bufvec *srcv,
+				    enum fuse_buf_copy_flags flags)
+{
+	size_t idx = srcv->idx;
+	size_t off = srcv->off;
+	ssize_t copied = -1;
+	ssize_t err = 0;
+	ssize_t res;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		srcv->idx = idx;
+		srcv->off = off;
+		res = fuse_buf_copy(dstv[i], srcv, flags);
+		if (res < 0) {
+			err = res;
+			res = 0;
+		}
+		if (copied < 0 || res < copied)
+			copied = res;
+	}
+	srcv->idx = idx;
+	srcv->off = off;
+
+	if (!copied && err)
+		return err;
+	fuse_bufvec_skip(srcv, copied);
+
+	return copied;
+}
+
+#if defined(HAVE_SPLICE) && defined(HAVE_TEE)
+static ssize_t fuse_buf_splice_all(int fd_in, const struct fuse_buf *dst,
+				   size_t dst_off, size_t len, int splice_flags)
+{
+	off_t dstpos_val;
+	off_t *dstpos = NULL;
+	size_t copied = 0;
+	ssize_t res;
+
+	if (dst->flags & FUSE_BUF_FD_SEEK) {
+		dstpos_val = dst->pos + dst_off;
+		dstpos = &dstpos_val;
+	}
+	while (copied < len) {
+		res = splice(fd_in, NULL, dst->fd, dstpos, len - copied,
+			     splice_flags);
+		if (res == -1)
+			return -errno;
+		if (res == 0)
+			return -EIO;
+		copied += res;
+	}
+
+	return copied;
+}
+
+/*
+ * Copy the contents of a pipe to several fds without reading them
+ * into memory. For all but the last destination the data is
+ * duplicated with tee() into a private pipe and spliced from there,
+ * the last destination takes it from the source pipe itself. If a
+ * later tee() comes up short, the destinations before it got more than
+ * the rest, and the smallest amount is returned. Returns -ENOSYS
+ * before copying anything if this does not work for the given buffers.
+ */
+static ssize_t fuse_buf_copy_tee(struct fuse_bufvec *dstv[], size_t count,
+				 struct fuse_bufvec *srcv,
+				 enum fuse_buf_copy_flags flags)
+{
+	const struct fuse_buf *src = fuse_bufvec_current(srcv);
+	int splice_flags = 0;
+	size_t copied = 0;
+	int pipefd[2];
+	int is_short;
+	ssize_t res = 0;
+	size_t len;
+	size_t i;
+
+	if (src == NULL || !(src->flags & FUSE_BUF_IS_FD) ||
+	    (src->flags & FUSE_BUF_FD_SEEK))
+		return -ENOSYS;
+	len = src->size - srcv->off;
+	for (i = 0; i < count; i++) {
+		const struct fuse_buf *dst = fuse_bufvec_current(dstv[i]);
+
+		if (dst == NULL || !(dst->flags & FUSE_BUF_IS_FD))
+			return -ENOSYS;
+		len = min_size(len, dst->size - dstv[i]->off);
+	}
+
+	if (pipe(pipefd) == -1)
+		return -ENOSYS;
+#ifdef F_SETPIPE_SZ
+	if (len > 0 && len < INT_MAX)
+		fcntl(pipefd[0], F_SETPIPE_SZ, (int) len);
+#endif
+	if (flags & FUSE_BUF_SPLICE_MOVE)
+		splice_flags |= SPLICE_F_MOVE;
+
+	while (copied < len) {
+		size_t chunk = len - copied;
+
+		is_short = 0;
+		for (i = 0; i + 1 < count; i++) {
+			const struct fuse_buf *dst = fuse_bufvec_current(dstv[i]);
+
+			/* The source may hold less than announced */
+			res = tee(src->fd, pipefd[1], chunk, SPLICE_F_NONBLOCK);
+			if (res == -1) {
+				res = -errno;
+				/* EINVAL: not a pipe, EAGAIN: nothing in it */
+				if (!copied && !i && res == -EINVAL)
+					res = -ENOSYS;
+				else if (res == -EAGAIN)
+					res = 0;
+				goto out;
+			}
+			if (res == 0) {
+				res = 0;
+				goto out;
+			}
+			if (i && res < chunk)
+				is_short = 1;
+			chunk = res;
+
+			res = fuse_buf_splice_all(pipefd[0], dst, dstv[i]->off,
+						  chunk, splice_flags);
+			if (res < 0)
+				goto out;
+			fuse_bufvec_advance(dstv[i], chunk);
+		}
+
+		res = fuse_buf_splice_all(src->fd, fuse_bufvec_current(dstv[i]),
+					  dstv[i]->off, chunk, splice_flags);
+		if (res < 0)
+			goto out;
+		fuse_bufvec_advance(dstv[i], chunk);
+		fuse_bufvec_advance(srcv, chunk);
+		copied += chunk;
+		if (is_short)
+			break;
+	}
+
+out:
+	close(pipefd[0]);
+	close(pipefd[1]);
+	if (res < 0 && !copied)
+		return res;
+
+	return copied;
+}
+#endif
+
+/*
+ * Fallback for sources that can only be read once: read the data
+ * into memory, and write it to each destination from there
+ */
+static ssize_t fuse_buf_copy_bounce(struct fuse_bufvec *dstv[], size_t count,
+				    struct fuse_bufvec *srcv,
+				    enum fuse_buf_copy_flags flags)
+{
+	size_t len = fuse_bufvec_left(srcv);
+	struct fuse_bufvec tmp;
+	ssize_t res;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		len = min_size(len, fuse_bufvec_left(dstv[i]));
+	if (len == SIZE_MAX)
+		return -EINVAL;
+
+	tmp = FUSE_BUFVEC_INIT(len);
+	tmp.buf[0].mem = malloc(len ? len : 1);
+	if (tmp.buf[0].mem == NULL)
+		return -ENOMEM;
+
+	res = fuse_buf_copy(&tmp, srcv, flags);
+	if (res > 0) {
+		tmp.buf[0].size = res;
+		tmp.idx = 0;
+		tmp.off = 0;
+		res = fuse_buf_copy_replay(dstv, count, &tmp, flags);
+	}
+	free(tmp.buf[0].mem);
+
+	return res;
+}
+
+ssize_t fuse_buf_copy_fanout(struct fuse_bufvec *dstv[], size_t count,
+			     struct fuse_bufvec *srcv,
+			     enum fuse_buf_copy_flags flags)
+{
+	if (count == 0)
+		return 0;
+	if (count == 1)
+		return fuse_buf_copy(dstv[0], srcv, flags);
+
+	if (fuse_bufvec_rereadable(srcv))
+		return fuse_buf_copy_replay(dstv, count, srcv, flags);
+
+#if defined(HAVE_SPLICE) && defined(HAVE_TEE)
+	if (!(flags & FUSE_BUF_NO_SPLICE)) {
+		ssize_t res = fuse_buf_copy_tee(dstv, count, srcv, flags);
+
+		if (res != -ENOSYS)
+			return res;
+	}
+#endif
+
+	return fuse_buf_copy_bounce(dstv, count, srcv, flags);
+}
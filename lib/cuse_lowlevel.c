@@ -11,6 +11,7 @@
 #include "cuse_lowlevel.h"
 #include "fuse_kernel.h"
 #include "fuse_i.h"
+#include "fuse_misc.h"
 #include "fuse_opt.h"
 
 #include <stdio.h>
@@ -20,6 +21,10 @@
 #include <errno.h>
 #include <unistd.h>
 
+/* Size of struct cuse_lowlevel_ops up to libfuse 3.10 */
+#define CUSE_LOWLEVEL_OPS_SIZE_30 \
+	offsetof(struct cuse_lowlevel_ops, write_buf)
+
 struct cuse_data {
 	struct cuse_lowlevel_ops	clop;
 	unsigned			max_read;
@@ -56,6 +61,14 @@ static void cuse_fll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 	req_clop(req)->write(req, buf, size, off, fi);
 }
 
+static void cuse_fll_write_buf(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_bufvec *bufv, off_t off,
+			       struct fuse_file_info *fi)
+{
+	(void)ino;
+	req_clop(req)->write_buf(req, bufv, off, fi);
+}
+
 static void cuse_fll_flush(fuse_req_t req, fuse_ino_t ino,
 			   struct fuse_file_info *fi)
 {
@@ -113,7 +126,8 @@ static size_t cuse_pack_info(int argc, const char **argv, char *buf)
 }
 
 static struct cuse_data *cuse_prep_data(const struct cuse_info *ci,
-					const struct cuse_lowlevel_ops *clop)
+					const struct cuse_lowlevel_ops *clop,
+					size_t clop_size)
 {
 	struct cuse_data *cd;
 	size_t dev_info_len;
@@ -133,7 +147,8 @@ static struct cuse_data *cuse_prep_data(const struct cuse_info *ci,
 		return NULL;
 	}
 
-	memcpy(&cd->clop, clop, sizeof(cd->clop));
+	/* Operations the caller doesn't know about stay NULL */
+	memcpy(&cd->clop, clop, clop_size);
 	cd->max_read = 131072;
 	cd->dev_major = ci->dev_major;
 	cd->dev_minor = ci->dev_minor;
@@ -144,18 +159,19 @@ static struct cuse_data *cuse_prep_data(const struct cuse_info *ci,
 	return cd;
 }
 
-struct fuse_session *cuse_lowlevel_new(struct fuse_args *args,
-				       const struct cuse_info *ci,
-				       const struct cuse_lowlevel_ops *clop,
-				       void *userdata)
+static struct fuse_session *cuse_session_new(struct fuse_args *args,
+					     const struct cuse_info *ci,
+					     const struct cuse_lowlevel_ops *clop,
+					     size_t clop_size, void *userdata)
 {
 	struct fuse_lowlevel_ops lop;
 	struct cuse_data *cd;
 	struct fuse_session *se;
 
-	cd = cuse_prep_data(ci, clop);
+	cd = cuse_prep_data(ci, clop, clop_size);
 	if (!cd)
 		return NULL;
+	clop = &cd->clop;
 
 	memset(&lop, 0, sizeof(lop));
 	lop.init	= clop->init;
@@ -168,6 +184,7 @@ struct fuse_session *cuse_lowlevel_new(struct fuse_args *args,
 	lop.fsync	= clop->fsync		? cuse_fll_fsync	: NULL;
 	lop.ioctl	= clop->ioctl		? cuse_fll_ioctl	: NULL;
 	lop.poll	= clop->poll		? cuse_fll_poll		: NULL;
+	lop.write_buf	= clop->write_buf	? cuse_fll_write_buf	: NULL;
 
 	se = fuse_session_new(args, &lop, sizeof(lop), userdata);
 	if (!se) {
@@ -179,6 +196,29 @@ struct fuse_session *cuse_lowlevel_new(struct fuse_args *args,
 	return se;
 }
 
+FUSE_SYMVER("cuse_lowlevel_new_311", "cuse_lowlevel_new@@FUSE_3.11")
+struct fuse_session *cuse_lowlevel_new_311(struct fuse_args *args,
+					   const struct cuse_info *ci,
+					   const struct cuse_lowlevel_ops *clop,
+					   void *userdata)
+{
+	return cuse_session_new(args, ci, clop, sizeof(*clop), userdata);
+}
+
+struct fuse_session *cuse_lowlevel_new_30(struct fuse_args *args,
+					  const struct cuse_info *ci,
+					  const struct cuse_lowlevel_ops *clop,
+					  void *userdata);
+FUSE_SYMVER("cuse_lowlevel_new_30", "cuse_lowlevel_new@FUSE_3.0")
+struct fuse_session *cuse_lowlevel_new_30(struct fuse_args *args,
+					  const struct cuse_info *ci,
+					  const struct cuse_lowlevel_ops *clop,
+					  void *userdata)
+{
+	return cuse_session_new(args, ci, clop, CUSE_LOWLEVEL_OPS_SIZE_30,
+				userdata);
+}
+
 static int cuse_reply_init(fuse_req_t req, struct cuse_init_out *arg,
 			   char *dev_info, unsigned dev_info_len)
 {
@@ -228,10 +268,35 @@ void cuse_lowlevel_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	if (bufsize < se->conn.max_write)
 		se->conn.max_write = bufsize;
 
+	/* The device is read and written like /dev/fuse */
+	if (se->conn.proto_minor >= 14) {
+#ifdef HAVE_SPLICE
+#ifdef HAVE_VMSPLICE
+		se->conn.capable |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+#endif
+		se->conn.capable |= FUSE_CAP_SPLICE_READ;
+#endif
+	}
+	if (se->op.write_buf)
+		se->conn.want |= se->conn.capable & FUSE_CAP_SPLICE_READ;
+
 	se->got_init = 1;
 	if (se->op.init)
 		se->op.init(se->userdata, &se->conn);
 
+	if (se->conn.want & ~se->conn.capable) {
+		fuse_log(FUSE_LOG_ERR, "cuse: error: device requested capabilities "
+			"0x%x that are not supported, aborting.\n",
+			se->conn.want & ~se->conn.capable);
+		fuse_reply_err(req, EPROTO);
+		se->error = -EPROTO;
+		fuse_session_exit(se);
+		return;
+	}
+
+	if (se->conn.want & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE))
+		fuse_ll_pipe_pool_fill(se);
+
 	memset(&outarg, 0, sizeof(outarg));
 	outarg.major = FUSE_KERNEL_VERSION;
 	outarg.minor = FUSE_KERNEL_MINOR_VERSION;
@@ -261,10 +326,12 @@ void cuse_lowlevel_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	fuse_free_req(req);
 }
 
-struct fuse_session *cuse_lowlevel_setup(int argc, char *argv[],
-					 const struct cuse_info *ci,
-					 const struct cuse_lowlevel_ops *clop,
-					 int *multithreaded, void *userdata)
+static struct fuse_session *cuse_setup(int argc, char *argv[],
+				       const struct cuse_info *ci,
+				       const struct cuse_lowlevel_ops *clop,
+				       size_t clop_size,
+				       struct fuse_cmdline_opts *opts,
+				       void *userdata)
 {
 	const char *devname = "/dev/cuse";
 	static const struct fuse_opt kill_subtype_opts[] = {
@@ -273,13 +340,11 @@ struct fuse_session *cuse_lowlevel_setup(int argc, char *argv[],
 	};
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct fuse_session *se;
-	struct fuse_cmdline_opts opts;
 	int fd;
 	int res;
 
-	if (fuse_parse_cmdline(&args, &opts) == -1)
+	if (fuse_parse_cmdline_311(&args, opts) == -1)
 		return NULL;
-	*multithreaded = !opts.singlethread;
 
 	/* Remove subtype= option */
 	res = fuse_opt_parse(&args, NULL, kill_subtype_opts, NULL);
@@ -296,7 +361,7 @@ struct fuse_session *cuse_lowlevel_setup(int argc, char *argv[],
 			close(fd);
 	} while (fd >= 0 && fd <= 2);
 
-	se = cuse_lowlevel_new(&args, ci, clop, userdata);
+	se = cuse_session_new(&args, ci, clop, clop_size, userdata);
 	if (se == NULL)
 		goto out1;
 
@@ -315,10 +380,12 @@ struct fuse_session *cuse_lowlevel_setup(int argc, char *argv[],
 	if (res == -1)
 		goto err_se;
 
-	res = fuse_daemonize(opts.foreground);
+	res = fuse_daemonize(opts->foreground);
 	if (res == -1)
 		goto err_sig;
 
+	free(opts->mountpoint);
+	opts->mountpoint = NULL;
 	fuse_opt_free_args(&args);
 	return se;
 
@@ -327,37 +394,87 @@ err_sig:
 err_se:
 	fuse_session_destroy(se);
 out1:
-	free(opts.mountpoint);
+	free(opts->mountpoint);
+	opts->mountpoint = NULL;
 	fuse_opt_free_args(&args);
 	return NULL;
 }
 
+FUSE_SYMVER("cuse_lowlevel_setup_311", "cuse_lowlevel_setup@@FUSE_3.11")
+struct fuse_session *cuse_lowlevel_setup_311(int argc, char *argv[],
+					     const struct cuse_info *ci,
+					     const struct cuse_lowlevel_ops *clop,
+					     int *multithreaded, void *userdata)
+{
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+
+	se = cuse_setup(argc, argv, ci, clop, sizeof(*clop), &opts, userdata);
+	if (se)
+		*multithreaded = !opts.singlethread;
+	return se;
+}
+
+struct fuse_session *cuse_lowlevel_setup_30(int argc, char *argv[],
+					    const struct cuse_info *ci,
+					    const struct cuse_lowlevel_ops *clop,
+					    int *multithreaded, void *userdata);
+FUSE_SYMVER("cuse_lowlevel_setup_30", "cuse_lowlevel_setup@FUSE_3.0")
+struct fuse_session *cuse_lowlevel_setup_30(int argc, char *argv[],
+					    const struct cuse_info *ci,
+					    const struct cuse_lowlevel_ops *clop,
+					    int *multithreaded, void *userdata)
+{
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+
+	se = cuse_setup(argc, argv, ci, clop, CUSE_LOWLEVEL_OPS_SIZE_30,
+			&opts, userdata);
+	if (se)
+		*multithreaded = !opts.singlethread;
+	return se;
+}
+
 void cuse_lowlevel_teardown(struct fuse_session *se)
 {
 	fuse_remove_signal_handlers(se);
 	fuse_session_destroy(se);
 }
 
-int cuse_lowlevel_main(int argc, char *argv[], const struct cuse_info *ci,
-		       const struct cuse_lowlevel_ops *clop, void *userdata)
+static int cuse_main(int argc, char *argv[], const struct cuse_info *ci,
+		     const struct cuse_lowlevel_ops *clop, size_t clop_size,
+		     struct fuse_loop_config *config, void *userdata)
 {
+	struct fuse_loop_config loop_config;
+	struct fuse_cmdline_opts opts;
 	struct fuse_session *se;
-	int multithreaded;
 	int res;
 
-	se = cuse_lowlevel_setup(argc, argv, ci, clop, &multithreaded,
-				 userdata);
+	se = cuse_setup(argc, argv, ci, clop, clop_size, &opts, userdata);
 	if (se == NULL)
 		return 1;
 
-	if (multithreaded) {
-		struct fuse_loop_config config;
-		config.clone_fd = 0;
-		config.max_idle_threads = 10;
-		res = fuse_session_loop_mt_32(se, &config);
-	}
-	else
+	/*
+	 * FUSE_DEV_IOC_CLONE only accepts /dev/fuse fds, so there is no
+	 * clone_fd for CUSE
+	 */
+	if (opts.singlethread) {
 		res = fuse_session_loop(se);
+	} else if (config) {
+		loop_config = *config;
+		loop_config.clone_fd = 0;
+		res = fuse_session_loop_mt_311(se, &loop_config);
+	} else {
+		memset(&loop_config, 0, sizeof(loop_config));
+		loop_config.max_idle_threads = opts.max_idle_threads;
+		loop_config.min_threads = opts.min_threads;
+		loop_config.max_threads = opts.max_threads;
+		loop_config.idle_timeout_ms = opts.idle_timeout_ms;
+		loop_config.affinity = opts.affinity;
+		loop_config.bulk_threads = opts.bulk_threads;
+		loop_config.receivers = opts.receivers;
+		res = fuse_session_loop_mt_311(se, &loop_config);
+	}
 
 	cuse_lowlevel_teardown(se);
 	if (res == -1)
@@ -365,3 +482,33 @@ int cuse_lowlevel_main(int argc, char *argv[], const struct cuse_info *ci,
 
 	return 0;
 }
+
+FUSE_SYMVER("cuse_lowlevel_main_311", "cuse_lowlevel_main@@FUSE_3.11")
+int cuse_lowlevel_main_311(int argc, char *argv[], const struct cuse_info *ci,
+			   const struct cuse_lowlevel_ops *clop,
+			   void *userdata)
+{
+	return cuse_main(argc, argv, ci, clop, sizeof(*clop), NULL, userdata);
+}
+
+int cuse_lowlevel_main_30(int argc, char *argv[], const struct cuse_info *ci,
+			  const struct cuse_lowlevel_ops *clop,
+			  void *userdata);
+FUSE_SYMVER("cuse_lowlevel_main_30", "cuse_lowlevel_main@FUSE_3.0")
+int cuse_lowlevel_main_30(int argc, char *argv[], const struct cuse_info *ci,
+			  const struct cuse_lowlevel_ops *clop,
+			  void *userdata)
+{
+	return cuse_main(argc, argv, ci, clop, CUSE_LOWLEVEL_OPS_SIZE_30, NULL,
+			 userdata);
+}
+
+int cuse_lowlevel_main_config(int argc, char *argv[],
+			      const struct cuse_info *ci,
+			      const struct cuse_lowlevel_ops *clop,
+			      struct fuse_loop_config *config,
+			      void *userdata)
+{
+	return cuse_main(argc, argv, ci, clop, sizeof(*clop), config,
+			 userdata);
+}
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <time.h>
 #include <fcntl.h>
@@ -57,11 +58,30 @@
 
 #define NODE_TABLE_MIN_SIZE 8192
 
+/*
+ * Remembered nodes pruned per hold of f->lock, and the time one call
+ * of fuse_clean_cache() may take before leaving the rest for later
+ */
+#define PRUNE_BATCH 256
+#define PRUNE_PASS_TIME 0.05
+
+/* Forgets of a batch applied per hold of f->lock */
+#define FORGET_BATCH 256
+
+/*
+ * Partial node slabs are kept on this many lists by how full they are.
+ * With slab_hugepage, slabs have the size of a (2MB) huge page.
+ */
+#define NODE_SLAB_CLASSES 8
+#define NODE_SLAB_HUGEPAGE (2 * 1024 * 1024)
+
 struct fuse_fs {
 	struct fuse_operations op;
 	struct fuse_module *m;
 	void *user_data;
 	int debug;
+	/* Room this filesystem wants in front of its paths */
+	size_t path_reserve;
 };
 
 struct fusemod_so {
@@ -71,6 +91,10 @@ struct fusemod_so {
 
 struct lock_queue_element {
 	struct lock_queue_element *next;
+	/* Next waiter on the same list */
+	struct lock_queue_element *wait_next;
+	/* The waiters list this element is parked on, NULL if it is ready */
+	struct lock_queue_element **parked;
 	pthread_cond_t cond;
 	fuse_ino_t nodeid1;
 	const char *name1;
@@ -108,7 +132,9 @@ struct list_head {
 struct node_slab {
 	struct list_head list;  /* must be the first member */
 	struct list_head freelist;
-	int used;
+	unsigned int used;
+	unsigned int num;
+	int hugetlb;
 };
 
 struct fuse {
@@ -116,18 +142,82 @@ struct fuse {
 	struct node_table name_table;
 	struct node_table id_table;
 	struct list_head lru_table;
+	size_t lru_count;
 	fuse_ino_t ctr;
 	unsigned int generation;
 	unsigned int hidectr;
+	unsigned int path_gen;
+	/* Spare bytes in front of every built path, for stacked modules */
+	size_t path_headroom;
 	pthread_mutex_t lock;
 	struct fuse_config conf;
 	int intr_installed;
 	struct fuse_fs *fs;
 	struct lock_queue_element *lockq;
+	/* Queued elements to be retried by wake_up_queued() */
+	struct lock_queue_element *lockq_ready;
+	/* Parked elements whose blocker had no memory for a waiters list */
+	struct lock_queue_element *lockq_nomem;
+	/* Requests that had to wait for a tree lock, and their retries */
+	uint64_t lock_waits;
+	uint64_t lock_retries;
 	int pagesize;
-	struct list_head partial_slabs;
+	size_t slab_size;
+	/* Partial slabs by fullness class, see slab_class() */
+	struct list_head partial_slabs[NODE_SLAB_CLASSES];
 	struct list_head full_slabs;
+	struct node_slab *empty_slab;
+	size_t slabs;
+	size_t hugetlb_slabs;
+	uint64_t slab_allocs;
+	uint64_t slab_frees;
+	size_t nodes;
+	uint64_t nodes_reclaimed;
 	pthread_t prune_thread;
+	/* Signalled when an auto_cache revalidation finishes */
+	pthread_cond_t ac_cond;
+	/* Nodes to revalidate ahead of expiry, see ac_refresh_thread() */
+	struct ac_refresh *ac_refresh_head;
+	struct ac_refresh **ac_refresh_tail;
+	pthread_cond_t ac_refresh_cond;
+	pthread_t ac_refresh_thread;
+	int ac_refresh_started;
+	int ac_refresh_stop;
+	/* With negative_cache, NEG_TABLE_SHARDS tables */
+	struct neg_table *neg_table;
+	/* Write buffers holding data, oldest first, see wbuf_thread() */
+	struct list_head wbuf_dirty;
+	pthread_cond_t wbuf_cond;
+	pthread_t wbuf_thread;
+	int wbuf_started;
+	int wbuf_stop;
+	/* With readahead, windows to fill, see ra_thread() */
+	struct list_head ra_queue;
+	pthread_cond_t ra_cond;
+	pthread_t *ra_threads;
+	unsigned int ra_started;
+	int ra_stop;
+	uint64_t ra_hits;
+	uint64_t ra_misses;
+	uint64_t ra_bytes;
+	/* With attr_cache, bumped by every invalidation, see attr_store() */
+	uint64_t attr_gen;
+	/* attr_gen when a file last gained or lost a link */
+	uint64_t attr_links_gen;
+	uint64_t attr_hits;
+	uint64_t attr_misses;
+};
+
+struct ac_refresh {
+	struct ac_refresh *next;
+	struct node *node;
+};
+
+/* The trees a lock is linked into, see struct lock_table */
+enum {
+	LOCK_BY_RANGE,
+	LOCK_BY_OWNER,
+	LOCK_TREES
 };
 
 struct lock {
@@ -136,29 +226,158 @@ struct lock {
 	off_t end;
 	pid_t pid;
 	uint64_t owner;
+	struct lock *left[LOCK_TREES];
+	struct lock *right[LOCK_TREES];
+	int height[LOCK_TREES];
+	/* Largest end, and largest end of a write lock, in the range subtree */
+	off_t max_end;
+	off_t wr_max_end;
+	/* Temporary list in locks_insert() */
 	struct lock *next;
 };
 
+/*
+ * The POSIX locks of a node, in two AVL trees. One is ordered by start
+ * offset and is an interval tree, it finds the locks conflicting with a
+ * range without looking at the ones that cannot overlap it. The other
+ * is ordered by owner, then start, and finds the locks an owner's
+ * request merges with or splits. The locks of one owner never overlap.
+ * Allocated on the first lock of the node and protected by its own
+ * mutex, not by f->lock.
+ */
+struct lock_table {
+	pthread_mutex_t lock;
+	struct lock *root[LOCK_TREES];
+};
+
+/*
+ * With write_coalesce, contiguous writes through one file handle are
+ * gathered here and passed on to the filesystem as a single write of
+ * up to write_coalesce bytes. Allocated on the first such write to a
+ * node. The data is protected by the buffer's own mutex, which nests
+ * outside f->lock; dirty and since are protected by f->lock.
+ */
+/*
+ * A handle that wrote into a write buffer. The error of a delayed
+ * write is kept here until the handle is flushed, synced or released.
+ * Handles without a file handle of their own cannot be told apart, so
+ * the first of them to be flushed gets the error.
+ */
+struct wbuf_error {
+	struct wbuf_error *next;
+	uint64_t fh;
+	int error;
+};
+
+struct write_buf {
+	pthread_mutex_t lock;
+	struct node *node;
+	/* The handle the data was written through */
+	struct fuse_file_info fi;
+	char *mem;
+	off_t off;
+	size_t len;
+	/* Of the handles with data written since their last flush */
+	struct wbuf_error *errors;
+	/* In f->wbuf_dirty while there may be data */
+	struct list_head dirty;
+	struct timespec since;
+};
+
+/*
+ * With readahead, the window the sequential reads through a file
+ * handle are served from. Once two reads in a row continue each
+ * other, a prefetch thread reads up to readahead bytes beyond them.
+ * The windows of a node are linked from it by f->lock, which also
+ * protects refctr; the rest is protected by the window's own mutex,
+ * which nests outside f->lock. A change of the file's contents
+ * increments the node's ra_gen, which drops the data of windows
+ * filled before.
+ */
+struct read_ahead {
+	pthread_mutex_t lock;
+	/* Signalled when a prefetch finishes */
+	pthread_cond_t cond;
+	struct read_ahead *node_next;
+	struct node *node;
+	struct fuse_file_info fi;
+	int refctr;
+	int released;
+	unsigned int gen;
+	char *mem;
+	/* The data in the window */
+	off_t off;
+	size_t len;
+	/* The window ends at the end of the file */
+	int eof;
+	/* Where the next sequential read starts */
+	off_t next;
+	int seq;
+	/* A prefetch is reading beyond len */
+	int busy;
+	/* In f->ra_queue while a prefetch is wanted */
+	struct list_head queued;
+};
+
 struct node {
+	/*
+	 * Everything a hash chain walk looks at comes first, so that
+	 * skipping a node touches a single cache line
+	 */
 	struct node *name_next;
 	struct node *id_next;
+	uint64_t name_hash;
 	fuse_ino_t nodeid;
-	unsigned int generation;
-	int refctr;
 	struct node *parent;
 	char *name;
+	int refctr;
+	int treelock;
+
 	uint64_t nlookup;
+	unsigned int generation;
 	int open_count;
 	struct timespec stat_updated;
 	struct timespec mtime;
 	off_t size;
-	struct lock *locks;
+	struct lock_table *locks;
 	unsigned int is_hidden : 1;
 	unsigned int cache_valid : 1;
-	int treelock;
+	/* A getattr for auto_cache is in flight, or queued */
+	unsigned int ac_revalidating : 1;
+	/* Allocated on first use, kept until the node is freed */
+	struct node_ext *ext;
 	char inline_name[32];
 };
 
+/* With attr_cache, what the file system last reported */
+struct node_attr {
+	struct stat stat;
+	struct timespec updated;
+	/*
+	 * Value of f->attr_gen when the attributes were last invalidated,
+	 * or before they were asked for if that is later
+	 */
+	uint64_t gen;
+	int valid;
+};
+
+/* State of the node that is only needed by some requests or options */
+struct node_ext {
+	/* Queued lock requests waiting for treelock to drop to zero */
+	struct lock_queue_element *waiters;
+	/* With path_cache, valid while path_gen matches f->path_gen */
+	char *path;
+	unsigned int pathlen;
+	unsigned int path_gen;
+	/* With readdir_cache, the last complete listing of a directory */
+	struct dir_listing *dircache;
+	unsigned int dircache_gen;
+	struct write_buf *wbuf;
+	struct read_ahead *ra;
+	unsigned int ra_gen;
+	struct node_attr *attr;
+};
+
 #define TREELOCK_WRITE -1
 #define TREELOCK_WAIT_OFFSET INT_MIN
 
@@ -168,10 +387,34 @@ struct node_lru {
 	struct timespec forget_time;
 };
 
-struct fuse_direntry {
-	struct stat stat;
-	char *name;
-	struct fuse_direntry *next;
+/*
+ * A directory listing packed into one buffer. Entries are stored back
+ * to back, and index[i] is the offset of entry i, so that a readdir
+ * chunk can start at any position without walking the entries before
+ * it. Only the inode number and the type are kept, that is all that
+ * readdir and readdirplus (with ino=0) replies made from a listing
+ * need. Listings are shared by reference and protected by f->lock.
+ */
+struct dir_listing {
+	int refctr;
+	struct timespec mtime;
+	off_t size;
+	char *buf;
+	size_t len;
+	size_t bufsize;
+	size_t *index;
+	size_t count;
+	size_t index_size;
+};
+
+#define DIR_LISTING_ALIGN(x) \
+	(((x) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+
+struct dir_listing_entry {
+	uint64_t ino;
+	uint32_t mode;
+	uint16_t namelen;
+	char name[];
 };
 
 struct fuse_dh {
@@ -179,8 +422,6 @@ struct fuse_dh {
 	struct fuse *fuse;
 	fuse_req_t req;
 	char *contents;
-	struct fuse_direntry *first;
-	struct fuse_direntry **last;
 	unsigned len;
 	unsigned size;
 	unsigned needlen;
@@ -188,11 +429,19 @@ struct fuse_dh {
 	uint64_t fh;
 	int error;
 	fuse_ino_t nodeid;
+	/* Complete listing, read by this handle or shared from the cache */
+	struct dir_listing *listing;
+	/* attr_cache_gen() before the listing was requested */
+	uint64_t attr_gen;
 };
 
+/* Paths of one operation that fuse_fs_path_prepend() may write in front of */
+#define FUSE_CTX_PATHS 2
+
 struct fuse_context_i {
 	struct fuse_context ctx;
 	fuse_req_t req;
+	const char *paths[FUSE_CTX_PATHS];
 };
 
 /* Defined by FUSE_REGISTER_MODULE() in lib/modules/subdir.c and iconv.c.  */
@@ -206,6 +455,11 @@ static pthread_mutex_t fuse_context_lock = PTHREAD_MUTEX_INITIALIZER;
 static int fuse_context_ref;
 static struct fuse_module *fuse_modules = NULL;
 
+static struct fuse_context_i *fuse_get_context_internal(void)
+{
+	return (struct fuse_context_i *) pthread_getspecific(fuse_context_key);
+}
+
 static int fuse_register_module(const char *name,
 				fuse_module_factory_t factory,
 				struct fusemod_so *so)
@@ -408,6 +662,8 @@ static size_t get_node_size(struct fuse *f)
 		return sizeof(struct node);
 }
 
+static int reclaim_nodes(struct fuse *f, fuse_ino_t parent);
+
 #ifdef FUSE_NODE_SLAB
 static struct node_slab *list_to_slab(struct list_head *head)
 {
@@ -416,10 +672,62 @@ static struct node_slab *list_to_slab(struct list_head *head)
 
 static struct node_slab *node_to_slab(struct fuse *f, struct node *node)
 {
-	return (struct node_slab *) (((uintptr_t) node) & ~((uintptr_t) f->pagesize - 1));
+	return (struct node_slab *) (((uintptr_t) node) & ~((uintptr_t) f->slab_size - 1));
+}
+
+/* Fullness class of a partial slab, higher classes are fuller */
+static unsigned int slab_class(struct node_slab *slab)
+{
+	return slab->used * NODE_SLAB_CLASSES / slab->num;
+}
+
+/*
+ * Node to slab lookup masks the node address, so slabs larger than a
+ * page are mapped with some slack and trimmed to an aligned region.
+ */
+static void *map_slab(struct fuse *f, int *hugetlb)
+{
+	size_t size = f->slab_size;
+	uintptr_t addr;
+	uintptr_t aligned;
+	void *mem;
+
+	*hugetlb = 0;
+#ifdef MAP_HUGETLB
+	if (f->conf.slab_hugepage && size == NODE_SLAB_HUGEPAGE) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			*hugetlb = 1;
+			return mem;
+		}
+	}
+#endif
+	if (size == (size_t) f->pagesize)
+		return mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	mem = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return mem;
+
+	addr = (uintptr_t) mem;
+	aligned = (addr + size - 1) & ~((uintptr_t) size - 1);
+	if (aligned != addr)
+		munmap(mem, aligned - addr);
+	if (aligned + size != addr + 2 * size)
+		munmap((void *) (aligned + size), addr + size - aligned);
+	mem = (void *) aligned;
+#ifdef MADV_HUGEPAGE
+	/* No reserved huge pages, transparent ones are the next best thing */
+	if (f->conf.slab_hugepage)
+		madvise(mem, size, MADV_HUGEPAGE);
+#endif
+	return mem;
 }
 
-static int alloc_slab(struct fuse *f)
+static struct node_slab *alloc_slab(struct fuse *f)
 {
 	void *mem;
 	struct node_slab *slab;
@@ -427,124 +735,252 @@ static int alloc_slab(struct fuse *f)
 	size_t num;
 	size_t i;
 	size_t node_size = get_node_size(f);
+	int hugetlb;
 
-	mem = mmap(NULL, f->pagesize, PROT_READ | PROT_WRITE,
-		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (f->conf.node_mem_max &&
+	    (f->slabs + 1) * f->slab_size > f->conf.node_mem_max)
+		return NULL;
 
+	mem = map_slab(f, &hugetlb);
 	if (mem == MAP_FAILED)
-		return -1;
+		return NULL;
 
 	slab = mem;
 	init_list_head(&slab->freelist);
 	slab->used = 0;
-	num = (f->pagesize - sizeof(struct node_slab)) / node_size;
+	slab->hugetlb = hugetlb;
+	num = (f->slab_size - sizeof(struct node_slab)) / node_size;
+	slab->num = num;
 
-	start = (char *) mem + f->pagesize - num * node_size;
+	start = (char *) mem + f->slab_size - num * node_size;
 	for (i = 0; i < num; i++) {
 		struct list_head *n;
 
 		n = (struct list_head *) (start + i * node_size);
 		list_add_tail(n, &slab->freelist);
 	}
-	list_add_tail(&slab->list, &f->partial_slabs);
+	f->slabs++;
+	f->slab_allocs++;
+	f->hugetlb_slabs += hugetlb;
 
-	return 0;
+	return slab;
+}
+
+static void free_slab(struct fuse *f, struct node_slab *slab)
+{
+	int res;
+
+	f->slabs--;
+	f->slab_frees++;
+	f->hugetlb_slabs -= slab->hugetlb;
+	res = munmap(slab, f->slab_size);
+	if (res == -1)
+		fuse_log(FUSE_LOG_WARNING, "fuse warning: munmap(%p) failed\n",
+			 slab);
 }
 
-static struct node *alloc_node(struct fuse *f)
+/*
+ * Take from the fullest partial slab, so that allocations pack into
+ * few slabs and the emptier ones have a chance to drain and be freed
+ * after a mass forget.
+ */
+static struct node_slab *get_partial_slab(struct fuse *f)
+{
+	int i;
+
+	for (i = NODE_SLAB_CLASSES - 1; i >= 0; i--) {
+		if (!list_empty(&f->partial_slabs[i]))
+			return list_to_slab(f->partial_slabs[i].next);
+	}
+	return NULL;
+}
+
+static int node_mem_avail(struct fuse *f)
+{
+	return get_partial_slab(f) || f->empty_slab || !f->conf.node_mem_max ||
+		(f->slabs + 1) * f->slab_size <= f->conf.node_mem_max;
+}
+
+static struct node_slab *get_slab(struct fuse *f)
 {
 	struct node_slab *slab;
-	struct list_head *node;
 
-	if (list_empty(&f->partial_slabs)) {
-		int res = alloc_slab(f);
-		if (res != 0)
-			return NULL;
+	slab = get_partial_slab(f);
+	if (!slab) {
+		slab = f->empty_slab;
+		f->empty_slab = NULL;
 	}
-	slab = list_to_slab(f->partial_slabs.next);
+	if (!slab)
+		slab = alloc_slab(f);
+	return slab;
+}
+
+static struct node *alloc_node(struct fuse *f, fuse_ino_t parent)
+{
+	struct node_slab *slab;
+	struct list_head *node;
+
+	slab = get_slab(f);
+	if (!slab && reclaim_nodes(f, parent))
+		slab = get_slab(f);
+	if (!slab)
+		return NULL;
+
+	if (slab->used)
+		list_del(&slab->list);
 	slab->used++;
 	node = slab->freelist.next;
 	list_del(node);
-	if (list_empty(&slab->freelist)) {
-		list_del(&slab->list);
+	if (list_empty(&slab->freelist))
 		list_add_tail(&slab->list, &f->full_slabs);
-	}
+	else
+		list_add_head(&slab->list, &f->partial_slabs[slab_class(slab)]);
 	memset(node, 0, sizeof(struct node));
+	f->nodes++;
 
 	return (struct node *) node;
 }
 
-static void free_slab(struct fuse *f, struct node_slab *slab)
-{
-	int res;
-
-	list_del(&slab->list);
-	res = munmap(slab, f->pagesize);
-	if (res == -1)
-		fuse_log(FUSE_LOG_WARNING, "fuse warning: munmap(%p) failed\n",
-			 slab);
-}
-
 static void free_node_mem(struct fuse *f, struct node *node)
 {
 	struct node_slab *slab = node_to_slab(f, node);
 	struct list_head *n = (struct list_head *) node;
+	int was_full = list_empty(&slab->freelist);
+	unsigned int class = slab_class(slab);
 
+	f->nodes--;
 	slab->used--;
+	list_add_head(n, &slab->freelist);
+	if (!was_full && slab->used && slab_class(slab) == class)
+		return;
+
+	list_del(&slab->list);
 	if (slab->used) {
-		if (list_empty(&slab->freelist)) {
-			list_del(&slab->list);
-			list_add_tail(&slab->list, &f->partial_slabs);
-		}
-		list_add_head(n, &slab->freelist);
+		list_add_head(&slab->list, &f->partial_slabs[slab_class(slab)]);
+	} else if (!f->empty_slab) {
+		/* Keep one empty slab to absorb create/forget churn */
+		f->empty_slab = slab;
 	} else {
 		free_slab(f, slab);
 	}
 }
+
+static void free_slabs(struct fuse *f)
+{
+	int i;
+
+	if (f->empty_slab)
+		free_slab(f, f->empty_slab);
+	f->empty_slab = NULL;
+	for (i = 0; i < NODE_SLAB_CLASSES; i++)
+		assert(list_empty(&f->partial_slabs[i]));
+	assert(list_empty(&f->full_slabs));
+}
+
+static void get_slab_stats(struct fuse *f, struct fuse_stats *stats)
+{
+	size_t node_size = get_node_size(f);
+	size_t per_slab = (f->slab_size - sizeof(struct node_slab)) / node_size;
+
+	stats->slabs = f->slabs;
+	stats->slab_size = f->slab_size;
+	stats->hugetlb_slabs = f->hugetlb_slabs;
+	stats->slab_allocs = f->slab_allocs;
+	stats->slab_frees = f->slab_frees;
+	stats->free_nodes = f->slabs * per_slab - f->nodes;
+}
 #else
-static struct node *alloc_node(struct fuse *f)
+static int node_mem_avail(struct fuse *f)
 {
-	return (struct node *) calloc(1, get_node_size(f));
+	return !f->conf.node_mem_max ||
+		(f->nodes + 1) * get_node_size(f) <= f->conf.node_mem_max;
+}
+
+static struct node *alloc_node(struct fuse *f, fuse_ino_t parent)
+{
+	struct node *node;
+
+	if (!node_mem_avail(f) && !reclaim_nodes(f, parent))
+		return NULL;
+
+	node = (struct node *) calloc(1, get_node_size(f));
+	if (node)
+		f->nodes++;
+	return node;
 }
 
 static void free_node_mem(struct fuse *f, struct node *node)
 {
-	(void) f;
+	f->nodes--;
 	free(node);
 }
+
+static void free_slabs(struct fuse *f)
+{
+	(void) f;
+}
+
+static void get_slab_stats(struct fuse *f, struct fuse_stats *stats)
+{
+	(void) f;
+	(void) stats;
+}
 #endif
 
-static size_t id_hash(struct fuse *f, fuse_ino_t ino)
+/* Finalizer of MurmurHash3, spreads every input bit over the result */
+static uint64_t hash_fmix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static size_t table_hash(struct node_table *t, uint64_t hash)
 {
-	uint64_t hash = ((uint32_t) ino * 2654435761U) % f->id_table.size;
-	uint64_t oldhash = hash % (f->id_table.size / 2);
+	size_t oldhash;
 
-	if (oldhash >= f->id_table.split)
+	hash %= t->size;
+	oldhash = hash % (t->size / 2);
+	if (oldhash >= t->split)
 		return oldhash;
 	else
 		return hash;
 }
 
+static uint64_t id_hash(fuse_ino_t ino)
+{
+	return hash_fmix(ino);
+}
+
 static struct node *get_node_nocheck(struct fuse *f, fuse_ino_t nodeid)
 {
-	size_t hash = id_hash(f, nodeid);
+	struct node_table *t = &f->id_table;
 	struct node *node;
 
-	for (node = f->id_table.array[hash]; node != NULL; node = node->id_next)
+	for (node = t->array[table_hash(t, id_hash(nodeid))]; node != NULL;
+	     node = node->id_next)
 		if (node->nodeid == nodeid)
 			return node;
 
 	return NULL;
 }
 
+static void node_not_found(fuse_ino_t nodeid)
+{
+	fuse_log(FUSE_LOG_ERR, "fuse internal error: node %llu not found\n",
+		 (unsigned long long) nodeid);
+	abort();
+}
+
 static struct node *get_node(struct fuse *f, fuse_ino_t nodeid)
 {
 	struct node *node = get_node_nocheck(f, nodeid);
-	if (!node) {
-		fuse_log(FUSE_LOG_ERR, "fuse internal error: node %llu not found\n",
-			(unsigned long long) nodeid);
-		abort();
-	}
+	if (!node)
+		node_not_found(nodeid);
 	return node;
 }
 
@@ -552,9 +988,12 @@ static void curr_time(struct timespec *now);
 static double diff_timespec(const struct timespec *t1,
 			   const struct timespec *t2);
 
-static void remove_node_lru(struct node *node)
+static void remove_node_lru(struct fuse *f, struct node *node)
 {
 	struct node_lru *lnode = node_lru(node);
+
+	if (!list_empty(&lnode->lru))
+		f->lru_count--;
 	list_del(&lnode->lru);
 	init_list_head(&lnode->lru);
 }
@@ -563,18 +1002,117 @@ static void set_forget_time(struct fuse *f, struct node *node)
 {
 	struct node_lru *lnode = node_lru(node);
 
+	if (list_empty(&lnode->lru))
+		f->lru_count++;
 	list_del(&lnode->lru);
 	list_add_tail(&lnode->lru, &f->lru_table);
 	curr_time(&lnode->forget_time);
 }
 
+static void free_listing(struct dir_listing *l)
+{
+	free(l->buf);
+	free(l->index);
+	free(l);
+}
+
+/* Called with f->lock held */
+static void put_listing(struct dir_listing *l)
+{
+	assert(l->refctr > 0);
+	if (!--l->refctr)
+		free_listing(l);
+}
+
+/* Called with f->lock held */
+static void drop_dircache(struct node *node)
+{
+	struct node_ext *ext = node->ext;
+
+	/* Without it no listing can be in the making either */
+	if (ext == NULL)
+		return;
+
+	ext->dircache_gen++;
+	if (ext->dircache) {
+		put_listing(ext->dircache);
+		ext->dircache = NULL;
+	}
+}
+
+static void dircache_invalidate(struct fuse *f, fuse_ino_t nodeid)
+{
+	struct node *node;
+
+	if (!f->conf.readdir_cache)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node_nocheck(f, nodeid);
+	if (node)
+		drop_dircache(node);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void free_lock_table(struct lock_table *lt);
+static void free_write_buf(struct write_buf *wb);
+static void free_read_ahead(struct read_ahead *ra);
+static void ra_invalidate(struct fuse *f, fuse_ino_t ino);
+static void ra_release(struct fuse *f, fuse_ino_t ino,
+		       struct fuse_file_info *fi);
+static int wbuf_sync(struct fuse *f, fuse_ino_t ino, const char *path,
+		     struct fuse_file_info *fi);
+
+static void free_node_ext(struct node_ext *ext)
+{
+	free(ext->path);
+	if (ext->dircache)
+		put_listing(ext->dircache);
+	if (ext->wbuf)
+		free_write_buf(ext->wbuf);
+	if (ext->ra)
+		free_read_ahead(ext->ra);
+	free(ext->attr);
+	free(ext);
+}
+
 static void free_node(struct fuse *f, struct node *node)
 {
 	if (node->name != node->inline_name)
 		free(node->name);
+	if (node->locks)
+		free_lock_table(node->locks);
+	if (node->ext)
+		free_node_ext(node->ext);
 	free_node_mem(f, node);
 }
 
+/* Called with f->lock held, returns NULL if out of memory */
+static struct node_ext *node_ext(struct node *node)
+{
+	if (node->ext == NULL)
+		node->ext = calloc(1, sizeof(struct node_ext));
+
+	return node->ext;
+}
+
+/* Called with f->lock held */
+static void invalidate_path(struct fuse *f, struct node *node)
+{
+	if (node->ext) {
+		free(node->ext->path);
+		node->ext->path = NULL;
+	}
+
+	/*
+	 * Cached descendants hold a reference, so the paths below this
+	 * node are only cached if it has more references than its own
+	 * lookup count accounts for. Those are dropped all at once.
+	 */
+	if (node->refctr > (node->nlookup ? 1 : 0))
+		f->path_gen++;
+}
+
 static void node_table_reduce(struct node_table *t)
 {
 	size_t newsize = t->size / 2;
@@ -619,14 +1157,16 @@ static void remerge_id(struct fuse *f)
 
 static void unhash_id(struct fuse *f, struct node *node)
 {
-	struct node **nodep = &f->id_table.array[id_hash(f, node->nodeid)];
+	struct node_table *t = &f->id_table;
+	struct node **nodep;
 
-	for (; *nodep != NULL; nodep = &(*nodep)->id_next)
+	for (nodep = &t->array[table_hash(t, id_hash(node->nodeid))];
+	     *nodep != NULL; nodep = &(*nodep)->id_next)
 		if (*nodep == node) {
 			*nodep = node->id_next;
-			f->id_table.use--;
+			t->use--;
 
-			if(f->id_table.use < f->id_table.size / 4)
+			if(t->use < t->size / 4)
 				remerge_id(f);
 			return;
 		}
@@ -663,7 +1203,7 @@ static void rehash_id(struct fuse *f)
 	t->split++;
 	for (nodep = &t->array[hash]; *nodep != NULL; nodep = next) {
 		struct node *node = *nodep;
-		size_t newhash = id_hash(f, node->nodeid);
+		size_t newhash = table_hash(t, id_hash(node->nodeid));
 
 		if (newhash != hash) {
 			next = nodep;
@@ -680,30 +1220,42 @@ static void rehash_id(struct fuse *f)
 
 static void hash_id(struct fuse *f, struct node *node)
 {
-	size_t hash = id_hash(f, node->nodeid);
-	node->id_next = f->id_table.array[hash];
-	f->id_table.array[hash] = node;
-	f->id_table.use++;
+	struct node_table *t = &f->id_table;
+	size_t bucket = table_hash(t, id_hash(node->nodeid));
+
+	node->id_next = t->array[bucket];
+	t->array[bucket] = node;
+	t->use++;
 
-	if (f->id_table.use >= f->id_table.size / 2)
+	if (t->use >= t->size / 2)
 		rehash_id(f);
 }
 
-static size_t name_hash(struct fuse *f, fuse_ino_t parent,
-			const char *name)
+/*
+ * Hashes eight bytes at a time. The length comes from strlen(), which
+ * is vectorized in the C library, so that the loop never reads past
+ * the end of the name.
+ */
+static uint64_t name_hash(fuse_ino_t parent, const char *name)
 {
-	uint64_t hash = parent;
-	uint64_t oldhash;
+	const uint64_t mul = 0x9e3779b97f4a7c15ULL;
+	size_t len = strlen(name);
+	uint64_t hash = parent * mul + len;
+	uint64_t word;
 
-	for (; *name; name++)
-		hash = hash * 31 + (unsigned char) *name;
+	for (; len >= sizeof(word); len -= sizeof(word)) {
+		memcpy(&word, name, sizeof(word));
+		hash = (hash ^ word) * mul;
+		hash ^= hash >> 29;
+		name += sizeof(word);
+	}
+	if (len) {
+		word = 0;
+		memcpy(&word, name, len);
+		hash = (hash ^ word) * mul;
+	}
 
-	hash %= f->name_table.size;
-	oldhash = hash % (f->name_table.size / 2);
-	if (oldhash >= f->name_table.split)
-		return oldhash;
-	else
-		return hash;
+	return hash_fmix(hash);
 }
 
 static void unref_node(struct fuse *f, struct node *node);
@@ -737,10 +1289,14 @@ static void remerge_name(struct fuse *f)
 static void unhash_name(struct fuse *f, struct node *node)
 {
 	if (node->name) {
-		size_t hash = name_hash(f, node->parent->nodeid, node->name);
-		struct node **nodep = &f->name_table.array[hash];
+		struct node_table *t = &f->name_table;
+		struct node **nodep;
+
+		if (f->conf.path_cache)
+			invalidate_path(f, node);
 
-		for (; *nodep != NULL; nodep = &(*nodep)->name_next)
+		for (nodep = &t->array[table_hash(t, node->name_hash)];
+		     *nodep != NULL; nodep = &(*nodep)->name_next)
 			if (*nodep == node) {
 				*nodep = node->name_next;
 				node->name_next = NULL;
@@ -749,9 +1305,9 @@ static void unhash_name(struct fuse *f, struct node *node)
 					free(node->name);
 				node->name = NULL;
 				node->parent = NULL;
-				f->name_table.use--;
+				t->use--;
 
-				if (f->name_table.use < f->name_table.size / 4)
+				if (t->use < t->size / 4)
 					remerge_name(f);
 				return;
 			}
@@ -776,7 +1332,7 @@ static void rehash_name(struct fuse *f)
 	t->split++;
 	for (nodep = &t->array[hash]; *nodep != NULL; nodep = next) {
 		struct node *node = *nodep;
-		size_t newhash = name_hash(f, node->parent->nodeid, node->name);
+		size_t newhash = table_hash(t, node->name_hash);
 
 		if (newhash != hash) {
 			next = nodep;
@@ -794,8 +1350,11 @@ static void rehash_name(struct fuse *f)
 static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
 		     const char *name)
 {
-	size_t hash = name_hash(f, parentid, name);
+	uint64_t hash = name_hash(parentid, name);
+	struct node_table *t = &f->name_table;
 	struct node *parent = get_node(f, parentid);
+	size_t bucket;
+
 	if (strlen(name) < sizeof(node->inline_name)) {
 		strcpy(node->inline_name, name);
 		node->name = node->inline_name;
@@ -806,12 +1365,14 @@ static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
 	}
 
 	parent->refctr ++;
+	node->name_hash = hash;
 	node->parent = parent;
-	node->name_next = f->name_table.array[hash];
-	f->name_table.array[hash] = node;
-	f->name_table.use++;
+	bucket = table_hash(t, hash);
+	node->name_next = t->array[bucket];
+	t->array[bucket] = node;
+	t->use++;
 
-	if (f->name_table.use >= f->name_table.size / 2)
+	if (t->use >= t->size / 2)
 		rehash_name(f);
 
 	return 0;
@@ -826,7 +1387,7 @@ static void delete_node(struct fuse *f, struct node *node)
 	assert(node->treelock == 0);
 	unhash_name(f, node);
 	if (lru_enabled(f))
-		remove_node_lru(node);
+		remove_node_lru(f, node);
 	unhash_id(f, node);
 	free_node(f, node);
 }
@@ -853,11 +1414,14 @@ static fuse_ino_t next_id(struct fuse *f)
 static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
 				const char *name)
 {
-	size_t hash = name_hash(f, parent, name);
+	uint64_t hash = name_hash(parent, name);
+	struct node_table *t = &f->name_table;
 	struct node *node;
 
-	for (node = f->name_table.array[hash]; node != NULL; node = node->name_next)
-		if (node->parent->nodeid == parent &&
+	for (node = t->array[table_hash(t, hash)]; node != NULL;
+	     node = node->name_next)
+		if (node->name_hash == hash &&
+		    node->parent->nodeid == parent &&
 		    strcmp(node->name, name) == 0)
 			return node;
 
@@ -882,7 +1446,7 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
 	else
 		node = lookup_node(f, parent, name);
 	if (node == NULL) {
-		node = alloc_node(f);
+		node = alloc_node(f, parent);
 		if (node == NULL)
 			goto out_err;
 
@@ -902,7 +1466,7 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
 			init_list_head(&lnode->lru);
 		}
 	} else if (lru_enabled(f) && node->nlookup == 1) {
-		remove_node_lru(node);
+		remove_node_lru(f, node);
 	}
 	inc_nlookup(node);
 out_err:
@@ -973,6 +1537,54 @@ static char *add_name(char **buf, unsigned *bufsize, char *s, const char *name)
 	return s;
 }
 
+/*
+ * Waiters are parked on the node that made their last attempt fail,
+ * and only retried once that node's treelock has dropped to zero.
+ */
+static void ready_waiters(struct fuse *f, struct lock_queue_element *list)
+{
+	struct lock_queue_element **qp;
+	struct lock_queue_element *qe;
+
+	for (qe = list; qe != NULL; qe = qe->wait_next)
+		qe->parked = NULL;
+
+	for (qp = &f->lockq_ready; *qp != NULL; qp = &(*qp)->wait_next);
+	*qp = list;
+}
+
+static void wait_for_node(struct fuse *f, struct lock_queue_element *qe,
+			  struct node *node)
+{
+	struct node_ext *ext;
+	struct lock_queue_element **qp;
+
+	assert(node != NULL);
+	qe->wait_next = NULL;
+	if (node->treelock == 0) {
+		ready_waiters(f, qe);
+		return;
+	}
+
+	/* Without memory for its own list, retried on every unlock */
+	ext = node_ext(node);
+	qe->parked = ext ? &ext->waiters : &f->lockq_nomem;
+	for (qp = qe->parked; *qp != NULL; qp = &(*qp)->wait_next);
+	*qp = qe;
+}
+
+static void node_unlocked(struct fuse *f, struct node *node)
+{
+	if (node->ext && node->ext->waiters) {
+		ready_waiters(f, node->ext->waiters);
+		node->ext->waiters = NULL;
+	}
+	if (f->lockq_nomem) {
+		ready_waiters(f, f->lockq_nomem);
+		f->lockq_nomem = NULL;
+	}
+}
+
 static void unlock_path(struct fuse *f, fuse_ino_t nodeid, struct node *wnode,
 			struct node *end)
 {
@@ -981,6 +1593,7 @@ static void unlock_path(struct fuse *f, fuse_ino_t nodeid, struct node *wnode,
 	if (wnode) {
 		assert(wnode->treelock == TREELOCK_WRITE);
 		wnode->treelock = 0;
+		node_unlocked(f, wnode);
 	}
 
 	for (node = get_node(f, nodeid);
@@ -991,34 +1604,102 @@ static void unlock_path(struct fuse *f, fuse_ino_t nodeid, struct node *wnode,
 		node->treelock--;
 		if (node->treelock == TREELOCK_WAIT_OFFSET)
 			node->treelock = 0;
+		if (node->treelock == 0)
+			node_unlocked(f, node);
 	}
 }
 
-static int try_get_path(struct fuse *f, fuse_ino_t nodeid, const char *name,
-			char **path, struct node **wnodep, bool need_lock)
+static char *cached_path(struct node *node, const char *name, size_t headroom)
 {
-	unsigned bufsize = 256;
+	struct node_ext *ext = node->ext;
+	size_t namelen = name ? strlen(name) : 0;
 	char *buf;
-	char *s;
-	struct node *node;
+
+	buf = malloc(headroom + ext->pathlen + namelen + 2);
+	if (buf == NULL)
+		return NULL;
+
+	buf += headroom;
+	memcpy(buf, ext->path, ext->pathlen);
+	if (name) {
+		buf[ext->pathlen] = '/';
+		memcpy(buf + ext->pathlen + 1, name, namelen + 1);
+	} else {
+		buf[ext->pathlen] = '\0';
+	}
+
+	return buf;
+}
+
+static void cache_path(struct fuse *f, struct node *node, const char *path,
+		       const char *name)
+{
+	struct node_ext *ext;
+	size_t len = strlen(path);
+
+	if (name)
+		len -= strlen(name) + 1;
+	/* Not worth it for the root, and "/" cannot be joined to a name */
+	if (len <= 1)
+		return;
+
+	ext = node_ext(node);
+	if (ext == NULL)
+		return;
+
+	free(ext->path);
+	ext->path = malloc(len + 1);
+	if (ext->path == NULL)
+		return;
+
+	memcpy(ext->path, path, len);
+	ext->path[len] = '\0';
+	ext->pathlen = len;
+	ext->path_gen = f->path_gen;
+}
+
+/*
+ * If the path is locked (-EAGAIN), the node that is in the way is
+ * stored in *blockerp.
+ */
+static int try_get_path(struct fuse *f, fuse_ino_t nodeid, const char *name,
+			char **path, struct node **wnodep, bool need_lock,
+			struct node **blockerp)
+{
+	unsigned bufsize = 256;
+	char *buf = NULL;
+	char *s = NULL;
+	struct node *node;
 	struct node *wnode = NULL;
+	struct node *start = get_node(f, nodeid);
+	bool cached;
 	int err;
 
 	*path = NULL;
 
-	err = -ENOMEM;
-	buf = malloc(bufsize);
-	if (buf == NULL)
-		goto out_err;
-
-	s = buf + bufsize - 1;
-	*s = '\0';
+	/*
+	 * With a cached path the walk up to the root is still needed to
+	 * check and lock the ancestors, but the string is not rebuilt.
+	 */
+	cached = f->conf.path_cache && start->ext != NULL &&
+		start->ext->path != NULL &&
+		start->ext->path_gen == f->path_gen;
 
-	if (name != NULL) {
-		s = add_name(&buf, &bufsize, s, name);
+	if (!cached) {
 		err = -ENOMEM;
-		if (s == NULL)
-			goto out_free;
+		buf = malloc(bufsize);
+		if (buf == NULL)
+			goto out_err;
+
+		s = buf + bufsize - 1;
+		*s = '\0';
+
+		if (name != NULL) {
+			s = add_name(&buf, &bufsize, s, name);
+			err = -ENOMEM;
+			if (s == NULL)
+				goto out_free;
+		}
 	}
 
 	if (wnodep) {
@@ -1028,6 +1709,8 @@ static int try_get_path(struct fuse *f, fuse_ino_t nodeid, const char *name,
 			if (wnode->treelock != 0) {
 				if (wnode->treelock > 0)
 					wnode->treelock += TREELOCK_WAIT_OFFSET;
+				if (blockerp)
+					*blockerp = wnode;
 				err = -EAGAIN;
 				goto out_free;
 			}
@@ -1035,32 +1718,61 @@ static int try_get_path(struct fuse *f, fuse_ino_t nodeid, const char *name,
 		}
 	}
 
-	for (node = get_node(f, nodeid); node->nodeid != FUSE_ROOT_ID;
+	for (node = start; node->nodeid != FUSE_ROOT_ID;
 	     node = node->parent) {
 		err = -ENOENT;
 		if (node->name == NULL || node->parent == NULL)
 			goto out_unlock;
 
-		err = -ENOMEM;
-		s = add_name(&buf, &bufsize, s, node->name);
-		if (s == NULL)
-			goto out_unlock;
+		if (!cached) {
+			err = -ENOMEM;
+			s = add_name(&buf, &bufsize, s, node->name);
+			if (s == NULL)
+				goto out_unlock;
+		}
 
 		if (need_lock) {
 			err = -EAGAIN;
-			if (node->treelock < 0)
+			if (node->treelock < 0) {
+				if (blockerp)
+					*blockerp = node;
 				goto out_unlock;
+			}
 
 			node->treelock++;
 		}
 	}
 
-	if (s[0])
-		memmove(buf, s, bufsize - (s - buf));
-	else
-		strcpy(buf, "/");
+	if (cached) {
+		err = -ENOMEM;
+		*path = cached_path(start, name, f->path_headroom);
+		if (*path == NULL)
+			goto out_unlock;
+	} else {
+		size_t off = s - buf;
+		size_t len = s[0] ? bufsize - off : 2;
+		size_t room = f->path_headroom;
+
+		if (room + len > bufsize) {
+			char *newbuf;
+
+			err = -ENOMEM;
+			newbuf = realloc(buf, room + len);
+			if (newbuf == NULL)
+				goto out_unlock;
+			buf = newbuf;
+			s = buf + off;
+		}
+		if (s[0])
+			memmove(buf + room, s, len);
+		else
+			strcpy(buf + room, "/");
+
+		*path = buf + room;
+		if (f->conf.path_cache)
+			cache_path(f, start, *path, name);
+	}
 
-	*path = buf;
 	if (wnodep)
 		*wnodep = wnode;
 
@@ -1094,20 +1806,26 @@ static void queue_element_unlock(struct fuse *f, struct lock_queue_element *qe)
 
 static void queue_element_wakeup(struct fuse *f, struct lock_queue_element *qe)
 {
+	struct node *blocker = NULL;
 	int err;
 	bool first = (qe == f->lockq);
 
 	if (!qe->path1) {
+		struct node *node = get_node(f, qe->nodeid1);
+
 		/* Just waiting for it to be unlocked */
-		if (get_node(f, qe->nodeid1)->treelock == 0)
+		if (node->treelock == 0)
 			pthread_cond_signal(&qe->cond);
+		else
+			wait_for_node(f, qe, node);
 
 		return;
 	}
 
+	f->lock_retries++;
 	if (!qe->first_locked) {
 		err = try_get_path(f, qe->nodeid1, qe->name1, qe->path1,
-				   qe->wnode1, true);
+				   qe->wnode1, true, &blocker);
 		if (!err)
 			qe->first_locked = true;
 		else if (err != -EAGAIN)
@@ -1115,7 +1833,7 @@ static void queue_element_wakeup(struct fuse *f, struct lock_queue_element *qe)
 	}
 	if (!qe->second_locked && qe->path2) {
 		err = try_get_path(f, qe->nodeid2, qe->name2, qe->path2,
-				   qe->wnode2, true);
+				   qe->wnode2, true, &blocker);
 		if (!err)
 			qe->second_locked = true;
 		else if (err != -EAGAIN)
@@ -1138,6 +1856,7 @@ static void queue_element_wakeup(struct fuse *f, struct lock_queue_element *qe)
 		queue_element_unlock(f, qe);
 
 	/* keep trying */
+	wait_for_node(f, qe, blocker);
 	return;
 
 err_unlock:
@@ -1152,8 +1871,11 @@ static void wake_up_queued(struct fuse *f)
 {
 	struct lock_queue_element *qe;
 
-	for (qe = f->lockq; qe != NULL; qe = qe->next)
+	while ((qe = f->lockq_ready) != NULL) {
+		f->lockq_ready = qe->wait_next;
+		qe->wait_next = NULL;
 		queue_element_wakeup(f, qe);
+	}
 }
 
 static void debug_path(struct fuse *f, const char *msg, fuse_ino_t nodeid,
@@ -1175,7 +1897,8 @@ static void debug_path(struct fuse *f, const char *msg, fuse_ino_t nodeid,
 	}
 }
 
-static void queue_path(struct fuse *f, struct lock_queue_element *qe)
+static void queue_path(struct fuse *f, struct lock_queue_element *qe,
+		       struct node *blocker)
 {
 	struct lock_queue_element **qp;
 
@@ -1186,37 +1909,95 @@ static void queue_path(struct fuse *f, struct lock_queue_element *qe)
 	qe->next = NULL;
 	for (qp = &f->lockq; *qp != NULL; qp = &(*qp)->next);
 	*qp = qe;
+	f->lock_waits++;
+	wait_for_node(f, qe, blocker);
 }
 
 static void dequeue_path(struct fuse *f, struct lock_queue_element *qe)
 {
 	struct lock_queue_element **qp;
 
+	/* Still parked if the caller stopped waiting by itself */
+	if (qe->parked)
+		qp = qe->parked;
+	else
+		qp = &f->lockq_ready;
+	for (; *qp != NULL; qp = &(*qp)->wait_next) {
+		if (*qp == qe) {
+			*qp = qe->wait_next;
+			break;
+		}
+	}
+	qe->parked = NULL;
+
 	pthread_cond_destroy(&qe->cond);
 	for (qp = &f->lockq; *qp != qe; qp = &(*qp)->next);
 	*qp = qe->next;
 }
 
-static int wait_path(struct fuse *f, struct lock_queue_element *qe)
+static int wait_path(struct fuse *f, struct lock_queue_element *qe,
+		     struct node *blocker)
 {
-	queue_path(f, qe);
+	queue_path(f, qe, blocker);
 
-	do {
+	/* The blocker may already be gone after rolling back */
+	if (f->lockq_ready)
+		wake_up_queued(f);
+
+	while (!qe->done)
 		pthread_cond_wait(&qe->cond, &f->lock);
-	} while (!qe->done);
 
 	dequeue_path(f, qe);
 
 	return qe->err;
 }
 
+/*
+ * Remembers a path of the current operation, so that stacked modules
+ * can prepend to it in place.
+ */
+static void path_register(struct fuse *f, const char *path)
+{
+	struct fuse_context_i *c = fuse_get_context_internal();
+	int i;
+
+	if (!f->path_headroom || c == NULL || path == NULL)
+		return;
+
+	for (i = 0; i < FUSE_CTX_PATHS; i++) {
+		if (c->paths[i] == NULL) {
+			c->paths[i] = path;
+			return;
+		}
+	}
+}
+
+/* Frees a path built by try_get_path() */
+static void free_path_buf(struct fuse *f, char *path)
+{
+	struct fuse_context_i *c = fuse_get_context_internal();
+	int i;
+
+	if (path == NULL)
+		return;
+
+	if (c != NULL) {
+		for (i = 0; i < FUSE_CTX_PATHS; i++) {
+			if (c->paths[i] == path)
+				c->paths[i] = NULL;
+		}
+	}
+	free(path - f->path_headroom);
+}
+
 static int get_path_common(struct fuse *f, fuse_ino_t nodeid, const char *name,
 			   char **path, struct node **wnode)
 {
+	struct node *blocker = NULL;
 	int err;
 
 	pthread_mutex_lock(&f->lock);
-	err = try_get_path(f, nodeid, name, path, wnode, true);
+	err = try_get_path(f, nodeid, name, path, wnode, true, &blocker);
 	if (err == -EAGAIN) {
 		struct lock_queue_element qe = {
 			.nodeid1 = nodeid,
@@ -1225,11 +2006,14 @@ static int get_path_common(struct fuse *f, fuse_ino_t nodeid, const char *name,
 			.wnode1 = wnode,
 		};
 		debug_path(f, "QUEUE PATH", nodeid, name, !!wnode);
-		err = wait_path(f, &qe);
+		err = wait_path(f, &qe, blocker);
 		debug_path(f, "DEQUEUE PATH", nodeid, name, !!wnode);
 	}
 	pthread_mutex_unlock(&f->lock);
 
+	if (!err)
+		path_register(f, *path);
+
 	return err;
 }
 
@@ -1311,19 +2095,21 @@ static int check_dir_loop(struct fuse *f,
 static int try_get_path2(struct fuse *f, fuse_ino_t nodeid1, const char *name1,
 			 fuse_ino_t nodeid2, const char *name2,
 			 char **path1, char **path2,
-			 struct node **wnode1, struct node **wnode2)
+			 struct node **wnode1, struct node **wnode2,
+			 struct node **blockerp)
 {
 	int err;
 
 	/* FIXME: locking two paths needs deadlock checking */
-	err = try_get_path(f, nodeid1, name1, path1, wnode1, true);
+	err = try_get_path(f, nodeid1, name1, path1, wnode1, true, blockerp);
 	if (!err) {
-		err = try_get_path(f, nodeid2, name2, path2, wnode2, true);
+		err = try_get_path(f, nodeid2, name2, path2, wnode2, true,
+				   blockerp);
 		if (err) {
 			struct node *wn1 = wnode1 ? *wnode1 : NULL;
 
 			unlock_path(f, nodeid1, wn1, NULL);
-			free(*path1);
+			free_path_buf(f, *path1);
 		}
 	}
 	return err;
@@ -1334,6 +2120,7 @@ static int get_path2(struct fuse *f, fuse_ino_t nodeid1, const char *name1,
 		     char **path1, char **path2,
 		     struct node **wnode1, struct node **wnode2)
 {
+	struct node *blocker = NULL;
 	int err;
 
 	pthread_mutex_lock(&f->lock);
@@ -1349,7 +2136,7 @@ static int get_path2(struct fuse *f, fuse_ino_t nodeid1, const char *name1,
 #endif
 
 	err = try_get_path2(f, nodeid1, name1, nodeid2, name2,
-			    path1, path2, wnode1, wnode2);
+			    path1, path2, wnode1, wnode2, &blocker);
 	if (err == -EAGAIN) {
 		struct lock_queue_element qe = {
 			.nodeid1 = nodeid1,
@@ -1364,7 +2151,7 @@ static int get_path2(struct fuse *f, fuse_ino_t nodeid1, const char *name1,
 
 		debug_path(f, "QUEUE PATH1", nodeid1, name1, !!wnode1);
 		debug_path(f, "      PATH2", nodeid2, name2, !!wnode2);
-		err = wait_path(f, &qe);
+		err = wait_path(f, &qe, blocker);
 		debug_path(f, "DEQUEUE PATH1", nodeid1, name1, !!wnode1);
 		debug_path(f, "        PATH2", nodeid2, name2, !!wnode2);
 	}
@@ -1374,6 +2161,11 @@ out_unlock:
 #endif
 	pthread_mutex_unlock(&f->lock);
 
+	if (!err) {
+		path_register(f, *path1);
+		path_register(f, *path2);
+	}
+
 	return err;
 }
 
@@ -1382,10 +2174,10 @@ static void free_path_wrlock(struct fuse *f, fuse_ino_t nodeid,
 {
 	pthread_mutex_lock(&f->lock);
 	unlock_path(f, nodeid, wnode, NULL);
-	if (f->lockq)
+	if (f->lockq_ready)
 		wake_up_queued(f);
 	pthread_mutex_unlock(&f->lock);
-	free(path);
+	free_path_buf(f, path);
 }
 
 static void free_path(struct fuse *f, fuse_ino_t nodeid, char *path)
@@ -1403,8 +2195,28 @@ static void free_path2(struct fuse *f, fuse_ino_t nodeid1, fuse_ino_t nodeid2,
 	unlock_path(f, nodeid2, wnode2, NULL);
 	wake_up_queued(f);
 	pthread_mutex_unlock(&f->lock);
-	free(path1);
-	free(path2);
+	free_path_buf(f, path1);
+	free_path_buf(f, path2);
+}
+
+/*
+ * Called with f->lock held. Returns 0 without doing anything if the
+ * node would be dropped but is still tree locked.
+ */
+static int forget_node_nowait(struct fuse *f, struct node *node,
+			      uint64_t nlookup)
+{
+	if (node->nlookup == nlookup && node->treelock)
+		return 0;
+
+	assert(node->nlookup >= nlookup);
+	node->nlookup -= nlookup;
+	if (!node->nlookup) {
+		unref_node(f, node);
+	} else if (lru_enabled(f) && node->nlookup == 1) {
+		set_forget_time(f, node);
+	}
+	return 1;
 }
 
 static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
@@ -1425,9 +2237,12 @@ static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
 		};
 
 		debug_path(f, "QUEUE PATH (forget)", nodeid, NULL, false);
-		queue_path(f, &qe);
+		queue_path(f, &qe, node);
 
 		do {
+			/* Parked again if the node was relocked meanwhile */
+			if (!qe.parked)
+				wait_for_node(f, &qe, node);
 			pthread_cond_wait(&qe.cond, &f->lock);
 		} while (node->nlookup == nlookup && node->treelock);
 
@@ -1435,14 +2250,65 @@ static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
 		debug_path(f, "DEQUEUE_PATH (forget)", nodeid, NULL, false);
 	}
 
-	assert(node->nlookup >= nlookup);
-	node->nlookup -= nlookup;
-	if (!node->nlookup) {
-		unref_node(f, node);
-	} else if (lru_enabled(f) && node->nlookup == 1) {
-		set_forget_time(f, node);
+	forget_node_nowait(f, node, nlookup);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static int forget_cmp(const void *p1, const void *p2)
+{
+	const struct fuse_forget_data *f1 = p1;
+	const struct fuse_forget_data *f2 = p2;
+
+	if (f1->ino != f2->ino)
+		return f1->ino < f2->ino ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Forget many nodes, taking f->lock once per FORGET_BATCH of them.
+ * The array is sorted in place, so that repeated inode numbers are
+ * merged. Nodes that are still tree locked are left for forget_node()
+ * after the batches, so that waiting for them does not hold up the
+ * rest.
+ */
+static void forget_nodes(struct fuse *f, struct fuse_forget_data *forgets,
+			 size_t count)
+{
+	struct node *node;
+	size_t deferred = 0;
+	size_t i, j, n;
+
+	qsort(forgets, count, sizeof(forgets[0]), forget_cmp);
+	for (i = 0, n = 0; i < count; i++) {
+		if (forgets[i].ino == FUSE_ROOT_ID)
+			continue;
+		if (n && forgets[n - 1].ino == forgets[i].ino)
+			forgets[n - 1].nlookup += forgets[i].nlookup;
+		else
+			forgets[n++] = forgets[i];
+	}
+	count = n;
+
+	pthread_mutex_lock(&f->lock);
+	for (i = 0; i < count; i += n) {
+		n = count - i < FORGET_BATCH ? count - i : FORGET_BATCH;
+
+		for (j = 0; j < n; j++) {
+			node = get_node(f, forgets[i + j].ino);
+			if (!forget_node_nowait(f, node,
+						forgets[i + j].nlookup))
+				forgets[deferred++] = forgets[i + j];
+		}
+
+		if (i + n < count) {
+			pthread_mutex_unlock(&f->lock);
+			pthread_mutex_lock(&f->lock);
+		}
 	}
 	pthread_mutex_unlock(&f->lock);
+
+	for (i = 0; i < deferred; i++)
+		forget_node(f, forgets[i].ino, forgets[i].nlookup);
 }
 
 static void unlink_node(struct fuse *f, struct node *node)
@@ -2437,7 +3303,8 @@ static char *hidden_name(struct fuse *f, fuse_ino_t dir, const char *oldname,
 			newnode = lookup_node(f, dir, newname);
 		} while(newnode);
 
-		res = try_get_path(f, dir, newname, &newpath, NULL, false);
+		res = try_get_path(f, dir, newname, &newpath, NULL, false,
+				   NULL);
 		pthread_mutex_unlock(&f->lock);
 		if (res)
 			break;
@@ -2446,7 +3313,7 @@ static char *hidden_name(struct fuse *f, fuse_ino_t dir, const char *oldname,
 		res = fuse_fs_getattr(f->fs, newpath, &buf, NULL);
 		if (res == -ENOENT)
 			break;
-		free(newpath);
+		free_path_buf(f, newpath);
 		newpath = NULL;
 	} while(res == 0 && --failctr);
 
@@ -2465,7 +3332,7 @@ static int hide_node(struct fuse *f, const char *oldpath,
 		err = fuse_fs_rename(f->fs, oldpath, newpath, 0);
 		if (!err)
 			err = rename_node(f, dir, oldname, dir, newname, 1);
-		free(newpath);
+		free_path_buf(f, newpath);
 	}
 	return err;
 }
@@ -2505,8 +3372,136 @@ static void update_stat(struct node *node, const struct stat *stbuf)
 	curr_time(&node->stat_updated);
 }
 
+/*
+ * With attr_cache, what the file system last reported for a node
+ * answers getattr for attr_cache seconds.  Operations that may change
+ * the attributes invalidate them once they are done, and results that
+ * were obtained before that are not stored.
+ */
+static uint64_t attr_cache_gen(struct fuse *f)
+{
+	return __atomic_load_n(&f->attr_gen, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Called with f->lock held, gen is what attr_cache_gen() returned
+ * before the file system was asked
+ */
+static void attr_store(struct fuse *f, struct node *node,
+		       const struct stat *stbuf, uint64_t gen)
+{
+	struct node_attr *a = node->ext ? node->ext->attr : NULL;
+
+	if (f->conf.attr_cache <= 0)
+		return;
+
+	/* A node without attributes may have been invalidated meanwhile */
+	if (a ? a->gen > gen : attr_cache_gen(f) != gen)
+		return;
+
+	if (!a) {
+		if (!node_ext(node))
+			return;
+		a = malloc(sizeof(struct node_attr));
+		if (!a)
+			return;
+		node->ext->attr = a;
+	}
+	a->stat = *stbuf;
+	curr_time(&a->updated);
+	a->gen = gen;
+	a->valid = 1;
+}
+
+/* Called with f->lock held */
+static void attr_drop(struct fuse *f, struct node *node)
+{
+	uint64_t gen = __atomic_add_fetch(&f->attr_gen, 1, __ATOMIC_RELEASE);
+	struct node_attr *a = node->ext ? node->ext->attr : NULL;
+
+	if (a) {
+		a->gen = gen;
+		a->valid = 0;
+	}
+}
+
+static void attr_invalidate(struct fuse *f, fuse_ino_t ino)
+{
+	struct node *node;
+
+	if (f->conf.attr_cache <= 0)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node_nocheck(f, ino);
+	if (node)
+		attr_drop(f, node);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * A file gained or lost a link. Without use_ino its other names have
+ * nodes of their own, which cannot be found, so the attributes of every
+ * file with several links that were asked for before are dropped.
+ */
+static void attr_invalidate_links(struct fuse *f)
+{
+	uint64_t gen;
+
+	if (f->conf.attr_cache <= 0)
+		return;
+
+	gen = __atomic_add_fetch(&f->attr_gen, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&f->attr_links_gen, gen, __ATOMIC_RELEASE);
+}
+
+static void attr_invalidate_name(struct fuse *f, fuse_ino_t parent,
+				 const char *name)
+{
+	struct node *node;
+
+	if (f->conf.attr_cache <= 0)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	node = lookup_node(f, parent, name);
+	if (node)
+		attr_drop(f, node);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static int attr_lookup(struct fuse *f, fuse_ino_t ino, struct stat *stbuf)
+{
+	struct timespec now;
+	struct node_attr *a;
+	struct node *node;
+	int found = 0;
+
+	if (f->conf.attr_cache <= 0)
+		return 0;
+
+	curr_time(&now);
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	a = node->ext ? node->ext->attr : NULL;
+	if (a && a->valid &&
+	    diff_timespec(&now, &a->updated) < f->conf.attr_cache &&
+	    (a->stat.st_nlink < 2 || S_ISDIR(a->stat.st_mode) ||
+	     a->gen >= __atomic_load_n(&f->attr_links_gen,
+				       __ATOMIC_ACQUIRE))) {
+		*stbuf = a->stat;
+		found = 1;
+		f->attr_hits++;
+	} else {
+		f->attr_misses++;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return found;
+}
+
 static int do_lookup(struct fuse *f, fuse_ino_t nodeid, const char *name,
-		     struct fuse_entry_param *e)
+		     struct fuse_entry_param *e, uint64_t gen)
 {
 	struct node *node;
 
@@ -2518,67 +3513,269 @@ static int do_lookup(struct fuse *f, fuse_ino_t nodeid, const char *name,
 	e->generation = node->generation;
 	e->entry_timeout = f->conf.entry_timeout;
 	e->attr_timeout = f->conf.attr_timeout;
-	if (f->conf.auto_cache) {
+	if (f->conf.auto_cache || f->conf.readdir_cache ||
+	    f->conf.attr_cache > 0) {
 		pthread_mutex_lock(&f->lock);
-		update_stat(node, &e->attr);
+		if (f->conf.auto_cache || f->conf.readdir_cache)
+			update_stat(node, &e->attr);
+		attr_store(f, node, &e->attr, gen);
 		pthread_mutex_unlock(&f->lock);
 	}
 	set_stat(f, e->ino, &e->attr);
 	return 0;
 }
 
-static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
-		       const char *name, const char *path,
-		       struct fuse_entry_param *e, struct fuse_file_info *fi)
+/*
+ * With negative_cache, names that the file system reported as not
+ * existing are remembered for that long, independently of the kernel's
+ * dentry cache. Entries are hashed like the name table, and split into
+ * NEG_TABLE_SHARDS tables with their own locks, as lookups do not take
+ * f->lock to check them. They all live equally long, so the list in
+ * insertion order is also in expiry order.
+ */
+#define NEG_TABLE_SHARD_BITS 4
+#define NEG_TABLE_SHARDS (1 << NEG_TABLE_SHARD_BITS)
+#define NEG_TABLE_SIZE 256
+#define NEG_TABLE_MAX 1024
+
+struct neg_entry {
+	struct neg_entry *next;
+	struct list_head list;
+	uint64_t hash;
+	fuse_ino_t parent;
+	struct timespec added;
+	char name[];
+};
+
+struct neg_table {
+	pthread_mutex_t lock;
+	struct neg_entry *array[NEG_TABLE_SIZE];
+	struct list_head list;
+	size_t use;
+	/* Bumped by every neg_forget(), see neg_insert() */
+	uint64_t gen;
+};
+
+/*
+ * The hashes are fully mixed, so the top bits can select the table
+ * while the bucket is taken from the remainder modulo NEG_TABLE_SIZE
+ */
+static struct neg_table *neg_shard(struct fuse *f, uint64_t hash)
 {
-	int res;
+	return &f->neg_table[hash >> (64 - NEG_TABLE_SHARD_BITS)];
+}
 
-	memset(e, 0, sizeof(struct fuse_entry_param));
-	res = fuse_fs_getattr(f->fs, path, &e->attr, fi);
-	if (res == 0) {
-		res = do_lookup(f, nodeid, name, e);
-		if (res == 0 && f->conf.debug) {
-			fuse_log(FUSE_LOG_DEBUG, "   NODEID: %llu\n",
-				(unsigned long long) e->ino);
-		}
+static int neg_table_init(struct fuse *f)
+{
+	int i;
+
+	f->neg_table = calloc(NEG_TABLE_SHARDS, sizeof(struct neg_table));
+	if (f->neg_table == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: memory allocation failed\n");
+		return -1;
 	}
-	return res;
+	for (i = 0; i < NEG_TABLE_SHARDS; i++) {
+		pthread_mutex_init(&f->neg_table[i].lock, NULL);
+		init_list_head(&f->neg_table[i].list);
+	}
+	return 0;
 }
 
-static struct fuse_context_i *fuse_get_context_internal(void)
+static void neg_remove(struct neg_table *t, struct neg_entry *ne)
 {
-	return (struct fuse_context_i *) pthread_getspecific(fuse_context_key);
+	struct neg_entry **nep;
+
+	for (nep = &t->array[ne->hash % NEG_TABLE_SIZE]; *nep != ne;
+	     nep = &(*nep)->next);
+	*nep = ne->next;
+	list_del(&ne->list);
+	t->use--;
+	free(ne);
 }
 
-static struct fuse_context_i *fuse_create_context(struct fuse *f)
+static void neg_table_free(struct fuse *f)
 {
-	struct fuse_context_i *c = fuse_get_context_internal();
-	if (c == NULL) {
-		c = (struct fuse_context_i *)
-			calloc(1, sizeof(struct fuse_context_i));
-		if (c == NULL) {
-			/* This is hard to deal with properly, so just
-			   abort.  If memory is so low that the
-			   context cannot be allocated, there's not
-			   much hope for the filesystem anyway */
-			fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate thread specific data\n");
-			abort();
-		}
-		pthread_setspecific(fuse_context_key, c);
-	} else {
-		memset(c, 0, sizeof(*c));
-	}
-	c->ctx.fuse = f;
+	int i;
 
-	return c;
+	if (f->neg_table == NULL)
+		return;
+	for (i = 0; i < NEG_TABLE_SHARDS; i++) {
+		struct neg_table *t = &f->neg_table[i];
+
+		while (!list_empty(&t->list))
+			neg_remove(t, list_entry(t->list.next,
+						 struct neg_entry, list));
+		pthread_mutex_destroy(&t->lock);
+	}
+	free(f->neg_table);
+	f->neg_table = NULL;
 }
 
-static void fuse_freecontext(void *data)
+/* Called with t->lock held */
+static void neg_expire(struct fuse *f, struct neg_table *t)
 {
-	free(data);
+	struct timespec now;
+
+	curr_time(&now);
+	while (!list_empty(&t->list)) {
+		struct neg_entry *ne = list_entry(t->list.next,
+						  struct neg_entry, list);
+
+		if (diff_timespec(&now, &ne->added) < f->conf.negative_cache)
+			break;
+		neg_remove(t, ne);
+	}
 }
 
-static int fuse_create_context_key(void)
+/* Called with t->lock held */
+static struct neg_entry *neg_find(struct neg_table *t, uint64_t hash,
+				  fuse_ino_t parent, const char *name)
+{
+	struct neg_entry *ne;
+
+	for (ne = t->array[hash % NEG_TABLE_SIZE]; ne != NULL; ne = ne->next)
+		if (ne->hash == hash && ne->parent == parent &&
+		    strcmp(ne->name, name) == 0)
+			break;
+
+	return ne;
+}
+
+/*
+ * Returns 1 if the name is known not to exist. Otherwise stores the
+ * generation to pass to neg_insert() if the file system says so.
+ */
+static int neg_lookup(struct fuse *f, fuse_ino_t parent, const char *name,
+		      uint64_t *genp)
+{
+	uint64_t hash;
+	struct neg_table *t;
+	struct neg_entry *ne;
+
+	if (f->neg_table == NULL)
+		return 0;
+
+	hash = name_hash(parent, name);
+	t = neg_shard(f, hash);
+	pthread_mutex_lock(&t->lock);
+	neg_expire(f, t);
+	ne = neg_find(t, hash, parent, name);
+	*genp = t->gen;
+	pthread_mutex_unlock(&t->lock);
+
+	return ne != NULL;
+}
+
+/*
+ * Remembers a name that does not exist, unless neg_forget() ran since
+ * the lookup started: the file system may have answered before a
+ * concurrent create.
+ */
+static void neg_insert(struct fuse *f, fuse_ino_t parent, const char *name,
+		       uint64_t gen)
+{
+	uint64_t hash;
+	struct neg_table *t;
+	struct neg_entry *ne;
+	size_t len;
+
+	if (f->neg_table == NULL)
+		return;
+
+	hash = name_hash(parent, name);
+	t = neg_shard(f, hash);
+	len = strlen(name);
+	ne = malloc(sizeof(*ne) + len + 1);
+	if (ne == NULL)
+		return;
+	ne->hash = hash;
+	ne->parent = parent;
+	memcpy(ne->name, name, len + 1);
+	curr_time(&ne->added);
+
+	pthread_mutex_lock(&t->lock);
+	if (t->gen != gen || neg_find(t, hash, parent, name) != NULL) {
+		pthread_mutex_unlock(&t->lock);
+		free(ne);
+		return;
+	}
+	if (t->use >= NEG_TABLE_MAX)
+		neg_remove(t, list_entry(t->list.next, struct neg_entry, list));
+	ne->next = t->array[hash % NEG_TABLE_SIZE];
+	t->array[hash % NEG_TABLE_SIZE] = ne;
+	list_add_tail(&ne->list, &t->list);
+	t->use++;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* Called after every operation that may have created the name */
+static void neg_forget(struct fuse *f, fuse_ino_t parent, const char *name)
+{
+	uint64_t hash;
+	struct neg_table *t;
+	struct neg_entry *ne;
+
+	if (f->neg_table == NULL)
+		return;
+
+	hash = name_hash(parent, name);
+	t = neg_shard(f, hash);
+	pthread_mutex_lock(&t->lock);
+	t->gen++;
+	ne = neg_find(t, hash, parent, name);
+	if (ne != NULL)
+		neg_remove(t, ne);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
+		       const char *name, const char *path,
+		       struct fuse_entry_param *e, struct fuse_file_info *fi)
+{
+	uint64_t gen = attr_cache_gen(f);
+	int res;
+
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	res = fuse_fs_getattr(f->fs, path, &e->attr, fi);
+	if (res == 0) {
+		res = do_lookup(f, nodeid, name, e, gen);
+		if (res == 0 && f->conf.debug) {
+			fuse_log(FUSE_LOG_DEBUG, "   NODEID: %llu\n",
+				(unsigned long long) e->ino);
+		}
+	}
+	return res;
+}
+
+static struct fuse_context_i *fuse_create_context(struct fuse *f)
+{
+	struct fuse_context_i *c = fuse_get_context_internal();
+	if (c == NULL) {
+		c = (struct fuse_context_i *)
+			calloc(1, sizeof(struct fuse_context_i));
+		if (c == NULL) {
+			/* This is hard to deal with properly, so just
+			   abort.  If memory is so low that the
+			   context cannot be allocated, there's not
+			   much hope for the filesystem anyway */
+			fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate thread specific data\n");
+			abort();
+		}
+		pthread_setspecific(fuse_context_key, c);
+	} else {
+		memset(c, 0, sizeof(*c));
+	}
+	c->ctx.fuse = f;
+
+	return c;
+}
+
+static void fuse_freecontext(void *data)
+{
+	free(data);
+}
+
+static int fuse_create_context_key(void)
 {
 	int err = 0;
 	pthread_mutex_lock(&fuse_context_lock);
@@ -2690,6 +3887,7 @@ static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
 	char *path;
 	int err;
 	struct node *dot = NULL;
+	uint64_t neg_gen = 0;
 
 	if (name[0] == '.') {
 		int len = strlen(name);
@@ -2716,6 +3914,20 @@ static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
 		}
 	}
 
+	if (name != NULL && neg_lookup(f, parent, name, &neg_gen)) {
+		if (f->conf.debug)
+			fuse_log(FUSE_LOG_DEBUG, "LOOKUP %llu/%s (negative)\n",
+				 (unsigned long long) parent, name);
+		memset(&e, 0, sizeof(e));
+		err = -ENOENT;
+		if (f->conf.negative_timeout != 0.0) {
+			e.entry_timeout = f->conf.negative_timeout;
+			err = 0;
+		}
+		reply_entry(req, &e, err);
+		return;
+	}
+
 	err = get_path_name(f, parent, name, &path);
 	if (!err) {
 		struct fuse_intr_data d;
@@ -2723,6 +3935,8 @@ static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
 			fuse_log(FUSE_LOG_DEBUG, "LOOKUP %s\n", path);
 		fuse_prepare_interrupt(f, req, &d);
 		err = lookup_path(f, parent, name, path, &e, NULL);
+		if (err == -ENOENT && name != NULL)
+			neg_insert(f, parent, name, neg_gen);
 		if (err == -ENOENT && f->conf.negative_timeout != 0.0) {
 			e.ino = 0;
 			e.entry_timeout = f->conf.negative_timeout;
@@ -2759,8 +3973,13 @@ static void fuse_lib_forget_multi(fuse_req_t req, size_t count,
 	struct fuse *f = req_fuse(req);
 	size_t i;
 
-	for (i = 0; i < count; i++)
-		do_forget(f, forgets[i].ino, forgets[i].nlookup);
+	if (f->conf.debug) {
+		for (i = 0; i < count; i++)
+			fuse_log(FUSE_LOG_DEBUG, "FORGET %llu/%llu\n",
+				 (unsigned long long) forgets[i].ino,
+				 (unsigned long long) forgets[i].nlookup);
+	}
+	forget_nodes(f, forgets, count);
 
 	fuse_reply_none(req);
 }
@@ -2771,18 +3990,24 @@ static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
 {
 	struct fuse *f = req_fuse_prepare(req);
 	struct stat buf;
+	uint64_t gen = attr_cache_gen(f);
 	char *path;
-	int err;
+	int cached;
+	int err = 0;
 
 	memset(&buf, 0, sizeof(buf));
 
-	if (fi != NULL)
-		err = get_path_nullok(f, ino, &path);
-	else
-		err = get_path(f, ino, &path);
-	if (!err) {
+	cached = attr_lookup(f, ino, &buf);
+	if (!cached) {
+		if (fi != NULL)
+			err = get_path_nullok(f, ino, &path);
+		else
+			err = get_path(f, ino, &path);
+	}
+	if (!cached && !err) {
 		struct fuse_intr_data d;
 		fuse_prepare_interrupt(f, req, &d);
+		wbuf_sync(f, ino, path, NULL);
 		err = fuse_fs_getattr(f->fs, path, &buf, fi);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
@@ -2792,10 +4017,13 @@ static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
 
 		pthread_mutex_lock(&f->lock);
 		node = get_node(f, ino);
+		if (!cached) {
+			attr_store(f, node, &buf, gen);
+			if (f->conf.auto_cache || f->conf.readdir_cache)
+				update_stat(node, &buf);
+		}
 		if (node->is_hidden && buf.st_nlink > 0)
 			buf.st_nlink--;
-		if (f->conf.auto_cache)
-			update_stat(node, &buf);
 		pthread_mutex_unlock(&f->lock);
 		set_stat(f, ino, &buf);
 		fuse_reply_attr(req, &buf, f->conf.attr_timeout);
@@ -2825,6 +4053,7 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 {
 	struct fuse *f = req_fuse_prepare(req);
 	struct stat buf;
+	uint64_t gen;
 	char *path;
 	int err;
 
@@ -2836,6 +4065,7 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 	if (!err) {
 		struct fuse_intr_data d;
 		fuse_prepare_interrupt(f, req, &d);
+		wbuf_sync(f, ino, path, NULL);
 		err = 0;
 		if (!err && (valid & FUSE_SET_ATTR_MODE))
 			err = fuse_fs_chmod(f->fs, path, attr->st_mode, fi);
@@ -2849,6 +4079,7 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		if (!err && (valid & FUSE_SET_ATTR_SIZE)) {
 			err = fuse_fs_truncate(f->fs, path,
 					       attr->st_size, fi);
+			ra_invalidate(f, ino);
 		}
 #ifdef HAVE_UTIMENSAT
 		if (!err &&
@@ -2883,6 +4114,8 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 			tv[1].tv_nsec = ST_MTIM_NSEC(attr);
 			err = fuse_fs_utimens(f->fs, path, tv, fi);
 		}
+		attr_invalidate(f, ino);
+		gen = attr_cache_gen(f);
 		if (!err) {
 			err = fuse_fs_getattr(f->fs, path, &buf, fi);
 		}
@@ -2890,9 +4123,15 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		free_path(f, ino, path);
 	}
 	if (!err) {
-		if (f->conf.auto_cache) {
+		if (f->conf.auto_cache || f->conf.readdir_cache ||
+		    f->conf.attr_cache > 0) {
+			struct node *node;
+
 			pthread_mutex_lock(&f->lock);
-			update_stat(get_node(f, ino), &buf);
+			node = get_node(f, ino);
+			if (f->conf.auto_cache || f->conf.readdir_cache)
+				update_stat(node, &buf);
+			attr_store(f, node, &buf, gen);
 			pthread_mutex_unlock(&f->lock);
 		}
 		set_stat(f, ino, &buf);
@@ -2962,6 +4201,8 @@ static void fuse_lib_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 			fi.flags = O_CREAT | O_EXCL | O_WRONLY;
 			err = fuse_fs_create(f->fs, path, mode, &fi);
 			if (!err) {
+				dircache_invalidate(f, parent);
+				attr_invalidate(f, parent);
 				err = lookup_path(f, parent, name, path, &e,
 						  &fi);
 				fuse_fs_release(f->fs, path, &fi);
@@ -2969,10 +4210,14 @@ static void fuse_lib_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 		}
 		if (err == -ENOSYS) {
 			err = fuse_fs_mknod(f->fs, path, mode, rdev);
-			if (!err)
+			if (!err) {
+				dircache_invalidate(f, parent);
+				attr_invalidate(f, parent);
 				err = lookup_path(f, parent, name, path, &e,
 						  NULL);
+			}
 		}
+		neg_forget(f, parent, name);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, parent, path);
 	}
@@ -2993,8 +4238,12 @@ static void fuse_lib_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_mkdir(f->fs, path, mode);
-		if (!err)
+		if (!err) {
+			dircache_invalidate(f, parent);
+			attr_invalidate(f, parent);
 			err = lookup_path(f, parent, name, path, &e, NULL);
+		}
+		neg_forget(f, parent, name);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, parent, path);
 	}
@@ -3017,9 +4266,19 @@ static void fuse_lib_unlink(fuse_req_t req, fuse_ino_t parent,
 		if (!f->conf.hard_remove && is_open(f, parent, name)) {
 			err = hide_node(f, path, parent, name);
 		} else {
+			/* Its path is gone once unlinked */
+			if (wnode)
+				wbuf_sync(f, wnode->nodeid, path, NULL);
 			err = fuse_fs_unlink(f->fs, path);
-			if (!err)
+			if (!err) {
+				attr_invalidate_name(f, parent, name);
 				remove_node(f, parent, name);
+			}
+		}
+		if (!err) {
+			dircache_invalidate(f, parent);
+			attr_invalidate(f, parent);
+			attr_invalidate_links(f);
 		}
 		fuse_finish_interrupt(f, req, &d);
 		free_path_wrlock(f, parent, wnode, path);
@@ -3041,8 +4300,12 @@ static void fuse_lib_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_rmdir(f->fs, path);
 		fuse_finish_interrupt(f, req, &d);
-		if (!err)
+		if (!err) {
+			attr_invalidate_name(f, parent, name);
 			remove_node(f, parent, name);
+			dircache_invalidate(f, parent);
+			attr_invalidate(f, parent);
+		}
 		free_path_wrlock(f, parent, wnode, path);
 	}
 	reply_err(req, err);
@@ -3062,8 +4325,12 @@ static void fuse_lib_symlink(fuse_req_t req, const char *linkname,
 
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_symlink(f->fs, linkname, path);
-		if (!err)
+		if (!err) {
+			dircache_invalidate(f, parent);
+			attr_invalidate(f, parent);
 			err = lookup_path(f, parent, name, path, &e, NULL);
+		}
+		neg_forget(f, parent, name);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, parent, path);
 	}
@@ -3090,9 +4357,20 @@ static void fuse_lib_rename(fuse_req_t req, fuse_ino_t olddir,
 		if (!f->conf.hard_remove && !(flags & RENAME_EXCHANGE) &&
 		    is_open(f, newdir, newname))
 			err = hide_node(f, newpath, newdir, newname);
+		else if (wnode2 && !(flags & RENAME_EXCHANGE))
+			/* The target's path is gone once replaced */
+			wbuf_sync(f, wnode2->nodeid, newpath, NULL);
 		if (!err) {
 			err = fuse_fs_rename(f->fs, oldpath, newpath, flags);
 			if (!err) {
+				dircache_invalidate(f, olddir);
+				dircache_invalidate(f, newdir);
+				attr_invalidate(f, olddir);
+				attr_invalidate(f, newdir);
+				attr_invalidate_name(f, olddir, oldname);
+				attr_invalidate_name(f, newdir, newname);
+				/* The file it replaced lost a link */
+				attr_invalidate_links(f);
 				if (flags & RENAME_EXCHANGE) {
 					err = exchange_node(f, olddir, oldname,
 							    newdir, newname);
@@ -3101,6 +4379,7 @@ static void fuse_lib_rename(fuse_req_t req, fuse_ino_t olddir,
 							  newdir, newname, 0);
 				}
 			}
+			neg_forget(f, newdir, newname);
 		}
 		fuse_finish_interrupt(f, req, &d);
 		free_path2(f, olddir, newdir, wnode1, wnode2, oldpath, newpath);
@@ -3124,9 +4403,16 @@ static void fuse_lib_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
 
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_link(f->fs, oldpath, newpath);
-		if (!err)
+		if (!err) {
+			dircache_invalidate(f, newparent);
+			attr_invalidate(f, newparent);
+			/* Its link count and ctime changed */
+			attr_invalidate(f, ino);
+			attr_invalidate_links(f);
 			err = lookup_path(f, newparent, newname, newpath,
 					  &e, NULL);
+		}
+		neg_forget(f, newparent, newname);
 		fuse_finish_interrupt(f, req, &d);
 		free_path2(f, ino, newparent, NULL, NULL, oldpath, newpath);
 	}
@@ -3139,6 +4425,9 @@ static void fuse_do_release(struct fuse *f, fuse_ino_t ino, const char *path,
 	struct node *node;
 	int unlink_hidden = 0;
 
+	/* Nothing left to report the error to */
+	wbuf_sync(f, ino, path, fi);
+	ra_release(f, ino, fi);
 	fuse_fs_release(f->fs, path, fi);
 
 	pthread_mutex_lock(&f->lock);
@@ -3148,6 +4437,8 @@ static void fuse_do_release(struct fuse *f, fuse_ino_t ino, const char *path,
 	if (node->is_hidden && !node->open_count) {
 		unlink_hidden = 1;
 		node->is_hidden = 0;
+		if (node->parent)
+			drop_dircache(node->parent);
 	}
 	pthread_mutex_unlock(&f->lock);
 
@@ -3180,6 +4471,8 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_create(f->fs, path, mode, fi);
 		if (!err) {
+			dircache_invalidate(f, parent);
+			attr_invalidate(f, parent);
 			err = lookup_path(f, parent, name, path, &e, fi);
 			if (err)
 				fuse_fs_release(f->fs, path, fi);
@@ -3195,6 +4488,7 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
 
 			}
 		}
+		neg_forget(f, parent, name);
 		fuse_finish_interrupt(f, req, &d);
 	}
 	if (!err) {
@@ -3221,6 +4515,124 @@ static double diff_timespec(const struct timespec *t1,
 		((double) t1->tv_nsec - (double) t2->tv_nsec) / 1000000000.0;
 }
 
+static double ac_age(struct node *node)
+{
+	struct timespec now;
+
+	curr_time(&now);
+	return diff_timespec(&now, &node->stat_updated);
+}
+
+/* Called with f->lock held */
+static void ac_revalidated(struct fuse *f, struct node *node, int err,
+			   const struct stat *stbuf)
+{
+	if (!err)
+		update_stat(node, stbuf);
+	else
+		node->cache_valid = 0;
+	node->ac_revalidating = 0;
+	pthread_cond_broadcast(&f->ac_cond);
+}
+
+/*
+ * Revalidates the attributes of queued nodes in the background, so
+ * that with ac_refresh opens of busy files do not wait for getattr.
+ */
+static void *ac_refresh_thread(void *data)
+{
+	struct fuse *f = data;
+
+	fuse_create_context(f);
+	pthread_mutex_lock(&f->lock);
+	while (1) {
+		struct ac_refresh *r;
+		struct node *node;
+		struct stat stbuf;
+		char *path;
+		int err;
+
+		while (f->ac_refresh_head == NULL && !f->ac_refresh_stop)
+			pthread_cond_wait(&f->ac_refresh_cond, &f->lock);
+		if (f->ac_refresh_stop)
+			break;
+
+		r = f->ac_refresh_head;
+		f->ac_refresh_head = r->next;
+		if (f->ac_refresh_head == NULL)
+			f->ac_refresh_tail = &f->ac_refresh_head;
+		node = r->node;
+		free(r);
+		pthread_mutex_unlock(&f->lock);
+
+		err = get_path(f, node->nodeid, &path);
+		if (!err) {
+			err = fuse_fs_getattr(f->fs, path, &stbuf, NULL);
+			free_path(f, node->nodeid, path);
+		}
+
+		pthread_mutex_lock(&f->lock);
+		ac_revalidated(f, node, err, &stbuf);
+		unref_node(f, node);
+	}
+	pthread_mutex_unlock(&f->lock);
+	return NULL;
+}
+
+/* Called with f->lock held */
+static void ac_queue_refresh(struct fuse *f, struct node *node)
+{
+	struct ac_refresh *r;
+
+	if (!f->ac_refresh_started) {
+		if (fuse_start_thread(&f->ac_refresh_thread,
+				      ac_refresh_thread, f) != 0) {
+			/* Revalidate on expiry instead */
+			f->conf.ac_refresh = 0;
+			return;
+		}
+		f->ac_refresh_started = 1;
+	}
+
+	r = malloc(sizeof(*r));
+	if (r == NULL)
+		return;
+	r->next = NULL;
+	r->node = node;
+	node->refctr++;
+	node->ac_revalidating = 1;
+	*f->ac_refresh_tail = r;
+	f->ac_refresh_tail = &r->next;
+	pthread_cond_signal(&f->ac_refresh_cond);
+}
+
+static void ac_stop_refresh(struct fuse *f)
+{
+	struct ac_refresh *r;
+
+	if (!f->ac_refresh_started)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	f->ac_refresh_stop = 1;
+	pthread_cond_signal(&f->ac_refresh_cond);
+	pthread_mutex_unlock(&f->lock);
+	pthread_join(f->ac_refresh_thread, NULL);
+
+	while ((r = f->ac_refresh_head) != NULL) {
+		f->ac_refresh_head = r->next;
+		r->node->ac_revalidating = 0;
+		unref_node(f, r->node);
+		free(r);
+	}
+	f->ac_refresh_tail = &f->ac_refresh_head;
+	f->ac_refresh_started = 0;
+}
+
+/*
+ * Only one getattr per node is in flight: concurrent opens of a node
+ * whose attributes expired wait for the first one to revalidate them.
+ */
 static void open_auto_cache(struct fuse *f, fuse_ino_t ino, const char *path,
 			    struct fuse_file_info *fi)
 {
@@ -3228,25 +4640,27 @@ static void open_auto_cache(struct fuse *f, fuse_ino_t ino, const char *path,
 
 	pthread_mutex_lock(&f->lock);
 	node = get_node(f, ino);
-	if (node->cache_valid) {
-		struct timespec now;
+	while (node->cache_valid && ac_age(node) > f->conf.ac_attr_timeout) {
+		struct stat stbuf;
+		int err;
 
-		curr_time(&now);
-		if (diff_timespec(&now, &node->stat_updated) >
-		    f->conf.ac_attr_timeout) {
-			struct stat stbuf;
-			int err;
-			pthread_mutex_unlock(&f->lock);
-			err = fuse_fs_getattr(f->fs, path, &stbuf, fi);
-			pthread_mutex_lock(&f->lock);
-			if (!err)
-				update_stat(node, &stbuf);
-			else
-				node->cache_valid = 0;
+		if (node->ac_revalidating) {
+			pthread_cond_wait(&f->ac_cond, &f->lock);
+			continue;
 		}
+		node->ac_revalidating = 1;
+		pthread_mutex_unlock(&f->lock);
+		err = fuse_fs_getattr(f->fs, path, &stbuf, fi);
+		pthread_mutex_lock(&f->lock);
+		ac_revalidated(f, node, err, &stbuf);
+		break;
 	}
-	if (node->cache_valid)
+	if (node->cache_valid) {
 		fi->keep_cache = 1;
+		if (f->conf.ac_refresh > 0 && !node->ac_revalidating &&
+		    ac_age(node) > f->conf.ac_attr_timeout - f->conf.ac_refresh)
+			ac_queue_refresh(f, node);
+	}
 
 	node->cache_valid = 1;
 	pthread_mutex_unlock(&f->lock);
@@ -3265,6 +4679,8 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_open(f->fs, path, fi);
 		if (!err) {
+			if (fi->flags & O_TRUNC)
+				attr_invalidate(f, ino);
 			if (f->conf.direct_io)
 				fi->direct_io = 1;
 			if (f->conf.kernel_cache)
@@ -3290,81 +4706,882 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
 	free_path(f, ino, path);
 }
 
-static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
-			  off_t off, struct fuse_file_info *fi)
-{
-	struct fuse *f = req_fuse_prepare(req);
-	struct fuse_bufvec *buf = NULL;
+struct fuse_async {
+	struct fuse *f;
+	fuse_req_t req;
+	fuse_ino_t ino;
 	char *path;
-	int res;
+};
 
-	res = get_path_nullok(f, ino, &path);
-	if (res == 0) {
-		struct fuse_intr_data d;
+static fuse_async_t fuse_async_new(struct fuse *f, fuse_req_t req,
+				   fuse_ino_t ino, char *path)
+{
+	fuse_async_t async = malloc(sizeof(struct fuse_async));
 
-		fuse_prepare_interrupt(f, req, &d);
-		res = fuse_fs_read_buf(f->fs, path, &buf, size, off, fi);
-		fuse_finish_interrupt(f, req, &d);
-		free_path(f, ino, path);
+	if (async) {
+		async->f = f;
+		async->req = req;
+		async->ino = ino;
+		async->path = path;
 	}
+	return async;
+}
 
-	if (res == 0)
-		fuse_reply_data(req, buf, FUSE_BUF_SPLICE_MOVE);
-	else
-		reply_err(req, res);
+/* The path is kept until completion, so that it stays locked too */
+static fuse_req_t fuse_async_finish(fuse_async_t async)
+{
+	fuse_req_t req = async->req;
 
-	fuse_free_buf(buf);
+	free_path(async->f, async->ino, async->path);
+	free(async);
+	return req;
 }
 
-static void fuse_lib_write_buf(fuse_req_t req, fuse_ino_t ino,
-			       struct fuse_bufvec *buf, off_t off,
-			       struct fuse_file_info *fi)
+int fuse_async_reply_data(fuse_async_t async, struct fuse_bufvec *bufv)
 {
-	struct fuse *f = req_fuse_prepare(req);
-	char *path;
-	int res;
+	return fuse_reply_data(fuse_async_finish(async), bufv,
+			       FUSE_BUF_SPLICE_MOVE);
+}
 
-	res = get_path_nullok(f, ino, &path);
-	if (res == 0) {
-		struct fuse_intr_data d;
+int fuse_async_reply_buf(fuse_async_t async, const char *buf, size_t size)
+{
+	return fuse_reply_buf(fuse_async_finish(async), buf, size);
+}
 
-		fuse_prepare_interrupt(f, req, &d);
-		res = fuse_fs_write_buf(f->fs, path, buf, off, fi);
-		fuse_finish_interrupt(f, req, &d);
-		free_path(f, ino, path);
-	}
+int fuse_async_reply_write(fuse_async_t async, size_t count)
+{
+	attr_invalidate(async->f, async->ino);
+	return fuse_reply_write(fuse_async_finish(async), count);
+}
 
-	if (res >= 0)
-		fuse_reply_write(req, res);
-	else
-		reply_err(req, res);
+int fuse_async_reply_err(fuse_async_t async, int err)
+{
+	return fuse_reply_err(fuse_async_finish(async), err);
 }
 
-static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
-			   struct fuse_file_info *fi)
+int fuse_async_interrupted(fuse_async_t async)
 {
-	struct fuse *f = req_fuse_prepare(req);
-	char *path;
-	int err;
+	return fuse_req_interrupted(async->req);
+}
 
-	err = get_path_nullok(f, ino, &path);
-	if (!err) {
-		struct fuse_intr_data d;
+/*
+ * Returns zero if the operation was started, and the request will be
+ * answered through the handle
+ */
+static int fuse_fs_read_async(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+			      char *path, size_t size, off_t off,
+			      struct fuse_file_info *fi)
+{
+	struct fuse_fs *fs = f->fs;
+	fuse_async_t async;
+	int res;
 
-		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_fsync(f->fs, path, datasync, fi);
-		fuse_finish_interrupt(f, req, &d);
-		free_path(f, ino, path);
-	}
-	reply_err(req, err);
+	async = fuse_async_new(f, req, ino, path);
+	if (!async)
+		return -ENOMEM;
+
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->debug)
+		fuse_log(FUSE_LOG_DEBUG,
+			"read_async[%llu] %zu bytes from %llu flags: 0x%x\n",
+			(unsigned long long) fi->fh,
+			size, (unsigned long long) off, fi->flags);
+
+	res = fs->op.read_async(path, size, off, fi, async);
+	if (res)
+		free(async);
+	return res;
 }
 
-static struct fuse_dh *get_dirhandle(const struct fuse_file_info *llfi,
-				     struct fuse_file_info *fi)
+static int fuse_fs_write_buf_async(struct fuse *f, fuse_req_t req,
+				   fuse_ino_t ino, char *path,
+				   struct fuse_bufvec *buf, off_t off,
+				   struct fuse_file_info *fi)
 {
-	struct fuse_dh *dh = (struct fuse_dh *) (uintptr_t) llfi->fh;
-	memset(fi, 0, sizeof(struct fuse_file_info));
-	fi->fh = dh->fh;
+	struct fuse_fs *fs = f->fs;
+	fuse_async_t async;
+	int res;
+
+	async = fuse_async_new(f, req, ino, path);
+	if (!async)
+		return -ENOMEM;
+
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->debug)
+		fuse_log(FUSE_LOG_DEBUG,
+			"write_async%s[%llu] %zu bytes to %llu flags: 0x%x\n",
+			fi->writepage ? "page" : "",
+			(unsigned long long) fi->fh,
+			fuse_buf_size(buf), (unsigned long long) off,
+			fi->flags);
+
+	res = fs->op.write_buf_async(path, buf, off, fi, async);
+	if (res)
+		free(async);
+	return res;
+}
+
+/*
+ * Buffered data is written when a write does not continue it, when
+ * the buffer is full, when its handle is flushed, synced or released,
+ * before operations that look at the contents or the size of the
+ * file, and by wbuf_thread() once it is older than
+ * write_coalesce_delay.
+ */
+static void free_write_buf(struct write_buf *wb)
+{
+	struct wbuf_error *we;
+
+	while ((we = wb->errors) != NULL) {
+		wb->errors = we->next;
+		free(we);
+	}
+	pthread_mutex_destroy(&wb->lock);
+	free(wb->mem);
+	free(wb);
+}
+
+static struct write_buf *wbuf_get(struct fuse *f, fuse_ino_t ino)
+{
+	struct write_buf *wb = NULL;
+	struct node_ext *ext;
+	struct node *node;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	ext = node_ext(node);
+	if (ext != NULL)
+		wb = ext->wbuf;
+	if (ext != NULL && wb == NULL) {
+		wb = calloc(1, sizeof(*wb));
+		if (wb != NULL)
+			wb->mem = malloc(f->conf.write_coalesce);
+		if (wb == NULL || wb->mem == NULL) {
+			free(wb);
+			wb = NULL;
+		} else {
+			pthread_mutex_init(&wb->lock, NULL);
+			init_list_head(&wb->dirty);
+			wb->node = node;
+			ext->wbuf = wb;
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return wb;
+}
+
+/* Called with wb->lock held */
+static struct wbuf_error **wbuf_find_error(struct write_buf *wb, uint64_t fh)
+{
+	struct wbuf_error **wep;
+
+	for (wep = &wb->errors; *wep != NULL; wep = &(*wep)->next) {
+		if ((*wep)->fh == fh)
+			break;
+	}
+	return wep;
+}
+
+/* Records an error of the buffered data, called with wb->lock held */
+static void wbuf_set_error(struct write_buf *wb, int err)
+{
+	struct wbuf_error *we = *wbuf_find_error(wb, wb->fi.fh);
+
+	/* Added by wbuf_add() before the handle's data */
+	if (we != NULL && !we->error)
+		we->error = err;
+}
+
+static void *wbuf_thread(void *data);
+
+/* Called with f->lock held */
+static void wbuf_mark_dirty(struct fuse *f, struct write_buf *wb)
+{
+	if (!f->wbuf_started && f->conf.write_coalesce_delay > 0) {
+		if (fuse_start_thread(&f->wbuf_thread, wbuf_thread, f) != 0) {
+			/* Only write out when the buffer has to be */
+			f->conf.write_coalesce_delay = 0;
+		} else {
+			f->wbuf_started = 1;
+		}
+	}
+	if (list_empty(&wb->dirty)) {
+		curr_time(&wb->since);
+		list_add_tail(&wb->dirty, &f->wbuf_dirty);
+		pthread_cond_signal(&f->wbuf_cond);
+	}
+}
+
+/*
+ * Passes the buffered data on to the filesystem. Called with wb->lock
+ * held, path is that of the node.
+ */
+static void wbuf_write(struct fuse *f, struct write_buf *wb, const char *path)
+{
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(wb->len);
+	int res;
+
+	if (wb->len) {
+		bufv.buf[0].mem = wb->mem;
+		res = fuse_fs_write_buf(f->fs, path, &bufv, wb->off, &wb->fi);
+		if (res >= 0 && (size_t) res < wb->len)
+			res = -EIO;
+		if (res < 0)
+			wbuf_set_error(wb, res);
+		wb->len = 0;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	list_del(&wb->dirty);
+	init_list_head(&wb->dirty);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Writes out what is buffered for the node, so that the filesystem
+ * sees the file as the kernel does. With fi, the first delayed write
+ * error of that handle since it was last flushed is returned.
+ */
+static int wbuf_sync(struct fuse *f, fuse_ino_t ino, const char *path,
+		     struct fuse_file_info *fi)
+{
+	struct write_buf *wb;
+	struct node *node;
+	int err = 0;
+
+	if (!f->conf.write_coalesce)
+		return 0;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	wb = node->ext ? node->ext->wbuf : NULL;
+	pthread_mutex_unlock(&f->lock);
+	if (wb == NULL)
+		return 0;
+
+	pthread_mutex_lock(&wb->lock);
+	if (wb->len)
+		wbuf_write(f, wb, path);
+	if (fi) {
+		struct wbuf_error **wep = wbuf_find_error(wb, fi->fh);
+		struct wbuf_error *we = *wep;
+
+		if (we != NULL) {
+			err = we->error;
+			*wep = we->next;
+			free(we);
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return err;
+}
+
+static int wbuf_may_coalesce(struct fuse *f, struct fuse_file_info *fi)
+{
+	return f->conf.write_coalesce && !f->fs->op.write_buf_async &&
+		!(fi->flags & (O_DSYNC | O_DIRECT));
+}
+
+/* Used instead of fuse_fs_write_buf() with write_coalesce */
+static int wbuf_add(struct fuse *f, fuse_ino_t ino, const char *path,
+		    struct fuse_bufvec *buf, off_t off,
+		    struct fuse_file_info *fi)
+{
+	size_t max = f->conf.write_coalesce;
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	struct write_buf *wb;
+	ssize_t res;
+
+	wb = wbuf_get(f, ino);
+	if (wb == NULL)
+		return fuse_fs_write_buf(f->fs, path, buf, off, fi);
+
+	pthread_mutex_lock(&wb->lock);
+	if (wb->len && (wb->fi.fh != fi->fh ||
+			off != wb->off + (off_t) wb->len ||
+			wb->len + size > max))
+		wbuf_write(f, wb, path);
+
+	if (size >= max) {
+		res = fuse_fs_write_buf(f->fs, path, buf, off, fi);
+		goto out;
+	}
+
+	/* Somewhere to keep the error of a delayed write */
+	if (*wbuf_find_error(wb, fi->fh) == NULL) {
+		struct wbuf_error *we = calloc(1, sizeof(*we));
+
+		if (we == NULL) {
+			res = fuse_fs_write_buf(f->fs, path, buf, off, fi);
+			goto out;
+		}
+		we->fh = fi->fh;
+		we->next = wb->errors;
+		wb->errors = we;
+	}
+
+	dst.buf[0].mem = wb->mem + wb->len;
+	res = fuse_buf_copy(&dst, buf, 0);
+	if (res <= 0)
+		goto out;
+
+	if (!wb->len) {
+		wb->fi = *fi;
+		wb->off = off;
+		pthread_mutex_lock(&f->lock);
+		wbuf_mark_dirty(f, wb);
+		pthread_mutex_unlock(&f->lock);
+	}
+	wb->len += res;
+	if (f->fs->debug)
+		fuse_log(FUSE_LOG_DEBUG, "   write[%llu] buffered %zu bytes "
+			 "at %llu\n", (unsigned long long) fi->fh, wb->len,
+			 (unsigned long long) wb->off);
+	if (wb->len == max)
+		wbuf_write(f, wb, path);
+out:
+	pthread_mutex_unlock(&wb->lock);
+	return res;
+}
+
+/* Called with f->lock held, which is dropped meanwhile */
+static void wbuf_write_out(struct fuse *f, struct write_buf *wb)
+{
+	struct node *node = wb->node;
+	char *path;
+	int err;
+
+	list_del(&wb->dirty);
+	init_list_head(&wb->dirty);
+	node->refctr++;
+	pthread_mutex_unlock(&f->lock);
+
+	err = get_path_nullok(f, node->nodeid, &path);
+	pthread_mutex_lock(&wb->lock);
+	if (!err)
+		wbuf_write(f, wb, path);
+	else if (wb->len)
+		wbuf_set_error(wb, err);
+	pthread_mutex_unlock(&wb->lock);
+	if (!err)
+		free_path(f, node->nodeid, path);
+
+	pthread_mutex_lock(&f->lock);
+	unref_node(f, node);
+}
+
+/* Writes out buffers once their data is write_coalesce_delay old */
+static void *wbuf_thread(void *data)
+{
+	struct fuse *f = data;
+
+	fuse_create_context(f);
+	pthread_mutex_lock(&f->lock);
+	while (!f->wbuf_stop) {
+		struct write_buf *wb;
+		struct timespec now;
+		struct timeval tv;
+		double wait;
+
+		if (list_empty(&f->wbuf_dirty)) {
+			pthread_cond_wait(&f->wbuf_cond, &f->lock);
+			continue;
+		}
+
+		wb = list_entry(f->wbuf_dirty.next, struct write_buf, dirty);
+		curr_time(&now);
+		wait = f->conf.write_coalesce_delay -
+			diff_timespec(&now, &wb->since);
+		if (wait > 0) {
+			gettimeofday(&tv, NULL);
+			wait += tv.tv_usec / 1000000.0;
+			now.tv_sec = tv.tv_sec + (time_t) wait;
+			now.tv_nsec = (wait - (time_t) wait) * 1000000000.0;
+			pthread_cond_timedwait(&f->wbuf_cond, &f->lock, &now);
+			continue;
+		}
+		wbuf_write_out(f, wb);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return NULL;
+}
+
+static void wbuf_stop_thread(struct fuse *f)
+{
+	if (f->wbuf_started) {
+		pthread_mutex_lock(&f->lock);
+		f->wbuf_stop = 1;
+		pthread_cond_signal(&f->wbuf_cond);
+		pthread_mutex_unlock(&f->lock);
+		pthread_join(f->wbuf_thread, NULL);
+		f->wbuf_started = 0;
+	}
+
+	/* Files that were never released */
+	pthread_mutex_lock(&f->lock);
+	while (!list_empty(&f->wbuf_dirty))
+		wbuf_write_out(f, list_entry(f->wbuf_dirty.next,
+					     struct write_buf, dirty));
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* Called with f->lock held */
+static void ra_put(struct read_ahead *ra)
+{
+	if (--ra->refctr)
+		return;
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra->mem);
+	free(ra);
+}
+
+static void free_read_ahead(struct read_ahead *ra)
+{
+	struct read_ahead *next;
+
+	for (; ra != NULL; ra = next) {
+		next = ra->node_next;
+		ra->refctr = 1;
+		ra_put(ra);
+	}
+}
+
+/*
+ * The window of the handle, allocated on its first read. Handles
+ * without a file handle of their own share a window, which one of
+ * them may release while another reads from it, so the caller gets a
+ * reference that it drops with ra_put().
+ */
+static struct read_ahead *ra_get(struct fuse *f, fuse_ino_t ino,
+				 struct fuse_file_info *fi)
+{
+	struct read_ahead *ra = NULL;
+	struct node_ext *ext;
+	struct node *node;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	ext = node_ext(node);
+	if (ext == NULL)
+		goto out;
+	for (ra = ext->ra; ra != NULL; ra = ra->node_next) {
+		if (ra->fi.fh == fi->fh)
+			break;
+	}
+	if (ra != NULL) {
+		ra->refctr++;
+	} else {
+		ra = calloc(1, sizeof(*ra));
+		if (ra != NULL)
+			ra->mem = malloc(f->conf.readahead);
+		if (ra == NULL || ra->mem == NULL) {
+			free(ra);
+			ra = NULL;
+		} else {
+			pthread_mutex_init(&ra->lock, NULL);
+			pthread_cond_init(&ra->cond, NULL);
+			init_list_head(&ra->queued);
+			ra->node = node;
+			ra->fi = *fi;
+			ra->gen = ext->ra_gen;
+			/* One for the node's list, one for the caller */
+			ra->refctr = 2;
+			ra->node_next = ext->ra;
+			ext->ra = ra;
+		}
+	}
+out:
+	pthread_mutex_unlock(&f->lock);
+
+	return ra;
+}
+
+/*
+ * The contents of the node changed, drop what was read ahead. Called
+ * after the change, so that prefetches that may have missed it are
+ * dropped as well.
+ */
+static void ra_invalidate(struct fuse *f, fuse_ino_t ino)
+{
+	struct node *node;
+
+	if (!f->conf.readahead)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	if (node->ext && node->ext->ra)
+		__atomic_add_fetch(&node->ext->ra_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* Called with ra->lock held */
+static void ra_check_gen(struct read_ahead *ra)
+{
+	unsigned int gen = __atomic_load_n(&ra->node->ext->ra_gen,
+					   __ATOMIC_ACQUIRE);
+
+	if (ra->gen != gen) {
+		ra->gen = gen;
+		ra->len = 0;
+		ra->eof = 0;
+		ra->seq = 0;
+	}
+}
+
+/* The handle is going away, stop reading through it */
+static void ra_release(struct fuse *f, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	struct read_ahead *ra, **rap;
+	struct node *node;
+
+	if (!f->conf.readahead)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	ra = NULL;
+	if (node->ext) {
+		for (rap = &node->ext->ra; (ra = *rap) != NULL;
+		     rap = &ra->node_next) {
+			if (ra->fi.fh == fi->fh) {
+				*rap = ra->node_next;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+	if (ra == NULL)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	while (ra->busy)
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	ra->released = 1;
+	pthread_mutex_unlock(&ra->lock);
+
+	pthread_mutex_lock(&f->lock);
+	ra_put(ra);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void *ra_thread(void *data);
+
+/* Called with ra->lock held */
+static void ra_queue(struct fuse *f, struct read_ahead *ra)
+{
+	pthread_mutex_lock(&f->lock);
+	while (f->ra_started < f->conf.readahead_threads) {
+		if (fuse_start_thread(&f->ra_threads[f->ra_started],
+				      ra_thread, f) != 0)
+			break;
+		f->ra_started++;
+	}
+	if (f->ra_started && list_empty(&ra->queued)) {
+		ra->refctr++;
+		ra->node->refctr++;
+		list_add_tail(&ra->queued, &f->ra_queue);
+		pthread_cond_signal(&f->ra_cond);
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* Reads ahead of ra->next, until the window is full */
+static void ra_fill(struct fuse *f, struct read_ahead *ra)
+{
+	fuse_ino_t ino = ra->node->nodeid;
+	size_t start, done = 0;
+	unsigned int gen;
+	int eof = 0;
+	off_t off;
+	char *path;
+	int res;
+
+	pthread_mutex_lock(&ra->lock);
+	ra_check_gen(ra);
+	gen = ra->gen;
+	if (ra->released || ra->busy || ra->eof) {
+		pthread_mutex_unlock(&ra->lock);
+		return;
+	}
+	/* Keep what has not been read yet */
+	if (ra->next >= ra->off && ra->next <= ra->off + (off_t) ra->len) {
+		start = ra->next - ra->off;
+		memmove(ra->mem, ra->mem + start, ra->len - start);
+		ra->len -= start;
+	} else {
+		ra->len = 0;
+	}
+	ra->off = ra->next;
+	start = ra->len;
+	off = ra->off + start;
+	ra->busy = 1;
+	pthread_mutex_unlock(&ra->lock);
+
+	/* Only the prefetch touches the window beyond len */
+	if (get_path_nullok(f, ino, &path) == 0) {
+		wbuf_sync(f, ino, path, NULL);
+		while (start + done < f->conf.readahead) {
+			res = fuse_fs_read(f->fs, path, ra->mem + start + done,
+					   f->conf.readahead - start - done,
+					   off + done, &ra->fi);
+			if (res <= 0) {
+				eof = res == 0;
+				break;
+			}
+			done += res;
+		}
+		free_path(f, ino, path);
+	}
+
+	pthread_mutex_lock(&ra->lock);
+	ra->busy = 0;
+	ra_check_gen(ra);
+	/* Unless the file changed meanwhile */
+	if (ra->gen == gen) {
+		ra->len = start + done;
+		ra->eof = eof;
+	}
+	__atomic_add_fetch(&f->ra_bytes, done, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+static void *ra_thread(void *data)
+{
+	struct fuse *f = data;
+
+	fuse_create_context(f);
+	pthread_mutex_lock(&f->lock);
+	while (1) {
+		struct read_ahead *ra;
+		struct node *node;
+
+		while (list_empty(&f->ra_queue) && !f->ra_stop)
+			pthread_cond_wait(&f->ra_cond, &f->lock);
+		if (f->ra_stop)
+			break;
+
+		ra = list_entry(f->ra_queue.next, struct read_ahead, queued);
+		list_del(&ra->queued);
+		init_list_head(&ra->queued);
+		node = ra->node;
+		pthread_mutex_unlock(&f->lock);
+
+		ra_fill(f, ra);
+
+		pthread_mutex_lock(&f->lock);
+		ra_put(ra);
+		unref_node(f, node);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return NULL;
+}
+
+static void ra_stop_threads(struct fuse *f)
+{
+	struct read_ahead *ra;
+	unsigned int i;
+
+	pthread_mutex_lock(&f->lock);
+	f->ra_stop = 1;
+	pthread_cond_broadcast(&f->ra_cond);
+	pthread_mutex_unlock(&f->lock);
+	for (i = 0; i < f->ra_started; i++)
+		pthread_join(f->ra_threads[i], NULL);
+	f->ra_started = 0;
+
+	pthread_mutex_lock(&f->lock);
+	while (!list_empty(&f->ra_queue)) {
+		struct node *node;
+
+		ra = list_entry(f->ra_queue.next, struct read_ahead, queued);
+		list_del(&ra->queued);
+		init_list_head(&ra->queued);
+		node = ra->node;
+		ra_put(ra);
+		unref_node(f, node);
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+static int ra_may_read(struct fuse *f, struct fuse_file_info *fi)
+{
+	return f->conf.readahead && !f->fs->op.read_async &&
+		!f->fs->op.write_buf_async && !(fi->flags & O_DIRECT);
+}
+
+/*
+ * Serves the read from the window if it holds the data, and queues
+ * a prefetch if the reads are sequential. Returns a negative value if
+ * the read has to go to the filesystem.
+ */
+static int ra_read(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+		   size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct read_ahead *ra;
+	off_t end;
+	int res = -1;
+
+	ra = ra_get(f, ino, fi);
+	if (ra == NULL)
+		return -1;
+
+	pthread_mutex_lock(&ra->lock);
+	/* Wait for the prefetch that reads this */
+	while (ra->busy && off >= ra->off + (off_t) ra->len &&
+	       off < ra->off + (off_t) f->conf.readahead)
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	ra_check_gen(ra);
+
+	end = ra->off + ra->len;
+	if (ra->len && off >= ra->off &&
+	    (off + (off_t) size <= end || (ra->eof && off <= end))) {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(0);
+
+		if (off + (off_t) size > end)
+			size = end - off;
+		bufv.buf[0].mem = ra->mem + (off - ra->off);
+		bufv.buf[0].size = size;
+		fuse_reply_data(req, &bufv, 0);
+		__atomic_add_fetch(&f->ra_hits, 1, __ATOMIC_RELAXED);
+		res = 0;
+	} else {
+		__atomic_add_fetch(&f->ra_misses, 1, __ATOMIC_RELAXED);
+	}
+
+	if (off == ra->next || res == 0)
+		ra->seq++;
+	else
+		ra->seq = 0;
+	if (off + (off_t) size > ra->next)
+		ra->next = off + size;
+
+	/* Start reading ahead once half of the window is used up */
+	if (ra->seq >= 2 && !ra->busy && !(ra->eof && res == 0) &&
+	    ra->off + (off_t) ra->len - ra->next <
+	    (off_t) f->conf.readahead / 2) {
+		ra->eof = 0;
+		ra_queue(f, ra);
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	pthread_mutex_lock(&f->lock);
+	ra_put(ra);
+	pthread_mutex_unlock(&f->lock);
+
+	return res;
+}
+
+static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			  off_t off, struct fuse_file_info *fi)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	struct fuse_bufvec *buf = NULL;
+	char *path;
+	int res;
+
+	res = get_path_nullok(f, ino, &path);
+	if (res == 0)
+		wbuf_sync(f, ino, path, NULL);
+	if (res == 0 && ra_may_read(f, fi) &&
+	    ra_read(f, req, ino, size, off, fi) == 0) {
+		free_path(f, ino, path);
+		return;
+	}
+	if (res == 0 && f->fs->op.read_async) {
+		res = fuse_fs_read_async(f, req, ino, path, size, off, fi);
+		if (res == 0)
+			return;
+		free_path(f, ino, path);
+	} else if (res == 0) {
+		struct fuse_intr_data d;
+
+		fuse_prepare_interrupt(f, req, &d);
+		res = fuse_fs_read_buf(f->fs, path, &buf, size, off, fi);
+		fuse_finish_interrupt(f, req, &d);
+		free_path(f, ino, path);
+	}
+
+	if (res == 0)
+		fuse_reply_data(req, buf, FUSE_BUF_SPLICE_MOVE);
+	else
+		reply_err(req, res);
+
+	fuse_free_buf(buf);
+}
+
+static void fuse_lib_write_buf(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_bufvec *buf, off_t off,
+			       struct fuse_file_info *fi)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	char *path;
+	int res;
+
+	res = get_path_nullok(f, ino, &path);
+	if (res == 0 && f->fs->op.write_buf_async) {
+		res = fuse_fs_write_buf_async(f, req, ino, path, buf, off, fi);
+		if (res == 0)
+			return;
+		free_path(f, ino, path);
+	} else if (res == 0) {
+		struct fuse_intr_data d;
+
+		fuse_prepare_interrupt(f, req, &d);
+		if (wbuf_may_coalesce(f, fi))
+			res = wbuf_add(f, ino, path, buf, off, fi);
+		else
+			res = fuse_fs_write_buf(f->fs, path, buf, off, fi);
+		ra_invalidate(f, ino);
+		attr_invalidate(f, ino);
+		fuse_finish_interrupt(f, req, &d);
+		free_path(f, ino, path);
+	}
+
+	if (res >= 0)
+		fuse_reply_write(req, res);
+	else
+		reply_err(req, res);
+}
+
+static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			   struct fuse_file_info *fi)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	char *path;
+	int err;
+	int res;
+
+	err = get_path_nullok(f, ino, &path);
+	if (!err) {
+		struct fuse_intr_data d;
+
+		fuse_prepare_interrupt(f, req, &d);
+		/* A delayed write error is reported in preference */
+		err = wbuf_sync(f, ino, path, fi);
+		res = fuse_fs_fsync(f->fs, path, datasync, fi);
+		if (!err)
+			err = res;
+		fuse_finish_interrupt(f, req, &d);
+		free_path(f, ino, path);
+	}
+	reply_err(req, err);
+}
+
+static struct fuse_dh *get_dirhandle(const struct fuse_file_info *llfi,
+				     struct fuse_file_info *fi)
+{
+	struct fuse_dh *dh = (struct fuse_dh *) (uintptr_t) llfi->fh;
+	memset(fi, 0, sizeof(struct fuse_file_info));
+	fi->fh = dh->fh;
 	return dh;
 }
 
@@ -3386,7 +5603,7 @@ static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
 	memset(dh, 0, sizeof(struct fuse_dh));
 	dh->fuse = f;
 	dh->contents = NULL;
-	dh->first = NULL;
+	dh->listing = NULL;
 	dh->len = 0;
 	dh->filled = 0;
 	dh->nodeid = ino;
@@ -3445,28 +5662,65 @@ static int extend_contents(struct fuse_dh *dh, unsigned minsize)
 	return 0;
 }
 
-static int fuse_add_direntry_to_dh(struct fuse_dh *dh, const char *name,
-				   struct stat *st)
+static int listing_add(struct dir_listing *l, const char *name,
+		       const struct stat *st)
 {
-	struct fuse_direntry *de;
+	struct dir_listing_entry *ent;
+	size_t namelen = strlen(name);
+	size_t entlen = DIR_LISTING_ALIGN(sizeof(*ent) + namelen + 1);
 
-	de = malloc(sizeof(struct fuse_direntry));
-	if (!de) {
-		dh->error = -ENOMEM;
+	if (namelen > UINT16_MAX)
 		return -1;
+
+	if (l->len + entlen > l->bufsize) {
+		size_t newsize = l->bufsize ? l->bufsize * 2 : 4096;
+		char *newbuf;
+
+		while (newsize < l->len + entlen)
+			newsize *= 2;
+		newbuf = realloc(l->buf, newsize);
+		if (!newbuf)
+			return -1;
+		l->buf = newbuf;
+		l->bufsize = newsize;
 	}
-	de->name = strdup(name);
-	if (!de->name) {
-		dh->error = -ENOMEM;
-		free(de);
-		return -1;
+	if (l->count == l->index_size) {
+		size_t newsize = l->index_size ? l->index_size * 2 : 64;
+		size_t *newindex;
+
+		newindex = realloc(l->index, newsize * sizeof(size_t));
+		if (!newindex)
+			return -1;
+		l->index = newindex;
+		l->index_size = newsize;
 	}
-	de->stat = *st;
-	de->next = NULL;
 
-	*dh->last = de;
-	dh->last = &de->next;
+	ent = (struct dir_listing_entry *) (l->buf + l->len);
+	ent->ino = st->st_ino;
+	ent->mode = st->st_mode;
+	ent->namelen = namelen;
+	memcpy(ent->name, name, namelen + 1);
+	l->index[l->count++] = l->len;
+	l->len += entlen;
+
+	return 0;
+}
 
+static int fuse_add_direntry_to_dh(struct fuse_dh *dh, const char *name,
+				   struct stat *st)
+{
+	if (!dh->listing) {
+		dh->listing = calloc(1, sizeof(struct dir_listing));
+		if (!dh->listing) {
+			dh->error = -ENOMEM;
+			return -1;
+		}
+		dh->listing->refctr = 1;
+	}
+	if (listing_add(dh->listing, name, st) == -1) {
+		dh->error = -ENOMEM;
+		return -1;
+	}
 	return 0;
 }
 
@@ -3505,7 +5759,8 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 
 	if (!dh->fuse->conf.use_ino) {
 		stbuf.st_ino = FUSE_UNKNOWN_INO;
-		if (dh->fuse->conf.readdir_ino) {
+		/* Listed entries are looked up when they are sent */
+		if (dh->fuse->conf.readdir_ino && off) {
 			stbuf.st_ino = (ino_t)
 				lookup_nodeid(dh->fuse, dh->nodeid, name);
 		}
@@ -3519,7 +5774,7 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 			return 1;
 		}
 
-		if (dh->first) {
+		if (dh->listing) {
 			dh->error = -EIO;
 			return 1;
 		}
@@ -3570,7 +5825,8 @@ static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 		e.attr = *statp;
 
 		if (!is_dot_or_dotdot(name)) {
-			res = do_lookup(f, dh->nodeid, name, &e);
+			res = do_lookup(f, dh->nodeid, name, &e,
+					dh->attr_gen);
 			if (res) {
 				dh->error = res;
 				return 1;
@@ -3583,7 +5839,7 @@ static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 			if (f->conf.use_ino)
 				e.attr.st_ino = statp->st_ino;
 		}
-		if (!f->conf.use_ino && f->conf.readdir_ino) {
+		if (!f->conf.use_ino && f->conf.readdir_ino && off) {
 			e.attr.st_ino = (ino_t)
 				lookup_nodeid(f, dh->nodeid, name);
 		}
@@ -3597,7 +5853,7 @@ static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 			return 1;
 		}
 
-		if (dh->first) {
+		if (dh->listing) {
 			dh->error = -EIO;
 			return 1;
 		}
@@ -3621,13 +5877,13 @@ static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 	return 0;
 }
 
-static void free_direntries(struct fuse_direntry *de)
+static void put_dh_listing(struct fuse_dh *dh)
 {
-	while (de) {
-		struct fuse_direntry *next = de->next;
-		free(de->name);
-		free(de);
-		de = next;
+	if (dh->listing) {
+		pthread_mutex_lock(&dh->fuse->lock);
+		put_listing(dh->listing);
+		pthread_mutex_unlock(&dh->fuse->lock);
+		dh->listing = NULL;
 	}
 }
 
@@ -3650,67 +5906,166 @@ static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
 		if (flags & FUSE_READDIR_PLUS)
 			filler = fill_dir_plus;
 
-		free_direntries(dh->first);
-		dh->first = NULL;
-		dh->last = &dh->first;
+		put_dh_listing(dh);
 		dh->len = 0;
 		dh->error = 0;
 		dh->needlen = size;
 		dh->filled = 0;
 		dh->req = req;
+		dh->attr_gen = attr_cache_gen(f);
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_readdir(f->fs, path, dh, filler, off, fi, flags);
 		fuse_finish_interrupt(f, req, &d);
 		dh->req = NULL;
 		if (!err)
-			err = dh->error;
-		if (err)
-			dh->filled = 0;
-		free_path(f, ino, path);
+			err = dh->error;
+		if (err) {
+			dh->filled = 0;
+			put_dh_listing(dh);
+		}
+		free_path(f, ino, path);
+	}
+	return err;
+}
+
+/*
+ * Get the cached listing of a directory, validated the same way as
+ * the page cache with auto_cache: if the attributes are older than
+ * ac_attr_timeout they are fetched again, and the listing is dropped
+ * if the modification time or size of the directory has changed.
+ *
+ * Returns 0 if a listing read now may be cached. The attributes to
+ * check it against later are stored in *stamp.
+ */
+static int dircache_lookup(struct fuse *f, fuse_ino_t ino,
+			   struct dir_listing **listingp,
+			   struct dir_listing *stamp, unsigned int *genp)
+{
+	struct node_ext *ext;
+	struct node *node;
+	struct timespec now;
+	struct stat stbuf;
+	char *path;
+	int err = 0;
+
+	*listingp = NULL;
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	curr_time(&now);
+	if (diff_timespec(&now, &node->stat_updated) >
+	    f->conf.ac_attr_timeout) {
+		pthread_mutex_unlock(&f->lock);
+		err = get_path(f, ino, &path);
+		if (!err) {
+			err = fuse_fs_getattr(f->fs, path, &stbuf, NULL);
+			free_path(f, ino, path);
+		}
+		pthread_mutex_lock(&f->lock);
+		if (!err)
+			update_stat(node, &stbuf);
 	}
+	ext = node_ext(node);
+	if (!err && ext == NULL)
+		err = -ENOMEM;
+	if (err) {
+		drop_dircache(node);
+	} else if (ext->dircache &&
+		   (ext->dircache->mtime.tv_sec != node->mtime.tv_sec ||
+		    ext->dircache->mtime.tv_nsec != node->mtime.tv_nsec ||
+		    ext->dircache->size != node->size)) {
+		drop_dircache(node);
+	} else if (ext->dircache) {
+		ext->dircache->refctr++;
+		*listingp = ext->dircache;
+	}
+	stamp->mtime = node->mtime;
+	stamp->size = node->size;
+	*genp = ext ? ext->dircache_gen : 0;
+	pthread_mutex_unlock(&f->lock);
+
 	return err;
 }
 
-static int readdir_fill_from_list(fuse_req_t req, struct fuse_dh *dh,
-				  off_t off, enum fuse_readdir_flags flags)
+/*
+ * Keep the listing just read unless the directory was changed through
+ * this filesystem in the meantime
+ */
+static void dircache_store(struct fuse *f, fuse_ino_t ino, struct fuse_dh *dh,
+			   const struct dir_listing *stamp, unsigned int gen)
+{
+	struct dir_listing *l = dh->listing;
+	struct node *node;
+
+	l->mtime = stamp->mtime;
+	l->size = stamp->size;
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	/* Allocated by dircache_lookup(), which gave out the gen */
+	if (node->ext && node->ext->dircache_gen == gen) {
+		drop_dircache(node);
+		l->refctr++;
+		node->ext->dircache = l;
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* Entries of a listing that are packed at once */
+#define READDIR_BATCH 64
+
+static int readdir_fill_from_listing(fuse_req_t req, struct fuse_dh *dh,
+				     off_t off, enum fuse_readdir_flags flags)
 {
-	off_t pos;
-	struct fuse_direntry *de = dh->first;
+	struct fuse *f = dh->fuse;
+	struct dir_listing *l = dh->listing;
+	struct fuse_direntry ents[READDIR_BATCH];
+	struct fuse_entry_param e[READDIR_BATCH];
+	int plus = flags & FUSE_READDIR_PLUS;
+	size_t pos = off;
+	size_t i, n, added, used;
 
 	dh->len = 0;
 
 	if (extend_contents(dh, dh->needlen) == -1)
 		return dh->error;
 
-	for (pos = 0; pos < off; pos++) {
-		if (!de)
-			break;
-
-		de = de->next;
-	}
-	while (de) {
-		char *p = dh->contents + dh->len;
-		unsigned rem = dh->needlen - dh->len;
-		unsigned thislen;
-		unsigned newlen;
-		pos++;
-
-		if (flags & FUSE_READDIR_PLUS) {
-			struct fuse_entry_param e = {
-				.ino = 0,
-				.attr = de->stat,
-			};
-			thislen = fuse_add_direntry_plus(req, p, rem,
-							 de->name, &e, pos);
-		} else {
-			thislen = fuse_add_direntry(req, p, rem,
-						    de->name, &de->stat, pos);
+	while (pos < l->count) {
+		n = l->count - pos;
+		if (n > READDIR_BATCH)
+			n = READDIR_BATCH;
+		for (i = 0; i < n; i++) {
+			struct dir_listing_entry *ent;
+
+			ent = (struct dir_listing_entry *)
+				(l->buf + l->index[pos + i]);
+			ents[i].name = ent->name;
+			ents[i].namelen = ent->namelen;
+			ents[i].ino = ent->ino;
+			ents[i].mode = ent->mode;
+			ents[i].off = pos + i + 1;
+			/* Inode numbers of the node table are not stable */
+			if (!f->conf.use_ino && f->conf.readdir_ino)
+				ents[i].ino = (ino_t) lookup_nodeid(f,
+						dh->nodeid, ent->name);
+			if (plus) {
+				memset(&e[i], 0, sizeof(e[i]));
+				e[i].attr.st_ino = ents[i].ino;
+				e[i].attr.st_mode = ents[i].mode;
+			}
 		}
-		newlen = dh->len + thislen;
-		if (newlen > dh->needlen)
+
+		if (plus)
+			added = fuse_add_direntries_plus(req,
+					dh->contents + dh->len,
+					dh->needlen - dh->len, ents, e, n,
+					&used);
+		else
+			added = fuse_add_direntries(req,
+					dh->contents + dh->len,
+					dh->needlen - dh->len, ents, n, &used);
+		dh->len += used;
+		pos += added;
+		if (added < n)
 			break;
-		dh->len = newlen;
-		de = de->next;
 	}
 	return 0;
 }
@@ -3722,13 +6077,23 @@ static void fuse_readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
 	struct fuse *f = req_fuse_prepare(req);
 	struct fuse_file_info fi;
 	struct fuse_dh *dh = get_dirhandle(llfi, &fi);
+	struct dir_listing stamp = { 0 };
+	unsigned int gen = 0;
+	int cacheable = 0;
 	int err;
 
 	pthread_mutex_lock(&dh->lock);
 	/* According to SUS, directory contents need to be refreshed on
 	   rewinddir() */
-	if (!off)
+	if (!off) {
 		dh->filled = 0;
+		put_dh_listing(dh);
+		if (f->conf.readdir_cache) {
+			cacheable = !dircache_lookup(f, ino, &dh->listing,
+						     &stamp, &gen);
+			dh->filled = dh->listing != NULL;
+		}
+	}
 
 	if (!dh->filled) {
 		err = readdir_fill(f, req, ino, size, off, dh, &fi, flags);
@@ -3736,10 +6101,12 @@ static void fuse_readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
 			reply_err(req, err);
 			goto out;
 		}
+		if (dh->filled && cacheable)
+			dircache_store(f, ino, dh, &stamp, gen);
 	}
 	if (dh->filled) {
 		dh->needlen = size;
-		err = readdir_fill_from_list(req, dh, off, flags);
+		err = readdir_fill_from_listing(req, dh, off, flags);
 		if (err) {
 			reply_err(req, err);
 			goto out;
@@ -3781,7 +6148,7 @@ static void fuse_lib_releasedir(fuse_req_t req, fuse_ino_t ino,
 	pthread_mutex_lock(&dh->lock);
 	pthread_mutex_unlock(&dh->lock);
 	pthread_mutex_destroy(&dh->lock);
-	free_direntries(dh->first);
+	put_dh_listing(dh);
 	free(dh->contents);
 	free(dh);
 	reply_err(req, 0);
@@ -3845,6 +6212,8 @@ static void fuse_lib_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		struct fuse_intr_data d;
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_setxattr(f->fs, path, name, value, size, flags);
+		if (!err)
+			attr_invalidate(f, ino);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
 	}
@@ -3950,43 +6319,232 @@ static void fuse_lib_removexattr(fuse_req_t req, fuse_ino_t ino,
 		struct fuse_intr_data d;
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_removexattr(f->fs, path, name);
+		if (!err)
+			attr_invalidate(f, ino);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
 	}
 	reply_err(req, err);
 }
 
-static struct lock *locks_conflict(struct node *node, const struct lock *lock)
+static int lock_height(int t, const struct lock *l)
 {
-	struct lock *l;
+	return l ? l->height[t] : 0;
+}
 
-	for (l = node->locks; l; l = l->next)
-		if (l->owner != lock->owner &&
-		    lock->start <= l->end && l->start <= lock->end &&
-		    (l->type == F_WRLCK || lock->type == F_WRLCK))
-			break;
+/* Recomputes the height, and the end offsets kept in the range tree */
+static void lock_update(int t, struct lock *l)
+{
+	int hl = lock_height(t, l->left[t]);
+	int hr = lock_height(t, l->right[t]);
+	struct lock *c[2] = { l->left[t], l->right[t] };
+	int i;
+
+	l->height[t] = (hl > hr ? hl : hr) + 1;
+	if (t != LOCK_BY_RANGE)
+		return;
+
+	l->max_end = l->end;
+	l->wr_max_end = l->type == F_WRLCK ? l->end : -1;
+	for (i = 0; i < 2; i++) {
+		if (c[i] && c[i]->max_end > l->max_end)
+			l->max_end = c[i]->max_end;
+		if (c[i] && c[i]->wr_max_end > l->wr_max_end)
+			l->wr_max_end = c[i]->wr_max_end;
+	}
+}
 
+static struct lock *lock_rotate_right(int t, struct lock *l)
+{
+	struct lock *left = l->left[t];
+
+	l->left[t] = left->right[t];
+	left->right[t] = l;
+	lock_update(t, l);
+	lock_update(t, left);
+	return left;
+}
+
+static struct lock *lock_rotate_left(int t, struct lock *l)
+{
+	struct lock *right = l->right[t];
+
+	l->right[t] = right->left[t];
+	right->left[t] = l;
+	lock_update(t, l);
+	lock_update(t, right);
+	return right;
+}
+
+static struct lock *lock_balance(int t, struct lock *l)
+{
+	int diff = lock_height(t, l->left[t]) - lock_height(t, l->right[t]);
+
+	if (diff > 1) {
+		struct lock *left = l->left[t];
+
+		if (lock_height(t, left->left[t]) <
+		    lock_height(t, left->right[t]))
+			l->left[t] = lock_rotate_left(t, left);
+		return lock_rotate_right(t, l);
+	}
+	if (diff < -1) {
+		struct lock *right = l->right[t];
+
+		if (lock_height(t, right->right[t]) <
+		    lock_height(t, right->left[t]))
+			l->right[t] = lock_rotate_right(t, right);
+		return lock_rotate_left(t, l);
+	}
+	lock_update(t, l);
 	return l;
 }
 
-static void delete_lock(struct lock **lockp)
+/* Ties are broken by address, so that every lock has its own place */
+static int lock_before(int t, const struct lock *a, const struct lock *b)
 {
-	struct lock *l = *lockp;
-	*lockp = l->next;
-	free(l);
+	if (t == LOCK_BY_OWNER && a->owner != b->owner)
+		return a->owner < b->owner;
+	if (a->start != b->start)
+		return a->start < b->start;
+	return (uintptr_t) a < (uintptr_t) b;
+}
+
+static struct lock *lock_tree_insert(int t, struct lock *root,
+				     struct lock *lock)
+{
+	if (!root) {
+		lock->left[t] = lock->right[t] = NULL;
+		lock_update(t, lock);
+		return lock;
+	}
+	if (lock_before(t, lock, root))
+		root->left[t] = lock_tree_insert(t, root->left[t], lock);
+	else
+		root->right[t] = lock_tree_insert(t, root->right[t], lock);
+
+	return lock_balance(t, root);
+}
+
+static struct lock *lock_tree_remove_min(int t, struct lock *root,
+					 struct lock **min)
+{
+	if (!root->left[t]) {
+		*min = root;
+		return root->right[t];
+	}
+	root->left[t] = lock_tree_remove_min(t, root->left[t], min);
+
+	return lock_balance(t, root);
+}
+
+/* lock must be in the tree */
+static struct lock *lock_tree_remove(int t, struct lock *root,
+				     struct lock *lock)
+{
+	if (root == lock) {
+		struct lock *min;
+
+		if (!root->right[t])
+			return root->left[t];
+		root->right[t] = lock_tree_remove_min(t, root->right[t], &min);
+		min->left[t] = root->left[t];
+		min->right[t] = root->right[t];
+		return lock_balance(t, min);
+	}
+	if (lock_before(t, lock, root))
+		root->left[t] = lock_tree_remove(t, root->left[t], lock);
+	else
+		root->right[t] = lock_tree_remove(t, root->right[t], lock);
+
+	return lock_balance(t, root);
+}
+
+static void lock_link(struct lock_table *lt, struct lock *lock)
+{
+	int t;
+
+	for (t = 0; t < LOCK_TREES; t++)
+		lt->root[t] = lock_tree_insert(t, lt->root[t], lock);
+}
+
+static void lock_unlink(struct lock_table *lt, struct lock *lock)
+{
+	int t;
+
+	for (t = 0; t < LOCK_TREES; t++)
+		lt->root[t] = lock_tree_remove(t, lt->root[t], lock);
+}
+
+static void free_lock_tree(struct lock *l)
+{
+	while (l) {
+		struct lock *right = l->right[LOCK_BY_RANGE];
+
+		free_lock_tree(l->left[LOCK_BY_RANGE]);
+		free(l);
+		l = right;
+	}
+}
+
+static void free_lock_table(struct lock_table *lt)
+{
+	free_lock_tree(lt->root[LOCK_BY_RANGE]);
+	pthread_mutex_destroy(&lt->lock);
+	free(lt);
+}
+
+/* Only write locks can conflict with a read lock, or with F_UNLCK */
+static struct lock *locks_conflict(struct lock *l, const struct lock *lock)
+{
+	while (l) {
+		struct lock *res;
+		off_t max_end = lock->type == F_WRLCK ?
+			l->max_end : l->wr_max_end;
+
+		if (max_end < lock->start)
+			break;
+		res = locks_conflict(l->left[LOCK_BY_RANGE], lock);
+		if (res)
+			return res;
+		if (lock->end < l->start)
+			break;
+		if (l->owner != lock->owner && lock->start <= l->end &&
+		    (l->type == F_WRLCK || lock->type == F_WRLCK))
+			return l;
+		l = l->right[LOCK_BY_RANGE];
+	}
+	return NULL;
 }
 
-static void insert_lock(struct lock **pos, struct lock *lock)
+/* Appends the locks of the owner that overlap [start, end], in order */
+static void locks_collect(struct lock *l, uint64_t owner, off_t start,
+			  off_t end, struct lock ***tailp)
 {
-	lock->next = *pos;
-	*pos = lock;
+	while (l) {
+		if (l->owner < owner ||
+		    (l->owner == owner && l->end < start)) {
+			l = l->right[LOCK_BY_OWNER];
+		} else if (l->owner > owner || end < l->start) {
+			l = l->left[LOCK_BY_OWNER];
+		} else {
+			locks_collect(l->left[LOCK_BY_OWNER], owner, start,
+				      end, tailp);
+			**tailp = l;
+			*tailp = &l->next;
+			l = l->right[LOCK_BY_OWNER];
+		}
+	}
 }
 
-static int locks_insert(struct node *node, struct lock *lock)
+static int locks_insert(struct lock_table *lt, struct lock *lock)
 {
-	struct lock **lp;
 	struct lock *newl1 = NULL;
 	struct lock *newl2 = NULL;
+	struct lock *list = NULL;
+	struct lock **tail = &list;
+	struct lock *l;
+	struct lock *next;
 
 	if (lock->type != F_UNLCK || lock->start != 0 ||
 	    lock->end != OFFSET_MAX) {
@@ -4000,54 +6558,50 @@ static int locks_insert(struct node *node, struct lock *lock)
 		}
 	}
 
-	for (lp = &node->locks; *lp;) {
-		struct lock *l = *lp;
-		if (l->owner != lock->owner)
-			goto skip;
+	/* Locks of the same type are merged with adjacent ones too */
+	locks_collect(lt->root[LOCK_BY_OWNER], lock->owner,
+		      lock->start ? lock->start - 1 : 0,
+		      lock->end != OFFSET_MAX ? lock->end + 1 : OFFSET_MAX,
+		      &tail);
+	*tail = NULL;
+
+	for (l = list; l; l = l->next)
+		if (l->type == lock->type &&
+		    l->start <= lock->start && lock->end <= l->end)
+			goto out;
 
+	for (l = list; l; l = next) {
+		next = l->next;
+		lock_unlink(lt, l);
 		if (lock->type == l->type) {
-			if (l->end < lock->start - 1)
-				goto skip;
-			if (lock->end < l->start - 1)
-				break;
-			if (l->start <= lock->start && lock->end <= l->end)
-				goto out;
 			if (l->start < lock->start)
 				lock->start = l->start;
 			if (lock->end < l->end)
 				lock->end = l->end;
-			goto delete;
+			free(l);
+			continue;
+		}
+		if (l->end < lock->start || lock->end < l->start) {
+			/* Only adjacent */
+		} else if (lock->start <= l->start && l->end <= lock->end) {
+			free(l);
+			continue;
+		} else if (l->end <= lock->end) {
+			l->end = lock->start - 1;
+		} else if (lock->start <= l->start) {
+			l->start = lock->end + 1;
 		} else {
-			if (l->end < lock->start)
-				goto skip;
-			if (lock->end < l->start)
-				break;
-			if (lock->start <= l->start && l->end <= lock->end)
-				goto delete;
-			if (l->end <= lock->end) {
-				l->end = lock->start - 1;
-				goto skip;
-			}
-			if (lock->start <= l->start) {
-				l->start = lock->end + 1;
-				break;
-			}
 			*newl2 = *l;
 			newl2->start = lock->end + 1;
 			l->end = lock->start - 1;
-			insert_lock(&l->next, newl2);
+			lock_link(lt, newl2);
 			newl2 = NULL;
 		}
-	skip:
-		lp = &l->next;
-		continue;
-
-	delete:
-		delete_lock(lp);
+		lock_link(lt, l);
 	}
 	if (lock->type != F_UNLCK) {
 		*newl1 = *lock;
-		insert_lock(lp, newl1);
+		lock_link(lt, newl1);
 		newl1 = NULL;
 	}
 out:
@@ -4056,6 +6610,45 @@ out:
 	return 0;
 }
 
+/* Returns the lock table of the node, allocating it if create is set */
+static struct lock_table *get_lock_table(struct fuse *f, fuse_ino_t ino,
+					 int create)
+{
+	struct node *node;
+	struct lock_table *lt;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	lt = node->locks;
+	if (!lt && create) {
+		lt = calloc(1, sizeof(struct lock_table));
+		if (lt) {
+			pthread_mutex_init(&lt->lock, NULL);
+			node->locks = lt;
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return lt;
+}
+
+/*
+ * The request has the file open, so the node and its lock table stay
+ * around after f->lock is dropped
+ */
+static void node_locks_insert(struct fuse *f, fuse_ino_t ino,
+			      struct lock *lock)
+{
+	struct lock_table *lt = get_lock_table(f, ino,
+					       lock->type != F_UNLCK);
+
+	if (lt) {
+		pthread_mutex_lock(&lt->lock);
+		locks_insert(lt, lock);
+		pthread_mutex_unlock(&lt->lock);
+	}
+}
+
 static void flock_to_lock(struct flock *flock, struct lock *lock)
 {
 	memset(lock, 0, sizeof(struct lock));
@@ -4082,22 +6675,31 @@ static int fuse_flush_common(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
 	struct flock lock;
 	struct lock l;
 	int err;
+	int res;
 	int errlock;
 
 	fuse_prepare_interrupt(f, req, &d);
 	memset(&lock, 0, sizeof(lock));
 	lock.l_type = F_UNLCK;
 	lock.l_whence = SEEK_SET;
-	err = fuse_fs_flush(f->fs, path, fi);
+	/*
+	 * The file system is flushed even if a delayed write failed, but
+	 * that error is reported in preference
+	 */
+	err = wbuf_sync(f, ino, path, fi);
+	res = fuse_fs_flush(f->fs, path, fi);
+	/* Keep the kernel flushing, delayed write errors come back here */
+	if (res == -ENOSYS && f->conf.write_coalesce)
+		res = 0;
+	if (!err)
+		err = res;
 	errlock = fuse_fs_lock(f->fs, path, fi, F_SETLK, &lock);
 	fuse_finish_interrupt(f, req, &d);
 
 	if (errlock != -ENOSYS) {
 		flock_to_lock(&lock, &l);
 		l.owner = fi->lock_owner;
-		pthread_mutex_lock(&f->lock);
-		locks_insert(get_node(f, ino), &l);
-		pthread_mutex_unlock(&f->lock);
+		node_locks_insert(f, ino, &l);
 
 		/* if op.lock() is defined FLUSH is needed regardless
 		   of op.flush() */
@@ -4168,16 +6770,20 @@ static void fuse_lib_getlk(fuse_req_t req, fuse_ino_t ino,
 {
 	int err;
 	struct lock l;
-	struct lock *conflict;
+	struct lock *conflict = NULL;
+	struct lock_table *lt;
 	struct fuse *f = req_fuse(req);
 
 	flock_to_lock(lock, &l);
 	l.owner = fi->lock_owner;
-	pthread_mutex_lock(&f->lock);
-	conflict = locks_conflict(get_node(f, ino), &l);
-	if (conflict)
-		lock_to_flock(conflict, lock);
-	pthread_mutex_unlock(&f->lock);
+	lt = get_lock_table(f, ino, 0);
+	if (lt) {
+		pthread_mutex_lock(&lt->lock);
+		conflict = locks_conflict(lt->root[LOCK_BY_RANGE], &l);
+		if (conflict)
+			lock_to_flock(conflict, lock);
+		pthread_mutex_unlock(&lt->lock);
+	}
 	if (!conflict)
 		err = fuse_lock_common(req, ino, fi, lock, F_GETLK);
 	else
@@ -4200,9 +6806,7 @@ static void fuse_lib_setlk(fuse_req_t req, fuse_ino_t ino,
 		struct lock l;
 		flock_to_lock(lock, &l);
 		l.owner = fi->lock_owner;
-		pthread_mutex_lock(&f->lock);
-		locks_insert(get_node(f, ino), &l);
-		pthread_mutex_unlock(&f->lock);
+		node_locks_insert(f, ino, &l);
 	}
 	reply_err(req, err);
 }
@@ -4330,7 +6934,10 @@ static void fuse_lib_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
 	err = get_path_nullok(f, ino, &path);
 	if (!err) {
 		fuse_prepare_interrupt(f, req, &d);
+		wbuf_sync(f, ino, path, NULL);
 		err = fuse_fs_fallocate(f->fs, path, mode, offset, length, fi);
+		ra_invalidate(f, ino);
+		attr_invalidate(f, ino);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
 	}
@@ -4363,8 +6970,12 @@ static void fuse_lib_copy_file_range(fuse_req_t req, fuse_ino_t nodeid_in,
 	}
 
 	fuse_prepare_interrupt(f, req, &d);
+	wbuf_sync(f, nodeid_in, path_in, NULL);
+	wbuf_sync(f, nodeid_out, path_out, NULL);
 	res = fuse_fs_copy_file_range(f->fs, path_in, fi_in, off_in, path_out,
 				      fi_out, off_out, len, flags);
+	ra_invalidate(f, nodeid_out);
+	attr_invalidate(f, nodeid_out);
 	fuse_finish_interrupt(f, req, &d);
 
 	if (res >= 0)
@@ -4392,6 +7003,7 @@ static void fuse_lib_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence
 	}
 
 	fuse_prepare_interrupt(f, req, &d);
+	wbuf_sync(f, ino, path, NULL);
 	res = fuse_fs_lseek(f->fs, path, off, whence, fi);
 	fuse_finish_interrupt(f, req, &d);
 	free_path(f, ino, path);
@@ -4412,6 +7024,10 @@ static int clean_delay(struct fuse *f)
 	int max_sleep = 3600;
 	int sleep_time = f->conf.remember / 10;
 
+	/* Checking the limit is cheap when it is not exceeded */
+	if (f->conf.remember_max)
+		return 1;
+
 	if (sleep_time > max_sleep)
 		return max_sleep;
 	if (sleep_time < min_sleep)
@@ -4419,40 +7035,109 @@ static int clean_delay(struct fuse *f)
 	return sleep_time;
 }
 
-int fuse_clean_cache(struct fuse *f)
+/*
+ * Every node looked at leaves the head of the LRU list, either because
+ * it is forgotten or because it is an active directory and moves to
+ * the tail. This allows dropping f->lock after each batch and carrying
+ * on from the head.
+ */
+static int prune_batch(struct fuse *f, const struct timespec *now)
 {
 	struct node_lru *lnode;
-	struct list_head *curr, *next;
 	struct node *node;
-	struct timespec now;
+	int n;
 
-	pthread_mutex_lock(&f->lock);
+	for (n = 0; n < PRUNE_BATCH && !list_empty(&f->lru_table); n++) {
+		lnode = list_entry(f->lru_table.next, struct node_lru, lru);
+		node = &lnode->node;
 
-	curr_time(&now);
+		if (diff_timespec(now, &lnode->forget_time) <= f->conf.remember &&
+		    (!f->conf.remember_max ||
+		     f->lru_count <= f->conf.remember_max))
+			return 0;
 
-	for (curr = f->lru_table.next; curr != &f->lru_table; curr = next) {
-		double age;
+		assert(node->nlookup == 1);
 
-		next = curr->next;
-		lnode = list_entry(curr, struct node_lru, lru);
-		node = &lnode->node;
+		/* Don't forget active directories, check again later */
+		if (node->refctr > 1) {
+			set_forget_time(f, node);
+			continue;
+		}
 
-		age = diff_timespec(&now, &lnode->forget_time);
-		if (age <= f->conf.remember)
-			break;
+		node->nlookup = 0;
+		unhash_name(f, node);
+		unref_node(f, node);
+	}
 
-		assert(node->nlookup == 1);
+	return !list_empty(&f->lru_table);
+}
+
+/*
+ * Called from alloc_node() when node_mem_max has been reached. Evicts
+ * remembered nodes from the head of the LRU list regardless of their
+ * age, until there is room for another node. The parent of the node
+ * being allocated is skipped, the caller is about to reference it.
+ */
+static int reclaim_nodes(struct fuse *f, fuse_ino_t parent)
+{
+	struct node_lru *lnode;
+	struct node *node;
+	int n;
+
+	if (!lru_enabled(f))
+		return 0;
+
+	for (n = 0; n < PRUNE_BATCH && !list_empty(&f->lru_table); n++) {
+		lnode = list_entry(f->lru_table.next, struct node_lru, lru);
+		node = &lnode->node;
 
-		/* Don't forget active directories */
-		if (node->refctr > 1)
+		assert(node->nlookup == 1);
+		if (node->refctr > 1 || node->treelock ||
+		    node->nodeid == parent) {
+			set_forget_time(f, node);
 			continue;
+		}
 
 		node->nlookup = 0;
 		unhash_name(f, node);
 		unref_node(f, node);
+		f->nodes_reclaimed++;
+		if (node_mem_avail(f))
+			return 1;
 	}
+
+	return 0;
+}
+
+int fuse_clean_cache(struct fuse *f)
+{
+	struct timespec start;
+	struct timespec now;
+	size_t todo;
+	int more;
+
+	curr_time(&start);
+	now = start;
+
+	pthread_mutex_lock(&f->lock);
+	/* Active directories moved to the tail are not looked at again */
+	todo = f->lru_count;
+	do {
+		more = prune_batch(f, &start);
+		todo -= todo > PRUNE_BATCH ? PRUNE_BATCH : todo;
+		if (!more || !todo)
+			break;
+
+		pthread_mutex_unlock(&f->lock);
+		curr_time(&now);
+		pthread_mutex_lock(&f->lock);
+	} while (diff_timespec(&now, &start) < PRUNE_PASS_TIME);
 	pthread_mutex_unlock(&f->lock);
 
+	/* Out of time, continue soon */
+	if (more && todo)
+		return 1;
+
 	return clean_delay(f);
 }
 
@@ -4511,6 +7196,25 @@ struct fuse_session *fuse_get_session(struct fuse *f)
 	return f->se;
 }
 
+void fuse_get_stats(struct fuse *f, struct fuse_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&f->lock);
+	stats->nodes = f->nodes;
+	stats->node_size = get_node_size(f);
+	stats->remembered = f->lru_count;
+	stats->nodes_reclaimed = f->nodes_reclaimed;
+	get_slab_stats(f, stats);
+	stats->lock_waits = f->lock_waits;
+	stats->lock_retries = f->lock_retries;
+	stats->readahead_hits = f->ra_hits;
+	stats->readahead_misses = f->ra_misses;
+	stats->readahead_bytes = f->ra_bytes;
+	stats->attr_cache_hits = f->attr_hits;
+	stats->attr_cache_misses = f->attr_misses;
+	pthread_mutex_unlock(&f->lock);
+}
+
 static int fuse_session_loop_remember(struct fuse *f)
 {
 	struct fuse_session *se = f->se;
@@ -4523,6 +7227,7 @@ static int fuse_session_loop_remember(struct fuse *f)
 	};
 	struct fuse_buf fbuf = {
 		.mem = NULL,
+		.flags = FUSE_BUF_TIERED,
 	};
 
 	curr_time(&now);
@@ -4558,7 +7263,7 @@ static int fuse_session_loop_remember(struct fuse *f)
 		}
 	}
 
-	free(fbuf.mem);
+	fuse_session_free_buf_int(se, &fbuf);
 	fuse_session_reset(se);
 	return res < 0 ? -1 : 0;
 }
@@ -4574,8 +7279,8 @@ int fuse_loop(struct fuse *f)
 	return fuse_session_loop(f->se);
 }
 
-FUSE_SYMVER("fuse_loop_mt_32", "fuse_loop_mt@@FUSE_3.2")
-int fuse_loop_mt_32(struct fuse *f, struct fuse_loop_config *config)
+FUSE_SYMVER("fuse_loop_mt_311", "fuse_loop_mt@@FUSE_3.11")
+int fuse_loop_mt_311(struct fuse *f, struct fuse_loop_config *config)
 {
 	if (f == NULL)
 		return -1;
@@ -4584,19 +7289,32 @@ int fuse_loop_mt_32(struct fuse *f, struct fuse_loop_config *config)
 	if (res)
 		return -1;
 
-	res = fuse_session_loop_mt_32(fuse_get_session(f), config);
+	res = fuse_session_loop_mt_311(fuse_get_session(f), config);
 	fuse_stop_cleanup_thread(f);
 	return res;
 }
 
+FUSE_SYMVER("fuse_loop_mt_32", "fuse_loop_mt@FUSE_3.2")
+int fuse_loop_mt_32(struct fuse *f, struct fuse_loop_config_v1 *config_v1)
+{
+	struct fuse_loop_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.clone_fd = config_v1->clone_fd;
+	config.max_idle_threads = config_v1->max_idle_threads;
+	return fuse_loop_mt_311(f, &config);
+}
+
 int fuse_loop_mt_31(struct fuse *f, int clone_fd);
 FUSE_SYMVER("fuse_loop_mt_31", "fuse_loop_mt@FUSE_3.0")
 int fuse_loop_mt_31(struct fuse *f, int clone_fd)
 {
 	struct fuse_loop_config config;
+
+	memset(&config, 0, sizeof(config));
 	config.clone_fd = clone_fd;
 	config.max_idle_threads = 10;
-	return fuse_loop_mt_32(f, &config);
+	return fuse_loop_mt_311(f, &config);
 }
 
 void fuse_exit(struct fuse *f)
@@ -4639,6 +7357,7 @@ int fuse_invalidate_path(struct fuse *f, const char *path) {
 	if (err) {
 		return err;
 	}
+	attr_invalidate(f, ino);
 
 	return fuse_lowlevel_notify_inval_inode(f->se, ino, 0, 0);
 }
@@ -4663,10 +7382,23 @@ static const struct fuse_opt fuse_lib_opts[] = {
 	FUSE_LIB_OPT("attr_timeout=%lf",      attr_timeout, 0),
 	FUSE_LIB_OPT("ac_attr_timeout=%lf",   ac_attr_timeout, 0),
 	FUSE_LIB_OPT("ac_attr_timeout=",      ac_attr_timeout_set, 1),
+	FUSE_LIB_OPT("ac_refresh=%lf",        ac_refresh, 0),
 	FUSE_LIB_OPT("negative_timeout=%lf",  negative_timeout, 0),
+	FUSE_LIB_OPT("negative_cache=%lf",    negative_cache, 0),
 	FUSE_LIB_OPT("noforget",              remember, -1),
 	FUSE_LIB_OPT("remember=%u",           remember, 0),
 	FUSE_LIB_OPT("modules=%s",	      modules, 0),
+	FUSE_LIB_OPT("path_cache",	      path_cache, 1),
+	FUSE_LIB_OPT("remember_max=%u",       remember_max, 0),
+	FUSE_LIB_OPT("slab_size=%u",          slab_size, 0),
+	FUSE_LIB_OPT("slab_hugepage",         slab_hugepage, 1),
+	FUSE_LIB_OPT("node_mem_max=%lu",      node_mem_max, 0),
+	FUSE_LIB_OPT("readdir_cache",         readdir_cache, 1),
+	FUSE_LIB_OPT("write_coalesce=%u",     write_coalesce, 0),
+	FUSE_LIB_OPT("write_coalesce_delay=%lf", write_coalesce_delay, 0),
+	FUSE_LIB_OPT("readahead=%u",          readahead, 0),
+	FUSE_LIB_OPT("readahead_threads=%u",  readahead_threads, 0),
+	FUSE_LIB_OPT("attr_cache=%lf",        attr_cache, 0),
 	FUSE_OPT_END
 };
 
@@ -4710,10 +7442,23 @@ void fuse_lib_help(struct fuse_args *args)
 "    -o gid=N               set file group\n"
 "    -o entry_timeout=T     cache timeout for names (1.0s)\n"
 "    -o negative_timeout=T  cache timeout for deleted names (0.0s)\n"
+"    -o negative_cache=T    remember missing names in the library (0.0s)\n"
 "    -o attr_timeout=T      cache timeout for attributes (1.0s)\n"
 "    -o ac_attr_timeout=T   auto cache timeout for attributes (attr_timeout)\n"
+"    -o ac_refresh=T        refresh them in the background T s before (0s)\n"
 "    -o noforget            never forget cached inodes\n"
 "    -o remember=T          remember cached inodes for T seconds (0s)\n"
+"    -o remember_max=N      remember at most N otherwise unused inodes\n"
+"    -o path_cache          cache the paths of recently used inodes\n"
+"    -o slab_size=N         allocate inodes in slabs of N bytes\n"
+"    -o slab_hugepage       allocate inodes in huge pages\n"
+"    -o node_mem_max=N      use at most N bytes for inodes\n"
+"    -o readdir_cache       cache directory listings (off)\n"
+"    -o write_coalesce=N    merge contiguous writes up to N bytes (0)\n"
+"    -o write_coalesce_delay=T  write merged data out after T s (0.1s)\n"
+"    -o readahead=N         read up to N bytes ahead of sequential reads (0)\n"
+"    -o readahead_threads=N read ahead on N threads (1)\n"
+"    -o attr_cache=T        remember attributes in the library (0.0s)\n"
 "    -o modules=M1[:M2...]  names of modules to push onto filesystem stack\n");
 
 
@@ -4804,6 +7549,7 @@ static int fuse_push_module(struct fuse *f, const char *module,
 		return -1;
 	}
 	newfs->m = m;
+	f->path_headroom += newfs->path_reserve;
 	f->fs = newfs;
 	return 0;
 }
@@ -4830,6 +7576,66 @@ struct fuse_fs *fuse_fs_new(const struct fuse_operations *op, size_t op_size,
 	return fs;
 }
 
+void fuse_fs_reserve_path(struct fuse_fs *fs, size_t len)
+{
+	fs->path_reserve = len;
+}
+
+/* Room in front of path, if it lies in front of a path of this operation */
+static int path_headroom(const char *path, size_t *room)
+{
+	struct fuse_context_i *c = fuse_get_context_internal();
+	uintptr_t p = (uintptr_t) path;
+	int i;
+
+	if (c == NULL || c->ctx.fuse == NULL || path == NULL)
+		return 0;
+
+	for (i = 0; i < FUSE_CTX_PATHS; i++) {
+		uintptr_t end = (uintptr_t) c->paths[i];
+		uintptr_t start = end - c->ctx.fuse->path_headroom;
+
+		if (c->paths[i] != NULL && p >= start && p <= end) {
+			*room = p - start;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int fuse_fs_path_prepend(const char *path, const char *prefix, size_t len,
+			 char **newpathp)
+{
+	size_t room;
+	size_t pathlen;
+	char *newpath;
+
+	if (path_headroom(path, &room) && room >= len) {
+		newpath = (char *) path - len;
+		memcpy(newpath, prefix, len);
+		*newpathp = newpath;
+		return 0;
+	}
+
+	pathlen = strlen(path);
+	newpath = malloc(len + pathlen + 1);
+	if (newpath == NULL)
+		return -ENOMEM;
+
+	memcpy(newpath, prefix, len);
+	memcpy(newpath + len, path, pathlen + 1);
+	*newpathp = newpath;
+	return 0;
+}
+
+void fuse_fs_path_release(char *path)
+{
+	size_t room;
+
+	if (!path_headroom(path, &room))
+		free(path);
+}
+
 static int node_table_init(struct node_table *t)
 {
 	t->size = NODE_TABLE_MIN_SIZE;
@@ -4884,6 +7690,7 @@ struct fuse *fuse_new_31(struct fuse_args *args,
 	struct node *root;
 	struct fuse_fs *fs;
 	struct fuse_lowlevel_ops llop = fuse_path_ops;
+	int i;
 
 	f = (struct fuse *) calloc(1, sizeof(struct fuse));
 	if (f == NULL) {
@@ -4894,6 +7701,7 @@ struct fuse *fuse_new_31(struct fuse_args *args,
 	f->conf.entry_timeout = 1.0;
 	f->conf.attr_timeout = 1.0;
 	f->conf.negative_timeout = 0.0;
+	f->conf.write_coalesce_delay = 0.1;
 	f->conf.intr_signal = FUSE_DEFAULT_INTR_SIGNAL;
 
 	/* Parse options */
@@ -4930,7 +7738,13 @@ struct fuse *fuse_new_31(struct fuse_args *args,
 	}
 
 	f->pagesize = getpagesize();
-	init_list_head(&f->partial_slabs);
+	f->slab_size = f->pagesize;
+	if (f->conf.slab_hugepage && f->conf.slab_size < NODE_SLAB_HUGEPAGE)
+		f->conf.slab_size = NODE_SLAB_HUGEPAGE;
+	while (f->slab_size < f->conf.slab_size)
+		f->slab_size <<= 1;
+	for (i = 0; i < NODE_SLAB_CLASSES; i++)
+		init_list_head(&f->partial_slabs[i]);
 	init_list_head(&f->full_slabs);
 	init_list_head(&f->lru_table);
 
@@ -4978,9 +7792,29 @@ struct fuse *fuse_new_31(struct fuse_args *args,
 	if (node_table_init(&f->id_table) == -1)
 		goto out_free_name_table;
 
+	if (f->conf.negative_cache > 0 && neg_table_init(f) == -1)
+		goto out_free_id_table;
+
 	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->ac_cond, NULL);
+	pthread_cond_init(&f->ac_refresh_cond, NULL);
+	f->ac_refresh_tail = &f->ac_refresh_head;
+	pthread_cond_init(&f->wbuf_cond, NULL);
+	init_list_head(&f->wbuf_dirty);
+	pthread_cond_init(&f->ra_cond, NULL);
+	init_list_head(&f->ra_queue);
+	if (f->conf.readahead) {
+		if (!f->conf.readahead_threads)
+			f->conf.readahead_threads = 1;
+		f->ra_threads = calloc(f->conf.readahead_threads,
+				       sizeof(pthread_t));
+		if (f->ra_threads == NULL) {
+			fuse_log(FUSE_LOG_ERR, "fuse: memory allocation failed\n");
+			goto out_free_id_table;
+		}
+	}
 
-	root = alloc_node(f);
+	root = alloc_node(f, FUSE_ROOT_ID);
 	if (root == NULL) {
 		fuse_log(FUSE_LOG_ERR, "fuse: memory allocation failed\n");
 		goto out_free_id_table;
@@ -5008,6 +7842,8 @@ struct fuse *fuse_new_31(struct fuse_args *args,
 out_free_root:
 	free(root);
 out_free_id_table:
+	free(f->ra_threads);
+	neg_table_free(f);
 	free(f->id_table.array);
 out_free_name_table:
 	free(f->name_table.array);
@@ -5059,6 +7895,24 @@ void fuse_destroy(struct fuse *f)
 {
 	size_t i;
 
+	if (f->conf.debug)
+		fuse_log(FUSE_LOG_DEBUG, "tree lock waits: %llu, retries: %llu\n",
+			 (unsigned long long) f->lock_waits,
+			 (unsigned long long) f->lock_retries);
+	if (f->conf.debug && f->conf.readahead)
+		fuse_log(FUSE_LOG_DEBUG, "readahead hits: %llu, misses: %llu, "
+			 "bytes: %llu\n", (unsigned long long) f->ra_hits,
+			 (unsigned long long) f->ra_misses,
+			 (unsigned long long) f->ra_bytes);
+	if (f->conf.debug && f->conf.attr_cache > 0)
+		fuse_log(FUSE_LOG_DEBUG, "attr_cache hits: %llu, misses: %llu\n",
+			 (unsigned long long) f->attr_hits,
+			 (unsigned long long) f->attr_misses);
+
+	ac_stop_refresh(f);
+	ra_stop_threads(f);
+	wbuf_stop_thread(f);
+
 	if (f->conf.intr && f->intr_installed)
 		fuse_restore_intr_signal(f->conf.intr_signal);
 
@@ -5072,9 +7926,9 @@ void fuse_destroy(struct fuse *f)
 			     node = node->id_next) {
 				if (node->is_hidden) {
 					char *path;
-					if (try_get_path(f, node->nodeid, NULL, &path, NULL, false) == 0) {
+					if (try_get_path(f, node->nodeid, NULL, &path, NULL, false, NULL) == 0) {
 						fuse_fs_unlink(f->fs, path);
-						free(path);
+						free_path_buf(f, path);
 					}
 				}
 			}
@@ -5090,16 +7944,22 @@ void fuse_destroy(struct fuse *f)
 			f->id_table.use--;
 		}
 	}
-	assert(list_empty(&f->partial_slabs));
-	assert(list_empty(&f->full_slabs));
+	free_slabs(f);
 
-	while (fuse_modules) {
-		fuse_put_module(fuse_modules);
-	}
+	neg_table_free(f);
 	free(f->id_table.array);
 	free(f->name_table.array);
+	pthread_cond_destroy(&f->ac_refresh_cond);
+	pthread_cond_destroy(&f->wbuf_cond);
+	pthread_cond_destroy(&f->ra_cond);
+	free(f->ra_threads);
+	pthread_cond_destroy(&f->ac_cond);
 	pthread_mutex_destroy(&f->lock);
+	/* The session's destroy callback still drops the module stack */
 	fuse_session_destroy(f->se);
+	while (fuse_modules) {
+		fuse_put_module(fuse_modules);
+	}
 	free(f->conf.modules);
 	free(f);
 	fuse_delete_context_key();
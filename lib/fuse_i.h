@@ -12,14 +12,21 @@
 struct mount_opts;
 
 struct fuse_req {
+	/* Stays initialized while the request sits in a request cache */
+	pthread_mutex_t lock;
 	struct fuse_session *se;
 	uint64_t unique;
 	int ctr;
-	pthread_mutex_t lock;
 	struct fuse_ctx ctx;
 	struct fuse_chan *ch;
 	int interrupted;
 	unsigned int ioctl_64bit : 1;
+	/* For the session statistics, start_ns is zero if not counted */
+	unsigned int opcode;
+	uint64_t start_ns;
+	size_t out_bytes;
+	/* Charged to the admission budget, zero if not charged */
+	size_t admit_bytes;
 	union {
 		struct {
 			uint64_t unique;
@@ -31,6 +38,110 @@ struct fuse_req {
 	} u;
 	struct fuse_req *next;
 	struct fuse_req *prev;
+	/* Chain in the in-flight table, see fuse_ll_add_inflight() */
+	struct fuse_req *hash_next;
+};
+
+/*
+ * In-flight requests by unique id, for FUSE_INTERRUPT. The shard lock
+ * also protects ctr, interrupted and u.ni of its requests.
+ */
+#define FUSE_INFLIGHT_SHARD_BITS 6
+#define FUSE_INFLIGHT_SHARDS (1 << FUSE_INFLIGHT_SHARD_BITS)
+#define FUSE_INFLIGHT_MIN_SIZE 16
+
+struct fuse_inflight_shard {
+	pthread_mutex_t lock;
+	struct fuse_req **buckets;
+	size_t size;
+	size_t count;
+};
+
+struct fuse_ll_pipe;
+struct fuse_ll_large_buf;
+
+/* Queue depth if the notify_queue option is not given */
+#define FUSE_NOTIFY_QUEUE_DEPTH 1024
+
+struct fuse_notify_item;
+struct fuse_reply_batch;
+
+/*
+ * Writes out the replies that session threads have held back for
+ * reply_batch_delay, e.g. while they process a slow request
+ */
+struct fuse_reply_timer {
+	pthread_mutex_t lock;
+	/* Signalled when a batch is started, or the thread is told to stop */
+	pthread_cond_t cond;
+	struct fuse_reply_batch *batches;
+	int started;
+	int stop;
+	pthread_t thread;
+};
+
+/*
+ * Notifications waiting for the sender thread, in order. Pending inode
+ * and entry invalidations are also hashed, so that duplicates can be
+ * merged into them.
+ */
+struct fuse_notify_queue {
+	pthread_mutex_t lock;
+	/* Signalled when items are added, or the thread is told to stop */
+	pthread_cond_t cond;
+	/* Signalled when the sender is done with a batch */
+	pthread_cond_t sent;
+	struct fuse_notify_item *head;
+	struct fuse_notify_item **tail;
+	struct fuse_notify_item **hash;
+	size_t hash_size;
+	unsigned int count;
+	unsigned int depth;
+	int sending;
+	int started;
+	int stop;
+	pthread_t thread;
+};
+
+/*
+ * Budget for the requests that were received but not answered yet,
+ * see fuse_ll_admit_wait(). Disabled if both limits are zero.
+ */
+struct fuse_admission {
+	unsigned int max_reqs;
+	size_t max_bytes;
+	/* Receiving resumes once usage is below these again */
+	unsigned int low_reqs;
+	size_t low_bytes;
+	uint64_t reqs;
+	uint64_t bytes;
+	uint64_t waits;
+	int waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* Measurements for choosing between splice and copy */
+struct fuse_splice_tune {
+	/* Cost of copying a small request out of the pipe (ns) */
+	uint64_t syscall_ns;
+	/* Cost of copying one KiB out of the pipe (ns) */
+	uint64_t kib_ns;
+	/* Counts requests that could have been spliced */
+	unsigned int probe;
+};
+
+/* Per-thread freelist of request objects */
+struct fuse_req_cache {
+	struct fuse_session *se;
+	struct fuse_req *free;
+	unsigned int count;
+	uint64_t allocs;
+	uint64_t hits;
+	/* Written by this thread only, in_flight may wrap */
+	struct fuse_opcode_stats ops[FUSE_STATS_MAX_OPCODE];
+	struct fuse_req_cache *prev;
+	struct fuse_req_cache *next;
 };
 
 struct fuse_notify_req {
@@ -45,8 +156,18 @@ struct fuse_session {
 	char *mountpoint;
 	volatile int exited;
 	int fd;
+	/* Set by fuse_session_custom_io() */
+	struct fuse_custom_io *io;
+	/*
+	 * Eventfd of the fuse_multi_loop serving the session, or -1.
+	 * That loop does not splice.
+	 */
+	int multi_loop_fd;
 	struct mount_opts *mo;
 	int debug;
+	/* With debug, only trace one in debug_sample requests */
+	unsigned int debug_sample;
+	int log_async;
 	int deny_others;
 	struct fuse_lowlevel_ops op;
 	int got_init;
@@ -54,16 +175,44 @@ struct fuse_session {
 	void *userdata;
 	uid_t owner;
 	struct fuse_conn_info conn;
-	struct fuse_req list;
+	struct fuse_inflight_shard inflight[FUSE_INFLIGHT_SHARDS];
+	/* Interrupts waiting for their request, under lock */
 	struct fuse_req interrupts;
+	/* Length of interrupts, also read without the lock */
+	unsigned int interrupts_pending;
 	pthread_mutex_t lock;
 	int got_destroy;
 	pthread_key_t pipe_key;
+	struct fuse_ll_pipe *pipe_pool;
+	unsigned int pipe_pool_count;
+	unsigned int pipe_pool_size;
+	/* Free large receive buffers, under lock */
+	struct fuse_ll_large_buf *large_bufs;
+	int buf_hugepage;
+	int align_write;
+	unsigned int splice_threshold;
+	int splice_autotune;
+	struct fuse_splice_tune splice_tune;
+	pthread_key_t req_key;
+	struct fuse_req_cache req_caches;
+	uint64_t req_allocs;
+	uint64_t req_hits;
+	/* Statistics of threads that have exited */
+	struct fuse_opcode_stats op_stats[FUSE_STATS_MAX_OPCODE];
+	pthread_key_t reply_key;
+	unsigned int reply_batch;
+	unsigned int reply_batch_delay;
+	struct fuse_reply_timer reply_timer;
 	int broken_splice_nonblock;
 	uint64_t notify_ctr;
 	struct fuse_notify_req notify_list;
 	size_t bufsize;
 	int error;
+	int io_uring;
+	unsigned int uring_depth;
+	struct fuse_uring *uring;
+	struct fuse_notify_queue notify_queue;
+	struct fuse_admission admission;
 };
 
 struct fuse_chan {
@@ -110,6 +259,7 @@ struct mount_opts *parse_mount_opts(struct fuse_args *args);
 void destroy_mount_opts(struct mount_opts *mo);
 void fuse_mount_version(void);
 unsigned get_max_read(struct mount_opts *o);
+int get_auto_unmount(struct mount_opts *o);
 void fuse_kern_unmount(const char *mountpoint, int fd);
 int fuse_kern_mount(const char *mountpoint, struct mount_opts *mo);
 
@@ -121,15 +271,132 @@ void cuse_lowlevel_init(fuse_req_t req, fuse_ino_t nodeide, const void *inarg);
 
 int fuse_start_thread(pthread_t *thread_id, void *(*func)(void *), void *arg);
 
+/*
+ * Queue a reply on the io_uring of the session. Returns -ENOSYS if
+ * the caller should write the reply itself. If *release* is given,
+ * the data after the header is not copied, and release(arg) is called
+ * once the write has completed.
+ */
+int fuse_uring_send_reply(struct fuse_session *se, struct iovec *iov,
+			  int count, size_t len,
+			  void (*release)(void *arg), void *arg);
+
+/* Largest number of messages passed to fuse_uring_write_batch() */
+#define FUSE_URING_BATCH_MAX 64
+
+/*
+ * Write each iovec as a separate message to fd, all with a single
+ * system call. *ringp is set up on first use and must be released
+ * with fuse_uring_free(). If *res* is given, it receives 0 or -errno
+ * for each message, otherwise failures are logged. All writes are
+ * completed before returning 0. A negative return value means that
+ * nothing was written: -ENOSYS if io_uring is not available.
+ */
+int fuse_uring_write_batch(struct fuse_uring **ringp, int fd,
+			   struct iovec *iov, unsigned int count, int *res);
+void fuse_uring_free(struct fuse_uring *ring);
+
+/*
+ * Reply batching for session loops: called before each read, writes
+ * out the replies this thread has held back unless more requests are
+ * pending. fuse_ll_reply_batch_flush() writes them unconditionally.
+ */
+void fuse_ll_reply_batch_prepare(struct fuse_session *se,
+				 struct fuse_chan *ch);
+void fuse_ll_reply_batch_flush(struct fuse_session *se);
+
+/*
+ * Admission control for session loops: called before reading a
+ * request, waits while the in-flight budget is used up.
+ * fuse_ll_admit_full() tells whether that would wait.
+ */
+int fuse_ll_admit_full(struct fuse_session *se);
+void fuse_ll_admit_wait(struct fuse_session *se);
+
+/* Fills the splice pipe pool once INIT has been answered */
+void fuse_ll_pipe_pool_fill(struct fuse_session *se);
+
+/*
+ * Internal buffer flags, kept across fuse_session_receive_buf_int()
+ * calls. The library's loops set FUSE_BUF_TIERED: their buf->mem then
+ * only has room for FUSE_SMALL_BUFSIZE bytes, and larger requests are
+ * read into a buffer borrowed from the session (FUSE_BUF_POOLED) until
+ * the next receive. With a custom transport that has receive_buf(),
+ * buf->mem is the transport's memory instead (FUSE_BUF_LENT). Such
+ * buffers must be freed with fuse_session_free_buf_int().
+ */
+#define FUSE_BUF_TIERED		(1 << 30)
+#define FUSE_BUF_POOLED		(1 << 29)
+#define FUSE_BUF_LENT		(1 << 28)
+#define FUSE_BUF_INTERNAL	(FUSE_BUF_TIERED | FUSE_BUF_POOLED | \
+				 FUSE_BUF_LENT)
+
+/* Large enough for every request that is not a big WRITE or SETXATTR */
+#define FUSE_SMALL_BUFSIZE	8192
+
+/*
+ * Offset of the data in a WRITE request. With align_write, receive
+ * buffers start this far before a page boundary.
+ */
+#define FUSE_WRITE_DATA_OFFSET	(sizeof(struct fuse_in_header) + \
+				 sizeof(struct fuse_write_in))
+
 int fuse_session_receive_buf_int(struct fuse_session *se, struct fuse_buf *buf,
 				 struct fuse_chan *ch);
+void fuse_session_free_buf_int(struct fuse_session *se, struct fuse_buf *buf);
+/*
+ * Gives back the memory that buf borrowed for the last request, which
+ * is otherwise done by the next receive
+ */
+void fuse_session_return_buf_int(struct fuse_session *se, struct fuse_buf *buf);
+/* Frees the large receive buffers that no thread holds */
+void fuse_ll_trim_bufs(struct fuse_session *se);
+/*
+ * Moves the request in buf to dst, so that another thread can process
+ * it. Data still in the calling thread's splice pipe is copied out.
+ * On -ENOMEM, buf is left as it was. Other errors mean that the pipe
+ * could not be read, and the request has been answered with EIO via
+ * *ch* if at least its header could be.
+ */
+int fuse_session_move_buf_int(struct fuse_session *se, struct fuse_buf *dst,
+			      struct fuse_buf *buf, struct fuse_chan *ch);
 void fuse_session_process_buf_int(struct fuse_session *se,
 				  const struct fuse_buf *buf, struct fuse_chan *ch);
 
 struct fuse *fuse_new_31(struct fuse_args *args, const struct fuse_operations *op,
 		      size_t op_size, void *private_data);
-int fuse_loop_mt_32(struct fuse *f, struct fuse_loop_config *config);
-int fuse_session_loop_mt_32(struct fuse_session *se, struct fuse_loop_config *config);
+
+/**
+ * Layout of struct fuse_loop_config up to libfuse 3.10, used by the
+ * compatibility versions of the multi-threaded loop functions.
+ */
+struct fuse_loop_config_v1 {
+	int clone_fd;
+	unsigned int max_idle_threads;
+};
+
+int fuse_loop_mt_32(struct fuse *f, struct fuse_loop_config_v1 *config_v1);
+int fuse_loop_mt_311(struct fuse *f, struct fuse_loop_config *config);
+int fuse_session_loop_mt_32(struct fuse_session *se,
+			    struct fuse_loop_config_v1 *config_v1);
+int fuse_session_loop_mt_311(struct fuse_session *se,
+			     struct fuse_loop_config *config);
+int fuse_parse_cmdline_311(struct fuse_args *args,
+			   struct fuse_cmdline_opts *opts);
+
+struct cuse_info;
+struct cuse_lowlevel_ops;
+struct fuse_session *cuse_lowlevel_new_311(struct fuse_args *args,
+					   const struct cuse_info *ci,
+					   const struct cuse_lowlevel_ops *clop,
+					   void *userdata);
+struct fuse_session *cuse_lowlevel_setup_311(int argc, char *argv[],
+					     const struct cuse_info *ci,
+					     const struct cuse_lowlevel_ops *clop,
+					     int *multithreaded, void *userdata);
+int cuse_lowlevel_main_311(int argc, char *argv[], const struct cuse_info *ci,
+			   const struct cuse_lowlevel_ops *clop,
+			   void *userdata);
 
 #define FUSE_MAX_MAX_PAGES 256
 #define FUSE_DEFAULT_MAX_PAGES_PER_REQ 32
@@ -12,6 +12,21 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Per-thread buffer space if fuse_log_start_async() is given 0 */
+#define FUSE_LOG_RING_DEFAULT (64 * 1024)
+
+/* Longer messages are truncated in async mode */
+#define FUSE_LOG_MSG_MAX 1024
+
+/* How often the log thread looks for messages */
+#define FUSE_LOG_DRAIN_MS 10
 
 static void default_log_func(
 		__attribute__(( unused )) enum fuse_log_level level,
@@ -22,6 +37,309 @@ static void default_log_func(
 
 static fuse_log_func_t log_func = default_log_func;
 
+/*
+ * Asynchronous logging: every thread formats its messages into a ring
+ * of its own, which only the log thread reads. Writers never wait for
+ * the handler; if their ring is full, the message is dropped.
+ */
+struct log_entry {
+	uint64_t time;
+	uint32_t len;
+	/* -1 for the padding at the end of the ring */
+	int32_t level;
+	char text[];
+};
+
+struct log_ring {
+	char *buf;
+	size_t size;
+	/* Advanced by the owning thread */
+	uint64_t head;
+	/* Advanced by the log thread */
+	uint64_t tail;
+	int dead;
+	struct log_ring *next;
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static int log_key_ok;
+static pthread_t log_thread;
+/* Under log_lock */
+static struct log_ring *log_rings;
+static unsigned int log_users;
+static size_t log_ring_size;
+static int log_stop;
+/* Also read without the lock */
+static int log_async;
+static uint64_t log_dropped;
+
+static void log_ring_destructor(void *data)
+{
+	struct log_ring *r = data;
+
+	/* The log thread frees it once it is empty */
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void log_init(void)
+{
+	log_key_ok = pthread_key_create(&log_key, log_ring_destructor) == 0;
+}
+
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *r = pthread_getspecific(log_key);
+	size_t size;
+
+	if (r != NULL)
+		return r;
+	/* Messages of the handler itself go out directly */
+	if (pthread_equal(pthread_self(), log_thread))
+		return NULL;
+
+	pthread_mutex_lock(&log_lock);
+	size = log_ring_size;
+	pthread_mutex_unlock(&log_lock);
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	r->buf = malloc(size);
+	if (r->buf == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->size = size;
+	if (pthread_setspecific(log_key, r) != 0) {
+		free(r->buf);
+		free(r);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	r->next = log_rings;
+	log_rings = r;
+	pthread_mutex_unlock(&log_lock);
+
+	return r;
+}
+
+static size_t log_align(size_t len)
+{
+	return (len + sizeof(struct log_entry) - 1) &
+		~(sizeof(struct log_entry) - 1);
+}
+
+/* Returns -1 if the message has to be logged synchronously */
+static int log_ring_put(enum fuse_log_level level, const char *fmt,
+			va_list ap)
+{
+	struct log_ring *r = log_ring_get();
+	char msg[FUSE_LOG_MSG_MAX];
+	struct log_entry *e;
+	struct timespec ts;
+	uint64_t tail;
+	size_t off, toend, need, used;
+	int len;
+
+	if (r == NULL)
+		return -1;
+
+	len = vsnprintf(msg, sizeof(msg), fmt, ap);
+	if (len < 0)
+		return 0;
+	if (len >= (int) sizeof(msg))
+		len = sizeof(msg) - 1;
+
+	need = log_align(sizeof(*e) + len + 1);
+	off = r->head & (r->size - 1);
+	toend = r->size - off;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	used = r->head - tail;
+	if (used + need + (toend < need ? toend : 0) > r->size) {
+		__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (toend < need) {
+		e = (struct log_entry *) (r->buf + off);
+		e->len = toend - sizeof(*e);
+		e->level = -1;
+		__atomic_store_n(&r->head, r->head + toend, __ATOMIC_RELEASE);
+		used += toend;
+		off = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	e = (struct log_entry *) (r->buf + off);
+	e->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	e->len = need - sizeof(*e);
+	e->level = level;
+	memcpy(e->text, msg, len + 1);
+	__atomic_store_n(&r->head, r->head + need, __ATOMIC_RELEASE);
+
+	/* Don't wait for the next round if the ring fills up */
+	if (used + need > r->size / 2)
+		pthread_cond_signal(&log_cond);
+	return 0;
+}
+
+static void log_call(enum fuse_log_level level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_func(level, fmt, ap);
+	va_end(ap);
+}
+
+/* The next message of a ring, skipping the padding */
+static struct log_entry *log_ring_peek(struct log_ring *r)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	struct log_entry *e;
+
+	while (r->tail != head) {
+		e = (struct log_entry *) (r->buf + (r->tail & (r->size - 1)));
+		if (e->level != -1)
+			return e;
+		__atomic_store_n(&r->tail, r->tail + sizeof(*e) + e->len,
+				 __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*
+ * Passes on everything that is queued, oldest first. Called with
+ * log_lock held, which is dropped while the handler runs: new threads
+ * take it to register their ring, and must not wait for a slow
+ * handler. Rings are only freed here, by the log thread.
+ */
+static void log_drain(void)
+{
+	static uint64_t reported;
+	struct log_ring **rp;
+	struct log_ring *r, *oldest;
+	struct log_entry *e, *first;
+	uint64_t dropped;
+
+	for (;;) {
+		oldest = NULL;
+		first = NULL;
+		for (r = log_rings; r; r = r->next) {
+			e = log_ring_peek(r);
+			if (e && (!first || e->time < first->time)) {
+				oldest = r;
+				first = e;
+			}
+		}
+		if (!oldest)
+			break;
+		pthread_mutex_unlock(&log_lock);
+		log_call(first->level, "%s", first->text);
+		pthread_mutex_lock(&log_lock);
+		__atomic_store_n(&oldest->tail,
+				 oldest->tail + sizeof(*first) + first->len,
+				 __ATOMIC_RELEASE);
+	}
+
+	/* Rings of exited threads are empty now */
+	for (rp = &log_rings; (r = *rp) != NULL;) {
+		if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+		    !log_ring_peek(r)) {
+			*rp = r->next;
+			free(r->buf);
+			free(r);
+		} else {
+			rp = &r->next;
+		}
+	}
+
+	dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	if (dropped != reported) {
+		pthread_mutex_unlock(&log_lock);
+		log_call(FUSE_LOG_WARNING, "fuse: %llu log messages dropped\n",
+			 (unsigned long long) (dropped - reported));
+		pthread_mutex_lock(&log_lock);
+		reported = dropped;
+	}
+}
+
+static void *log_thread_main(void *data)
+{
+	struct timespec ts;
+
+	(void) data;
+
+	pthread_mutex_lock(&log_lock);
+	while (!log_stop) {
+		log_drain();
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += FUSE_LOG_DRAIN_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&log_cond, &log_lock, &ts);
+	}
+	log_drain();
+	pthread_mutex_unlock(&log_lock);
+
+	return NULL;
+}
+
+int fuse_log_start_async(size_t size)
+{
+	int err = 0;
+
+	pthread_once(&log_once, log_init);
+	if (!log_key_ok)
+		return -ENOMEM;
+
+	if (!size)
+		size = FUSE_LOG_RING_DEFAULT;
+	if (size < 2 * FUSE_LOG_MSG_MAX)
+		size = 2 * FUSE_LOG_MSG_MAX;
+	/* Ring positions are masked */
+	while (size & (size - 1))
+		size &= size - 1;
+
+	pthread_mutex_lock(&log_lock);
+	if (log_users++ == 0) {
+		/* Rings that are left over keep their size */
+		log_ring_size = size;
+		log_stop = 0;
+		err = pthread_create(&log_thread, NULL, log_thread_main, NULL);
+		if (err)
+			log_users = 0;
+		else
+			__atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&log_lock);
+
+	return -err;
+}
+
+void fuse_log_stop_async(void)
+{
+	int stop;
+
+	pthread_mutex_lock(&log_lock);
+	stop = log_users && --log_users == 0;
+	if (stop) {
+		__atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+		log_stop = 1;
+		pthread_cond_signal(&log_cond);
+	}
+	pthread_mutex_unlock(&log_lock);
+
+	if (stop)
+		pthread_join(log_thread, NULL);
+}
+
 void fuse_set_log_func(fuse_log_func_t func)
 {
 	if (!func)
@@ -33,8 +351,12 @@ void fuse_set_log_func(fuse_log_func_t func)
 void fuse_log(enum fuse_log_level level, const char *fmt, ...)
 {
 	va_list ap;
+	int res = -1;
 
 	va_start(ap, fmt);
-	log_func(level, fmt, ap);
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		res = log_ring_put(level, fmt, ap);
+	if (res == -1)
+		log_func(level, fmt, ap);
 	va_end(ap);
 }
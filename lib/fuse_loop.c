@@ -21,9 +21,19 @@ int fuse_session_loop(struct fuse_session *se)
 	int res = 0;
 	struct fuse_buf fbuf = {
 		.mem = NULL,
+		.flags = FUSE_BUF_TIERED,
 	};
 
+	if (se->io_uring) {
+		res = fuse_session_loop_uring(se, se->uring_depth);
+		if (res != -ENOSYS)
+			return res;
+		fuse_log(FUSE_LOG_ERR, "fuse: falling back to read/write loop\n");
+		res = 0;
+	}
+
 	while (!fuse_session_exited(se)) {
+		fuse_ll_reply_batch_prepare(se, NULL);
 		res = fuse_session_receive_buf_int(se, &fbuf, NULL);
 
 		if (res == -EINTR)
@@ -34,7 +44,8 @@ int fuse_session_loop(struct fuse_session *se)
 		fuse_session_process_buf_int(se, &fbuf, NULL);
 	}
 
-	free(fbuf.mem);
+	fuse_ll_reply_batch_flush(se);
+	fuse_session_free_buf_int(se, &fbuf);
 	if(res > 0)
 		/* No error, just the length of the most recently read
 		   request */
@@ -8,11 +8,14 @@
   See the file COPYING.LIB.
 */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 #include "fuse_lowlevel.h"
 #include "fuse_misc.h"
 #include "fuse_kernel.h"
 #include "fuse_i.h"
+#include "fuse_probes.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,10 +27,44 @@
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 
 /* Environment var controlling the thread stack size */
 #define ENVNAME_THREAD_STACK "FUSE_THREAD_STACK"
 
+/* Location of the NUMA topology information */
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+
+/*
+ * A set of workers serving one CPU or NUMA node. Without affinity
+ * there is a single group covering all workers.
+ */
+struct fuse_worker_group {
+	struct fuse_chan *ch;
+	int numworker;
+	int numavail;
+	/* Bulk requests waiting for one of the numbulk workers */
+	pthread_mutex_t bulk_lock;
+	struct fuse_queued_req *bulk_head;
+	struct fuse_queued_req **bulk_tail;
+	unsigned int numbulk;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	int pinned;
+	cpu_set_t cpus;
+#endif
+};
+
+/* A request queued by the thread that read it */
+struct fuse_queued_req {
+	struct fuse_queued_req *next;
+	/* Where the request was read, the reply has to go there */
+	struct fuse_chan *ch;
+	struct fuse_buf buf;
+};
+
 struct fuse_worker {
 	struct fuse_worker *prev;
 	struct fuse_worker *next;
@@ -38,12 +75,36 @@ struct fuse_worker {
 	struct fuse_buf fbuf;
 	struct fuse_chan *ch;
 	struct fuse_mt *mt;
+	struct fuse_worker_group *grp;
+};
+
+/* Requests an executor of the pipelined loop can have queued */
+#define FUSE_DEQUE_SIZE 256
+
+/* Handlers block on I/O, so one executor per CPU may be too few */
+#define FUSE_MIN_EXECUTORS 4
+
+/*
+ * Receivers add at the tail, the owner takes the oldest request from
+ * the head and thieves take the newest one from the tail
+ */
+struct fuse_deque {
+	pthread_mutex_t lock;
+	unsigned int head;
+	unsigned int tail;
+	struct fuse_queued_req *reqs[FUSE_DEQUE_SIZE];
+};
+
+struct fuse_executor {
+	pthread_t thread_id;
+	struct fuse_mt *mt;
+	struct fuse_deque dq;
 };
 
 struct fuse_mt {
 	pthread_mutex_t lock;
-	int numworker;
-	int numavail;
+	struct fuse_worker_group *groups;
+	unsigned int numgroups;
 	struct fuse_session *se;
 	struct fuse_worker main;
 	sem_t finish;
@@ -51,6 +112,18 @@ struct fuse_mt {
 	int error;
 	int clone_fd;
 	int max_idle;
+	unsigned int min_threads;
+	unsigned int max_threads;
+	int idle_timeout;
+	unsigned int bulk_threads;
+	/* Pipelined loop: the workers only receive */
+	unsigned int receivers;
+	struct fuse_executor *execs;
+	unsigned int numexecs;
+	unsigned int next_exec;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	int numidle;
 };
 
 static struct fuse_chan *fuse_chan_new(int fd)
@@ -111,22 +184,237 @@ static void list_del_worker(struct fuse_worker *w)
 	next->prev = prev;
 }
 
-static int fuse_loop_start_thread(struct fuse_mt *mt);
+static int fuse_loop_start_thread(struct fuse_mt *mt,
+				  struct fuse_worker_group *grp);
+
+/*
+ * The per-request accounting (numavail and numworker) is done with
+ * atomic operations so that dispatching a request does not need
+ * mt->lock. The lock is only taken to add or remove a worker, which
+ * is also when the worker list is modified. Decisions taken on the
+ * lockless values are therefore re-checked under the lock.
+ */
+static int fuse_may_grow(struct fuse_mt *mt, struct fuse_worker_group *grp)
+{
+	return !mt->max_threads ||
+		__atomic_load_n(&grp->numworker, __ATOMIC_RELAXED) <
+		(int) mt->max_threads;
+}
+
+static int fuse_may_shrink(struct fuse_mt *mt, struct fuse_worker_group *grp)
+{
+	return __atomic_load_n(&grp->numworker, __ATOMIC_RELAXED) >
+		(int) mt->min_threads;
+}
+
+/* Called with mt->lock held, drops it */
+static void *fuse_worker_exit(struct fuse_mt *mt, struct fuse_worker *w)
+{
+	list_del_worker(w);
+	__atomic_sub_fetch(&w->grp->numavail, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&w->grp->numworker, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&mt->lock);
+	FUSE_PROBE2(worker_exit, w->grp - mt->groups, 1);
+
+	pthread_detach(w->thread_id);
+	/* Held back replies may be for the channel */
+	fuse_ll_reply_batch_flush(mt->se);
+	fuse_session_free_buf_int(mt->se, &w->fbuf);
+	fuse_chan_put(w->ch);
+	free(w);
+	return NULL;
+}
+
+/*
+ * Wait for the next request, but no longer than the idle timeout.
+ * Returns -ETIMEDOUT if nothing arrived, zero otherwise.  Errors are
+ * left for fuse_session_receive_buf_int() to report.
+ */
+static int fuse_wait_request(struct fuse_worker *w)
+{
+	struct fuse_mt *mt = w->mt;
+	struct pollfd pfd = {
+		.fd = w->ch ? w->ch->fd : mt->se->fd,
+		.events = POLLIN,
+	};
+
+	if (poll(&pfd, 1, mt->idle_timeout) == 0)
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+static int fuse_is_bulk(const struct fuse_buf *buf)
+{
+	const struct fuse_in_header *in = buf->mem;
+
+	/* Only big requests are left in the pipe */
+	if (buf->flags & FUSE_BUF_IS_FD)
+		return 1;
+
+	switch (in->opcode) {
+	case FUSE_READ:
+	case FUSE_WRITE:
+	case FUSE_FSYNC:
+	case FUSE_FALLOCATE:
+	case FUSE_COPY_FILE_RANGE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void fuse_run_queued(struct fuse_mt *mt, struct fuse_queued_req *req)
+{
+	fuse_session_process_buf_int(mt->se, &req->buf, req->ch);
+	fuse_session_free_buf_int(mt->se, &req->buf);
+	fuse_chan_put(req->ch);
+	free(req);
+}
+
+/*
+ * Takes the request out of the worker's buffer, so that another thread
+ * can process it. On -ENOMEM the request is still in the buffer, and
+ * the caller has to process it. Other errors mean that it could not
+ * be read, and has already been answered if possible.
+ */
+static int fuse_take_req(struct fuse_mt *mt, struct fuse_worker *w,
+			 struct fuse_queued_req **reqp)
+{
+	struct fuse_queued_req *req = malloc(sizeof(*req));
+	int res;
+
+	if (req == NULL)
+		return -ENOMEM;
+	res = fuse_session_move_buf_int(mt->se, &req->buf, &w->fbuf, w->ch);
+	if (res != 0) {
+		free(req);
+		return res;
+	}
+	req->ch = w->ch ? fuse_chan_get(w->ch) : NULL;
+	*reqp = req;
+	return 0;
+}
+
+/* Returns NULL, and gives up the bulk slot, if nothing is queued */
+static struct fuse_queued_req *fuse_next_bulk(struct fuse_worker_group *grp)
+{
+	struct fuse_queued_req *req;
+
+	pthread_mutex_lock(&grp->bulk_lock);
+	req = grp->bulk_head;
+	if (req) {
+		grp->bulk_head = req->next;
+		if (grp->bulk_head == NULL)
+			grp->bulk_tail = &grp->bulk_head;
+	} else {
+		__atomic_store_n(&grp->numbulk, grp->numbulk - 1,
+				 __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&grp->bulk_lock);
+
+	return req;
+}
+
+/*
+ * With bulk_threads, only that many workers of a group process bulk
+ * requests. The others queue theirs for them and go back to reading,
+ * so that metadata requests don't wait behind data transfers.
+ */
+static void fuse_process_request(struct fuse_mt *mt, struct fuse_worker *w)
+{
+	struct fuse_worker_group *grp = w->grp;
+	struct fuse_queued_req *req = NULL;
+	int res;
+
+	if (!mt->bulk_threads || !fuse_is_bulk(&w->fbuf)) {
+		fuse_session_process_buf_int(mt->se, &w->fbuf, w->ch);
+		return;
+	}
+
+	/* Moving the request is only worth it if it is going to wait */
+	if (__atomic_load_n(&grp->numbulk, __ATOMIC_RELAXED) >=
+	    mt->bulk_threads) {
+		res = fuse_take_req(mt, w, &req);
+		/* Already answered, as far as that was possible */
+		if (res != 0 && res != -ENOMEM)
+			return;
+	}
+
+	pthread_mutex_lock(&grp->bulk_lock);
+	if (req && grp->numbulk >= mt->bulk_threads) {
+		req->next = NULL;
+		*grp->bulk_tail = req;
+		grp->bulk_tail = &req->next;
+		pthread_mutex_unlock(&grp->bulk_lock);
+		return;
+	}
+	__atomic_store_n(&grp->numbulk, grp->numbulk + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&grp->bulk_lock);
+
+	if (req)
+		fuse_run_queued(mt, req);
+	else
+		fuse_session_process_buf_int(mt->se, &w->fbuf, w->ch);
+	while ((req = fuse_next_bulk(grp)) != NULL)
+		fuse_run_queued(mt, req);
+}
+
+static void fuse_worker_pin(struct fuse_worker *w)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	struct fuse_worker_group *grp = w->grp;
+
+	if (grp->pinned)
+		pthread_setaffinity_np(pthread_self(), sizeof(grp->cpus),
+				       &grp->cpus);
+#else
+	(void) w;
+#endif
+}
 
 static void *fuse_do_work(void *data)
 {
 	struct fuse_worker *w = (struct fuse_worker *) data;
 	struct fuse_mt *mt = w->mt;
+	struct fuse_worker_group *grp = w->grp;
+
+	/*
+	 * Pin before anything is allocated, so that the request
+	 * buffer and the splice pipe end up local to the group
+	 */
+	fuse_worker_pin(w);
 
 	while (!fuse_session_exited(mt->se)) {
-		int isforget = 0;
+		int avail;
 		int res;
 
+		/* Only a non-blocking device lets workers hold back replies */
+		if (mt->idle_timeout)
+			fuse_ll_reply_batch_prepare(mt->se, w->ch);
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (mt->idle_timeout && fuse_wait_request(w) == -ETIMEDOUT) {
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			pthread_mutex_lock(&mt->lock);
+			if (mt->exit) {
+				pthread_mutex_unlock(&mt->lock);
+				return NULL;
+			}
+			if (fuse_may_shrink(mt, grp))
+				return fuse_worker_exit(mt, w);
+			pthread_mutex_unlock(&mt->lock);
+			continue;
+		}
 		res = fuse_session_receive_buf_int(mt->se, &w->fbuf, w->ch);
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		if (res == -EINTR)
 			continue;
+		/*
+		 * With an idle timeout the device is non-blocking and
+		 * another worker may have picked up the request first
+		 */
+		if (res == -EAGAIN && mt->idle_timeout)
+			continue;
 		if (res <= 0) {
 			if (res < 0) {
 				fuse_session_exit(mt->se);
@@ -135,52 +423,203 @@ static void *fuse_do_work(void *data)
 			break;
 		}
 
-		pthread_mutex_lock(&mt->lock);
-		if (mt->exit) {
-			pthread_mutex_unlock(&mt->lock);
-			return NULL;
-		}
-
 		/*
-		 * This disgusting hack is needed so that zillions of threads
-		 * are not created on a burst of FORGET messages
+		 * A request that was read is processed even if the loop
+		 * is ending. Otherwise it would never be answered, not
+		 * even after fuse_session_handoff().
+		 *
+		 * Forgets count as busy like everything else: a batch of
+		 * them takes a while, and the kernel sends a single
+		 * FORGET whenever only one is queued, or the read buffer
+		 * cannot hold a batch.
 		 */
-		if (!(w->fbuf.flags & FUSE_BUF_IS_FD)) {
-			struct fuse_in_header *in = w->fbuf.mem;
-
-			if (in->opcode == FUSE_FORGET ||
-			    in->opcode == FUSE_BATCH_FORGET)
-				isforget = 1;
+		avail = __atomic_sub_fetch(&grp->numavail, 1, __ATOMIC_SEQ_CST);
+		if (avail == 0 && fuse_may_grow(mt, grp)) {
+			pthread_mutex_lock(&mt->lock);
+			/* Another worker may have become available meanwhile */
+			if (!mt->exit &&
+			    __atomic_load_n(&grp->numavail, __ATOMIC_RELAXED) == 0 &&
+			    fuse_may_grow(mt, grp))
+				fuse_loop_start_thread(mt, grp);
+			pthread_mutex_unlock(&mt->lock);
 		}
 
-		if (!isforget)
-			mt->numavail--;
-		if (mt->numavail == 0)
-			fuse_loop_start_thread(mt);
-		pthread_mutex_unlock(&mt->lock);
+		fuse_process_request(mt, w);
 
-		fuse_session_process_buf_int(mt->se, &w->fbuf, w->ch);
-
-		pthread_mutex_lock(&mt->lock);
-		if (!isforget)
-			mt->numavail++;
-		if (mt->numavail > mt->max_idle) {
+		avail = __atomic_add_fetch(&grp->numavail, 1, __ATOMIC_SEQ_CST);
+		if (!mt->idle_timeout && avail > mt->max_idle &&
+		    fuse_may_shrink(mt, grp)) {
+			pthread_mutex_lock(&mt->lock);
 			if (mt->exit) {
 				pthread_mutex_unlock(&mt->lock);
 				return NULL;
 			}
-			list_del_worker(w);
-			mt->numavail--;
-			mt->numworker--;
+			if (__atomic_load_n(&grp->numavail, __ATOMIC_RELAXED) >
+			    mt->max_idle && fuse_may_shrink(mt, grp))
+				return fuse_worker_exit(mt, w);
 			pthread_mutex_unlock(&mt->lock);
+		}
+	}
+
+	sem_post(&mt->finish);
+
+	return NULL;
+}
+
+static int fuse_deque_push(struct fuse_deque *dq, struct fuse_queued_req *req)
+{
+	int res = -1;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail - dq->head < FUSE_DEQUE_SIZE) {
+		dq->reqs[dq->tail++ % FUSE_DEQUE_SIZE] = req;
+		res = 0;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return res;
+}
+
+static struct fuse_queued_req *fuse_deque_take(struct fuse_deque *dq,
+					       int steal)
+{
+	struct fuse_queued_req *req = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head != dq->tail) {
+		if (steal)
+			req = dq->reqs[--dq->tail % FUSE_DEQUE_SIZE];
+		else
+			req = dq->reqs[dq->head++ % FUSE_DEQUE_SIZE];
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return req;
+}
+
+/* The executor's own next request, or one stolen from another */
+static struct fuse_queued_req *fuse_next_req(struct fuse_executor *ex)
+{
+	struct fuse_mt *mt = ex->mt;
+	struct fuse_queued_req *req;
+	unsigned int idx = ex - mt->execs;
+	unsigned int i;
+
+	req = fuse_deque_take(&ex->dq, 0);
+	for (i = 1; !req && i < mt->numexecs; i++)
+		req = fuse_deque_take(&mt->execs[(idx + i) % mt->numexecs].dq,
+				      1);
+	return req;
+}
 
-			pthread_detach(w->thread_id);
-			free(w->fbuf.mem);
-			fuse_chan_put(w->ch);
-			free(w);
-			return NULL;
+static void *fuse_do_execute(void *data)
+{
+	struct fuse_executor *ex = data;
+	struct fuse_mt *mt = ex->mt;
+	struct fuse_queued_req *req;
+
+	for (;;) {
+		req = fuse_next_req(ex);
+		if (req == NULL) {
+			pthread_mutex_lock(&mt->idle_lock);
+			/*
+			 * Receivers look at numidle after queueing, so
+			 * either they wake us up or we see the request
+			 */
+			__atomic_add_fetch(&mt->numidle, 1, __ATOMIC_SEQ_CST);
+			while (!mt->exit && (req = fuse_next_req(ex)) == NULL)
+				pthread_cond_wait(&mt->idle_cond,
+						  &mt->idle_lock);
+			__atomic_sub_fetch(&mt->numidle, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&mt->idle_lock);
+			if (req == NULL)
+				break;
 		}
-		pthread_mutex_unlock(&mt->lock);
+		fuse_run_queued(mt, req);
+	}
+
+	return NULL;
+}
+
+/*
+ * Hands the request to the executors, round robin. If all of them are
+ * backed up, the receiver processes it itself.
+ */
+static void fuse_dispatch(struct fuse_mt *mt, struct fuse_worker *w)
+{
+	struct fuse_queued_req *req;
+	unsigned int start;
+	unsigned int i;
+	int res;
+
+	res = fuse_take_req(mt, w, &req);
+	if (res == -ENOMEM) {
+		fuse_session_process_buf_int(mt->se, &w->fbuf, w->ch);
+		return;
+	}
+	/* Already answered, as far as that was possible */
+	if (res != 0)
+		return;
+
+	start = __atomic_fetch_add(&mt->next_exec, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < mt->numexecs; i++) {
+		if (fuse_deque_push(&mt->execs[(start + i) % mt->numexecs].dq,
+				    req) == 0)
+			break;
+	}
+	if (i == mt->numexecs) {
+		fuse_run_queued(mt, req);
+		return;
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&mt->numidle, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&mt->idle_lock);
+		pthread_cond_signal(&mt->idle_cond);
+		pthread_mutex_unlock(&mt->idle_lock);
+	}
+}
+
+static int fuse_is_interrupt(const struct fuse_buf *buf)
+{
+	const struct fuse_in_header *in = buf->mem;
+
+	return !(buf->flags & FUSE_BUF_IS_FD) &&
+		in->opcode == FUSE_INTERRUPT;
+}
+
+/*
+ * Receiver of the pipelined loop: reads requests and leaves them to
+ * the executors. Only interrupts are processed right away, as their
+ * request may be waiting in a queue or stuck in a handler.
+ */
+static void *fuse_do_receive(void *data)
+{
+	struct fuse_worker *w = (struct fuse_worker *) data;
+	struct fuse_mt *mt = w->mt;
+	int res;
+
+	fuse_worker_pin(w);
+
+	while (!fuse_session_exited(mt->se)) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_session_receive_buf_int(mt->se, &w->fbuf, w->ch);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0) {
+			if (res < 0) {
+				fuse_session_exit(mt->se);
+				mt->error = res;
+			}
+			break;
+		}
+
+		/* Answered even if the loop is ending, see fuse_do_work() */
+		if (fuse_is_interrupt(&w->fbuf))
+			fuse_session_process_buf_int(mt->se, &w->fbuf, w->ch);
+		else
+			fuse_dispatch(mt, w);
 	}
 
 	sem_post(&mt->finish);
@@ -188,6 +627,62 @@ static void *fuse_do_work(void *data)
 	return NULL;
 }
 
+static int fuse_start_executors(struct fuse_mt *mt, unsigned int num)
+{
+	struct fuse_executor *ex;
+	unsigned int i;
+
+	mt->execs = calloc(num, sizeof(struct fuse_executor));
+	if (mt->execs == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate executors\n");
+		return -1;
+	}
+	pthread_mutex_init(&mt->idle_lock, NULL);
+	pthread_cond_init(&mt->idle_cond, NULL);
+
+	for (i = 0; i < num; i++) {
+		ex = &mt->execs[i];
+		ex->mt = mt;
+		pthread_mutex_init(&ex->dq.lock, NULL);
+		/* Receivers only look at the executors started so far */
+		if (fuse_start_thread(&ex->thread_id, fuse_do_execute, ex) == -1)
+			break;
+		__atomic_store_n(&mt->numexecs, i + 1, __ATOMIC_RELEASE);
+	}
+
+	return mt->numexecs ? 0 : -1;
+}
+
+static void fuse_stop_executors(struct fuse_mt *mt)
+{
+	struct fuse_queued_req *req;
+	unsigned int i;
+
+	if (mt->execs == NULL)
+		return;
+
+	pthread_mutex_lock(&mt->idle_lock);
+	pthread_cond_broadcast(&mt->idle_cond);
+	pthread_mutex_unlock(&mt->idle_lock);
+
+	for (i = 0; i < mt->numexecs; i++)
+		pthread_join(mt->execs[i].thread_id, NULL);
+
+	/* Left over when the session ended */
+	for (i = 0; i < mt->numexecs; i++) {
+		while ((req = fuse_deque_take(&mt->execs[i].dq, 0)) != NULL) {
+			fuse_session_free_buf_int(mt->se, &req->buf);
+			fuse_chan_put(req->ch);
+			free(req);
+		}
+	}
+	for (i = 0; i < mt->numexecs; i++)
+		pthread_mutex_destroy(&mt->execs[i].dq.lock);
+	pthread_cond_destroy(&mt->idle_cond);
+	pthread_mutex_destroy(&mt->idle_lock);
+	free(mt->execs);
+}
+
 int fuse_start_thread(pthread_t *thread_id, void *(*func)(void *), void *arg)
 {
 	sigset_t oldset;
@@ -239,6 +734,8 @@ static struct fuse_chan *fuse_clone_chan(struct fuse_mt *mt)
 		return NULL;
 	}
 	fcntl(clonefd, F_SETFD, FD_CLOEXEC);
+	if (mt->idle_timeout)
+		fcntl(clonefd, F_SETFL, fcntl(clonefd, F_GETFL) | O_NONBLOCK);
 
 	masterfd = mt->se->fd;
 	res = ioctl(clonefd, FUSE_DEV_IOC_CLONE, &masterfd);
@@ -255,7 +752,8 @@ static struct fuse_chan *fuse_clone_chan(struct fuse_mt *mt)
 	return newch;
 }
 
-static int fuse_loop_start_thread(struct fuse_mt *mt)
+static int fuse_loop_start_thread(struct fuse_mt *mt,
+				  struct fuse_worker_group *grp)
 {
 	int res;
 
@@ -266,10 +764,14 @@ static int fuse_loop_start_thread(struct fuse_mt *mt)
 	}
 	memset(w, 0, sizeof(struct fuse_worker));
 	w->fbuf.mem = NULL;
+	w->fbuf.flags = FUSE_BUF_TIERED;
 	w->mt = mt;
+	w->grp = grp;
 
 	w->ch = NULL;
-	if (mt->clone_fd) {
+	if (grp->ch) {
+		w->ch = fuse_chan_get(grp->ch);
+	} else if (mt->clone_fd) {
 		w->ch = fuse_clone_chan(mt);
 		if(!w->ch) {
 			/* Don't attempt this again */
@@ -279,15 +781,19 @@ static int fuse_loop_start_thread(struct fuse_mt *mt)
 		}
 	}
 
-	res = fuse_start_thread(&w->thread_id, fuse_do_work, w);
+	res = fuse_start_thread(&w->thread_id,
+				mt->receivers ? fuse_do_receive : fuse_do_work,
+				w);
 	if (res == -1) {
 		fuse_chan_put(w->ch);
 		free(w);
 		return -1;
 	}
 	list_add_worker(w, &mt->main);
-	mt->numavail ++;
-	mt->numworker ++;
+	__atomic_add_fetch(&grp->numavail, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&grp->numworker, 1, __ATOMIC_SEQ_CST);
+	FUSE_PROBE2(worker_start, grp - mt->groups,
+		    __atomic_load_n(&grp->numworker, __ATOMIC_RELAXED));
 
 	return 0;
 }
@@ -298,49 +804,255 @@ static void fuse_join_worker(struct fuse_mt *mt, struct fuse_worker *w)
 	pthread_mutex_lock(&mt->lock);
 	list_del_worker(w);
 	pthread_mutex_unlock(&mt->lock);
-	free(w->fbuf.mem);
+	FUSE_PROBE2(worker_exit, w->grp - mt->groups, 0);
+	fuse_session_free_buf_int(mt->se, &w->fbuf);
 	fuse_chan_put(w->ch);
 	free(w);
 }
 
-FUSE_SYMVER("fuse_session_loop_mt_32", "fuse_session_loop_mt@@FUSE_3.2")
-int fuse_session_loop_mt_32(struct fuse_session *se, struct fuse_loop_config *config)
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/*
+ * Parse a list in sysfs format ("0-3,8,10-11") into a CPU set
+ */
+static int fuse_read_cpu_list(const char *path, cpu_set_t *set)
+{
+	FILE *fp;
+	char buf[4096];
+	char *p, *end;
+	unsigned long first, last;
+
+	CPU_ZERO(set);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (p == NULL)
+		return -1;
+
+	while (*p && *p != '\n') {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p)
+				return -1;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		p = end;
+		if (*p == ',')
+			p++;
+	}
+
+	return 0;
+}
+
+static void fuse_loop_add_group(struct fuse_mt *mt, cpu_set_t *cpus)
+{
+	struct fuse_worker_group *grp = &mt->groups[mt->numgroups++];
+
+	grp->pinned = 1;
+	grp->cpus = *cpus;
+	/*
+	 * On failure the group's workers simply share the session fd,
+	 * as they always do with a custom transport
+	 */
+	if (!mt->se->io)
+		grp->ch = fuse_clone_chan(mt);
+}
+
+static int fuse_loop_setup_groups(struct fuse_mt *mt, int affinity)
 {
-	int err;
+	cpu_set_t allowed;
+	cpu_set_t cpus;
+	cpu_set_t nodes;
+	char path[64];
+	unsigned int maxgroups = 1;
+	unsigned int i;
+
+	if (affinity != FUSE_LOOP_AFFINITY_NONE) {
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+			fuse_log(FUSE_LOG_ERR, "fuse: failed to get CPU "
+				 "affinity: %s\n", strerror(errno));
+			affinity = FUSE_LOOP_AFFINITY_NONE;
+		} else {
+			/* Every group has at least one CPU */
+			maxgroups = CPU_COUNT(&allowed);
+		}
+	}
+
+	mt->numgroups = 0;
+	mt->groups = calloc(maxgroups, sizeof(struct fuse_worker_group));
+	if (mt->groups == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate worker groups\n");
+		return -1;
+	}
+
+	if (affinity == FUSE_LOOP_AFFINITY_CPU) {
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (!CPU_ISSET(i, &allowed))
+				continue;
+			CPU_ZERO(&cpus);
+			CPU_SET(i, &cpus);
+			fuse_loop_add_group(mt, &cpus);
+		}
+	} else if (affinity == FUSE_LOOP_AFFINITY_NODE) {
+		/* Node numbers, stored in a CPU set for convenience */
+		if (fuse_read_cpu_list(SYSFS_NODE_DIR "/online", &nodes) == -1)
+			CPU_ZERO(&nodes);
+		for (i = 0; i < CPU_SETSIZE && mt->numgroups < maxgroups; i++) {
+			if (!CPU_ISSET(i, &nodes))
+				continue;
+			snprintf(path, sizeof(path),
+				 SYSFS_NODE_DIR "/node%u/cpulist", i);
+			if (fuse_read_cpu_list(path, &cpus) == -1)
+				continue;
+			CPU_AND(&cpus, &cpus, &allowed);
+			if (CPU_COUNT(&cpus) == 0)
+				continue;
+			fuse_loop_add_group(mt, &cpus);
+		}
+		if (mt->numgroups == 0)
+			fuse_log(FUSE_LOG_ERR, "fuse: no NUMA nodes found, "
+				 "workers will not be pinned\n");
+	}
+
+	if (mt->numgroups == 0)
+		mt->numgroups = 1;
+
+	return 0;
+}
+#else
+static int fuse_loop_setup_groups(struct fuse_mt *mt, int affinity)
+{
+	if (affinity != FUSE_LOOP_AFFINITY_NONE)
+		fuse_log(FUSE_LOG_ERR, "fuse: worker affinity is not "
+			 "supported on this platform\n");
+
+	mt->numgroups = 1;
+	mt->groups = calloc(1, sizeof(struct fuse_worker_group));
+	if (mt->groups == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate worker groups\n");
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+FUSE_SYMVER("fuse_session_loop_mt_311", "fuse_session_loop_mt@@FUSE_3.11")
+int fuse_session_loop_mt_311(struct fuse_session *se,
+			     struct fuse_loop_config *config)
+{
+	int err = 0;
+	int fdflags = -1;
+	unsigned int i, g;
 	struct fuse_mt mt;
 	struct fuse_worker *w;
 
 	memset(&mt, 0, sizeof(struct fuse_mt));
 	mt.se = se;
-	mt.clone_fd = config->clone_fd;
+	/* Custom transports have no device to clone */
+	mt.clone_fd = config->clone_fd && !se->io;
 	mt.error = 0;
-	mt.numworker = 0;
-	mt.numavail = 0;
 	mt.max_idle = config->max_idle_threads;
+	mt.max_threads = config->max_threads;
+	mt.min_threads = config->min_threads ? config->min_threads : 1;
+	if (mt.max_threads && mt.min_threads > mt.max_threads)
+		mt.min_threads = mt.max_threads;
+	mt.idle_timeout = config->idle_timeout_ms;
+	mt.bulk_threads = config->bulk_threads;
+	mt.receivers = config->receivers;
+	if (mt.receivers) {
+		/* Receivers block in read(), executors never exit */
+		mt.idle_timeout = 0;
+		mt.bulk_threads = 0;
+	}
 	mt.main.thread_id = pthread_self();
 	mt.main.prev = mt.main.next = &mt.main;
 	sem_init(&mt.finish, 0, 0);
 	pthread_mutex_init(&mt.lock, NULL);
 
+	/*
+	 * Idle workers wait in poll() with a timeout, the read itself
+	 * must not block so that workers losing the race for a
+	 * request return to poll().
+	 */
+	if (mt.idle_timeout) {
+		fdflags = fcntl(se->fd, F_GETFL);
+		if (fdflags == -1 ||
+		    fcntl(se->fd, F_SETFL, fdflags | O_NONBLOCK) == -1) {
+			fuse_log(FUSE_LOG_ERR, "fuse: failed to set device "
+				 "non-blocking: %s\n", strerror(errno));
+			err = -1;
+		}
+	}
+
+	if (!err)
+		err = fuse_loop_setup_groups(&mt, config->affinity);
+	for (g = 0; !err && g < mt.numgroups; g++) {
+		pthread_mutex_init(&mt.groups[g].bulk_lock, NULL);
+		mt.groups[g].bulk_tail = &mt.groups[g].bulk_head;
+	}
+
+	if (!err && mt.receivers) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (cpus < FUSE_MIN_EXECUTORS)
+			cpus = FUSE_MIN_EXECUTORS;
+		err = fuse_start_executors(&mt, mt.max_threads ? mt.max_threads :
+					   cpus);
+	}
+
 	pthread_mutex_lock(&mt.lock);
-	err = fuse_loop_start_thread(&mt);
+	for (g = 0; !err && g < mt.numgroups; g++) {
+		unsigned int num = mt.receivers ? mt.receivers : mt.min_threads;
+
+		for (i = 0; !err && i < num; i++)
+			err = fuse_loop_start_thread(&mt, &mt.groups[g]);
+	}
 	pthread_mutex_unlock(&mt.lock);
 	if (!err) {
 		/* sem_wait() is interruptible */
 		while (!fuse_session_exited(se))
 			sem_wait(&mt.finish);
+	}
+
+	pthread_mutex_lock(&mt.lock);
+	for (w = mt.main.next; w != &mt.main; w = w->next)
+		pthread_cancel(w->thread_id);
+	__atomic_store_n(&mt.exit, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mt.lock);
 
-		pthread_mutex_lock(&mt.lock);
-		for (w = mt.main.next; w != &mt.main; w = w->next)
-			pthread_cancel(w->thread_id);
-		mt.exit = 1;
-		pthread_mutex_unlock(&mt.lock);
+	while (mt.main.next != &mt.main)
+		fuse_join_worker(&mt, mt.main.next);
+	fuse_stop_executors(&mt);
 
-		while (mt.main.next != &mt.main)
-			fuse_join_worker(&mt, mt.main.next);
+	for (g = 0; mt.groups && g < mt.numgroups; g++) {
+		struct fuse_worker_group *grp = &mt.groups[g];
+		struct fuse_queued_req *req;
 
-		err = mt.error;
+		/* Left over when the session ended */
+		while ((req = grp->bulk_head) != NULL) {
+			grp->bulk_head = req->next;
+			fuse_session_free_buf_int(se, &req->buf);
+			fuse_chan_put(req->ch);
+			free(req);
+		}
+		if (grp->bulk_tail)
+			pthread_mutex_destroy(&grp->bulk_lock);
+		fuse_chan_put(grp->ch);
 	}
+	free(mt.groups);
+
+	if (!err)
+		err = mt.error;
+	if (fdflags != -1)
+		fcntl(se->fd, F_SETFL, fdflags);
 
 	pthread_mutex_destroy(&mt.lock);
 	sem_destroy(&mt.finish);
@@ -350,12 +1062,26 @@ int fuse_session_loop_mt_32(struct fuse_session *se, struct fuse_loop_config *co
 	return err;
 }
 
+FUSE_SYMVER("fuse_session_loop_mt_32", "fuse_session_loop_mt@FUSE_3.2")
+int fuse_session_loop_mt_32(struct fuse_session *se,
+			    struct fuse_loop_config_v1 *config_v1)
+{
+	struct fuse_loop_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.clone_fd = config_v1->clone_fd;
+	config.max_idle_threads = config_v1->max_idle_threads;
+	return fuse_session_loop_mt_311(se, &config);
+}
+
 int fuse_session_loop_mt_31(struct fuse_session *se, int clone_fd);
 FUSE_SYMVER("fuse_session_loop_mt_31", "fuse_session_loop_mt@FUSE_3.0")
 int fuse_session_loop_mt_31(struct fuse_session *se, int clone_fd)
 {
 	struct fuse_loop_config config;
+
+	memset(&config, 0, sizeof(config));
 	config.clone_fd = clone_fd;
 	config.max_idle_threads = 10;
-	return fuse_session_loop_mt_32(se, &config);
+	return fuse_session_loop_mt_311(se, &config);
 }
@@ -0,0 +1,565 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Implementation of the loop that serves many sessions with one pool
+  of worker threads.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "fuse_lowlevel.h"
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Handlers block on I/O, so one worker per CPU may be too few */
+#define FUSE_ML_MIN_WORKERS 4
+
+/* Events taken from epoll_wait() at once */
+#define FUSE_ML_EVENTS 64
+
+/*
+ * The device of a session is read by one worker at a time. Until the
+ * device runs dry, the reader queues the session again behind the
+ * others right after reading a request, so that the next one can be
+ * read while the first is processed.
+ */
+enum fuse_ml_state {
+	/* Waiting in epoll for the device to become readable */
+	FUSE_ML_POLLED,
+	/* In ml->ready */
+	FUSE_ML_READY,
+	/* In ml->parked: has its share of the workers */
+	FUSE_ML_PARKED,
+	/* A worker reads from it */
+	FUSE_ML_READING,
+	/* Not read any more, leaves the loop once busy is zero */
+	FUSE_ML_ENDED,
+	/* Left the loop, freed by the polling thread */
+	FUSE_ML_GONE,
+};
+
+struct fuse_ml_session {
+	struct fuse_ml_session *prev;
+	struct fuse_ml_session *next;
+	/* Next in ml->ready or ml->parked, or in ml->gone */
+	struct fuse_ml_session *qnext;
+	struct fuse_session *se;
+	void (*done)(struct fuse_session *se, int err, void *data);
+	void *data;
+	int fdflags;
+	enum fuse_ml_state state;
+	/* Set by fuse_multi_loop_remove() while a worker reads */
+	int removed;
+	/* Workers processing requests of the session */
+	unsigned int busy;
+	int error;
+};
+
+struct fuse_ml_queue {
+	struct fuse_ml_session *head;
+	struct fuse_ml_session **tail;
+};
+
+struct fuse_multi_loop {
+	pthread_mutex_t lock;
+	/* Workers wait here for a session to read from */
+	pthread_cond_t cond;
+	int epfd;
+	/* Wakes up the polling thread */
+	int evfd;
+	struct fuse_ml_session sessions;
+	struct fuse_ml_queue ready;
+	struct fuse_ml_queue parked;
+	struct fuse_ml_session *gone;
+	unsigned int numworkers;
+	/* Workers reading or processing a request */
+	unsigned int numbusy;
+	unsigned int session_threads;
+	pthread_t *workers;
+	int running;
+	int exit;
+};
+
+static void fuse_ml_enqueue(struct fuse_ml_queue *q, struct fuse_ml_session *s)
+{
+	s->qnext = NULL;
+	*q->tail = s;
+	q->tail = &s->qnext;
+}
+
+static struct fuse_ml_session *fuse_ml_dequeue(struct fuse_ml_queue *q)
+{
+	struct fuse_ml_session *s = q->head;
+
+	if (s != NULL) {
+		q->head = s->qnext;
+		if (q->head == NULL)
+			q->tail = &q->head;
+	}
+	return s;
+}
+
+static void fuse_ml_unqueue(struct fuse_ml_queue *q, struct fuse_ml_session *s)
+{
+	struct fuse_ml_session **p;
+
+	for (p = &q->head; *p != s; p = &(*p)->qnext)
+		;
+	*p = s->qnext;
+	if (q->tail == &s->qnext)
+		q->tail = p;
+}
+
+/* Hands the session to a worker, called with ml->lock held */
+static void fuse_ml_make_ready(struct fuse_multi_loop *ml,
+			       struct fuse_ml_session *s)
+{
+	if (s->busy < ml->session_threads) {
+		s->state = FUSE_ML_READY;
+		fuse_ml_enqueue(&ml->ready, s);
+	} else {
+		s->state = FUSE_ML_PARKED;
+		fuse_ml_enqueue(&ml->parked, s);
+	}
+	pthread_cond_signal(&ml->cond);
+}
+
+/*
+ * Sessions over their share are only served by otherwise idle workers,
+ * and one worker is always left for the others
+ */
+static struct fuse_ml_session *fuse_ml_next(struct fuse_multi_loop *ml)
+{
+	struct fuse_ml_session *s = fuse_ml_dequeue(&ml->ready);
+
+	if (s == NULL && ml->numbusy + 1 < ml->numworkers)
+		s = fuse_ml_dequeue(&ml->parked);
+	return s;
+}
+
+static int fuse_ml_poll(struct fuse_multi_loop *ml, struct fuse_ml_session *s,
+			int op)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.ptr = s,
+	};
+
+	if (epoll_ctl(ml->epfd, op, s->se->fd, &ev) == -1)
+		return -errno;
+	s->state = FUSE_ML_POLLED;
+	return 0;
+}
+
+/* Stops reading from the session, called with ml->lock held */
+static void fuse_ml_end(struct fuse_multi_loop *ml, struct fuse_ml_session *s)
+{
+	switch (s->state) {
+	case FUSE_ML_POLLED:
+		epoll_ctl(ml->epfd, EPOLL_CTL_DEL, s->se->fd, NULL);
+		break;
+	case FUSE_ML_READY:
+		fuse_ml_unqueue(&ml->ready, s);
+		break;
+	case FUSE_ML_PARKED:
+		fuse_ml_unqueue(&ml->parked, s);
+		break;
+	case FUSE_ML_READING:
+		/* The reader ends it */
+		s->removed = 1;
+		return;
+	default:
+		return;
+	}
+	s->state = FUSE_ML_ENDED;
+}
+
+/*
+ * Lets the session go once its last request is done. Called with
+ * ml->lock held, which is dropped around the callback.
+ */
+static void fuse_ml_leave(struct fuse_multi_loop *ml, struct fuse_ml_session *s)
+{
+	struct fuse_session *se = s->se;
+	int err;
+
+	if (s->state != FUSE_ML_ENDED || s->busy)
+		return;
+
+	s->state = FUSE_ML_GONE;
+	s->prev->next = s->next;
+	s->next->prev = s->prev;
+	/* No longer reported, but maybe already taken from epoll */
+	epoll_ctl(ml->epfd, EPOLL_CTL_DEL, se->fd, NULL);
+	pthread_mutex_unlock(&ml->lock);
+
+	fuse_ll_trim_bufs(se);
+	fcntl(se->fd, F_SETFL, s->fdflags);
+	__atomic_store_n(&se->multi_loop_fd, -1, __ATOMIC_RELEASE);
+	err = s->error;
+	if (se->error != 0)
+		err = se->error;
+	fuse_session_reset(se);
+	s->done(se, err, s->data);
+
+	pthread_mutex_lock(&ml->lock);
+	if (ml->running) {
+		s->qnext = ml->gone;
+		ml->gone = s;
+	} else {
+		free(s);
+	}
+}
+
+static void *fuse_ml_worker(void *data)
+{
+	struct fuse_multi_loop *ml = data;
+	struct fuse_buf fbuf = {
+		.mem = NULL,
+		.flags = FUSE_BUF_TIERED,
+	};
+	struct fuse_ml_session *s;
+	struct fuse_session *se;
+	int res;
+
+	pthread_mutex_lock(&ml->lock);
+	for (;;) {
+		s = NULL;
+		while (!ml->exit && (s = fuse_ml_next(ml)) == NULL)
+			pthread_cond_wait(&ml->cond, &ml->lock);
+		if (s == NULL)
+			break;
+		ml->numbusy++;
+		s->state = FUSE_ML_READING;
+		se = s->se;
+		pthread_mutex_unlock(&ml->lock);
+
+		/* The device is non-blocking */
+		res = fuse_session_receive_buf_int(se, &fbuf, NULL);
+		if (res <= 0)
+			fuse_session_return_buf_int(se, &fbuf);
+
+		pthread_mutex_lock(&ml->lock);
+		if (res > 0) {
+			s->busy++;
+			if (s->removed || fuse_session_exited(se))
+				s->state = FUSE_ML_ENDED;
+			else
+				fuse_ml_make_ready(ml, s);
+			pthread_mutex_unlock(&ml->lock);
+
+			fuse_session_process_buf_int(se, &fbuf, NULL);
+			fuse_session_return_buf_int(se, &fbuf);
+
+			pthread_mutex_lock(&ml->lock);
+			s->busy--;
+			if (s->state == FUSE_ML_PARKED &&
+			    s->busy < ml->session_threads) {
+				fuse_ml_unqueue(&ml->parked, s);
+				fuse_ml_make_ready(ml, s);
+			}
+		} else if (s->removed || fuse_session_exited(se) ||
+			   (res != -EAGAIN && res != -EINTR)) {
+			/* Unmounted, or the device failed */
+			if (res < 0 && res != -EAGAIN && res != -EINTR)
+				s->error = res;
+			s->state = FUSE_ML_ENDED;
+		} else if (res == -EINTR) {
+			fuse_ml_make_ready(ml, s);
+		} else {
+			res = fuse_ml_poll(ml, s, EPOLL_CTL_MOD);
+			if (res < 0) {
+				s->error = res;
+				s->state = FUSE_ML_ENDED;
+			}
+		}
+
+		/* An idle session keeps no buffers */
+		if (s->state == FUSE_ML_POLLED && !s->busy)
+			fuse_ll_trim_bufs(se);
+		fuse_ml_leave(ml, s);
+		ml->numbusy--;
+	}
+	pthread_mutex_unlock(&ml->lock);
+
+	free(fbuf.mem);
+	return NULL;
+}
+
+struct fuse_multi_loop *fuse_multi_loop_new(const struct fuse_loop_config *config)
+{
+	struct fuse_multi_loop *ml;
+	struct epoll_event ev = { .events = EPOLLIN };
+	long cpus;
+
+	ml = calloc(1, sizeof(struct fuse_multi_loop));
+	if (ml == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate loop\n");
+		return NULL;
+	}
+	ml->sessions.prev = ml->sessions.next = &ml->sessions;
+	ml->ready.tail = &ml->ready.head;
+	ml->parked.tail = &ml->parked.head;
+
+	if (config)
+		ml->numworkers = config->max_threads;
+	if (!ml->numworkers) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		ml->numworkers = cpus < FUSE_ML_MIN_WORKERS ?
+			FUSE_ML_MIN_WORKERS : cpus;
+	}
+	if (config)
+		ml->session_threads = config->session_threads;
+	if (!ml->session_threads)
+		ml->session_threads = ml->numworkers / 2;
+	if (!ml->session_threads)
+		ml->session_threads = 1;
+
+	ml->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ml->epfd == -1) {
+		fuse_log(FUSE_LOG_ERR, "fuse: epoll_create1: %s\n",
+			 strerror(errno));
+		goto out_free;
+	}
+	ml->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ml->evfd == -1) {
+		fuse_log(FUSE_LOG_ERR, "fuse: eventfd: %s\n", strerror(errno));
+		goto out_close_ep;
+	}
+	/* data.ptr NULL stands for the eventfd */
+	if (epoll_ctl(ml->epfd, EPOLL_CTL_ADD, ml->evfd, &ev) == -1) {
+		fuse_log(FUSE_LOG_ERR, "fuse: epoll_ctl: %s\n", strerror(errno));
+		goto out_close_ev;
+	}
+	pthread_mutex_init(&ml->lock, NULL);
+	pthread_cond_init(&ml->cond, NULL);
+
+	return ml;
+
+out_close_ev:
+	close(ml->evfd);
+out_close_ep:
+	close(ml->epfd);
+out_free:
+	free(ml);
+	return NULL;
+}
+
+int fuse_multi_loop_add(struct fuse_multi_loop *ml, struct fuse_session *se,
+			void (*done)(struct fuse_session *se, int err,
+				     void *data),
+			void *data)
+{
+	struct fuse_ml_session *s;
+	int res;
+
+	if (se->fd == -1 || se->io != NULL || se->multi_loop_fd != -1 ||
+	    done == NULL)
+		return -EINVAL;
+
+	s = calloc(1, sizeof(struct fuse_ml_session));
+	if (s == NULL)
+		return -ENOMEM;
+	s->se = se;
+	s->done = done;
+	s->data = data;
+
+	s->fdflags = fcntl(se->fd, F_GETFL);
+	if (s->fdflags == -1 ||
+	    fcntl(se->fd, F_SETFL, s->fdflags | O_NONBLOCK) == -1) {
+		res = -errno;
+		free(s);
+		return res;
+	}
+	__atomic_store_n(&se->multi_loop_fd, ml->evfd, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&ml->lock);
+	res = fuse_ml_poll(ml, s, EPOLL_CTL_ADD);
+	if (res == 0) {
+		s->next = &ml->sessions;
+		s->prev = ml->sessions.prev;
+		ml->sessions.prev->next = s;
+		ml->sessions.prev = s;
+	}
+	pthread_mutex_unlock(&ml->lock);
+
+	if (res < 0) {
+		__atomic_store_n(&se->multi_loop_fd, -1, __ATOMIC_RELEASE);
+		fcntl(se->fd, F_SETFL, s->fdflags);
+		free(s);
+	}
+	return res;
+}
+
+void fuse_multi_loop_remove(struct fuse_multi_loop *ml,
+			    struct fuse_session *se)
+{
+	struct fuse_ml_session *s;
+
+	pthread_mutex_lock(&ml->lock);
+	for (s = ml->sessions.next; s != &ml->sessions; s = s->next) {
+		if (s->se == se) {
+			fuse_ml_end(ml, s);
+			fuse_ml_leave(ml, s);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ml->lock);
+}
+
+/*
+ * Ends the sessions that fuse_session_exit() was called for while
+ * they waited for requests. Called with ml->lock held.
+ */
+static void fuse_ml_end_exited(struct fuse_multi_loop *ml)
+{
+	struct fuse_ml_session *s;
+
+restart:
+	for (s = ml->sessions.next; s != &ml->sessions; s = s->next) {
+		if (s->state > FUSE_ML_READING || !fuse_session_exited(s->se))
+			continue;
+		fuse_ml_end(ml, s);
+		if (s->state == FUSE_ML_ENDED && !s->busy) {
+			/* Drops the lock, so the list may have changed */
+			fuse_ml_leave(ml, s);
+			goto restart;
+		}
+	}
+}
+
+/* Called with ml->lock held */
+static void fuse_ml_free_gone(struct fuse_multi_loop *ml)
+{
+	struct fuse_ml_session *s;
+
+	while ((s = ml->gone) != NULL) {
+		ml->gone = s->qnext;
+		free(s);
+	}
+}
+
+int fuse_multi_loop_run(struct fuse_multi_loop *ml)
+{
+	struct epoll_event events[FUSE_ML_EVENTS];
+	struct fuse_ml_session *s;
+	unsigned int started;
+	uint64_t val;
+	int err = 0;
+	int res;
+	int i;
+
+	pthread_mutex_lock(&ml->lock);
+	if (ml->running) {
+		pthread_mutex_unlock(&ml->lock);
+		return -EBUSY;
+	}
+	ml->running = 1;
+	pthread_mutex_unlock(&ml->lock);
+
+	ml->workers = calloc(ml->numworkers, sizeof(pthread_t));
+	if (ml->workers == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate workers\n");
+		err = -ENOMEM;
+	}
+	for (started = 0; !err && started < ml->numworkers; started++) {
+		if (fuse_start_thread(&ml->workers[started], fuse_ml_worker,
+				      ml) == -1) {
+			err = -EAGAIN;
+			break;
+		}
+	}
+
+	while (!err && !__atomic_load_n(&ml->exit, __ATOMIC_ACQUIRE)) {
+		res = epoll_wait(ml->epfd, events, FUSE_ML_EVENTS, -1);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			fuse_log(FUSE_LOG_ERR, "fuse: epoll_wait: %s\n",
+				 strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&ml->lock);
+		for (i = 0; i < res; i++) {
+			s = events[i].data.ptr;
+			if (s == NULL) {
+				while (read(ml->evfd, &val, sizeof(val)) > 0)
+					;
+				fuse_ml_end_exited(ml);
+			} else if (s->state == FUSE_ML_POLLED) {
+				fuse_ml_make_ready(ml, s);
+			}
+		}
+		/* Nothing taken from epoll refers to them any more */
+		fuse_ml_free_gone(ml);
+		pthread_mutex_unlock(&ml->lock);
+	}
+
+	pthread_mutex_lock(&ml->lock);
+	ml->exit = 1;
+	pthread_cond_broadcast(&ml->cond);
+	pthread_mutex_unlock(&ml->lock);
+	while (started)
+		pthread_join(ml->workers[--started], NULL);
+	free(ml->workers);
+	ml->workers = NULL;
+
+	pthread_mutex_lock(&ml->lock);
+	while ((s = ml->sessions.next) != &ml->sessions) {
+		fuse_ml_end(ml, s);
+		fuse_ml_leave(ml, s);
+	}
+	fuse_ml_free_gone(ml);
+	ml->running = 0;
+	ml->exit = 0;
+	pthread_mutex_unlock(&ml->lock);
+
+	return err;
+}
+
+void fuse_multi_loop_exit(struct fuse_multi_loop *ml)
+{
+	uint64_t val = 1;
+	ssize_t res;
+
+	__atomic_store_n(&ml->exit, 1, __ATOMIC_RELEASE);
+	res = write(ml->evfd, &val, sizeof(val));
+	(void) res;
+}
+
+void fuse_multi_loop_destroy(struct fuse_multi_loop *ml)
+{
+	struct fuse_ml_session *s;
+
+	if (ml == NULL)
+		return;
+
+	while ((s = ml->sessions.next) != &ml->sessions) {
+		s->prev->next = s->next;
+		s->next->prev = s->prev;
+		fcntl(s->se->fd, F_SETFL, s->fdflags);
+		__atomic_store_n(&s->se->multi_loop_fd, -1, __ATOMIC_RELEASE);
+		free(s);
+	}
+	pthread_cond_destroy(&ml->cond);
+	pthread_mutex_destroy(&ml->lock);
+	close(ml->evfd);
+	close(ml->epfd);
+	free(ml);
+}
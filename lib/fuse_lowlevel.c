@@ -17,6 +17,7 @@
 #include "fuse_opt.h"
 #include "fuse_misc.h"
 #include "mount_util.h"
+#include "fuse_probes.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +28,11 @@
 #include <errno.h>
 #include <assert.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <poll.h>
 
 #ifndef F_LINUX_SPECIFIC_BASE
 #define F_LINUX_SPECIFIC_BASE       1024
@@ -37,6 +43,38 @@
 
 
 #define PARAM(inarg) (((char *)(inarg)) + sizeof(*(inarg)))
+
+/* Number of free request objects each thread keeps around */
+#define FUSE_REQ_CACHE_MAX 64
+
+/* Number of pipes kept for reuse, unless pipe_pool is larger */
+#define FUSE_PIPE_POOL_MAX 16
+
+/* Large buffers are rounded up to this with buf_hugepage */
+#define FUSE_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Spliced requests smaller than this are always copied, so that the
+ * headers (in particular those of FORGET requests, which fuse_loop_mt
+ * needs to see) can be inspected.
+ */
+#define FUSE_SPLICE_MIN_THRESHOLD				\
+	(sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in))
+
+/* With splice_autotune, every n-th large request is copied anyway */
+#define FUSE_SPLICE_PROBE_INTERVAL 64
+
+/* Buffer space for batched replies, and the largest reply batched */
+#define FUSE_REPLY_BATCH_SIZE (64 * 1024)
+#define FUSE_REPLY_BATCH_MSG_MAX 4096
+
+/* Default for reply_batch_delay (us) */
+#define FUSE_REPLY_BATCH_DELAY 100
+
+/* Update a counter that only the calling thread writes */
+#define FUSE_STAT_ADD(var, n) \
+	__atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+
 #define OFFSET_MAX 0x7fffffffffffffffLL
 
 #define container_of(ptr, type, member) ({				\
@@ -55,6 +93,14 @@ static __attribute__((constructor)) void fuse_ll_init_pagesize(void)
 	pagesize = getpagesize();
 }
 
+static uint64_t fuse_ll_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void convert_stat(const struct stat *stbuf, struct fuse_attr *attr)
 {
 	attr->ino	= stbuf->st_ino;
@@ -121,55 +167,746 @@ static void list_add_req(struct fuse_req *req, struct fuse_req *next)
 	next->prev = req;
 }
 
+static uint64_t inflight_hash(uint64_t unique)
+{
+	return unique * 0x9e3779b97f4a7c15ULL;
+}
+
+/* The top bits select the shard, the ones below them the bucket */
+static struct fuse_inflight_shard *inflight_shard(struct fuse_session *se,
+						  uint64_t unique)
+{
+	return &se->inflight[inflight_hash(unique) >>
+			     (64 - FUSE_INFLIGHT_SHARD_BITS)];
+}
+
+static size_t inflight_bucket(struct fuse_inflight_shard *sh, uint64_t unique)
+{
+	return (inflight_hash(unique) >> 32) & (sh->size - 1);
+}
+
+/* Called with sh->lock held */
+static void inflight_grow(struct fuse_inflight_shard *sh)
+{
+	struct fuse_req **old = sh->buckets;
+	size_t oldsize = sh->size;
+	struct fuse_req **buckets;
+	size_t i;
+
+	buckets = calloc(oldsize * 2, sizeof(buckets[0]));
+	if (buckets == NULL)
+		return;	/* Longer chains will do */
+
+	sh->buckets = buckets;
+	sh->size = oldsize * 2;
+	for (i = 0; i < oldsize; i++) {
+		struct fuse_req *req;
+		struct fuse_req *next;
+
+		for (req = old[i]; req != NULL; req = next) {
+			size_t b = inflight_bucket(sh, req->unique);
+
+			next = req->hash_next;
+			req->hash_next = buckets[b];
+			buckets[b] = req;
+		}
+	}
+	free(old);
+}
+
+/* Called with sh->lock held */
+static struct fuse_req *inflight_find(struct fuse_inflight_shard *sh,
+				      uint64_t unique)
+{
+	struct fuse_req *req;
+
+	for (req = sh->buckets[inflight_bucket(sh, unique)]; req != NULL;
+	     req = req->hash_next)
+		if (req->unique == unique)
+			break;
+
+	return req;
+}
+
+/* Called with sh->lock held, req need not be in the table */
+static void inflight_del(struct fuse_inflight_shard *sh, struct fuse_req *req)
+{
+	struct fuse_req **reqp;
+
+	for (reqp = &sh->buckets[inflight_bucket(sh, req->unique)];
+	     *reqp != NULL; reqp = &(*reqp)->hash_next)
+		if (*reqp == req) {
+			*reqp = req->hash_next;
+			req->hash_next = NULL;
+			sh->count--;
+			return;
+		}
+}
+
+static void fuse_ll_destroy_inflight(struct fuse_session *se)
+{
+	size_t i;
+
+	for (i = 0; i < FUSE_INFLIGHT_SHARDS; i++) {
+		free(se->inflight[i].buckets);
+		pthread_mutex_destroy(&se->inflight[i].lock);
+	}
+}
+
+/*
+ * Adds a new request to the in-flight table and returns the number of
+ * interrupts waiting for their request. That is read under the shard
+ * lock, and do_interrupt() counts an interrupt before looking up its
+ * request, so either the interrupt finds req, or this sees it pending.
+ */
+static unsigned int fuse_ll_add_inflight(struct fuse_session *se,
+					 struct fuse_req *req)
+{
+	struct fuse_inflight_shard *sh = inflight_shard(se, req->unique);
+	unsigned int pending;
+	size_t b;
+
+	pthread_mutex_lock(&sh->lock);
+	if (sh->count >= 2 * sh->size)
+		inflight_grow(sh);
+	b = inflight_bucket(sh, req->unique);
+	req->hash_next = sh->buckets[b];
+	sh->buckets[b] = req;
+	sh->count++;
+	pending = __atomic_load_n(&se->interrupts_pending, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sh->lock);
+
+	return pending;
+}
+
+static struct fuse_req_cache *fuse_ll_get_req_cache(struct fuse_session *se)
+{
+	struct fuse_req_cache *cache = pthread_getspecific(se->req_key);
+
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct fuse_req_cache));
+		if (cache == NULL)
+			return NULL;
+
+		cache->se = se;
+		pthread_setspecific(se->req_key, cache);
+		pthread_mutex_lock(&se->lock);
+		cache->next = se->req_caches.next;
+		cache->prev = &se->req_caches;
+		se->req_caches.next->prev = cache;
+		se->req_caches.next = cache;
+		pthread_mutex_unlock(&se->lock);
+	}
+
+	return cache;
+}
+
+static void fuse_ll_req_cache_free(struct fuse_req_cache *cache)
+{
+	struct fuse_req *req;
+
+	while ((req = cache->free) != NULL) {
+		cache->free = req->next;
+		pthread_mutex_destroy(&req->lock);
+		free(req);
+	}
+	free(cache);
+}
+
+static void fuse_ll_add_op_stats(struct fuse_opcode_stats *dst,
+				 struct fuse_opcode_stats *src)
+{
+	int i, j;
+
+	for (i = 0; i < FUSE_STATS_MAX_OPCODE; i++) {
+		dst[i].count += __atomic_load_n(&src[i].count,
+						__ATOMIC_RELAXED);
+		dst[i].in_flight += __atomic_load_n(&src[i].in_flight,
+						    __ATOMIC_RELAXED);
+		dst[i].bytes_in += __atomic_load_n(&src[i].bytes_in,
+						   __ATOMIC_RELAXED);
+		dst[i].bytes_out += __atomic_load_n(&src[i].bytes_out,
+						    __ATOMIC_RELAXED);
+		for (j = 0; j < FUSE_STATS_LATENCY_BUCKETS; j++)
+			dst[i].latency[j] +=
+				__atomic_load_n(&src[i].latency[j],
+						__ATOMIC_RELAXED);
+	}
+}
+
+static void fuse_ll_req_cache_destructor(void *data)
+{
+	struct fuse_req_cache *cache = data;
+	struct fuse_session *se = cache->se;
+
+	pthread_mutex_lock(&se->lock);
+	cache->prev->next = cache->next;
+	cache->next->prev = cache->prev;
+	se->req_allocs += cache->allocs;
+	se->req_hits += cache->hits;
+	fuse_ll_add_op_stats(se->op_stats, cache->ops);
+	pthread_mutex_unlock(&se->lock);
+	fuse_ll_req_cache_free(cache);
+}
+
+/*
+ * Requests are returned to the cache of the thread that frees them,
+ * which may be different from the one that allocated them. This
+ * may be called with se->lock held, so it must not create a cache.
+ */
+static void fuse_ll_admit_release(struct fuse_req *req);
+
 static void destroy_req(fuse_req_t req)
 {
+	struct fuse_req_cache *cache = pthread_getspecific(req->se->req_key);
+
+	/* INTERRUPT requests are never answered */
+	if (req->admit_bytes)
+		fuse_ll_admit_release(req);
+
+	if (cache != NULL && cache->count < FUSE_REQ_CACHE_MAX) {
+		req->next = cache->free;
+		cache->free = req;
+		cache->count++;
+		return;
+	}
+
 	pthread_mutex_destroy(&req->lock);
 	free(req);
 }
 
+static void fuse_ll_stats_receive(struct fuse_req *req,
+				  const struct fuse_in_header *in,
+				  uint64_t start)
+{
+	struct fuse_req_cache *cache = fuse_ll_get_req_cache(req->se);
+	struct fuse_opcode_stats *st;
+
+	if (cache == NULL || in->opcode >= FUSE_STATS_MAX_OPCODE)
+		return;
+
+	st = &cache->ops[in->opcode];
+	FUSE_STAT_ADD(st->count, 1);
+	FUSE_STAT_ADD(st->in_flight, 1);
+	FUSE_STAT_ADD(st->bytes_in, in->len);
+	req->opcode = in->opcode;
+	req->start_ns = start;
+}
+
+/*
+ * The request may be answered by another thread than the one that
+ * received it, so in_flight of a single thread may go negative.
+ */
+static void fuse_ll_stats_reply(struct fuse_req *req)
+{
+	struct fuse_req_cache *cache = fuse_ll_get_req_cache(req->se);
+	struct fuse_opcode_stats *st;
+	uint64_t us;
+	int bucket = 0;
+
+	if (cache == NULL)
+		return;
+
+	st = &cache->ops[req->opcode];
+	FUSE_STAT_ADD(st->in_flight, -1);
+	FUSE_STAT_ADD(st->bytes_out, req->out_bytes);
+	us = (fuse_ll_now_ns() - req->start_ns) / 1000;
+	if (us)
+		bucket = 64 - __builtin_clzll(us);
+	if (bucket >= FUSE_STATS_LATENCY_BUCKETS)
+		bucket = FUSE_STATS_LATENCY_BUCKETS - 1;
+	FUSE_STAT_ADD(st->latency[bucket], 1);
+	req->start_ns = 0;
+}
+
+/* How often waiters look for fuse_session_exit(), in ms */
+#define FUSE_ADMIT_POLL_MS 100
+
+static int admit_enabled(struct fuse_admission *ad)
+{
+	return ad->max_reqs || ad->max_bytes;
+}
+
+static int admit_over(struct fuse_admission *ad, unsigned int reqs,
+		      size_t bytes)
+{
+	return (ad->max_reqs &&
+		__atomic_load_n(&ad->reqs, __ATOMIC_SEQ_CST) >= reqs) ||
+	       (ad->max_bytes &&
+		__atomic_load_n(&ad->bytes, __ATOMIC_SEQ_CST) >= bytes);
+}
+
+/*
+ * Resuming below the limits keeps the waiters from being woken for
+ * every reply. The gap follows the kernel's congestion threshold.
+ */
+static void fuse_ll_admit_init(struct fuse_session *se)
+{
+	struct fuse_admission *ad = &se->admission;
+	unsigned int num = 3, den = 4;
+
+	if (se->conn.max_background && se->conn.congestion_threshold) {
+		num = se->conn.congestion_threshold;
+		den = se->conn.max_background;
+	}
+	ad->low_reqs = (uint64_t) ad->max_reqs * num / den;
+	ad->low_bytes = (uint64_t) ad->max_bytes * num / den;
+	if (!ad->low_reqs || ad->low_reqs > ad->max_reqs)
+		ad->low_reqs = ad->max_reqs ? ad->max_reqs : 1;
+	if (!ad->low_bytes || ad->low_bytes > ad->max_bytes)
+		ad->low_bytes = ad->max_bytes ? ad->max_bytes : 1;
+}
+
+static void fuse_ll_admit(struct fuse_req *req, size_t bytes)
+{
+	struct fuse_admission *ad = &req->se->admission;
+
+	__atomic_add_fetch(&ad->reqs, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&ad->bytes, bytes, __ATOMIC_SEQ_CST);
+	req->admit_bytes = bytes;
+}
+
+static void fuse_ll_admit_release(struct fuse_req *req)
+{
+	struct fuse_admission *ad = &req->se->admission;
+
+	__atomic_sub_fetch(&ad->reqs, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&ad->bytes, req->admit_bytes, __ATOMIC_SEQ_CST);
+	req->admit_bytes = 0;
+
+	/* Pairs with the increment of waiting in fuse_ll_admit_wait() */
+	if (__atomic_load_n(&ad->waiting, __ATOMIC_SEQ_CST) &&
+	    !admit_over(ad, ad->low_reqs, ad->low_bytes)) {
+		pthread_mutex_lock(&ad->lock);
+		pthread_cond_broadcast(&ad->cond);
+		pthread_mutex_unlock(&ad->lock);
+	}
+}
+
+int fuse_ll_admit_full(struct fuse_session *se)
+{
+	struct fuse_admission *ad = &se->admission;
+
+	return admit_enabled(ad) && admit_over(ad, ad->max_reqs, ad->max_bytes);
+}
+
+static void admit_wait_cleanup(void *data)
+{
+	struct fuse_admission *ad = data;
+
+	__atomic_sub_fetch(&ad->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&ad->lock);
+}
+
+/*
+ * Holding back the read leaves further requests queued in the kernel,
+ * which then blocks the callers once max_background is reached.
+ */
+void fuse_ll_admit_wait(struct fuse_session *se)
+{
+	struct fuse_admission *ad = &se->admission;
+	struct timespec ts;
+
+	if (!fuse_ll_admit_full(se))
+		return;
+
+	pthread_mutex_lock(&ad->lock);
+	ad->waits++;
+	__atomic_add_fetch(&ad->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_cleanup_push(admit_wait_cleanup, ad);
+	while (admit_over(ad, ad->low_reqs, ad->low_bytes) &&
+	       !fuse_session_exited(se)) {
+		/* fuse_session_exit() may be called from a signal handler */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += FUSE_ADMIT_POLL_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&ad->cond, &ad->lock, &ts);
+	}
+	pthread_cleanup_pop(1);
+}
+
 void fuse_free_req(fuse_req_t req)
 {
 	int ctr;
-	struct fuse_session *se = req->se;
+	struct fuse_inflight_shard *sh = inflight_shard(req->se, req->unique);
 
-	pthread_mutex_lock(&se->lock);
+	if (req->start_ns)
+		fuse_ll_stats_reply(req);
+	if (req->admit_bytes)
+		fuse_ll_admit_release(req);
+
+	pthread_mutex_lock(&sh->lock);
 	req->u.ni.func = NULL;
 	req->u.ni.data = NULL;
-	list_del_req(req);
+	inflight_del(sh, req);
 	ctr = --req->ctr;
+	pthread_mutex_unlock(&sh->lock);
 	fuse_chan_put(req->ch);
 	req->ch = NULL;
-	pthread_mutex_unlock(&se->lock);
 	if (!ctr)
 		destroy_req(req);
 }
 
 static struct fuse_req *fuse_ll_alloc_req(struct fuse_session *se)
 {
-	struct fuse_req *req;
+	struct fuse_req_cache *cache = fuse_ll_get_req_cache(se);
+	struct fuse_req *req = NULL;
+
+	if (cache != NULL) {
+		/* Only this thread writes the counters */
+		__atomic_store_n(&cache->allocs, cache->allocs + 1,
+				 __ATOMIC_RELAXED);
+		req = cache->free;
+		if (req != NULL) {
+			cache->free = req->next;
+			cache->count--;
+			__atomic_store_n(&cache->hits, cache->hits + 1,
+					 __ATOMIC_RELAXED);
+		}
+	}
 
-	req = (struct fuse_req *) calloc(1, sizeof(struct fuse_req));
 	if (req == NULL) {
-		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate request\n");
-	} else {
-		req->se = se;
-		req->ctr = 1;
-		list_init_req(req);
+		req = (struct fuse_req *) malloc(sizeof(struct fuse_req));
+		if (req == NULL) {
+			fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate request\n");
+			return NULL;
+		}
 		pthread_mutex_init(&req->lock, NULL);
 	}
 
+	memset(&req->se, 0, sizeof(struct fuse_req) -
+	       offsetof(struct fuse_req, se));
+	req->se = se;
+	req->ctr = 1;
+	list_init_req(req);
+
 	return req;
 }
 
-/* Send data. If *ch* is NULL, send via session master fd */
-static int fuse_send_msg(struct fuse_session *se, struct fuse_chan *ch,
-			 struct iovec *iov, int count)
+/*
+ * Replies held back by a thread until it goes back to the device, or
+ * until the reply timer finds them too old. The lock nests inside
+ * se->reply_timer.lock.
+ */
+struct fuse_reply_batch {
+	pthread_mutex_t lock;
+	struct fuse_session *se;
+	/* In se->reply_timer.batches */
+	struct fuse_reply_batch *next;
+	struct fuse_reply_batch **prevp;
+	int fd;
+	int no_ring;
+	unsigned int count;
+	size_t used;
+	/* When the first reply was held back, zero if there is none */
+	uint64_t first_ns;
+	struct fuse_uring *ring;
+	struct iovec iov[FUSE_URING_BATCH_MAX];
+	char buf[FUSE_REPLY_BATCH_SIZE];
+};
+
+/* writev(2) on the device, or the custom transport's equivalent */
+static ssize_t fuse_ll_writev(struct fuse_session *se, int fd,
+			      struct iovec *iov, int count)
+{
+	if (se->io)
+		return se->io->writev(fd, iov, count, se->userdata);
+	return writev(fd, iov, count);
+}
+
+static void fuse_ll_write_replies(struct fuse_session *se,
+				  struct fuse_reply_batch *rb)
+{
+	int res[FUSE_URING_BATCH_MAX];
+	unsigned int i;
+	int err = -ENOSYS;
+
+	if (rb->count > 1 && !rb->no_ring) {
+		err = fuse_uring_write_batch(&rb->ring, rb->fd, rb->iov,
+					     rb->count, res);
+		if (err == -ENOSYS)
+			rb->no_ring = 1;
+	}
+	/*
+	 * A reply that is not written leaves its request hanging in the
+	 * kernel, so whatever failed is tried once more on its own.
+	 * ENOENT means the operation was interrupted.
+	 */
+	for (i = 0; i < rb->count; i++) {
+		if (!err && (res[i] == 0 || res[i] == -ENOENT))
+			continue;
+		if (fuse_ll_writev(se, rb->fd, &rb->iov[i], 1) == -1 &&
+		    !fuse_session_exited(se) && errno != ENOENT)
+			perror("fuse: writing device");
+	}
+
+	rb->count = 0;
+	rb->used = 0;
+	__atomic_store_n(&rb->first_ns, 0, __ATOMIC_RELEASE);
+}
+
+static void *fuse_ll_reply_timer_thread(void *data)
+{
+	struct fuse_session *se = data;
+	struct fuse_reply_timer *rt = &se->reply_timer;
+	uint64_t delay = (uint64_t) se->reply_batch_delay * 1000;
+
+	pthread_mutex_lock(&rt->lock);
+	while (!rt->stop) {
+		struct fuse_reply_batch *rb;
+		uint64_t now = fuse_ll_now_ns();
+		uint64_t next = 0;
+		uint64_t first;
+		struct timespec ts;
+
+		for (rb = rt->batches; rb != NULL; rb = rb->next) {
+			first = __atomic_load_n(&rb->first_ns, __ATOMIC_ACQUIRE);
+			if (!first)
+				continue;
+			if (first + delay > now) {
+				if (!next || first + delay < next)
+					next = first + delay;
+				continue;
+			}
+			pthread_mutex_lock(&rb->lock);
+			if (rb->count && rb->first_ns + delay <= now)
+				fuse_ll_write_replies(se, rb);
+			pthread_mutex_unlock(&rb->lock);
+		}
+
+		if (!next) {
+			pthread_cond_wait(&rt->cond, &rt->lock);
+			continue;
+		}
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		pthread_cond_timedwait(&rt->cond, &rt->lock, &ts);
+	}
+	pthread_mutex_unlock(&rt->lock);
+
+	return NULL;
+}
+
+static void fuse_ll_reply_timer_init(struct fuse_reply_timer *rt)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&rt->lock, NULL);
+	/* Deadlines are taken from fuse_ll_now_ns() */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&rt->cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void fuse_ll_reply_timer_stop(struct fuse_reply_timer *rt)
+{
+	int started;
+
+	pthread_mutex_lock(&rt->lock);
+	rt->stop = 1;
+	started = rt->started;
+	rt->started = 0;
+	pthread_cond_signal(&rt->cond);
+	pthread_mutex_unlock(&rt->lock);
+
+	if (started)
+		pthread_join(rt->thread, NULL);
+}
+
+static void fuse_ll_reply_timer_kick(struct fuse_session *se)
+{
+	struct fuse_reply_timer *rt = &se->reply_timer;
+
+	pthread_mutex_lock(&rt->lock);
+	pthread_cond_signal(&rt->cond);
+	pthread_mutex_unlock(&rt->lock);
+}
+
+static int fuse_ll_batch_reply(struct fuse_session *se,
+			       struct fuse_reply_batch *rb, int fd,
+			       struct iovec *iov, int count, size_t len)
+{
+	int started = 0;
+	char *p;
+	int i;
+
+	if (len > FUSE_REPLY_BATCH_MSG_MAX)
+		return -1;
+
+	pthread_mutex_lock(&rb->lock);
+	if (rb->count && (rb->fd != fd || rb->count >= se->reply_batch ||
+			  rb->used + len > sizeof(rb->buf)))
+		fuse_ll_write_replies(se, rb);
+
+	if (!rb->count) {
+		rb->fd = fd;
+		__atomic_store_n(&rb->first_ns, fuse_ll_now_ns(),
+				 __ATOMIC_RELEASE);
+		started = 1;
+	}
+
+	p = rb->buf + rb->used;
+	rb->iov[rb->count].iov_base = p;
+	rb->iov[rb->count].iov_len = len;
+	for (i = 0; i < count; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	rb->used += len;
+	rb->count++;
+	pthread_mutex_unlock(&rb->lock);
+
+	if (started)
+		fuse_ll_reply_timer_kick(se);
+	return 0;
+}
+
+static struct fuse_reply_batch *fuse_ll_reply_batch_new(struct fuse_session *se)
+{
+	struct fuse_reply_timer *rt = &se->reply_timer;
+	struct fuse_reply_batch *rb;
+
+	rb = malloc(sizeof(struct fuse_reply_batch));
+	if (rb == NULL)
+		return NULL;
+	pthread_mutex_init(&rb->lock, NULL);
+	rb->se = se;
+	rb->count = 0;
+	rb->used = 0;
+	rb->first_ns = 0;
+	rb->no_ring = se->io != NULL;
+	rb->ring = NULL;
+
+	pthread_mutex_lock(&rt->lock);
+	if (!rt->started && !rt->stop) {
+		if (fuse_start_thread(&rt->thread, fuse_ll_reply_timer_thread,
+				      se) != 0) {
+			pthread_mutex_unlock(&rt->lock);
+			pthread_mutex_destroy(&rb->lock);
+			free(rb);
+			/* Without the timer replies could be held too long */
+			se->reply_batch = 0;
+			return NULL;
+		}
+		rt->started = 1;
+	}
+	rb->next = rt->batches;
+	if (rb->next != NULL)
+		rb->next->prevp = &rb->next;
+	rb->prevp = &rt->batches;
+	rt->batches = rb;
+	pthread_mutex_unlock(&rt->lock);
+
+	return rb;
+}
+
+/*
+ * Called by a session loop before it reads the next request. Replies
+ * are only held back while further requests are already waiting, up
+ * to reply_batch of them and for at most reply_batch_delay us, after
+ * which the reply timer writes them out if the thread has not come
+ * back by then. The loop must not block in the read while replies
+ * are held back, so the device has to be either non-blocking or read
+ * by this thread only.
+ */
+void fuse_ll_reply_batch_prepare(struct fuse_session *se,
+				 struct fuse_chan *ch)
+{
+	struct fuse_reply_batch *rb;
+	struct pollfd pfd = {
+		.fd = ch ? ch->fd : se->fd,
+		.events = POLLIN,
+	};
+
+	if (!se->reply_batch)
+		return;
+
+	rb = pthread_getspecific(se->reply_key);
+	if (rb == NULL) {
+		rb = fuse_ll_reply_batch_new(se);
+		if (rb != NULL)
+			pthread_setspecific(se->reply_key, rb);
+		return;
+	}
+
+	pthread_mutex_lock(&rb->lock);
+	if (rb->count && (rb->count >= se->reply_batch ||
+			  fuse_session_exited(se) ||
+			  fuse_ll_now_ns() - rb->first_ns >=
+			  (uint64_t) se->reply_batch_delay * 1000 ||
+			  poll(&pfd, 1, 0) != 1))
+		fuse_ll_write_replies(se, rb);
+	pthread_mutex_unlock(&rb->lock);
+}
+
+void fuse_ll_reply_batch_flush(struct fuse_session *se)
+{
+	struct fuse_reply_batch *rb;
+
+	if (!se->reply_batch)
+		return;
+	rb = pthread_getspecific(se->reply_key);
+	if (rb == NULL)
+		return;
+	pthread_mutex_lock(&rb->lock);
+	if (rb->count)
+		fuse_ll_write_replies(se, rb);
+	pthread_mutex_unlock(&rb->lock);
+}
+
+static void fuse_ll_reply_batch_destructor(void *data)
+{
+	struct fuse_reply_batch *rb = data;
+	struct fuse_reply_timer *rt = &rb->se->reply_timer;
+
+	pthread_mutex_lock(&rt->lock);
+	*rb->prevp = rb->next;
+	if (rb->next != NULL)
+		rb->next->prevp = rb->prevp;
+	pthread_mutex_unlock(&rt->lock);
+
+	if (rb->count)
+		fuse_ll_write_replies(rb->se, rb);
+	fuse_uring_free(rb->ring);
+	pthread_mutex_destroy(&rb->lock);
+	free(rb);
+}
+
+/*
+ * Whether the request with the given id is traced. With debug_sample,
+ * the request and its reply are picked by a hash of the id, so that
+ * both or neither are logged.
+ */
+static int fuse_ll_traced(struct fuse_session *se, uint64_t unique)
+{
+	if (!se->debug)
+		return 0;
+	if (se->debug_sample <= 1 || unique == 0)
+		return 1;
+	return ((unique * 0x9e3779b97f4a7c15ULL) >> 32) %
+		se->debug_sample == 0;
+}
+
+/*
+ * Send data. If *ch* is NULL, send via session master fd. If *release*
+ * is given, release(arg) is called once the data after the header is
+ * no longer needed, which may be after returning.
+ */
+static int fuse_send_msg_release(struct fuse_session *se,
+				 struct fuse_chan *ch,
+				 struct iovec *iov, int count,
+				 void (*release)(void *arg), void *arg)
 {
 	struct fuse_out_header *out = iov[0].iov_base;
 
 	assert(se != NULL);
 	out->len = iov_length(iov, count);
-	if (se->debug) {
+	FUSE_PROBE3(reply_send, out->unique, out->error, out->len);
+	if (fuse_ll_traced(se, out->unique)) {
 		if (out->unique == 0) {
 			fuse_log(FUSE_LOG_DEBUG, "NOTIFY: code=%d length=%u\n",
 				out->error, out->len);
@@ -185,10 +922,38 @@ static int fuse_send_msg(struct fuse_session *se, struct fuse_chan *ch,
 		}
 	}
 
-	ssize_t res = writev(ch ? ch->fd : se->fd,
-			     iov, count);
+	/* Replies (but not notifications) may go out via io_uring */
+	if (se->uring && out->unique != 0 && !ch &&
+	    fuse_uring_send_reply(se, iov, count, out->len,
+				  release, arg) == 0)
+		return 0;
+
+	/* Notifications must not overtake replies held back before them */
+	if (se->reply_batch && out->unique == 0)
+		fuse_ll_reply_batch_flush(se);
+
+	/*
+	 * Only session loop threads have a batch, other threads may
+	 * never come back to flush it.
+	 */
+	if (se->reply_batch && out->unique != 0) {
+		struct fuse_reply_batch *rb = pthread_getspecific(se->reply_key);
+
+		if (rb != NULL &&
+		    fuse_ll_batch_reply(se, rb, ch ? ch->fd : se->fd,
+					iov, count, out->len) == 0) {
+			if (release)
+				release(arg);
+			return 0;
+		}
+	}
+
+	ssize_t res = fuse_ll_writev(se, ch ? ch->fd : se->fd,
+				     iov, count);
 	int err = errno;
 
+	if (release)
+		release(arg);
 	if (res == -1) {
 		/* ENOENT means the operation was interrupted */
 		if (!fuse_session_exited(se) && err != ENOENT)
@@ -199,11 +964,18 @@ static int fuse_send_msg(struct fuse_session *se, struct fuse_chan *ch,
 	return 0;
 }
 
+static int fuse_send_msg(struct fuse_session *se, struct fuse_chan *ch,
+			 struct iovec *iov, int count)
+{
+	return fuse_send_msg_release(se, ch, iov, count, NULL, NULL);
+}
+
 
 int fuse_send_reply_iov_nofree(fuse_req_t req, int error, struct iovec *iov,
 			       int count)
 {
 	struct fuse_out_header out;
+	int res;
 
 	if (error <= -1000 || error > 0) {
 		fuse_log(FUSE_LOG_ERR, "fuse: bad error value: %i\n",	error);
@@ -216,7 +988,9 @@ int fuse_send_reply_iov_nofree(fuse_req_t req, int error, struct iovec *iov,
 	iov[0].iov_base = &out;
 	iov[0].iov_len = sizeof(struct fuse_out_header);
 
-	return fuse_send_msg(req->se, req->ch, iov, count);
+	res = fuse_send_msg(req->se, req->ch, iov, count);
+	req->out_bytes += out.len;
+	return res;
 }
 
 static int send_reply_iov(fuse_req_t req, int error, struct iovec *iov,
@@ -260,6 +1034,36 @@ int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count)
 	return res;
 }
 
+int fuse_reply_pinned(fuse_req_t req, const struct iovec *iov, int count,
+		      void (*release)(void *arg), void *arg)
+{
+	struct fuse_out_header out;
+	struct iovec *padded_iov;
+	int res;
+
+	padded_iov = malloc((count + 1) * sizeof(struct iovec));
+	if (padded_iov == NULL) {
+		release(arg);
+		return fuse_reply_err(req, ENOMEM);
+	}
+
+	out.unique = req->unique;
+	out.error = 0;
+	padded_iov[0].iov_base = &out;
+	padded_iov[0].iov_len = sizeof(struct fuse_out_header);
+	memcpy(padded_iov + 1, iov, count * sizeof(struct iovec));
+	count++;
+
+	res = fuse_send_msg_release(req->se, req->ch, padded_iov, count,
+				    release, arg);
+	free(padded_iov);
+	if (res == 0)
+		req->out_bytes += out.len;
+	fuse_free_req(req);
+
+	return res;
+}
+
 
 /* `buf` is allowed to be empty so that the proper size may be
    allocated by the caller */
@@ -339,7 +1143,15 @@ static unsigned int calc_timeout_nsec(double t)
 		return (unsigned int) (f * 1.0e9);
 }
 
-static void fill_entry(struct fuse_entry_out *arg,
+static uint32_t attr_flags(struct fuse_session *se, uint32_t flags)
+{
+	/* Entries may be packed without a request, e.g. to be cached */
+	if (se == NULL || !(se->conn.want & FUSE_CAP_DAX_INODE))
+		return 0;
+	return flags & FUSE_ATTR_DAX;
+}
+
+static void fill_entry(struct fuse_session *se, struct fuse_entry_out *arg,
 		       const struct fuse_entry_param *e)
 {
 	arg->nodeid = e->ino;
@@ -349,6 +1161,7 @@ static void fill_entry(struct fuse_entry_out *arg,
 	arg->attr_valid = calc_timeout_sec(e->attr_timeout);
 	arg->attr_valid_nsec = calc_timeout_nsec(e->attr_timeout);
 	convert_stat(&e->attr, &arg->attr);
+	arg->attr.flags = attr_flags(se, e->attr_flags);
 }
 
 /* `buf` is allowed to be empty so that the proper size may be
@@ -357,7 +1170,6 @@ size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
 			      const char *name,
 			      const struct fuse_entry_param *e, off_t off)
 {
-	(void)req;
 	size_t namelen;
 	size_t entlen;
 	size_t entlen_padded;
@@ -370,7 +1182,7 @@ size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
 
 	struct fuse_direntplus *dp = (struct fuse_direntplus *) buf;
 	memset(&dp->entry_out, 0, sizeof(dp->entry_out));
-	fill_entry(&dp->entry_out, e);
+	fill_entry(req ? req->se : NULL, &dp->entry_out, e);
 
 	struct fuse_dirent *dirent = &dp->dirent;
 	dirent->ino = e->attr.st_ino;
@@ -383,6 +1195,113 @@ size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
 	return entlen_padded;
 }
 
+/*
+ * The padding of an entry is less than the 8 bytes before its end,
+ * which all belong to the name. Clearing them with a single store
+ * before the name is copied leaves the padding zeroed.
+ */
+static void pack_dirent(struct fuse_dirent *dirent, char *end,
+			const struct fuse_direntry *ent, size_t namelen,
+			uint64_t ino, uint32_t mode)
+{
+	static const uint64_t zero;
+
+	memcpy(end - sizeof(zero), &zero, sizeof(zero));
+	dirent->ino = ino;
+	dirent->off = ent->off;
+	dirent->namelen = namelen;
+	dirent->type = (mode & S_IFMT) >> 12;
+	memcpy(dirent->name, ent->name, namelen);
+}
+
+size_t fuse_add_direntries(fuse_req_t req, char *buf, size_t bufsize,
+			   const struct fuse_direntry *ents, size_t count,
+			   size_t *used)
+{
+	size_t pos = 0;
+	size_t i;
+
+	(void) req;
+	for (i = 0; i < count; i++) {
+		const struct fuse_direntry *ent = &ents[i];
+		size_t namelen = ent->namelen ? ent->namelen : strlen(ent->name);
+		size_t entlen_padded = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET +
+							 namelen);
+
+		if (buf != NULL) {
+			if (entlen_padded > bufsize - pos)
+				break;
+			pack_dirent((struct fuse_dirent *) (buf + pos),
+				    buf + pos + entlen_padded, ent, namelen,
+				    ent->ino, ent->mode);
+		}
+		pos += entlen_padded;
+	}
+
+	*used = pos;
+	return i;
+}
+
+size_t fuse_add_direntries_plus(fuse_req_t req, char *buf, size_t bufsize,
+				const struct fuse_direntry *ents,
+				const struct fuse_entry_param *e,
+				size_t count, size_t *used)
+{
+	struct fuse_session *se = req ? req->se : NULL;
+	/* Usually the same for all entries, so only converted once */
+	double entry_timeout = 0.0, attr_timeout = 0.0;
+	uint64_t entry_valid = 0, attr_valid = 0;
+	uint32_t entry_nsec = 0, attr_nsec = 0;
+	size_t pos = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		const struct fuse_direntry *ent = &ents[i];
+		const struct fuse_entry_param *ep = &e[i];
+		size_t namelen = ent->namelen ? ent->namelen : strlen(ent->name);
+		size_t entlen_padded =
+			FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + namelen);
+		struct fuse_direntplus *dp;
+		struct fuse_entry_out *arg;
+
+		if (buf == NULL) {
+			pos += entlen_padded;
+			continue;
+		}
+		if (entlen_padded > bufsize - pos)
+			break;
+
+		if (ep->entry_timeout != entry_timeout) {
+			entry_timeout = ep->entry_timeout;
+			entry_valid = calc_timeout_sec(entry_timeout);
+			entry_nsec = calc_timeout_nsec(entry_timeout);
+		}
+		if (ep->attr_timeout != attr_timeout) {
+			attr_timeout = ep->attr_timeout;
+			attr_valid = calc_timeout_sec(attr_timeout);
+			attr_nsec = calc_timeout_nsec(attr_timeout);
+		}
+
+		/* Every field is set, so there is nothing to clear */
+		dp = (struct fuse_direntplus *) (buf + pos);
+		arg = &dp->entry_out;
+		arg->nodeid = ep->ino;
+		arg->generation = ep->generation;
+		arg->entry_valid = entry_valid;
+		arg->entry_valid_nsec = entry_nsec;
+		arg->attr_valid = attr_valid;
+		arg->attr_valid_nsec = attr_nsec;
+		convert_stat(&ep->attr, &arg->attr);
+		arg->attr.flags = attr_flags(se, ep->attr_flags);
+		pack_dirent(&dp->dirent, buf + pos + entlen_padded, ent,
+			    namelen, ep->attr.st_ino, ep->attr.st_mode);
+		pos += entlen_padded;
+	}
+
+	*used = pos;
+	return i;
+}
+
 static void fill_open(struct fuse_open_out *arg,
 		      const struct fuse_file_info *f)
 {
@@ -409,7 +1328,7 @@ int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
 		return fuse_reply_err(req, ENOENT);
 
 	memset(&arg, 0, sizeof(arg));
-	fill_entry(&arg, e);
+	fill_entry(req->se, &arg, e);
 	return send_reply_ok(req, &arg, size);
 }
 
@@ -423,14 +1342,14 @@ int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e,
 	struct fuse_open_out *oarg = (struct fuse_open_out *) (buf + entrysize);
 
 	memset(buf, 0, sizeof(buf));
-	fill_entry(earg, e);
+	fill_entry(req->se, earg, e);
 	fill_open(oarg, f);
 	return send_reply_ok(req, buf,
 			     entrysize + sizeof(struct fuse_open_out));
 }
 
-int fuse_reply_attr(fuse_req_t req, const struct stat *attr,
-		    double attr_timeout)
+int fuse_reply_attr_flags(fuse_req_t req, const struct stat *attr,
+			  double attr_timeout, uint32_t flags)
 {
 	struct fuse_attr_out arg;
 	size_t size = req->se->conn.proto_minor < 9 ?
@@ -440,10 +1359,17 @@ int fuse_reply_attr(fuse_req_t req, const struct stat *attr,
 	arg.attr_valid = calc_timeout_sec(attr_timeout);
 	arg.attr_valid_nsec = calc_timeout_nsec(attr_timeout);
 	convert_stat(attr, &arg.attr);
+	arg.attr.flags = attr_flags(req->se, flags);
 
 	return send_reply_ok(req, &arg, size);
 }
 
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr,
+		    double attr_timeout)
+{
+	return fuse_reply_attr_flags(req, attr, attr_timeout, 0);
+}
+
 int fuse_reply_readlink(fuse_req_t req, const char *linkname)
 {
 	return send_reply_ok(req, linkname, strlen(linkname));
@@ -520,6 +1446,8 @@ struct fuse_ll_pipe {
 	size_t size;
 	int can_grow;
 	int pipe[2];
+	struct fuse_session *se;
+	struct fuse_ll_pipe *next;
 };
 
 static void fuse_ll_pipe_free(struct fuse_ll_pipe *llp)
@@ -529,6 +1457,188 @@ static void fuse_ll_pipe_free(struct fuse_ll_pipe *llp)
 	free(llp);
 }
 
+/*
+ * Pipes of threads that exit are kept in a per-session pool, so
+ * that new threads get a pipe that has already been grown.
+ */
+static void fuse_ll_pipe_pool_put(struct fuse_ll_pipe *llp)
+{
+	struct fuse_session *se = llp->se;
+
+	pthread_mutex_lock(&se->lock);
+	if (se->pipe_pool_count < FUSE_PIPE_POOL_MAX ||
+	    se->pipe_pool_count < se->pipe_pool_size) {
+		llp->next = se->pipe_pool;
+		se->pipe_pool = llp;
+		se->pipe_pool_count++;
+		llp = NULL;
+	}
+	pthread_mutex_unlock(&se->lock);
+
+	if (llp)
+		fuse_ll_pipe_free(llp);
+}
+
+/*
+ * Large receive buffers are shared by all threads of a session: a
+ * thread only holds one while it processes a request that does not fit
+ * into its small buffer. The header sits in front of the memory handed
+ * out and remembers the small buffer of the borrower. With align_write,
+ * the memory starts so far into a page that the data of a WRITE request
+ * lands on the next one, for file systems that write it with O_DIRECT.
+ */
+struct fuse_ll_large_buf {
+	struct fuse_ll_large_buf *next;
+	void *small;
+	size_t size;
+	void *base;
+	/* Keeps mem cache line aligned, unless with align_write */
+	char pad[64 - 4 * sizeof(void *)];
+	char mem[];
+};
+
+static struct fuse_ll_large_buf *fuse_ll_large_buf_of(void *mem)
+{
+	return (struct fuse_ll_large_buf *)
+		((char *) mem - offsetof(struct fuse_ll_large_buf, mem));
+}
+
+static struct fuse_ll_large_buf *fuse_ll_large_buf_get(struct fuse_session *se,
+						       size_t size)
+{
+	struct fuse_ll_large_buf *lb;
+	size_t align = getpagesize();
+	size_t skew = 0;
+	size_t len;
+	void *mem;
+
+	pthread_mutex_lock(&se->lock);
+	lb = se->large_bufs;
+	if (lb)
+		se->large_bufs = lb->next;
+	pthread_mutex_unlock(&se->lock);
+
+	if (lb) {
+		if (lb->size >= size)
+			return lb;
+		/* Only from before INIT, when max_pages was not known */
+		free(lb->base);
+	}
+
+	if (se->align_write)
+		skew = align - offsetof(struct fuse_ll_large_buf, mem) -
+			FUSE_WRITE_DATA_OFFSET;
+	len = skew + sizeof(struct fuse_ll_large_buf) + size;
+	if (se->buf_hugepage) {
+		align = FUSE_HUGEPAGE_SIZE;
+		len = (len + align - 1) & ~(align - 1);
+	}
+	if (posix_memalign(&mem, align, len) != 0)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (se->buf_hugepage)
+		madvise(mem, len, MADV_HUGEPAGE);
+#endif
+	lb = (struct fuse_ll_large_buf *) ((char *) mem + skew);
+	lb->base = mem;
+	lb->size = len - skew - sizeof(struct fuse_ll_large_buf);
+	return lb;
+}
+
+static void fuse_ll_large_buf_put(struct fuse_session *se,
+				  struct fuse_ll_large_buf *lb)
+{
+	pthread_mutex_lock(&se->lock);
+	lb->next = se->large_bufs;
+	se->large_bufs = lb;
+	pthread_mutex_unlock(&se->lock);
+}
+
+/*
+ * Makes buf->mem large enough for size bytes. Unless the caller asked
+ * for FUSE_BUF_TIERED that is always a buffer of se->bufsize bytes.
+ */
+static int fuse_ll_buf_mem(struct fuse_session *se, struct fuse_buf *buf,
+			   size_t size)
+{
+	struct fuse_ll_large_buf *lb;
+
+	if (!(buf->flags & FUSE_BUF_TIERED) || size <= FUSE_SMALL_BUFSIZE) {
+		if (!buf->mem) {
+			buf->mem = malloc(buf->flags & FUSE_BUF_TIERED ?
+					  FUSE_SMALL_BUFSIZE : se->bufsize);
+			if (!buf->mem)
+				return -ENOMEM;
+		}
+		return 0;
+	}
+
+	lb = fuse_ll_large_buf_get(se, se->bufsize);
+	if (lb == NULL)
+		return -ENOMEM;
+	lb->small = buf->mem;
+	buf->mem = lb->mem;
+	buf->flags |= FUSE_BUF_POOLED;
+	return 0;
+}
+
+static void fuse_ll_buf_return(struct fuse_session *se, struct fuse_buf *buf)
+{
+	struct fuse_ll_large_buf *lb = fuse_ll_large_buf_of(buf->mem);
+
+	buf->mem = lb->small;
+	buf->flags &= ~FUSE_BUF_POOLED;
+	fuse_ll_large_buf_put(se, lb);
+}
+
+/* Hands memory from receive_buf() back to the custom transport */
+static void fuse_ll_buf_release(struct fuse_session *se, struct fuse_buf *buf)
+{
+	struct fuse_buf lent = {
+		.size = buf->size,
+		.mem = buf->mem,
+	};
+
+	se->io->release_buf(se->fd, &lent, se->userdata);
+	buf->mem = NULL;
+	buf->flags &= ~FUSE_BUF_LENT;
+}
+
+void fuse_session_return_buf_int(struct fuse_session *se, struct fuse_buf *buf)
+{
+	if (buf->flags & FUSE_BUF_POOLED)
+		fuse_ll_buf_return(se, buf);
+	else if (buf->flags & FUSE_BUF_LENT)
+		fuse_ll_buf_release(se, buf);
+}
+
+void fuse_ll_trim_bufs(struct fuse_session *se)
+{
+	struct fuse_ll_large_buf *lb;
+
+	pthread_mutex_lock(&se->lock);
+	lb = se->large_bufs;
+	se->large_bufs = NULL;
+	pthread_mutex_unlock(&se->lock);
+
+	while (lb != NULL) {
+		struct fuse_ll_large_buf *next = lb->next;
+
+		free(lb->base);
+		lb = next;
+	}
+}
+
+void fuse_session_free_buf_int(struct fuse_session *se, struct fuse_buf *buf)
+{
+	if (buf->flags & FUSE_BUF_POOLED)
+		fuse_ll_buf_return(se, buf);
+	else if (buf->flags & FUSE_BUF_LENT)
+		fuse_ll_buf_release(se, buf);
+	free(buf->mem);
+	buf->mem = NULL;
+}
+
 #ifdef HAVE_SPLICE
 #if !defined(HAVE_PIPE2) || !defined(O_CLOEXEC)
 static int fuse_pipe(int fds[2])
@@ -555,33 +1665,91 @@ static int fuse_pipe(int fds[2])
 }
 #endif
 
+static struct fuse_ll_pipe *fuse_ll_pipe_pool_get(struct fuse_session *se)
+{
+	struct fuse_ll_pipe *llp;
+
+	pthread_mutex_lock(&se->lock);
+	llp = se->pipe_pool;
+	if (llp) {
+		se->pipe_pool = llp->next;
+		se->pipe_pool_count--;
+	}
+	pthread_mutex_unlock(&se->lock);
+
+	return llp;
+}
+
+static struct fuse_ll_pipe *fuse_ll_new_pipe(struct fuse_session *se)
+{
+	struct fuse_ll_pipe *llp;
+	int res;
+
+	llp = malloc(sizeof(struct fuse_ll_pipe));
+	if (llp == NULL)
+		return NULL;
+
+	res = fuse_pipe(llp->pipe);
+	if (res == -1) {
+		free(llp);
+		return NULL;
+	}
+
+	/*
+	 *the default size is 16 pages on linux
+	 */
+	llp->size = pagesize * 16;
+	llp->can_grow = 1;
+	llp->se = se;
+	llp->next = NULL;
+
+	return llp;
+}
+
 static struct fuse_ll_pipe *fuse_ll_get_pipe(struct fuse_session *se)
 {
 	struct fuse_ll_pipe *llp = pthread_getspecific(se->pipe_key);
 	if (llp == NULL) {
-		int res;
-
-		llp = malloc(sizeof(struct fuse_ll_pipe));
+		llp = fuse_ll_pipe_pool_get(se);
+		if (llp == NULL)
+			llp = fuse_ll_new_pipe(se);
 		if (llp == NULL)
 			return NULL;
 
-		res = fuse_pipe(llp->pipe);
-		if (res == -1) {
-			free(llp);
-			return NULL;
-		}
-
-		/*
-		 *the default size is 16 pages on linux
-		 */
-		llp->size = pagesize * 16;
-		llp->can_grow = 1;
-
 		pthread_setspecific(se->pipe_key, llp);
 	}
 
 	return llp;
 }
+
+static int grow_pipe_to_max(int pipefd);
+
+/* Called after INIT, when the final buffer size is known */
+void fuse_ll_pipe_pool_fill(struct fuse_session *se)
+{
+	struct fuse_ll_pipe *llp;
+	unsigned int i;
+	int res;
+
+	for (i = 0; i < se->pipe_pool_size; i++) {
+		llp = fuse_ll_new_pipe(se);
+		if (llp == NULL)
+			break;
+		res = fcntl(llp->pipe[0], F_SETPIPE_SZ, se->bufsize);
+		if (res == -1) {
+			llp->can_grow = 0;
+			res = grow_pipe_to_max(llp->pipe[0]);
+		}
+		if (res > 0)
+			llp->size = res;
+		fuse_ll_pipe_pool_put(llp);
+	}
+}
+#else
+void fuse_ll_pipe_pool_fill(struct fuse_session *se)
+{
+	(void) se;
+}
 #endif
 
 static void fuse_ll_clear_pipe(struct fuse_session *se)
@@ -675,7 +1843,7 @@ static int fuse_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
 
 	llp = fuse_ll_get_pipe(se);
 	if (llp == NULL)
-		goto fallback;
+		goto no_splice;
 
 
 	headerlen = iov_length(iov, iov_count);
@@ -696,18 +1864,18 @@ static int fuse_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
 				if (res > 0)
 					llp->size = res;
 				llp->can_grow = 0;
-				goto fallback;
+				goto no_splice;
 			}
 			llp->size = res;
 		}
 		if (llp->size < pipesize)
-			goto fallback;
+			goto no_splice;
 	}
 
 
 	res = vmsplice(llp->pipe[1], iov, iov_count, SPLICE_F_NONBLOCK);
 	if (res == -1)
-		goto fallback;
+		goto no_splice;
 
 	if (res != headerlen) {
 		res = -EIO;
@@ -738,7 +1906,7 @@ static int fuse_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
 
 			pthread_setspecific(se->pipe_key, NULL);
 			fuse_ll_pipe_free(llp);
-			goto fallback;
+			goto no_splice;
 		}
 		res = -res;
 		goto clear_pipe;
@@ -793,6 +1961,7 @@ static int fuse_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
 			iov[iov_count].iov_base = mbuf;
 			iov[iov_count].iov_len = len;
 			iov_count++;
+			FUSE_PROBE2(splice_fallback, FUSE_PROBE_REPLY, len);
 			res = fuse_send_msg(se, ch, iov, iov_count);
 			free(mbuf);
 			return res;
@@ -802,8 +1971,9 @@ static int fuse_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
 	}
 	len = res;
 	out->len = headerlen + len;
+	FUSE_PROBE3(reply_send, out->unique, out->error, out->len);
 
-	if (se->debug) {
+	if (fuse_ll_traced(se, out->unique)) {
 		fuse_log(FUSE_LOG_DEBUG,
 			"   unique: %llu, success, outsize: %i (splice)\n",
 			(unsigned long long) out->unique, out->len);
@@ -833,6 +2003,8 @@ clear_pipe:
 	fuse_ll_clear_pipe(se);
 	return res;
 
+no_splice:
+	FUSE_PROBE2(splice_fallback, FUSE_PROBE_REPLY, len);
 fallback:
 	return fuse_send_data_iov_fallback(se, ch, iov, iov_count, buf, len);
 }
@@ -862,6 +2034,8 @@ int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv,
 	out.error = 0;
 
 	res = fuse_send_data_iov(req->se, req->ch, iov, 1, bufv, flags);
+	if (res == 0)
+		req->out_bytes += out.len;
 	if (res <= 0) {
 		fuse_free_req(req);
 		return res;
@@ -1384,6 +2558,7 @@ static void do_write_buf(fuse_req_t req, fuse_ino_t nodeid, const void *inarg,
 	struct fuse_write_in *arg = (struct fuse_write_in *) inarg;
 	struct fuse_file_info fi;
 
+	bufv.buf[0].flags &= ~FUSE_BUF_INTERNAL;
 	memset(&fi, 0, sizeof(fi));
 	fi.fh = arg->fh;
 	fi.writepage = arg->write_flags & FUSE_WRITE_CACHE;
@@ -1563,7 +2738,8 @@ static void do_statfs(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 static void do_setxattr(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
 	struct fuse_setxattr_in *arg = (struct fuse_setxattr_in *) inarg;
-	char *name = PARAM(arg);
+	/* The extended header is only sent with FUSE_SETXATTR_EXT */
+	char *name = (char *) arg + FUSE_COMPAT_SETXATTR_IN_SIZE;
 	char *value = name + strlen(name) + 1;
 
 	if (req->se->op.setxattr)
@@ -1685,37 +2861,45 @@ static void do_setlkw(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	do_setlk_common(req, nodeid, inarg, 1);
 }
 
+/* Called with se->lock held, which is dropped if the request is found */
 static int find_interrupted(struct fuse_session *se, struct fuse_req *req)
 {
+	struct fuse_inflight_shard *sh = inflight_shard(se, req->u.i.unique);
 	struct fuse_req *curr;
 
-	for (curr = se->list.next; curr != &se->list; curr = curr->next) {
-		if (curr->unique == req->u.i.unique) {
-			fuse_interrupt_func_t func;
-			void *data;
-
-			curr->ctr++;
-			pthread_mutex_unlock(&se->lock);
-
-			/* Ugh, ugly locking */
-			pthread_mutex_lock(&curr->lock);
-			pthread_mutex_lock(&se->lock);
-			curr->interrupted = 1;
-			func = curr->u.ni.func;
-			data = curr->u.ni.data;
-			pthread_mutex_unlock(&se->lock);
-			if (func)
-				func(curr, data);
-			pthread_mutex_unlock(&curr->lock);
-
-			pthread_mutex_lock(&se->lock);
-			curr->ctr--;
-			if (!curr->ctr)
-				destroy_req(curr);
+	pthread_mutex_lock(&sh->lock);
+	curr = inflight_find(sh, req->u.i.unique);
+	if (curr) {
+		fuse_interrupt_func_t func;
+		void *data;
+		int ctr;
 
-			return 1;
-		}
+		curr->ctr++;
+		pthread_mutex_unlock(&sh->lock);
+		pthread_mutex_unlock(&se->lock);
+
+		/* Ugh, ugly locking */
+		pthread_mutex_lock(&curr->lock);
+		pthread_mutex_lock(&sh->lock);
+		__atomic_store_n(&curr->interrupted, 1, __ATOMIC_RELAXED);
+		func = curr->u.ni.func;
+		data = curr->u.ni.data;
+		pthread_mutex_unlock(&sh->lock);
+		if (func)
+			func(curr, data);
+		pthread_mutex_unlock(&curr->lock);
+
+		pthread_mutex_lock(&sh->lock);
+		ctr = --curr->ctr;
+		pthread_mutex_unlock(&sh->lock);
+		if (!ctr)
+			destroy_req(curr);
+
+		pthread_mutex_lock(&se->lock);
+		return 1;
 	}
+	pthread_mutex_unlock(&sh->lock);
+
 	for (curr = se->interrupts.next; curr != &se->interrupts;
 	     curr = curr->next) {
 		if (curr->u.i.unique == req->u.i.unique)
@@ -1730,17 +2914,23 @@ static void do_interrupt(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	struct fuse_session *se = req->se;
 
 	(void) nodeid;
-	if (se->debug)
+	if (fuse_ll_traced(se, arg->unique))
 		fuse_log(FUSE_LOG_DEBUG, "INTERRUPT: %llu\n",
 			(unsigned long long) arg->unique);
 
 	req->u.i.unique = arg->unique;
 
 	pthread_mutex_lock(&se->lock);
-	if (find_interrupted(se, req))
+	/* Counted before the lookup, see fuse_ll_add_inflight() */
+	__atomic_add_fetch(&se->interrupts_pending, 1, __ATOMIC_SEQ_CST);
+	if (find_interrupted(se, req)) {
+		FUSE_PROBE2(interrupt, arg->unique, 1);
+		__atomic_sub_fetch(&se->interrupts_pending, 1, __ATOMIC_RELAXED);
 		destroy_req(req);
-	else
+	} else {
+		FUSE_PROBE2(interrupt, arg->unique, 0);
 		list_add_req(req, &se->interrupts);
+	}
 	pthread_mutex_unlock(&se->lock);
 }
 
@@ -1752,9 +2942,12 @@ static struct fuse_req *check_interrupt(struct fuse_session *se,
 	for (curr = se->interrupts.next; curr != &se->interrupts;
 	     curr = curr->next) {
 		if (curr->u.i.unique == req->unique) {
-			req->interrupted = 1;
+			__atomic_store_n(&req->interrupted, 1,
+					 __ATOMIC_RELAXED);
 			list_del_req(curr);
-			free(curr);
+			__atomic_sub_fetch(&se->interrupts_pending, 1,
+					   __ATOMIC_RELAXED);
+			destroy_req(curr);
 			return NULL;
 		}
 	}
@@ -1762,6 +2955,8 @@ static struct fuse_req *check_interrupt(struct fuse_session *se,
 	if (curr != &se->interrupts) {
 		list_del_req(curr);
 		list_init_req(curr);
+		__atomic_sub_fetch(&se->interrupts_pending, 1,
+				   __ATOMIC_RELAXED);
 		return curr;
 	} else
 		return NULL;
@@ -1853,37 +3048,113 @@ static void do_fallocate(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fuse_reply_err(req, ENOSYS);
 }
 
-static void do_copy_file_range(fuse_req_t req, fuse_ino_t nodeid_in, const void *inarg)
+static void do_copy_file_range(fuse_req_t req, fuse_ino_t nodeid_in, const void *inarg)
+{
+	struct fuse_copy_file_range_in *arg = (struct fuse_copy_file_range_in *) inarg;
+	struct fuse_file_info fi_in, fi_out;
+
+	memset(&fi_in, 0, sizeof(fi_in));
+	fi_in.fh = arg->fh_in;
+
+	memset(&fi_out, 0, sizeof(fi_out));
+	fi_out.fh = arg->fh_out;
+
+
+	if (req->se->op.copy_file_range)
+		req->se->op.copy_file_range(req, nodeid_in, arg->off_in,
+					    &fi_in, arg->nodeid_out,
+					    arg->off_out, &fi_out, arg->len,
+					    arg->flags);
+	else
+		fuse_reply_err(req, ENOSYS);
+}
+
+static void do_lseek(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
+{
+	struct fuse_lseek_in *arg = (struct fuse_lseek_in *) inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (req->se->op.lseek)
+		req->se->op.lseek(req, nodeid, arg->offset, arg->whence, &fi);
+	else
+		fuse_reply_err(req, ENOSYS);
+}
+
+static void do_setupmapping(fuse_req_t req, fuse_ino_t nodeid,
+			    const void *inarg)
+{
+	struct fuse_setupmapping_in *arg =
+		(struct fuse_setupmapping_in *) inarg;
+	struct fuse_file_info fi;
+	uint64_t flags = 0;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (arg->flags & FUSE_SETUPMAPPING_FLAG_WRITE)
+		flags |= FUSE_DAX_MAP_WRITE;
+	if (arg->flags & FUSE_SETUPMAPPING_FLAG_READ)
+		flags |= FUSE_DAX_MAP_READ;
+
+	if (req->se->op.setupmapping)
+		req->se->op.setupmapping(req, nodeid, arg->foffset, arg->len,
+					 arg->moffset, flags, &fi);
+	else
+		fuse_reply_err(req, ENOSYS);
+}
+
+/* The ranges are counted by the kernel, check that they are all there */
+static int removemapping_fits(const void *inarg, size_t insize)
 {
-	struct fuse_copy_file_range_in *arg = (struct fuse_copy_file_range_in *) inarg;
-	struct fuse_file_info fi_in, fi_out;
-
-	memset(&fi_in, 0, sizeof(fi_in));
-	fi_in.fh = arg->fh_in;
+	const struct fuse_removemapping_in *arg = inarg;
 
-	memset(&fi_out, 0, sizeof(fi_out));
-	fi_out.fh = arg->fh_out;
+	if (insize < sizeof(*arg))
+		return 0;
+	return arg->count <= (insize - sizeof(*arg)) /
+		sizeof(struct fuse_removemapping_one);
+}
 
+static void do_removemapping(fuse_req_t req, fuse_ino_t nodeid,
+			     const void *inarg)
+{
+	struct fuse_removemapping_in *arg =
+		(struct fuse_removemapping_in *) inarg;
+	const char *one = PARAM(arg);
+	struct fuse_dax_range *ranges;
+	uint32_t i;
 
-	if (req->se->op.copy_file_range)
-		req->se->op.copy_file_range(req, nodeid_in, arg->off_in,
-					    &fi_in, arg->nodeid_out,
-					    arg->off_out, &fi_out, arg->len,
-					    arg->flags);
-	else
+	if (!req->se->op.removemapping) {
 		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	/* The ranges follow the 4 byte header unaligned, copy them out */
+	ranges = calloc(arg->count, sizeof(ranges[0]));
+	if (ranges == NULL && arg->count) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	for (i = 0; i < arg->count; i++) {
+		struct fuse_removemapping_one r;
+
+		memcpy(&r, one + i * sizeof(r), sizeof(r));
+		ranges[i].moffset = r.moffset;
+		ranges[i].len = r.len;
+	}
+
+	req->se->op.removemapping(req, nodeid, ranges, arg->count);
+	free(ranges);
 }
 
-static void do_lseek(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
+static void do_syncfs(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
-	struct fuse_lseek_in *arg = (struct fuse_lseek_in *) inarg;
-	struct fuse_file_info fi;
-
-	memset(&fi, 0, sizeof(fi));
-	fi.fh = arg->fh;
+	(void) inarg;
 
-	if (req->se->op.lseek)
-		req->se->op.lseek(req, nodeid, arg->offset, arg->whence, &fi);
+	if (req->se->op.syncfs)
+		req->se->op.syncfs(req, nodeid);
 	else
 		fuse_reply_err(req, ENOSYS);
 }
@@ -1898,12 +3169,20 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	struct fuse_session *se = req->se;
 	size_t bufsize = se->bufsize;
 	size_t outargsize = sizeof(outarg);
+	uint64_t inflags = 0;
 
 	(void) nodeid;
+	if (arg->major == 7 && arg->minor >= 6) {
+		inflags = arg->flags;
+		/* flags2 is only there if the kernel sent the extended header */
+		if (inflags & FUSE_INIT_EXT)
+			inflags |= (uint64_t) arg->flags2 << 32;
+	}
 	if (se->debug) {
 		fuse_log(FUSE_LOG_DEBUG, "INIT: %u.%u\n", arg->major, arg->minor);
 		if (arg->major == 7 && arg->minor >= 6) {
-			fuse_log(FUSE_LOG_DEBUG, "flags=0x%08x\n", arg->flags);
+			fuse_log(FUSE_LOG_DEBUG, "flags=0x%016llx\n",
+				 (unsigned long long) inflags);
 			fuse_log(FUSE_LOG_DEBUG, "max_readahead=0x%08x\n",
 				arg->max_readahead);
 		}
@@ -1969,6 +3248,10 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 			se->conn.capable |= FUSE_CAP_NO_OPENDIR_SUPPORT;
 		if (arg->flags & FUSE_EXPLICIT_INVAL_DATA)
 			se->conn.capable |= FUSE_CAP_EXPLICIT_INVAL_DATA;
+		if (inflags & FUSE_MAP_ALIGNMENT)
+			se->conn.capable |= FUSE_CAP_MAP_ALIGNMENT;
+		if (inflags & FUSE_HAS_INODE_DAX)
+			se->conn.capable |= FUSE_CAP_DAX_INODE;
 		if (!(arg->flags & FUSE_MAX_PAGES)) {
 			size_t max_bufsize =
 				FUSE_DEFAULT_MAX_PAGES_PER_REQ * getpagesize()
@@ -1981,12 +3264,18 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		se->conn.max_readahead = 0;
 	}
 
-	if (se->conn.proto_minor >= 14) {
+	/*
+	 * Custom transports have nothing to splice from or to, and the
+	 * multi-session loop would need a pipe per worker and session
+	 */
+	if (se->conn.proto_minor >= 14 && !se->io && se->multi_loop_fd == -1) {
 #ifdef HAVE_SPLICE
 #ifdef HAVE_VMSPLICE
 		se->conn.capable |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
 #endif
-		se->conn.capable |= FUSE_CAP_SPLICE_READ;
+		/* Spliced WRITE data sits right behind the header */
+		if (!se->align_write)
+			se->conn.capable |= FUSE_CAP_SPLICE_READ;
 #endif
 	}
 	if (se->conn.proto_minor >= 18)
@@ -2042,6 +3331,9 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		return;
 	}
 
+	if (se->conn.want & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE))
+		fuse_ll_pipe_pool_fill(se);
+
 	unsigned max_read_mo = get_max_read(se->mo);
 	if (se->conn.max_read != max_read_mo) {
 		fuse_log(FUSE_LOG_ERR, "fuse: error: init() and fuse_session_new() "
@@ -2093,6 +3385,14 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		outarg.flags |= FUSE_CACHE_SYMLINKS;
 	if (se->conn.want & FUSE_CAP_EXPLICIT_INVAL_DATA)
 		outarg.flags |= FUSE_EXPLICIT_INVAL_DATA;
+	if (se->conn.want & FUSE_CAP_MAP_ALIGNMENT) {
+		outarg.flags |= FUSE_MAP_ALIGNMENT;
+		outarg.map_alignment = se->conn.map_alignment;
+	}
+	if (se->conn.want & FUSE_CAP_DAX_INODE)
+		outarg.flags2 |= FUSE_HAS_INODE_DAX >> 32;
+	if (inflags & FUSE_INIT_EXT)
+		outarg.flags |= FUSE_INIT_EXT;
 	outarg.max_readahead = se->conn.max_readahead;
 	outarg.max_write = se->conn.max_write;
 	if (se->conn.proto_minor >= 13) {
@@ -2105,15 +3405,32 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 				se->conn.max_background * 3 / 4;
 		}
 
+		/* More background requests would wait in the kernel */
+		if (se->admission.max_reqs &&
+		    se->conn.max_background > se->admission.max_reqs) {
+			se->conn.max_background = se->admission.max_reqs;
+			if (se->conn.congestion_threshold >
+			    se->conn.max_background)
+				se->conn.congestion_threshold =
+					se->conn.max_background * 3 / 4;
+		}
+
 		outarg.max_background = se->conn.max_background;
 		outarg.congestion_threshold = se->conn.congestion_threshold;
 	}
+	fuse_ll_admit_init(se);
 	if (se->conn.proto_minor >= 23)
 		outarg.time_gran = se->conn.time_gran;
 
 	if (se->debug) {
 		fuse_log(FUSE_LOG_DEBUG, "   INIT: %u.%u\n", outarg.major, outarg.minor);
 		fuse_log(FUSE_LOG_DEBUG, "   flags=0x%08x\n", outarg.flags);
+		if (outarg.flags & FUSE_INIT_EXT)
+			fuse_log(FUSE_LOG_DEBUG, "   flags2=0x%08x\n",
+				 outarg.flags2);
+		if (outarg.flags & FUSE_MAP_ALIGNMENT)
+			fuse_log(FUSE_LOG_DEBUG, "   map_alignment=%u\n",
+				 outarg.map_alignment);
 		fuse_log(FUSE_LOG_DEBUG, "   max_readahead=0x%08x\n",
 			outarg.max_readahead);
 		fuse_log(FUSE_LOG_DEBUG, "   max_write=0x%08x\n", outarg.max_write);
@@ -2296,6 +3613,492 @@ int fuse_lowlevel_notify_delete(struct fuse_session *se,
 	return send_notify_iov(se, FUSE_NOTIFY_DELETE, iov, 3);
 }
 
+/*
+ * Writes the message for e to buf, or with a NULL buf only checks
+ * it. Returns the length of the message or -errno.
+ */
+static ssize_t notify_batch_msg(struct fuse_session *se,
+				const struct fuse_notify_entry *e, char *buf)
+{
+	union {
+		struct fuse_notify_inval_inode_out inode;
+		struct fuse_notify_inval_entry_out entry;
+		struct fuse_notify_delete_out delete;
+		struct fuse_notify_store_out store;
+	} arg;
+	struct fuse_out_header out;
+	unsigned int minor;
+	size_t argsize;
+	size_t namesize = 0;
+	size_t datasize = 0;
+	size_t len;
+
+	memset(&arg, 0, sizeof(arg));
+	switch (e->type) {
+	case FUSE_NOTIFY_TYPE_INVAL_INODE:
+		out.error = FUSE_NOTIFY_INVAL_INODE;
+		minor = 12;
+		arg.inode.ino = e->ino;
+		arg.inode.off = e->off;
+		arg.inode.len = e->len;
+		argsize = sizeof(arg.inode);
+		break;
+	case FUSE_NOTIFY_TYPE_INVAL_ENTRY:
+		out.error = FUSE_NOTIFY_INVAL_ENTRY;
+		minor = 12;
+		arg.entry.parent = e->ino;
+		arg.entry.namelen = e->namelen;
+		argsize = sizeof(arg.entry);
+		namesize = e->namelen + 1;
+		break;
+	case FUSE_NOTIFY_TYPE_DELETE:
+		out.error = FUSE_NOTIFY_DELETE;
+		minor = 18;
+		arg.delete.parent = e->ino;
+		arg.delete.child = e->child;
+		arg.delete.namelen = e->namelen;
+		argsize = sizeof(arg.delete);
+		namesize = e->namelen + 1;
+		break;
+	case FUSE_NOTIFY_TYPE_STORE:
+		if (e->off < 0 || e->len < 0 || e->len > UINT32_MAX)
+			return -EINVAL;
+		out.error = FUSE_NOTIFY_STORE;
+		minor = 15;
+		arg.store.nodeid = e->ino;
+		arg.store.offset = e->off;
+		arg.store.size = e->len;
+		argsize = sizeof(arg.store);
+		datasize = e->len;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (se->conn.proto_minor < minor)
+		return -ENOSYS;
+
+	len = sizeof(out) + argsize + namesize + datasize;
+	if (buf) {
+		out.unique = 0;
+		out.len = len;
+		memcpy(buf, &out, sizeof(out));
+		memcpy(buf + sizeof(out), &arg, argsize);
+		if (namesize) {
+			memcpy(buf + sizeof(out) + argsize, e->name,
+			       e->namelen);
+			buf[len - 1] = '\0';
+		}
+		if (datasize)
+			memcpy(buf + sizeof(out) + argsize, e->data, datasize);
+	}
+	return len;
+}
+
+int fuse_lowlevel_notify_batch(struct fuse_session *se,
+			       struct fuse_notify_entry *entries,
+			       size_t count)
+{
+	struct fuse_notify_entry *msgs[FUSE_URING_BATCH_MAX];
+	struct iovec iov[FUSE_URING_BATCH_MAX];
+	int res[FUSE_URING_BATCH_MAX];
+	struct fuse_uring *ring = NULL;
+	int no_ring;
+	char *buf = NULL;
+	size_t bufsize = 0;
+	size_t failed = 0;
+	size_t i = 0;
+
+	if (!se)
+		return -EINVAL;
+	if (!se->got_init)
+		return -ENOTCONN;
+	/* The ring only writes to a device */
+	no_ring = se->io != NULL;
+
+	while (i < count) {
+		size_t first = i;
+		size_t used = 0;
+		unsigned int n = 0;
+		unsigned int k;
+		int err = -ENOSYS;
+		char *p;
+
+		for (; i < count && n < FUSE_URING_BATCH_MAX; i++) {
+			ssize_t len = notify_batch_msg(se, &entries[i], NULL);
+
+			entries[i].error = len < 0 ? len : 0;
+			if (len < 0) {
+				failed++;
+				continue;
+			}
+			used += len;
+			n++;
+		}
+		if (!n)
+			continue;
+
+		if (used > bufsize) {
+			char *newbuf = realloc(buf, used);
+
+			if (newbuf == NULL) {
+				for (; first < i; first++)
+					if (!entries[first].error)
+						entries[first].error = -ENOMEM;
+				failed += n;
+				continue;
+			}
+			buf = newbuf;
+			bufsize = used;
+		}
+
+		p = buf;
+		n = 0;
+		for (; first < i; first++) {
+			if (entries[first].error)
+				continue;
+			iov[n].iov_base = p;
+			iov[n].iov_len = notify_batch_msg(se, &entries[first], p);
+			p += iov[n].iov_len;
+			msgs[n++] = &entries[first];
+		}
+		if (se->debug)
+			fuse_log(FUSE_LOG_DEBUG, "NOTIFY: batch of %u\n", n);
+
+		if (n > 1 && !no_ring) {
+			err = fuse_uring_write_batch(&ring, se->fd, iov, n, res);
+			if (err == -ENOSYS)
+				no_ring = 1;
+		}
+		/* Otherwise res holds what each write returned */
+		if (err < 0) {
+			for (k = 0; k < n; k++)
+				res[k] = fuse_ll_writev(se, se->fd,
+							&iov[k], 1) == -1 ?
+					-errno : 0;
+		}
+		for (k = 0; k < n; k++) {
+			if (res[k] < 0) {
+				msgs[k]->error = res[k];
+				failed++;
+			}
+		}
+	}
+	fuse_uring_free(ring);
+	free(buf);
+
+	/* All failed, most likely for the same reason */
+	if (count && failed == count)
+		return entries[0].error;
+	return failed;
+}
+
+struct fuse_notify_item {
+	struct fuse_notify_item *next;
+	struct fuse_notify_item *hash_next;
+	uint64_t hash;
+	int hashed;
+	struct fuse_notify_entry e;
+	/* The name or data of e */
+	char buf[];
+};
+
+/*
+ * Stores are not hashed, the inode alone identifies an INVAL_INODE, and
+ * only a DELETE has a child
+ */
+static uint64_t notify_hash(const struct fuse_notify_entry *e)
+{
+	uint64_t h = (e->ino ^ ((uint64_t) e->type << 60)) *
+		0x9e3779b97f4a7c15ULL;
+	size_t i;
+
+	if (e->type == FUSE_NOTIFY_TYPE_INVAL_INODE)
+		return h;
+	if (e->type == FUSE_NOTIFY_TYPE_DELETE)
+		h ^= e->child;
+	for (i = 0; i < e->namelen; i++)
+		h = (h ^ (unsigned char) e->name[i]) * 0x100000001b3ULL;
+
+	return h ^ (h >> 29);
+}
+
+static int notify_same(const struct fuse_notify_entry *a,
+		       const struct fuse_notify_entry *b)
+{
+	if (a->type != b->type || a->ino != b->ino)
+		return 0;
+	if (a->type == FUSE_NOTIFY_TYPE_INVAL_INODE)
+		return 1;
+
+	if (a->type == FUSE_NOTIFY_TYPE_DELETE && a->child != b->child)
+		return 0;
+
+	return a->namelen == b->namelen &&
+		memcmp(a->name, b->name, a->namelen) == 0;
+}
+
+/* Called with nq->lock held */
+static struct fuse_notify_item **notify_find(struct fuse_notify_queue *nq,
+					     const struct fuse_notify_entry *e,
+					     uint64_t hash)
+{
+	struct fuse_notify_item **itemp;
+
+	for (itemp = &nq->hash[hash & (nq->hash_size - 1)]; *itemp != NULL;
+	     itemp = &(*itemp)->hash_next)
+		if ((*itemp)->hash == hash && notify_same(&(*itemp)->e, e))
+			break;
+
+	return itemp;
+}
+
+/* Called with nq->lock held */
+static void notify_unhash(struct fuse_notify_queue *nq,
+			  struct fuse_notify_item *item)
+{
+	struct fuse_notify_item **itemp;
+
+	if (!item->hashed)
+		return;
+	for (itemp = &nq->hash[item->hash & (nq->hash_size - 1)];
+	     *itemp != item; itemp = &(*itemp)->hash_next)
+		;
+	*itemp = item->hash_next;
+	item->hashed = 0;
+}
+
+/*
+ * Widens the inode invalidation a to cover b as well. A negative
+ * offset only invalidates the attributes, which every invalidation
+ * does, and a length of zero or less means up to the end of the file.
+ */
+static void notify_merge_range(struct fuse_notify_entry *a,
+			       const struct fuse_notify_entry *b)
+{
+	uint64_t end_a = a->off + (uint64_t) a->len;
+	uint64_t end_b = b->off + (uint64_t) b->len;
+	off_t start;
+
+	if (b->off < 0)
+		return;
+	if (a->off < 0) {
+		a->off = b->off;
+		a->len = b->len;
+		return;
+	}
+
+	start = a->off < b->off ? a->off : b->off;
+	if (a->len <= 0 || b->len <= 0 || end_a > INT64_MAX ||
+	    end_b > INT64_MAX)
+		a->len = 0;
+	else
+		a->len = (end_a > end_b ? end_a : end_b) - start;
+	a->off = start;
+}
+
+static void *fuse_ll_notify_thread(void *data)
+{
+	struct fuse_session *se = data;
+	struct fuse_notify_queue *nq = &se->notify_queue;
+	struct fuse_notify_item *items[FUSE_URING_BATCH_MAX];
+	struct fuse_notify_entry entries[FUSE_URING_BATCH_MAX];
+	unsigned int n;
+	unsigned int i;
+
+	pthread_mutex_lock(&nq->lock);
+	while (1) {
+		while (nq->head == NULL && !nq->stop)
+			pthread_cond_wait(&nq->cond, &nq->lock);
+		if (nq->stop)
+			break;
+
+		for (n = 0; nq->head != NULL && n < FUSE_URING_BATCH_MAX; n++) {
+			items[n] = nq->head;
+			nq->head = items[n]->next;
+			notify_unhash(nq, items[n]);
+			entries[n] = items[n]->e;
+			nq->count--;
+		}
+		if (nq->head == NULL)
+			nq->tail = &nq->head;
+		nq->sending = 1;
+		pthread_mutex_unlock(&nq->lock);
+
+		fuse_lowlevel_notify_batch(se, entries, n);
+		for (i = 0; i < n; i++) {
+			if (se->debug && entries[i].error)
+				fuse_log(FUSE_LOG_DEBUG,
+					 "NOTIFY: queued type %i failed: %s\n",
+					 entries[i].type,
+					 strerror(-entries[i].error));
+			free(items[i]);
+		}
+
+		pthread_mutex_lock(&nq->lock);
+		nq->sending = 0;
+		pthread_cond_broadcast(&nq->sent);
+	}
+	pthread_mutex_unlock(&nq->lock);
+
+	return NULL;
+}
+
+int fuse_lowlevel_notify_queue(struct fuse_session *se,
+			       const struct fuse_notify_entry *entry)
+{
+	struct fuse_notify_queue *nq;
+	struct fuse_notify_item *item;
+	struct fuse_notify_item **itemp;
+	uint64_t hash = 0;
+	size_t size = 0;
+	int res;
+
+	if (!se)
+		return -EINVAL;
+	if (!se->got_init)
+		return -ENOTCONN;
+	/* Fails the same way as sending it right away would */
+	res = notify_batch_msg(se, entry, NULL);
+	if (res < 0)
+		return res;
+	res = 0;
+
+	if (entry->type == FUSE_NOTIFY_TYPE_STORE)
+		size = entry->len;
+	else if (entry->type != FUSE_NOTIFY_TYPE_INVAL_INODE)
+		size = entry->namelen + 1;
+
+	nq = &se->notify_queue;
+	pthread_mutex_lock(&nq->lock);
+	if (nq->stop) {
+		res = -ENOTCONN;
+		goto out;
+	}
+	if (nq->hash == NULL) {
+		size_t hash_size = 16;
+
+		while (hash_size < nq->depth)
+			hash_size *= 2;
+		nq->hash = calloc(hash_size, sizeof(nq->hash[0]));
+		if (nq->hash == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+		nq->hash_size = hash_size;
+	}
+
+	if (entry->type != FUSE_NOTIFY_TYPE_STORE) {
+		hash = notify_hash(entry);
+		itemp = notify_find(nq, entry, hash);
+		if (*itemp != NULL) {
+			if (entry->type == FUSE_NOTIFY_TYPE_INVAL_INODE)
+				notify_merge_range(&(*itemp)->e, entry);
+			goto out;
+		}
+	} else {
+		/* Invalidations after the store must be sent after it */
+		struct fuse_notify_entry inval = {
+			.type = FUSE_NOTIFY_TYPE_INVAL_INODE,
+			.ino = entry->ino,
+		};
+
+		itemp = notify_find(nq, &inval, notify_hash(&inval));
+		if (*itemp != NULL)
+			notify_unhash(nq, *itemp);
+	}
+
+	if (nq->count >= nq->depth) {
+		res = -EAGAIN;
+		goto out;
+	}
+	if (!nq->started) {
+		if (fuse_start_thread(&nq->thread, fuse_ll_notify_thread,
+				      se) == -1) {
+			res = -EAGAIN;
+			goto out;
+		}
+		nq->started = 1;
+	}
+
+	item = malloc(sizeof(struct fuse_notify_item) + size);
+	if (item == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	item->e = *entry;
+	item->e.error = 0;
+	if (entry->type == FUSE_NOTIFY_TYPE_STORE) {
+		memcpy(item->buf, entry->data, size);
+		item->e.data = item->buf;
+	} else if (size) {
+		memcpy(item->buf, entry->name, entry->namelen);
+		item->buf[entry->namelen] = '\0';
+		item->e.name = item->buf;
+	}
+	item->next = NULL;
+	*nq->tail = item;
+	nq->tail = &item->next;
+	nq->count++;
+	item->hashed = entry->type != FUSE_NOTIFY_TYPE_STORE;
+	if (item->hashed) {
+		item->hash = hash;
+		item->hash_next = nq->hash[hash & (nq->hash_size - 1)];
+		nq->hash[hash & (nq->hash_size - 1)] = item;
+	}
+	pthread_cond_signal(&nq->cond);
+out:
+	pthread_mutex_unlock(&nq->lock);
+
+	return res;
+}
+
+int fuse_lowlevel_notify_queue_flush(struct fuse_session *se)
+{
+	struct fuse_notify_queue *nq;
+	int res = 0;
+
+	if (!se)
+		return -EINVAL;
+
+	nq = &se->notify_queue;
+	pthread_mutex_lock(&nq->lock);
+	while ((nq->head != NULL || nq->sending) && !nq->stop)
+		pthread_cond_wait(&nq->sent, &nq->lock);
+	if (nq->head != NULL)
+		res = -ENOTCONN;
+	pthread_mutex_unlock(&nq->lock);
+
+	return res;
+}
+
+/* Stops the sender thread and drops what it has not sent yet */
+static void fuse_ll_notify_queue_stop(struct fuse_session *se)
+{
+	struct fuse_notify_queue *nq = &se->notify_queue;
+	struct fuse_notify_item *item;
+	int started;
+
+	pthread_mutex_lock(&nq->lock);
+	nq->stop = 1;
+	started = nq->started;
+	nq->started = 0;
+	pthread_cond_broadcast(&nq->cond);
+	pthread_cond_broadcast(&nq->sent);
+	pthread_mutex_unlock(&nq->lock);
+
+	if (started)
+		pthread_join(nq->thread, NULL);
+
+	while ((item = nq->head) != NULL) {
+		nq->head = item->next;
+		free(item);
+	}
+	nq->tail = &nq->head;
+	nq->count = 0;
+	if (nq->hash != NULL)
+		memset(nq->hash, 0, nq->hash_size * sizeof(nq->hash[0]));
+}
+
 int fuse_lowlevel_notify_store(struct fuse_session *se, fuse_ino_t ino,
 			       off_t offset, struct fuse_bufvec *bufv,
 			       enum fuse_buf_copy_flags flags)
@@ -2309,25 +4112,196 @@ int fuse_lowlevel_notify_store(struct fuse_session *se, fuse_ino_t ino,
 	if (!se)
 		return -EINVAL;
 
-	if (se->conn.proto_minor < 15)
-		return -ENOSYS;
+	if (se->conn.proto_minor < 15)
+		return -ENOSYS;
+
+	out.unique = 0;
+	out.error = FUSE_NOTIFY_STORE;
+
+	outarg.nodeid = ino;
+	outarg.offset = offset;
+	outarg.size = size;
+	outarg.padding = 0;
+
+	iov[0].iov_base = &out;
+	iov[0].iov_len = sizeof(out);
+	iov[1].iov_base = &outarg;
+	iov[1].iov_len = sizeof(outarg);
+
+	res = fuse_send_data_iov(se, NULL, iov, 2, bufv, flags);
+	if (res > 0)
+		res = -res;
+
+	return res;
+}
+
+/* Size of the notifications sent by fuse_lowlevel_notify_store_fd() */
+#define FUSE_STORE_CHUNK (512 * 1024)
+
+struct fuse_store {
+	struct fuse_session *se;
+	fuse_ino_t ino;
+	int fd;
+	off_t offset;
+	off_t end;
+	uint64_t start_ns;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int cancel;
+	int res;
+	struct fuse_store_stats stats;
+};
+
+static int fuse_store_init(struct fuse_store *st, struct fuse_session *se,
+			   fuse_ino_t ino, int fd, off_t offset, off_t size)
+{
+	struct stat stbuf;
+
+	if (!se || offset < 0 || size < 0)
+		return -EINVAL;
+	if (se->conn.proto_minor < 15)
+		return -ENOSYS;
+	if (fstat(fd, &stbuf) == -1)
+		return -errno;
+	if (!S_ISREG(stbuf.st_mode))
+		return -EINVAL;
+
+	memset(st, 0, sizeof(*st));
+	st->se = se;
+	st->ino = ino;
+	st->fd = fd;
+	st->offset = offset;
+	/* The size of a store must match the data that follows it */
+	st->end = stbuf.st_size;
+	if (size && size < st->end - offset)
+		st->end = offset + size;
+	if (st->end < offset)
+		st->end = offset;
+	st->start_ns = fuse_ll_now_ns();
+	pthread_mutex_init(&st->lock, NULL);
+
+	return 0;
+}
+
+static int fuse_store_run(struct fuse_store *st)
+{
+	off_t pos = st->offset;
+	int res = 0;
+
+	while (pos < st->end) {
+		size_t size = st->end - pos;
+		struct fuse_bufvec bufv;
+
+		if (size > FUSE_STORE_CHUNK)
+			size = FUSE_STORE_CHUNK;
+		bufv = (struct fuse_bufvec) FUSE_BUFVEC_INIT(size);
+		bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK |
+			FUSE_BUF_FD_RETRY;
+		bufv.buf[0].fd = st->fd;
+		bufv.buf[0].pos = pos;
+
+		if (__atomic_load_n(&st->cancel, __ATOMIC_RELAXED)) {
+			res = -ECANCELED;
+			break;
+		}
+		res = fuse_lowlevel_notify_store(st->se, st->ino, pos, &bufv, 0);
+		if (res)
+			break;
+		pos += size;
+
+		pthread_mutex_lock(&st->lock);
+		st->stats.bytes += size;
+		st->stats.chunks++;
+		pthread_mutex_unlock(&st->lock);
+	}
+
+	pthread_mutex_lock(&st->lock);
+	st->stats.ns = fuse_ll_now_ns() - st->start_ns;
+	st->stats.done = 1;
+	st->res = res;
+	pthread_mutex_unlock(&st->lock);
+
+	return res;
+}
+
+int fuse_lowlevel_notify_store_fd(struct fuse_session *se, fuse_ino_t ino,
+				  int fd, off_t offset, off_t size,
+				  struct fuse_store_stats *stats)
+{
+	struct fuse_store st;
+	int res;
+
+	res = fuse_store_init(&st, se, ino, fd, offset, size);
+	if (res)
+		return res;
+
+	res = fuse_store_run(&st);
+	if (stats)
+		*stats = st.stats;
+	pthread_mutex_destroy(&st.lock);
+
+	return res;
+}
+
+static void *fuse_store_thread(void *data)
+{
+	fuse_store_run(data);
+
+	return NULL;
+}
+
+struct fuse_store *fuse_lowlevel_notify_store_fd_start(struct fuse_session *se,
+							fuse_ino_t ino, int fd,
+							off_t offset, off_t size)
+{
+	struct fuse_store *st;
+	int res;
+
+	st = malloc(sizeof(struct fuse_store));
+	if (st == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate store\n");
+		return NULL;
+	}
+	res = fuse_store_init(st, se, ino, fd, offset, size);
+	if (res) {
+		fuse_log(FUSE_LOG_ERR, "fuse: cannot store file: %s\n",
+			 strerror(-res));
+		free(st);
+		return NULL;
+	}
+	if (fuse_start_thread(&st->thread, fuse_store_thread, st) == -1) {
+		pthread_mutex_destroy(&st->lock);
+		free(st);
+		return NULL;
+	}
 
-	out.unique = 0;
-	out.error = FUSE_NOTIFY_STORE;
+	return st;
+}
 
-	outarg.nodeid = ino;
-	outarg.offset = offset;
-	outarg.size = size;
-	outarg.padding = 0;
+void fuse_store_progress(struct fuse_store *st, struct fuse_store_stats *stats)
+{
+	pthread_mutex_lock(&st->lock);
+	*stats = st->stats;
+	if (!stats->done)
+		stats->ns = fuse_ll_now_ns() - st->start_ns;
+	pthread_mutex_unlock(&st->lock);
+}
 
-	iov[0].iov_base = &out;
-	iov[0].iov_len = sizeof(out);
-	iov[1].iov_base = &outarg;
-	iov[1].iov_len = sizeof(outarg);
+void fuse_store_cancel(struct fuse_store *st)
+{
+	__atomic_store_n(&st->cancel, 1, __ATOMIC_RELAXED);
+}
 
-	res = fuse_send_data_iov(se, NULL, iov, 2, bufv, flags);
-	if (res > 0)
-		res = -res;
+int fuse_store_wait(struct fuse_store *st, struct fuse_store_stats *stats)
+{
+	int res;
+
+	pthread_join(st->thread, NULL);
+	res = st->res;
+	if (stats)
+		*stats = st->stats;
+	pthread_mutex_destroy(&st->lock);
+	free(st);
 
 	return res;
 }
@@ -2351,6 +4325,7 @@ static void fuse_ll_retrieve_reply(struct fuse_notify_req *nreq,
 		.count = 1,
 	};
 
+	bufv.buf[0].flags &= ~FUSE_BUF_INTERNAL;
 	if (!(bufv.buf[0].flags & FUSE_BUF_IS_FD))
 		bufv.buf[0].mem = PARAM(arg);
 
@@ -2434,25 +4409,21 @@ const struct fuse_ctx *fuse_req_ctx(fuse_req_t req)
 void fuse_req_interrupt_func(fuse_req_t req, fuse_interrupt_func_t func,
 			     void *data)
 {
+	struct fuse_inflight_shard *sh = inflight_shard(req->se, req->unique);
+
 	pthread_mutex_lock(&req->lock);
-	pthread_mutex_lock(&req->se->lock);
+	pthread_mutex_lock(&sh->lock);
 	req->u.ni.func = func;
 	req->u.ni.data = data;
-	pthread_mutex_unlock(&req->se->lock);
-	if (req->interrupted && func)
+	pthread_mutex_unlock(&sh->lock);
+	if (fuse_req_interrupted(req) && func)
 		func(req, data);
 	pthread_mutex_unlock(&req->lock);
 }
 
 int fuse_req_interrupted(fuse_req_t req)
 {
-	int interrupted;
-
-	pthread_mutex_lock(&req->se->lock);
-	interrupted = req->interrupted;
-	pthread_mutex_unlock(&req->se->lock);
-
-	return interrupted;
+	return __atomic_load_n(&req->interrupted, __ATOMIC_RELAXED);
 }
 
 static struct {
@@ -2504,6 +4475,9 @@ static struct {
 	[FUSE_RENAME2]     = { do_rename2,      "RENAME2"    },
 	[FUSE_COPY_FILE_RANGE] = { do_copy_file_range, "COPY_FILE_RANGE" },
 	[FUSE_LSEEK]	   = { do_lseek,       "LSEEK"	     },
+	[FUSE_SETUPMAPPING] = { do_setupmapping, "SETUPMAPPING" },
+	[FUSE_REMOVEMAPPING] = { do_removemapping, "REMOVEMAPPING" },
+	[FUSE_SYNCFS]	   = { do_syncfs,      "SYNCFS"	     },
 	[CUSE_INIT]	   = { cuse_lowlevel_init, "CUSE_INIT"   },
 };
 
@@ -2532,6 +4506,72 @@ static int fuse_ll_copy_from_pipe(struct fuse_bufvec *dst,
 	return 0;
 }
 
+/* Answers a request for which there is no struct fuse_req */
+static void fuse_ll_reply_unique_err(struct fuse_session *se,
+				     struct fuse_chan *ch, uint64_t unique,
+				     int err)
+{
+	struct fuse_out_header out = {
+		.unique = unique,
+		.error = -err,
+	};
+	struct iovec iov = {
+		.iov_base = &out,
+		.iov_len = sizeof(struct fuse_out_header),
+	};
+
+	fuse_send_msg(se, ch, &iov, 1);
+}
+
+int fuse_session_move_buf_int(struct fuse_session *se, struct fuse_buf *dst,
+			      struct fuse_buf *buf, struct fuse_chan *ch)
+{
+	const size_t hdrsize = sizeof(struct fuse_in_header);
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(hdrsize);
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(hdrsize);
+	int res;
+
+	if (!(buf->flags & FUSE_BUF_IS_FD)) {
+		*dst = *buf;
+		buf->mem = NULL;
+		buf->flags &= FUSE_BUF_TIERED;
+		return 0;
+	}
+
+	*dst = (struct fuse_buf) { .flags = buf->flags & FUSE_BUF_TIERED };
+	res = fuse_ll_buf_mem(se, dst, buf->size);
+	if (res != 0)
+		return res;
+
+	/*
+	 * The header comes first, so that the request can still be
+	 * answered if the rest cannot be read
+	 */
+	src.buf[0].flags = FUSE_BUF_IS_FD;
+	src.buf[0].fd = buf->fd;
+	mem.buf[0].mem = dst->mem;
+	if (buf->size < hdrsize ||
+	    fuse_ll_copy_from_pipe(&mem, &src) != 0)
+		goto clear_pipe;
+
+	src.buf[0].size = mem.buf[0].size = buf->size - hdrsize;
+	mem.buf[0].mem = (char *) dst->mem + hdrsize;
+	if (fuse_ll_copy_from_pipe(&mem, &src) != 0) {
+		struct fuse_in_header *in = dst->mem;
+
+		fuse_ll_reply_unique_err(se, ch, in->unique, EIO);
+		goto clear_pipe;
+	}
+	dst->size = buf->size;
+	buf->flags &= FUSE_BUF_INTERNAL;
+	return 0;
+
+clear_pipe:
+	fuse_session_free_buf_int(se, dst);
+	fuse_ll_clear_pipe(se);
+	return -EIO;
+}
+
 void fuse_session_process_buf(struct fuse_session *se,
 			      const struct fuse_buf *buf)
 {
@@ -2545,34 +4585,42 @@ void fuse_session_process_buf_int(struct fuse_session *se,
 		sizeof(struct fuse_write_in);
 	struct fuse_bufvec bufv = { .buf[0] = *buf, .count = 1 };
 	struct fuse_bufvec tmpbuf = FUSE_BUFVEC_INIT(write_header_size);
+	/*
+	 * Scratch space for the headers of a spliced request, so that
+	 * the zero copy write path does not need to allocate anything
+	 */
+	union {
+		struct {
+			struct fuse_in_header in;
+			struct fuse_write_in arg;
+		} write;
+		char buf[sizeof(struct fuse_in_header) +
+			 sizeof(struct fuse_write_in)];
+	} hdr;
 	struct fuse_in_header *in;
 	const void *inarg;
 	struct fuse_req *req;
-	void *mbuf = NULL;
+	struct fuse_ll_large_buf *lb = NULL;
+	void *mbuf;
+	uint64_t start = fuse_ll_now_ns();
 	int err;
 	int res;
 
 	if (buf->flags & FUSE_BUF_IS_FD) {
 		if (buf->size < tmpbuf.buf[0].size)
 			tmpbuf.buf[0].size = buf->size;
-
-		mbuf = malloc(tmpbuf.buf[0].size);
-		if (mbuf == NULL) {
-			fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate header\n");
-			goto clear_pipe;
-		}
-		tmpbuf.buf[0].mem = mbuf;
+		tmpbuf.buf[0].mem = hdr.buf;
 
 		res = fuse_ll_copy_from_pipe(&tmpbuf, &bufv);
 		if (res < 0)
 			goto clear_pipe;
 
-		in = mbuf;
+		in = &hdr.write.in;
 	} else {
 		in = buf->mem;
 	}
 
-	if (se->debug) {
+	if (fuse_ll_traced(se, in->unique)) {
 		fuse_log(FUSE_LOG_DEBUG,
 			"unique: %llu, opcode: %s (%i), nodeid: %llu, insize: %zu, pid: %u\n",
 			(unsigned long long) in->unique,
@@ -2582,16 +4630,7 @@ void fuse_session_process_buf_int(struct fuse_session *se,
 
 	req = fuse_ll_alloc_req(se);
 	if (req == NULL) {
-		struct fuse_out_header out = {
-			.unique = in->unique,
-			.error = -ENOMEM,
-		};
-		struct iovec iov = {
-			.iov_base = &out,
-			.iov_len = sizeof(struct fuse_out_header),
-		};
-
-		fuse_send_msg(se, ch, &iov, 1);
+		fuse_ll_reply_unique_err(se, ch, in->unique, ENOMEM);
 		goto clear_pipe;
 	}
 
@@ -2600,6 +4639,16 @@ void fuse_session_process_buf_int(struct fuse_session *se,
 	req->ctx.gid = in->gid;
 	req->ctx.pid = in->pid;
 	req->ch = ch ? fuse_chan_get(ch) : NULL;
+	fuse_ll_stats_receive(req, in, start);
+	/*
+	 * A SETLKW may wait for an unlock that is still queued in the
+	 * kernel, and interrupts must get through to end such waits. If
+	 * these counted, the budget could fill up with waiters that
+	 * nothing can wake.
+	 */
+	if (admit_enabled(&se->admission) && in->opcode != FUSE_SETLKW &&
+	    in->opcode != FUSE_INTERRUPT)
+		fuse_ll_admit(req, in->len);
 
 	err = EIO;
 	if (!se->got_init) {
@@ -2625,11 +4674,11 @@ void fuse_session_process_buf_int(struct fuse_session *se,
 	err = ENOSYS;
 	if (in->opcode >= FUSE_MAXOP || !fuse_ll_ops[in->opcode].func)
 		goto reply_err;
-	if (in->opcode != FUSE_INTERRUPT) {
+	if (in->opcode != FUSE_INTERRUPT &&
+	    fuse_ll_add_inflight(se, req)) {
 		struct fuse_req *intr;
 		pthread_mutex_lock(&se->lock);
 		intr = check_interrupt(se, req);
-		list_add_req(req, &se->list);
 		pthread_mutex_unlock(&se->lock);
 		if (intr)
 			fuse_reply_err(intr, EAGAIN);
@@ -2638,13 +4687,12 @@ void fuse_session_process_buf_int(struct fuse_session *se,
 	if ((buf->flags & FUSE_BUF_IS_FD) && write_header_size < buf->size &&
 	    (in->opcode != FUSE_WRITE || !se->op.write_buf) &&
 	    in->opcode != FUSE_NOTIFY_REPLY) {
-		void *newmbuf;
-
 		err = ENOMEM;
-		newmbuf = realloc(mbuf, buf->size);
-		if (newmbuf == NULL)
+		lb = fuse_ll_large_buf_get(se, buf->size);
+		if (lb == NULL)
 			goto reply_err;
-		mbuf = newmbuf;
+		mbuf = lb->mem;
+		memcpy(mbuf, hdr.buf, write_header_size);
 
 		tmpbuf = FUSE_BUFVEC_INIT(buf->size - write_header_size);
 		tmpbuf.buf[0].mem = (char *)mbuf + write_header_size;
@@ -2658,6 +4706,12 @@ void fuse_session_process_buf_int(struct fuse_session *se,
 	}
 
 	inarg = (void *) &in[1];
+	err = EINVAL;
+	if (in->opcode == FUSE_REMOVEMAPPING &&
+	    !removemapping_fits(inarg, buf->size - sizeof(*in)))
+		goto reply_err;
+
+	FUSE_PROBE3(request_dispatch, in->unique, in->opcode, in->nodeid);
 	if (in->opcode == FUSE_WRITE && se->op.write_buf)
 		do_write_buf(req, in->nodeid, inarg, buf);
 	else if (in->opcode == FUSE_NOTIFY_REPLY)
@@ -2666,7 +4720,8 @@ void fuse_session_process_buf_int(struct fuse_session *se,
 		fuse_ll_ops[in->opcode].func(req, in->nodeid, inarg);
 
 out_free:
-	free(mbuf);
+	if (lb)
+		fuse_ll_large_buf_put(se, lb);
 	return;
 
 reply_err:
@@ -2684,7 +4739,21 @@ static const struct fuse_opt fuse_ll_opts[] = {
 	LL_OPTION("debug", debug, 1),
 	LL_OPTION("-d", debug, 1),
 	LL_OPTION("--debug", debug, 1),
+	LL_OPTION("debug_sample=%u", debug_sample, 0),
+	LL_OPTION("log_async", log_async, 1),
 	LL_OPTION("allow_root", deny_others, 1),
+	LL_OPTION("io_uring", io_uring, 1),
+	LL_OPTION("uring_depth=%u", uring_depth, 0),
+	LL_OPTION("splice_threshold=%u", splice_threshold, 0),
+	LL_OPTION("splice_autotune", splice_autotune, 1),
+	LL_OPTION("pipe_pool=%u", pipe_pool_size, 0),
+	LL_OPTION("buf_hugepage", buf_hugepage, 1),
+	LL_OPTION("align_write", align_write, 1),
+	LL_OPTION("reply_batch=%u", reply_batch, 0),
+	LL_OPTION("reply_batch_delay=%u", reply_batch_delay, 0),
+	LL_OPTION("notify_queue=%u", notify_queue.depth, 0),
+	LL_OPTION("max_inflight=%u", admission.max_reqs, 0),
+	LL_OPTION("max_inflight_bytes=%zu", admission.max_bytes, 0),
 	FUSE_OPT_END
 };
 
@@ -2702,26 +4771,83 @@ void fuse_lowlevel_help(void)
 	printf(
 "    -o allow_other         allow access by all users\n"
 "    -o allow_root          allow access by root\n"
-"    -o auto_unmount        auto unmount on process termination\n");
+"    -o auto_unmount        auto unmount on process termination\n"
+"    -o io_uring            use io_uring in the single-threaded loop\n"
+"    -o uring_depth=N       number of requests read ahead with io_uring\n"
+"    -o splice_threshold=N  copy spliced requests smaller than N bytes\n"
+"    -o splice_autotune     adjust splice_threshold to the measured costs\n"
+"    -o pipe_pool=N         number of pre-grown splice pipes to keep\n"
+"    -o buf_hugepage        back large request buffers with huge pages\n"
+"    -o align_write         page align the data of WRITE requests\n"
+"    -o reply_batch=N       write up to N small replies at once\n"
+"    -o reply_batch_delay=N hold back replies for at most N us (default: 100)\n"
+"    -o notify_queue=N      queue up to N notifications (default: 1024)\n"
+"    -o max_inflight=N      stop reading requests while N are unanswered\n"
+"    -o max_inflight_bytes=N same for N bytes of unanswered requests\n"
+"    -o debug_sample=N      debug, but only trace one in N requests\n"
+"    -o log_async           log from a background thread\n");
 }
 
 void fuse_session_destroy(struct fuse_session *se)
 {
 	struct fuse_ll_pipe *llp;
+	struct fuse_ll_large_buf *lb;
+	struct fuse_req_cache *cache;
+	struct fuse_reply_batch *rb;
 
 	if (se->got_init && !se->got_destroy) {
 		if (se->op.destroy)
 			se->op.destroy(se->userdata);
 	}
+	fuse_ll_notify_queue_stop(se);
+	fuse_ll_reply_timer_stop(&se->reply_timer);
+	if (se->debug && admit_enabled(&se->admission))
+		fuse_log(FUSE_LOG_DEBUG, "fuse: reading paused %llu times "
+			 "for the in-flight budget\n",
+			 (unsigned long long) se->admission.waits);
+	free(se->notify_queue.hash);
+	pthread_cond_destroy(&se->notify_queue.cond);
+	pthread_cond_destroy(&se->notify_queue.sent);
+	pthread_mutex_destroy(&se->notify_queue.lock);
+	pthread_cond_destroy(&se->admission.cond);
+	pthread_mutex_destroy(&se->admission.lock);
 	llp = pthread_getspecific(se->pipe_key);
 	if (llp != NULL)
 		fuse_ll_pipe_free(llp);
 	pthread_key_delete(se->pipe_key);
+	while ((llp = se->pipe_pool) != NULL) {
+		se->pipe_pool = llp->next;
+		fuse_ll_pipe_free(llp);
+	}
+	while ((lb = se->large_bufs) != NULL) {
+		se->large_bufs = lb->next;
+		free(lb->base);
+	}
+	/* Destructors will no longer run */
+	pthread_key_delete(se->req_key);
+	while (se->req_caches.next != &se->req_caches) {
+		cache = se->req_caches.next;
+		se->req_caches.next = cache->next;
+		fuse_ll_req_cache_free(cache);
+	}
+	rb = pthread_getspecific(se->reply_key);
+	if (rb != NULL) {
+		/* The loop has returned, nobody waits for these anymore */
+		rb->count = 0;
+		fuse_ll_reply_batch_destructor(rb);
+	}
+	pthread_key_delete(se->reply_key);
+	pthread_cond_destroy(&se->reply_timer.cond);
+	pthread_mutex_destroy(&se->reply_timer.lock);
+	fuse_ll_destroy_inflight(se);
 	pthread_mutex_destroy(&se->lock);
 	free(se->cuse_data);
 	if (se->fd != -1)
 		close(se->fd);
+	free(se->io);
 	destroy_mount_opts(se->mo);
+	if (se->log_async)
+		fuse_log_stop_async();
 	free(se);
 }
 
@@ -2729,7 +4855,94 @@ void fuse_session_destroy(struct fuse_session *se)
 static void fuse_ll_pipe_destructor(void *data)
 {
 	struct fuse_ll_pipe *llp = data;
-	fuse_ll_pipe_free(llp);
+	fuse_ll_pipe_pool_put(llp);
+}
+
+#ifdef HAVE_SPLICE
+#define FUSE_EWMA(avg, sample) \
+	((avg) ? (avg) - (avg) / 8 + (sample) / 8 : (sample))
+
+/*
+ * Copying a request out of the pipe costs a system call plus a cost
+ * per byte. Leaving the data in the pipe saves the copy, but then the
+ * filesystem needs another system call to move it. Zero copy thus
+ * pays off once copying the data costs more than a system call.
+ */
+static void fuse_ll_tune_splice(struct fuse_session *se, size_t size,
+				uint64_t ns)
+{
+	struct fuse_splice_tune *t = &se->splice_tune;
+	uint64_t syscall_ns = __atomic_load_n(&t->syscall_ns, __ATOMIC_RELAXED);
+	uint64_t kib_ns = __atomic_load_n(&t->kib_ns, __ATOMIC_RELAXED);
+	uint64_t threshold;
+
+	if (size <= pagesize) {
+		syscall_ns = FUSE_EWMA(syscall_ns, ns);
+		__atomic_store_n(&t->syscall_ns, syscall_ns, __ATOMIC_RELAXED);
+	} else if (syscall_ns && ns > syscall_ns) {
+		kib_ns = FUSE_EWMA(kib_ns, (ns - syscall_ns) * 1024 / size);
+		__atomic_store_n(&t->kib_ns, kib_ns, __ATOMIC_RELAXED);
+	}
+	if (!syscall_ns || !kib_ns)
+		return;
+
+	threshold = syscall_ns * 1024 / kib_ns + FUSE_SPLICE_MIN_THRESHOLD;
+	if (threshold > se->bufsize)
+		threshold = se->bufsize;
+	__atomic_store_n(&se->splice_threshold, threshold, __ATOMIC_RELAXED);
+}
+#endif
+
+/* Receives the next request through the custom transport */
+static int fuse_ll_receive_io(struct fuse_session *se, struct fuse_buf *buf,
+			      int fd)
+{
+	const struct fuse_custom_io *io = se->io;
+	struct fuse_buf lent = { .mem = NULL };
+	ssize_t res;
+	int err;
+
+	/* Only the library's loops know to give the memory back */
+	if (io->receive_buf && (buf->flags & FUSE_BUF_TIERED)) {
+		res = io->receive_buf(fd, &lent, se->userdata);
+		err = errno;
+		if (res > 0) {
+			free(buf->mem);
+			buf->mem = lent.mem;
+			buf->flags = FUSE_BUF_TIERED | FUSE_BUF_LENT;
+		}
+	} else {
+		if (fuse_ll_buf_mem(se, buf, se->bufsize) != 0) {
+			fuse_log(FUSE_LOG_ERR,
+				"fuse: failed to allocate read buffer\n");
+			return -ENOMEM;
+		}
+		buf->flags &= FUSE_BUF_INTERNAL;
+		res = io->read(fd, buf->mem, se->bufsize, se->userdata);
+		err = errno;
+	}
+
+	if (res <= 0 && fuse_session_exited(se))
+		return 0;
+	if (res == 0 || (res == -1 && err == ENODEV)) {
+		/* The transport was closed */
+		fuse_session_exit(se);
+		return 0;
+	}
+	if (res == -1) {
+		if (err != EINTR && err != EAGAIN)
+			fuse_log(FUSE_LOG_ERR, "fuse: reading from transport: %s\n",
+				 strerror(err));
+		return -err;
+	}
+	buf->size = res;
+	if ((size_t) res < sizeof(struct fuse_in_header)) {
+		fuse_log(FUSE_LOG_ERR, "short read from transport\n");
+		return -EIO;
+	}
+	FUSE_PROBE2(request_receive, res, 0);
+
+	return res;
 }
 
 int fuse_session_receive_buf(struct fuse_session *se, struct fuse_buf *buf)
@@ -2746,13 +4959,27 @@ int fuse_session_receive_buf_int(struct fuse_session *se, struct fuse_buf *buf,
 	size_t bufsize = se->bufsize;
 	struct fuse_ll_pipe *llp;
 	struct fuse_buf tmpbuf;
+	unsigned int threshold;
+	uint64_t start = 0;
+	int probe = 0;
+#endif
+
+	/* The previous request is done with the large buffer */
+	fuse_session_return_buf_int(se, buf);
+
+	if (se->got_init)
+		fuse_ll_admit_wait(se);
 
+	if (se->io)
+		return fuse_ll_receive_io(se, buf, ch ? ch->fd : se->fd);
+
+#ifdef HAVE_SPLICE
 	if (se->conn.proto_minor < 14 || !(se->conn.want & FUSE_CAP_SPLICE_READ))
 		goto fallback;
 
 	llp = fuse_ll_get_pipe(se);
 	if (llp == NULL)
-		goto fallback;
+		goto no_splice;
 
 	if (llp->size < bufsize) {
 		if (llp->can_grow) {
@@ -2762,19 +4989,20 @@ int fuse_session_receive_buf_int(struct fuse_session *se, struct fuse_buf *buf,
 				res = grow_pipe_to_max(llp->pipe[0]);
 				if (res > 0)
 					llp->size = res;
-				goto fallback;
+				goto no_splice;
 			}
 			llp->size = res;
 		}
 		if (llp->size < bufsize)
-			goto fallback;
+			goto no_splice;
 	}
 
 	res = splice(ch ? ch->fd : se->fd,
 		     NULL, llp->pipe[1], NULL, bufsize, 0);
 	err = errno;
 
-	if (fuse_session_exited(se))
+	/* A request that was read is answered, even while exiting */
+	if (res <= 0 && fuse_session_exited(se))
 		return 0;
 
 	if (res == -1) {
@@ -2805,23 +5033,27 @@ int fuse_session_receive_buf_int(struct fuse_session *se, struct fuse_buf *buf,
 	 * fuse_loop_mt() needs to check for FORGET so this more than
 	 * just an optimization.
 	 */
-	if (res < sizeof(struct fuse_in_header) +
-	    sizeof(struct fuse_write_in) + pagesize) {
+	threshold = __atomic_load_n(&se->splice_threshold, __ATOMIC_RELAXED);
+	if (se->splice_autotune && res >= threshold)
+		probe = __atomic_add_fetch(&se->splice_tune.probe, 1,
+					   __ATOMIC_RELAXED) %
+			FUSE_SPLICE_PROBE_INTERVAL == 0;
+	if (res < threshold || probe) {
 		struct fuse_bufvec src = { .buf[0] = tmpbuf, .count = 1 };
 		struct fuse_bufvec dst = { .count = 1 };
 
-		if (!buf->mem) {
-			buf->mem = malloc(se->bufsize);
-			if (!buf->mem) {
-				fuse_log(FUSE_LOG_ERR,
-					"fuse: failed to allocate read buffer\n");
-				return -ENOMEM;
-			}
+		if (fuse_ll_buf_mem(se, buf, res) != 0) {
+			fuse_log(FUSE_LOG_ERR,
+				"fuse: failed to allocate read buffer\n");
+			fuse_ll_clear_pipe(se);
+			return -ENOMEM;
 		}
-		buf->size = se->bufsize;
-		buf->flags = 0;
+		buf->size = res;
+		buf->flags &= FUSE_BUF_INTERNAL;
 		dst.buf[0] = *buf;
 
+		if (se->splice_autotune)
+			start = fuse_ll_now_ns();
 		res = fuse_buf_copy(&dst, &src, 0);
 		if (res < 0) {
 			fuse_log(FUSE_LOG_ERR, "fuse: copy from pipe: %s\n",
@@ -2835,32 +5067,39 @@ int fuse_session_receive_buf_int(struct fuse_session *se, struct fuse_buf *buf,
 			return -EIO;
 		}
 		assert(res == tmpbuf.size);
+		if (se->splice_autotune)
+			fuse_ll_tune_splice(se, res, fuse_ll_now_ns() - start);
 
 	} else {
 		/* Don't overwrite buf->mem, as that would cause a leak */
 		buf->fd = tmpbuf.fd;
-		buf->flags = tmpbuf.flags;
+		buf->flags = tmpbuf.flags | (buf->flags & FUSE_BUF_INTERNAL);
 	}
 	buf->size = tmpbuf.size;
+	FUSE_PROBE2(request_receive, res, !!(buf->flags & FUSE_BUF_IS_FD));
 
 	return res;
 
+no_splice:
+	FUSE_PROBE2(splice_fallback, FUSE_PROBE_RECEIVE, bufsize);
 fallback:
 #endif
-	if (!buf->mem) {
-		buf->mem = malloc(se->bufsize);
-		if (!buf->mem) {
-			fuse_log(FUSE_LOG_ERR,
-				"fuse: failed to allocate read buffer\n");
-			return -ENOMEM;
-		}
+	/*
+	 * The kernel fails requests that don't fit into the read buffer,
+	 * so without splice there is no telling the small ones apart.
+	 */
+	if (fuse_ll_buf_mem(se, buf, se->bufsize) != 0) {
+		fuse_log(FUSE_LOG_ERR,
+			"fuse: failed to allocate read buffer\n");
+		return -ENOMEM;
 	}
+	buf->flags &= FUSE_BUF_INTERNAL;
 
 restart:
 	res = read(ch ? ch->fd : se->fd, buf->mem, se->bufsize);
 	err = errno;
 
-	if (fuse_session_exited(se))
+	if (res <= 0 && fuse_session_exited(se))
 		return 0;
 	if (res == -1) {
 		/* ENOENT means the operation was interrupted, it's safe
@@ -2887,6 +5126,7 @@ restart:
 	}
 
 	buf->size = res;
+	FUSE_PROBE2(request_receive, res, 0);
 
 	return res;
 }
@@ -2896,6 +5136,7 @@ struct fuse_session *fuse_session_new(struct fuse_args *args,
 				      size_t op_size, void *userdata)
 {
 	int err;
+	int i;
 	struct fuse_session *se;
 	struct mount_opts *mo;
 
@@ -2915,6 +5156,7 @@ struct fuse_session *fuse_session_new(struct fuse_args *args,
 		goto out1;
 	}
 	se->fd = -1;
+	se->multi_loop_fd = -1;
 	se->conn.max_write = UINT_MAX;
 	se->conn.max_readahead = UINT_MAX;
 
@@ -2948,17 +5190,49 @@ struct fuse_session *fuse_session_new(struct fuse_args *args,
 		goto out4;
 	}
 
+	if (se->debug_sample)
+		se->debug = 1;
 	if (se->debug)
 		fuse_log(FUSE_LOG_DEBUG, "FUSE library version: %s\n", PACKAGE_VERSION);
 
 	se->bufsize = FUSE_MAX_MAX_PAGES * getpagesize() +
 		FUSE_BUFFER_HEADER_SIZE;
 
-	list_init_req(&se->list);
+	if (!se->splice_threshold)
+		se->splice_threshold = FUSE_SPLICE_MIN_THRESHOLD + pagesize;
+	else if (se->splice_threshold < FUSE_SPLICE_MIN_THRESHOLD)
+		se->splice_threshold = FUSE_SPLICE_MIN_THRESHOLD;
+
+	if (se->reply_batch > FUSE_URING_BATCH_MAX)
+		se->reply_batch = FUSE_URING_BATCH_MAX;
+	if (!se->reply_batch_delay)
+		se->reply_batch_delay = FUSE_REPLY_BATCH_DELAY;
+	if (!se->notify_queue.depth)
+		se->notify_queue.depth = FUSE_NOTIFY_QUEUE_DEPTH;
+
 	list_init_req(&se->interrupts);
 	list_init_nreq(&se->notify_list);
 	se->notify_ctr = 1;
 	pthread_mutex_init(&se->lock, NULL);
+	pthread_mutex_init(&se->notify_queue.lock, NULL);
+	pthread_cond_init(&se->notify_queue.cond, NULL);
+	pthread_cond_init(&se->notify_queue.sent, NULL);
+	se->notify_queue.tail = &se->notify_queue.head;
+	fuse_ll_reply_timer_init(&se->reply_timer);
+	pthread_mutex_init(&se->admission.lock, NULL);
+	pthread_cond_init(&se->admission.cond, NULL);
+	fuse_ll_admit_init(se);
+	for (i = 0; i < FUSE_INFLIGHT_SHARDS; i++) {
+		struct fuse_inflight_shard *sh = &se->inflight[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		sh->size = FUSE_INFLIGHT_MIN_SIZE;
+		sh->buckets = calloc(sh->size, sizeof(sh->buckets[0]));
+		if (sh->buckets == NULL) {
+			fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate in-flight table\n");
+			goto out5;
+		}
+	}
 
 	err = pthread_key_create(&se->pipe_key, fuse_ll_pipe_destructor);
 	if (err) {
@@ -2967,14 +5241,47 @@ struct fuse_session *fuse_session_new(struct fuse_args *args,
 		goto out5;
 	}
 
+	se->req_caches.next = se->req_caches.prev = &se->req_caches;
+	err = pthread_key_create(&se->req_key, fuse_ll_req_cache_destructor);
+	if (err) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to create thread specific key: %s\n",
+			strerror(err));
+		goto out6;
+	}
+
+	err = pthread_key_create(&se->reply_key,
+				 fuse_ll_reply_batch_destructor);
+	if (err) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to create thread specific key: %s\n",
+			strerror(err));
+		goto out7;
+	}
+
 	memcpy(&se->op, op, op_size);
 	se->owner = getuid();
 	se->userdata = userdata;
 
+	if (se->log_async && fuse_log_start_async(0) != 0) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to start logging thread\n");
+		se->log_async = 0;
+	}
+
 	se->mo = mo;
 	return se;
 
+out7:
+	pthread_key_delete(se->req_key);
+out6:
+	pthread_key_delete(se->pipe_key);
 out5:
+	fuse_ll_destroy_inflight(se);
+	pthread_cond_destroy(&se->admission.cond);
+	pthread_mutex_destroy(&se->admission.lock);
+	pthread_cond_destroy(&se->notify_queue.cond);
+	pthread_cond_destroy(&se->notify_queue.sent);
+	pthread_mutex_destroy(&se->notify_queue.lock);
+	pthread_cond_destroy(&se->reply_timer.cond);
+	pthread_mutex_destroy(&se->reply_timer.lock);
 	pthread_mutex_destroy(&se->lock);
 out4:
 	fuse_opt_free_args(args);
@@ -3037,6 +5344,36 @@ error_out:
 	return -1;
 }
 
+int fuse_session_custom_io(struct fuse_session *se,
+			   const struct fuse_custom_io *io, size_t io_size,
+			   int fd)
+{
+	if (fd < 0 || se->fd != -1 || se->io)
+		return -EINVAL;
+	if (sizeof(struct fuse_custom_io) < io_size) {
+		fuse_log(FUSE_LOG_ERR, "fuse: warning: library too old, some operations may not work\n");
+		io_size = sizeof(struct fuse_custom_io);
+	}
+
+	se->io = calloc(1, sizeof(struct fuse_custom_io));
+	if (se->io == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate transport\n");
+		return -ENOMEM;
+	}
+	memcpy(se->io, io, io_size);
+	if (!se->io->writev || !se->io->read ||
+	    (se->io->receive_buf && !se->io->release_buf)) {
+		fuse_log(FUSE_LOG_ERR, "fuse: transport needs writev, read "
+			 "and, with receive_buf, release_buf\n");
+		free(se->io);
+		se->io = NULL;
+		return -EINVAL;
+	}
+	se->fd = fd;
+
+	return 0;
+}
+
 int fuse_session_fd(struct fuse_session *se)
 {
 	return se->fd;
@@ -3045,6 +5382,8 @@ int fuse_session_fd(struct fuse_session *se)
 void fuse_session_unmount(struct fuse_session *se)
 {
 	if (se->mountpoint != NULL) {
+		/* The sender thread must be done with the device */
+		fuse_ll_notify_queue_stop(se);
 		fuse_kern_unmount(se->mountpoint, se->fd);
 		se->fd = -1;
 		free(se->mountpoint);
@@ -3052,6 +5391,236 @@ void fuse_session_unmount(struct fuse_session *se)
 	}
 }
 
+#define FUSE_HANDOFF_MAGIC 0x46555345
+
+/* Sent by fuse_session_handoff() together with the device, followed
+   by the mount point */
+struct fuse_handoff_msg {
+	uint32_t magic;
+	uint32_t conn_size;
+	struct fuse_conn_info conn;
+	uint64_t bufsize;
+	uint64_t notify_ctr;
+	uint32_t mountpoint_len;
+	uint32_t padding;
+};
+
+static int handoff_send(int sock, const void *buf, size_t len, int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	ssize_t res;
+
+	if (fd != -1) {
+		memset(&ctl, 0, sizeof(ctl));
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = sizeof(ctl.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	while (iov.iov_len) {
+		res = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		/* The descriptor went with the first part */
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		iov.iov_base = (char *) iov.iov_base + res;
+		iov.iov_len -= res;
+	}
+	return 0;
+}
+
+/* Receives exactly len bytes, and the descriptor sent with them if fdp
+   is not NULL */
+static int handoff_recv(int sock, void *buf, size_t len, int *fdp)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	ssize_t res;
+
+	while (iov.iov_len) {
+		if (fdp) {
+			msg.msg_control = ctl.buf;
+			msg.msg_controllen = sizeof(ctl.buf);
+		}
+		res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (res == 0)
+			return -EPIPE;
+		for (cmsg = fdp ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_RIGHTS && *fdp == -1)
+				memcpy(fdp, CMSG_DATA(cmsg), sizeof(int));
+		}
+		iov.iov_base = (char *) iov.iov_base + res;
+		iov.iov_len -= res;
+	}
+	return 0;
+}
+
+int fuse_session_handoff(struct fuse_session *se, int sock)
+{
+	struct fuse_handoff_msg msg;
+	int res;
+
+	if (!se->got_init || se->got_destroy || se->fd == -1 ||
+	    se->cuse_data || se->io)
+		return -EINVAL;
+	if (se->mo && get_auto_unmount(se->mo)) {
+		fuse_log(FUSE_LOG_ERR, "fuse: mounts with auto_unmount cannot "
+			 "be handed over\n");
+		return -EINVAL;
+	}
+
+	/* Nothing else may write to the device from here on */
+	fuse_ll_notify_queue_stop(se);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = FUSE_HANDOFF_MAGIC;
+	msg.conn_size = sizeof(msg.conn);
+	msg.conn = se->conn;
+	msg.bufsize = se->bufsize;
+	msg.notify_ctr = se->notify_ctr;
+	if (se->mountpoint)
+		msg.mountpoint_len = strlen(se->mountpoint);
+
+	res = handoff_send(sock, &msg, sizeof(msg), se->fd);
+	if (!res && msg.mountpoint_len)
+		res = handoff_send(sock, se->mountpoint, msg.mountpoint_len, -1);
+	if (res) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to hand over session: %s\n",
+			 strerror(-res));
+		return res;
+	}
+
+	/* The successor has its own reference to the device */
+	close(se->fd);
+	se->fd = -1;
+	free(se->mountpoint);
+	se->mountpoint = NULL;
+
+	return 0;
+}
+
+/*
+ * Requests that the predecessor had read but not answered belong to
+ * the device file it read them from. Working on a clone of it lets
+ * the kernel fail them once the predecessor's copy is closed, rather
+ * than leave them waiting for an answer that never comes.
+ */
+static int handoff_clone_fd(int fd)
+{
+#ifdef FUSE_DEV_IOC_CLONE
+	uint32_t masterfd = fd;
+	int clonefd;
+
+	clonefd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (clonefd == -1)
+		return fd;
+	if (ioctl(clonefd, FUSE_DEV_IOC_CLONE, &masterfd) == -1) {
+		close(clonefd);
+		return fd;
+	}
+	close(fd);
+	return clonefd;
+#else
+	return fd;
+#endif
+}
+
+int fuse_session_takeover(struct fuse_session *se, int sock)
+{
+	struct fuse_handoff_msg msg;
+	char *mountpoint = NULL;
+	int fd = -1;
+	int res;
+
+	if (se->got_init || se->fd != -1)
+		return -EINVAL;
+
+	res = handoff_recv(sock, &msg, sizeof(msg), &fd);
+	if (res)
+		goto out_err;
+	res = -EPROTO;
+	if (msg.magic != FUSE_HANDOFF_MAGIC ||
+	    msg.conn_size != sizeof(msg.conn) || fd == -1)
+		goto out_err;
+	if (msg.mountpoint_len) {
+		res = -ENOMEM;
+		mountpoint = malloc(msg.mountpoint_len + 1);
+		if (mountpoint == NULL)
+			goto out_err;
+		res = handoff_recv(sock, mountpoint, msg.mountpoint_len, NULL);
+		if (res)
+			goto out_err;
+		mountpoint[msg.mountpoint_len] = '\0';
+	}
+
+	se->fd = handoff_clone_fd(fd);
+	se->mountpoint = mountpoint;
+	se->conn = msg.conn;
+	se->bufsize = msg.bufsize;
+	se->notify_ctr = msg.notify_ctr;
+	se->got_init = 1;
+	if (se->op.init)
+		se->op.init(se->userdata, &se->conn);
+
+	/* The kernel still goes by what was negotiated */
+	if (se->conn.want & ~msg.conn.want) {
+		fuse_log(FUSE_LOG_ERR, "fuse: error: filesystem requested "
+			 "capabilities 0x%x that were not negotiated\n",
+			 se->conn.want & ~msg.conn.want);
+		se->conn = msg.conn;
+		free(se->mountpoint);
+		se->mountpoint = NULL;
+		return -EPROTO;
+	}
+	se->conn = msg.conn;
+	/* The limits follow what the kernel was told, as after INIT */
+	fuse_ll_admit_init(se);
+
+	if (se->conn.want & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE))
+		fuse_ll_pipe_pool_fill(se);
+
+	if (se->debug)
+		fuse_log(FUSE_LOG_DEBUG, "fuse: took over session %u.%u, "
+			 "want=0x%x, max_write=%u\n", se->conn.proto_major,
+			 se->conn.proto_minor, se->conn.want,
+			 se->conn.max_write);
+	return 0;
+
+out_err:
+	fuse_log(FUSE_LOG_ERR, "fuse: failed to take over session: %s\n",
+		 strerror(-res));
+	if (fd != -1)
+		close(fd);
+	free(mountpoint);
+	return res;
+}
+
 #ifdef linux
 int fuse_req_getgroups(fuse_req_t req, int size, gid_t list[])
 {
@@ -3127,7 +5696,16 @@ int fuse_req_getgroups(fuse_req_t req, int size, gid_t list[])
 __attribute__((no_sanitize_thread))
 void fuse_session_exit(struct fuse_session *se)
 {
+	int fd = __atomic_load_n(&se->multi_loop_fd, __ATOMIC_ACQUIRE);
+	uint64_t val = 1;
+	ssize_t res;
+
 	se->exited = 1;
+	/* A fuse_multi_loop would only notice on the next request */
+	if (fd != -1) {
+		res = write(fd, &val, sizeof(val));
+		(void) res;
+	}
 }
 
 __attribute__((no_sanitize_thread))
@@ -3142,3 +5720,38 @@ int fuse_session_exited(struct fuse_session *se)
 {
 	return se->exited;
 }
+
+void fuse_session_get_stats(struct fuse_session *se,
+			    struct fuse_session_stats *stats)
+{
+	struct fuse_req_cache *cache;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&se->lock);
+	stats->req_allocs = se->req_allocs;
+	stats->req_cache_hits = se->req_hits;
+	fuse_ll_add_op_stats(stats->opcodes, se->op_stats);
+	for (cache = se->req_caches.next; cache != &se->req_caches;
+	     cache = cache->next) {
+		stats->req_allocs += __atomic_load_n(&cache->allocs,
+						     __ATOMIC_RELAXED);
+		stats->req_cache_hits += __atomic_load_n(&cache->hits,
+							 __ATOMIC_RELAXED);
+		fuse_ll_add_op_stats(stats->opcodes, cache->ops);
+	}
+	pthread_mutex_unlock(&se->lock);
+
+	stats->inflight_reqs = __atomic_load_n(&se->admission.reqs,
+					       __ATOMIC_RELAXED);
+	stats->inflight_bytes = __atomic_load_n(&se->admission.bytes,
+						__ATOMIC_RELAXED);
+	pthread_mutex_lock(&se->admission.lock);
+	stats->admission_waits = se->admission.waits;
+	pthread_mutex_unlock(&se->admission.lock);
+
+	/* A reply may have been counted before its request */
+	for (i = 0; i < FUSE_STATS_MAX_OPCODE; i++)
+		if ((int64_t) stats->opcodes[i].in_flight < 0)
+			stats->opcodes[i].in_flight = 0;
+}
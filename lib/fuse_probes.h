@@ -0,0 +1,28 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Static probes on the request lifecycle, see doc/probes.txt.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * The probes are USDT probes of the "libfuse" provider. Without the
+ * usdt build option they compile to nothing, and their arguments are
+ * not evaluated.
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define FUSE_PROBE2(name, a1, a2) DTRACE_PROBE2(libfuse, name, a1, a2)
+#define FUSE_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(libfuse, name, a1, a2, a3)
+#else
+#define FUSE_PROBE2(name, a1, a2) do { } while (0)
+#define FUSE_PROBE3(name, a1, a2, a3) do { } while (0)
+#endif
+
+/* First argument of the splice_fallback probe */
+#define FUSE_PROBE_RECEIVE 0
+#define FUSE_PROBE_REPLY 1
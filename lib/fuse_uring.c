@@ -0,0 +1,720 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  Implementation of the io_uring based FUSE session loop.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#include "config.h"
+#include "fuse_lowlevel.h"
+#include "fuse_kernel.h"
+#include "fuse_i.h"
+#include "fuse_probes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* IORING_FEAT_NODROP comes with linked writes and cancellation (5.5) */
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_NODROP)
+#define FUSE_URING_SUPPORTED
+#endif
+#endif
+
+/* Number of reads kept posted on the device if not specified */
+#define FUSE_URING_DEFAULT_DEPTH 16
+
+#ifdef FUSE_URING_SUPPORTED
+
+enum fuse_uring_op_type {
+	FUSE_URING_READ,
+	FUSE_URING_WRITE,
+	FUSE_URING_CANCEL,
+};
+
+/* Every SQE's user_data points to one of these */
+struct fuse_uring_op {
+	enum fuse_uring_op_type type;
+};
+
+struct fuse_uring_slot {
+	struct fuse_uring_op op;
+	struct fuse_buf fbuf;
+	/* fbuf.mem is further in with align_write */
+	void *mem;
+	size_t bufsize;
+	struct iovec iov;
+	int posted;
+};
+
+/*
+ * A queued reply. Its data is either copied behind the struct, or
+ * referenced by iov[1..iovcnt-1] until the write has completed and
+ * release() has been called.
+ */
+struct fuse_uring_reply {
+	struct fuse_uring_op op;
+	void (*release)(void *arg);
+	void *release_arg;
+	int iovcnt;
+	struct iovec iov[];
+};
+
+struct fuse_uring {
+	int fd;
+	pthread_t owner;
+	int processing;
+	unsigned int depth;
+	unsigned int posted;
+	unsigned int writes;
+	struct fuse_uring_slot *slots;
+	struct fuse_uring_op cancel_op;
+
+	/* Submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+};
+
+static int fuse_uring_setup(struct fuse_uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int single_mmap;
+	int err;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd == -1)
+		return -errno;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto err_close;
+
+	if (single_mmap) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto err_unmap_sq;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	return 0;
+
+err_unmap_cq:
+	err = errno;
+	if (!single_mmap)
+		munmap(ring->cq_ptr, ring->cq_len);
+	errno = err;
+err_unmap_sq:
+	err = errno;
+	munmap(ring->sq_ptr, ring->sq_len);
+	errno = err;
+err_close:
+	err = errno;
+	close(ring->fd);
+	return -err;
+}
+
+static void fuse_uring_teardown(struct fuse_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+/*
+ * Submit everything queued so far and block until at least `wait`
+ * completions are available.
+ */
+static int fuse_uring_enter(struct fuse_uring *ring, unsigned int wait)
+{
+	unsigned int submit;
+	int res;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	submit = ring->sq_local_tail -
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (!submit && !wait)
+		return 0;
+
+	res = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+		      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (res == -1)
+		return -errno;
+
+	return res;
+}
+
+static struct io_uring_sqe *fuse_uring_get_sqe(struct fuse_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+	unsigned int head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries) {
+		/* Queue is full, hand what we have to the kernel */
+		if (fuse_uring_enter(ring, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_local_tail - head >= ring->sq_entries)
+			return NULL;
+	}
+
+	idx = ring->sq_local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+
+	return sqe;
+}
+
+static int fuse_uring_post_read(struct fuse_session *se,
+				struct fuse_uring *ring,
+				struct fuse_uring_slot *slot)
+{
+	struct io_uring_sqe *sqe;
+
+	if (slot->bufsize < se->bufsize) {
+		size_t pagesize = getpagesize();
+		size_t skew = se->align_write ?
+			pagesize - FUSE_WRITE_DATA_OFFSET : 0;
+
+		free(slot->mem);
+		slot->mem = NULL;
+		slot->bufsize = 0;
+		if (posix_memalign(&slot->mem, pagesize,
+				   skew + se->bufsize) != 0) {
+			slot->mem = NULL;
+			fuse_log(FUSE_LOG_ERR,
+				"fuse: failed to allocate read buffer\n");
+			return -ENOMEM;
+		}
+		slot->fbuf.mem = (char *) slot->mem + skew;
+		slot->bufsize = se->bufsize;
+	}
+
+	sqe = fuse_uring_get_sqe(ring);
+	if (sqe == NULL)
+		return -EBUSY;
+
+	slot->iov.iov_base = slot->fbuf.mem;
+	slot->iov.iov_len = se->bufsize;
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = se->fd;
+	sqe->addr = (unsigned long) &slot->iov;
+	sqe->len = 1;
+	sqe->user_data = (unsigned long) &slot->op;
+	slot->posted = 1;
+	ring->posted++;
+
+	return 0;
+}
+
+static void fuse_uring_free_reply(struct fuse_uring_reply *reply)
+{
+	if (reply->release)
+		reply->release(reply->release_arg);
+	free(reply);
+}
+
+int fuse_uring_send_reply(struct fuse_session *se, struct iovec *iov,
+			  int count, size_t len,
+			  void (*release)(void *arg), void *arg)
+{
+	struct fuse_uring *ring = se->uring;
+	struct fuse_uring_reply *reply;
+	struct io_uring_sqe *sqe;
+	int iovcnt;
+	char *p;
+	int i;
+
+	if (ring == NULL || !ring->processing ||
+	    !pthread_equal(ring->owner, pthread_self()))
+		return -ENOSYS;
+
+	/*
+	 * The reply is sent once the request has been processed, so
+	 * it has to be copied out of the caller's buffers. Pinned data
+	 * stays where it is, only the header is copied.
+	 */
+	if (release) {
+		iovcnt = count;
+		len = iov[0].iov_len;
+	} else {
+		iovcnt = 1;
+	}
+	reply = malloc(sizeof(*reply) + iovcnt * sizeof(struct iovec) + len);
+	if (reply == NULL)
+		return -ENOMEM;
+
+	sqe = fuse_uring_get_sqe(ring);
+	if (sqe == NULL) {
+		free(reply);
+		return -EBUSY;
+	}
+
+	p = (char *) &reply->iov[iovcnt];
+	reply->iov[0].iov_base = p;
+	reply->iov[0].iov_len = len;
+	if (release) {
+		memcpy(p, iov[0].iov_base, len);
+		memcpy(&reply->iov[1], &iov[1],
+		       (count - 1) * sizeof(struct iovec));
+	} else {
+		for (i = 0; i < count; i++) {
+			memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+	}
+	reply->op.type = FUSE_URING_WRITE;
+	reply->release = release;
+	reply->release_arg = arg;
+	reply->iovcnt = iovcnt;
+
+	/*
+	 * Chain it to whatever comes next, in particular the read that
+	 * is re-posted for the same slot, so both go out with a single
+	 * io_uring_enter(). A hard link keeps the chain going even if
+	 * the write fails because the request was interrupted.
+	 */
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = se->fd;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe->addr = (unsigned long) reply->iov;
+	sqe->len = iovcnt;
+	sqe->user_data = (unsigned long) &reply->op;
+	ring->writes++;
+
+	return 0;
+}
+
+/* Returns a negated errno on fatal errors, zero otherwise */
+static int fuse_uring_complete_read(struct fuse_session *se,
+				    struct fuse_uring *ring,
+				    struct fuse_uring_slot *slot, int res)
+{
+	slot->posted = 0;
+	ring->posted--;
+
+	if (fuse_session_exited(se))
+		return 0;
+
+	if (res == -EINTR || res == -EAGAIN || res == -ECANCELED)
+		return 0;
+
+	/* ENODEV means we got unmounted, so we silently return success */
+	if (res == -ENODEV || res == 0) {
+		fuse_session_exit(se);
+		return 0;
+	}
+
+	if (res < 0) {
+		fuse_log(FUSE_LOG_ERR, "fuse: reading device: %s\n",
+			 strerror(-res));
+		return res;
+	}
+
+	if ((size_t) res < sizeof(struct fuse_in_header)) {
+		fuse_log(FUSE_LOG_ERR, "short read on fuse device\n");
+		return -EIO;
+	}
+
+	slot->fbuf.size = res;
+	FUSE_PROBE2(request_receive, res, 0);
+	ring->processing = 1;
+	fuse_session_process_buf_int(se, &slot->fbuf, NULL);
+	ring->processing = 0;
+
+	if (fuse_session_exited(se) || !se->got_init)
+		return 0;
+
+	/* Goes out linked behind the replies queued while processing */
+	res = fuse_uring_post_read(se, ring, slot);
+	return res == -EBUSY ? 0 : res;
+}
+
+static int fuse_uring_reap(struct fuse_session *se, struct fuse_uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	struct fuse_uring_op *op;
+	unsigned int head;
+	int err = 0;
+	int res;
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		op = (struct fuse_uring_op *) (unsigned long) cqe->user_data;
+		res = cqe->res;
+		head++;
+		/* Processing may queue SQEs, but never reaps completions */
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		switch (op->type) {
+		case FUSE_URING_READ:
+			res = fuse_uring_complete_read(se, ring,
+				(struct fuse_uring_slot *) op, res);
+			if (res < 0 && !err)
+				err = res;
+			break;
+		case FUSE_URING_WRITE:
+			ring->writes--;
+			/* ENOENT means the operation was interrupted */
+			if (res < 0 && res != -ENOENT &&
+			    !fuse_session_exited(se))
+				fuse_log(FUSE_LOG_ERR,
+					 "fuse: writing device: %s\n",
+					 strerror(-res));
+			fuse_uring_free_reply((struct fuse_uring_reply *) op);
+			break;
+		case FUSE_URING_CANCEL:
+			break;
+		}
+	}
+
+	return err;
+}
+
+/*
+ * Wait for all outstanding reads and writes, so that the kernel is
+ * done with our buffers when they are freed.
+ */
+static void fuse_uring_drain(struct fuse_session *se, struct fuse_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+	int res;
+
+	for (i = 0; i < ring->depth; i++) {
+		/*
+		 * Without a cancel for every read, the wait below may
+		 * never end. When the queue is full, submit what is in it
+		 * and make room in the completion queue to try again.
+		 */
+		while (ring->slots[i].posted &&
+		       (sqe = fuse_uring_get_sqe(ring)) == NULL) {
+			res = fuse_uring_enter(ring, 0);
+			if (res < 0 && res != -EINTR && res != -EAGAIN &&
+			    res != -EBUSY)
+				goto wait;
+			fuse_uring_reap(se, ring);
+		}
+		if (!ring->slots[i].posted)
+			continue;
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (unsigned long) &ring->slots[i].op;
+		sqe->user_data = (unsigned long) &ring->cancel_op;
+	}
+
+wait:
+	while (ring->posted || ring->writes) {
+		res = fuse_uring_enter(ring, 1);
+		if (res < 0 && res != -EINTR)
+			break;
+		fuse_uring_reap(se, ring);
+	}
+}
+
+int fuse_session_loop_uring(struct fuse_session *se, unsigned int depth)
+{
+	struct fuse_uring ring;
+	unsigned int nslots;
+	unsigned int i;
+	int res = 0;
+
+	if (se->uring) {
+		fuse_log(FUSE_LOG_ERR, "fuse: io_uring loop already running\n");
+		return -EBUSY;
+	}
+	/* The ring reads and writes a device */
+	if (se->io)
+		return -ENOSYS;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.depth = depth ? depth : FUSE_URING_DEFAULT_DEPTH;
+	ring.owner = pthread_self();
+	ring.cancel_op.type = FUSE_URING_CANCEL;
+
+	ring.slots = calloc(ring.depth, sizeof(struct fuse_uring_slot));
+	if (ring.slots == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate io_uring slots\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < ring.depth; i++)
+		ring.slots[i].op.type = FUSE_URING_READ;
+
+	/* Room for a read and a couple of replies per slot */
+	res = fuse_uring_setup(&ring, ring.depth * 4);
+	if (res < 0) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to set up io_uring: %s\n",
+			 strerror(-res));
+		free(ring.slots);
+		return res == -ENOMEM ? res : -ENOSYS;
+	}
+	se->uring = &ring;
+
+	while (!fuse_session_exited(se)) {
+		/*
+		 * Until INIT has been processed the final buffer size
+		 * is not known, so only a single read is posted.
+		 */
+		nslots = se->got_init ? ring.depth : 1;
+		if (se->got_init && fuse_ll_admit_full(se)) {
+			/* Queued replies go out before reading is held back */
+			fuse_uring_enter(&ring, 0);
+			fuse_ll_admit_wait(se);
+		}
+		for (i = 0; i < nslots && !res; i++) {
+			if (!ring.slots[i].posted)
+				res = fuse_uring_post_read(se, &ring,
+							   &ring.slots[i]);
+		}
+		if (res == -EBUSY)
+			res = 0;
+		if (res < 0)
+			break;
+
+		res = fuse_uring_enter(&ring, 1);
+		if (res == -EINTR || res == -EBUSY) {
+			res = 0;
+			continue;
+		}
+		if (res < 0) {
+			fuse_log(FUSE_LOG_ERR, "fuse: io_uring_enter: %s\n",
+				 strerror(-res));
+			break;
+		}
+
+		res = fuse_uring_reap(se, &ring);
+		if (res < 0)
+			break;
+	}
+	if (res < 0)
+		fuse_session_exit(se);
+
+	fuse_uring_drain(se, &ring);
+	se->uring = NULL;
+	fuse_uring_teardown(&ring);
+
+	for (i = 0; i < ring.depth; i++)
+		free(ring.slots[i].mem);
+	free(ring.slots);
+
+	if (res > 0)
+		res = 0;
+	if(se->error != 0)
+		res = se->error;
+	fuse_session_reset(se);
+	return res;
+}
+
+int fuse_uring_write_batch(struct fuse_uring **ringp, int fd,
+			   struct iovec *iov, unsigned int count, int *res)
+{
+	struct fuse_uring *ring = *ringp;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int results[FUSE_URING_BATCH_MAX];
+	unsigned int start, head, queued;
+	unsigned int done;
+	unsigned int i;
+	int err = 0;
+
+	if (count > FUSE_URING_BATCH_MAX)
+		return -EINVAL;
+
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(struct fuse_uring));
+		if (ring == NULL)
+			return -ENOMEM;
+		err = fuse_uring_setup(ring, FUSE_URING_BATCH_MAX);
+		if (err < 0) {
+			free(ring);
+			return -ENOSYS;
+		}
+		*ringp = ring;
+	}
+	if (res == NULL)
+		res = results;
+
+	/* Every batch is reaped completely, so the ring is empty */
+	start = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail != start || count > ring->sq_entries)
+		return -EBUSY;
+
+	for (i = 0; i < count; i++) {
+		sqe = fuse_uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long) &iov[i];
+		sqe->len = 1;
+		sqe->user_data = i;
+		res[i] = 1;
+	}
+
+	done = 0;
+	queued = count;
+	while (done < queued) {
+		err = fuse_uring_enter(ring, queued - done);
+		if (err < 0 && err != -EINTR && err != -EAGAIN &&
+		    err != -EBUSY) {
+			/*
+			 * Take back what the kernel has not consumed, and
+			 * only wait for the writes that it has
+			 */
+			head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+			if (ring->sq_local_tail != head) {
+				ring->sq_local_tail = head;
+				__atomic_store_n(ring->sq_tail, head,
+						 __ATOMIC_RELEASE);
+				queued = head - start;
+				continue;
+			}
+			/* Nothing to submit, and waiting fails */
+			fuse_log(FUSE_LOG_ERR, "fuse: io_uring_enter: %s\n",
+				 strerror(-err));
+			fuse_uring_free(ring);
+			*ringp = NULL;
+			break;
+		}
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			res[cqe->user_data] = cqe->res < 0 ? cqe->res : 0;
+			head++;
+			done++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	for (i = 0; i < count; i++) {
+		/* Never written */
+		if (res[i] > 0)
+			res[i] = err < 0 ? err : -EIO;
+		/* ENOENT means the operation was interrupted */
+		if (res == results && res[i] < 0 && res[i] != -ENOENT)
+			fuse_log(FUSE_LOG_ERR, "fuse: writing device: %s\n",
+				 strerror(-res[i]));
+	}
+
+	return 0;
+}
+
+void fuse_uring_free(struct fuse_uring *ring)
+{
+	if (ring == NULL)
+		return;
+	fuse_uring_teardown(ring);
+	free(ring);
+}
+
+#else /* FUSE_URING_SUPPORTED */
+
+int fuse_uring_send_reply(struct fuse_session *se, struct iovec *iov,
+			  int count, size_t len,
+			  void (*release)(void *arg), void *arg)
+{
+	(void) se;
+	(void) iov;
+	(void) count;
+	(void) len;
+	(void) release;
+	(void) arg;
+
+	return -ENOSYS;
+}
+
+int fuse_uring_write_batch(struct fuse_uring **ringp, int fd,
+			   struct iovec *iov, unsigned int count, int *res)
+{
+	(void) ringp;
+	(void) fd;
+	(void) iov;
+	(void) count;
+	(void) res;
+
+	return -ENOSYS;
+}
+
+void fuse_uring_free(struct fuse_uring *ring)
+{
+	(void) ring;
+}
+
+int fuse_session_loop_uring(struct fuse_session *se, unsigned int depth)
+{
+	(void) se;
+	(void) depth;
+
+	fuse_log(FUSE_LOG_ERR, "fuse: io_uring is not supported\n");
+	return -ENOSYS;
+}
+
+#endif /* FUSE_URING_SUPPORTED */
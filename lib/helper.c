@@ -28,6 +28,8 @@
 
 #define FUSE_HELPER_OPT(t, p) \
 	{ t, offsetof(struct fuse_cmdline_opts, p), 1 }
+#define FUSE_HELPER_OPT_VALUE(t, p, v) \
+	{ t, offsetof(struct fuse_cmdline_opts, p), v }
 
 static const struct fuse_opt fuse_helper_opts[] = {
 	FUSE_HELPER_OPT("-h",		show_help),
@@ -50,6 +52,13 @@ static const struct fuse_opt fuse_helper_opts[] = {
 #endif
 	FUSE_HELPER_OPT("clone_fd",	clone_fd),
 	FUSE_HELPER_OPT("max_idle_threads=%u", max_idle_threads),
+	FUSE_HELPER_OPT("min_threads=%u", min_threads),
+	FUSE_HELPER_OPT("max_threads=%u", max_threads),
+	FUSE_HELPER_OPT("idle_timeout=%u", idle_timeout_ms),
+	FUSE_HELPER_OPT_VALUE("affinity=cpu", affinity, FUSE_LOOP_AFFINITY_CPU),
+	FUSE_HELPER_OPT_VALUE("affinity=node", affinity, FUSE_LOOP_AFFINITY_NODE),
+	FUSE_HELPER_OPT("bulk_threads=%u", bulk_threads),
+	FUSE_HELPER_OPT("receivers=%u", receivers),
 	FUSE_OPT_END
 };
 
@@ -136,7 +145,20 @@ void fuse_cmdline_help(void)
 	       "    -o clone_fd            use separate fuse device fd for each thread\n"
 	       "                           (may improve performance)\n"
 	       "    -o max_idle_threads    the maximum number of idle worker threads\n"
-	       "                           allowed (default: 10)\n");
+	       "                           allowed (default: 10)\n"
+	       "    -o min_threads=N       number of worker threads that are always\n"
+	       "                           kept running (default: 1)\n"
+	       "    -o max_threads=N       the maximum number of worker threads\n"
+	       "                           (default: unlimited)\n"
+	       "    -o idle_timeout=N      let idle worker threads above min_threads\n"
+	       "                           exit after N milliseconds instead of\n"
+	       "                           using max_idle_threads\n"
+	       "    -o affinity=cpu|node   run a pinned set of worker threads with\n"
+	       "                           its own device fd per CPU or NUMA node\n"
+	       "    -o bulk_threads=N      process at most N data transfers at once,\n"
+	       "                           keeping the other workers for metadata\n"
+	       "    -o receivers=N         read requests on N threads and process\n"
+	       "                           them on separate ones\n");
 }
 
 static int fuse_helper_opt_proc(void *data, const char *arg, int key,
@@ -199,8 +221,9 @@ static int add_default_subtype(const char *progname, struct fuse_args *args)
 	return res;
 }
 
-int fuse_parse_cmdline(struct fuse_args *args,
-		       struct fuse_cmdline_opts *opts)
+FUSE_SYMVER("fuse_parse_cmdline_311", "fuse_parse_cmdline@@FUSE_3.11")
+int fuse_parse_cmdline_311(struct fuse_args *args,
+			   struct fuse_cmdline_opts *opts)
 {
 	memset(opts, 0, sizeof(struct fuse_cmdline_opts));
 
@@ -221,6 +244,43 @@ int fuse_parse_cmdline(struct fuse_args *args,
 	return 0;
 }
 
+/* Layout of struct fuse_cmdline_opts up to libfuse 3.10 */
+struct fuse_cmdline_opts_v1 {
+	int singlethread;
+	int foreground;
+	int debug;
+	int nodefault_subtype;
+	char *mountpoint;
+	int show_version;
+	int show_help;
+	int clone_fd;
+	unsigned int max_idle_threads;
+};
+
+int fuse_parse_cmdline_30(struct fuse_args *args,
+			  struct fuse_cmdline_opts_v1 *opts_v1);
+FUSE_SYMVER("fuse_parse_cmdline_30", "fuse_parse_cmdline@FUSE_3.0")
+int fuse_parse_cmdline_30(struct fuse_args *args,
+			  struct fuse_cmdline_opts_v1 *opts_v1)
+{
+	struct fuse_cmdline_opts opts;
+	int res;
+
+	res = fuse_parse_cmdline_311(args, &opts);
+
+	opts_v1->singlethread = opts.singlethread;
+	opts_v1->foreground = opts.foreground;
+	opts_v1->debug = opts.debug;
+	opts_v1->nodefault_subtype = opts.nodefault_subtype;
+	opts_v1->mountpoint = opts.mountpoint;
+	opts_v1->show_version = opts.show_version;
+	opts_v1->show_help = opts.show_help;
+	opts_v1->clone_fd = opts.clone_fd;
+	opts_v1->max_idle_threads = opts.max_idle_threads;
+
+	return res;
+}
+
 
 int fuse_daemonize(int foreground)
 {
@@ -284,7 +344,7 @@ int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op,
 	struct fuse_cmdline_opts opts;
 	int res;
 
-	if (fuse_parse_cmdline(&args, &opts) != 0)
+	if (fuse_parse_cmdline_311(&args, &opts) != 0)
 		return 1;
 
 	if (opts.show_version) {
@@ -339,9 +399,16 @@ int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op,
 		res = fuse_loop(fuse);
 	else {
 		struct fuse_loop_config loop_config;
+		memset(&loop_config, 0, sizeof(loop_config));
 		loop_config.clone_fd = opts.clone_fd;
 		loop_config.max_idle_threads = opts.max_idle_threads;
-		res = fuse_loop_mt_32(fuse, &loop_config);
+		loop_config.min_threads = opts.min_threads;
+		loop_config.max_threads = opts.max_threads;
+		loop_config.idle_timeout_ms = opts.idle_timeout_ms;
+		loop_config.affinity = opts.affinity;
+		loop_config.bulk_threads = opts.bulk_threads;
+		loop_config.receivers = opts.receivers;
+		res = fuse_loop_mt_311(fuse, &loop_config);
 	}
 	if (res)
 		res = 7;
@@ -13,19 +13,54 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <iconv.h>
 #include <pthread.h>
 #include <locale.h>
 #include <langinfo.h>
 
+/* Entries per direction in the cache of each thread */
+#define ICONV_CACHE_SIZE 64
+
+/* A converted string, stored as the input and output back to back */
+struct iconv_cache_entry {
+	uint64_t hash;
+	size_t inlen;
+	size_t outlen;
+	char *buf;
+};
+
+/*
+ * Conversion handles of one thread, so that conversions need no lock,
+ * and the strings it converted last. Conversion only depends on the
+ * string, so the cache never goes stale.
+ */
+struct iconv_thread {
+	struct iconv *ic;
+	struct iconv_thread *next;
+	struct iconv_thread *prev;
+	iconv_t tofs;
+	iconv_t fromfs;
+	struct iconv_cache_entry cache[2][ICONV_CACHE_SIZE];
+};
+
 struct iconv {
 	struct fuse_fs *next;
 	pthread_mutex_t lock;
 	char *from_code;
 	char *to_code;
+	/* The charsets actually converted between */
+	char *from;
+	char *to;
+	/* Used under lock if a thread cannot get its own handles */
 	iconv_t tofs;
 	iconv_t fromfs;
+	/* Both charsets encode ASCII as ASCII */
+	int ascii_compat;
+	pthread_key_t thread_key;
+	/* All struct iconv_thread, under lock */
+	struct iconv_thread threads;
 };
 
 struct iconv_dh {
@@ -39,10 +74,121 @@ static struct iconv *iconv_get(void)
 	return fuse_get_context()->private_data;
 }
 
-static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
-			  int fromfs)
+static void iconv_thread_free(struct iconv_thread *it)
+{
+	int i;
+
+	for (i = 0; i < ICONV_CACHE_SIZE; i++) {
+		free(it->cache[0][i].buf);
+		free(it->cache[1][i].buf);
+	}
+	iconv_close(it->tofs);
+	iconv_close(it->fromfs);
+	free(it);
+}
+
+static void iconv_thread_destructor(void *data)
+{
+	struct iconv_thread *it = data;
+	struct iconv *ic = it->ic;
+
+	pthread_mutex_lock(&ic->lock);
+	it->prev->next = it->next;
+	it->next->prev = it->prev;
+	pthread_mutex_unlock(&ic->lock);
+	iconv_thread_free(it);
+}
+
+static struct iconv_thread *iconv_thread_get(struct iconv *ic)
+{
+	struct iconv_thread *it = pthread_getspecific(ic->thread_key);
+
+	if (it != NULL)
+		return it;
+
+	it = calloc(1, sizeof(struct iconv_thread));
+	if (it == NULL)
+		return NULL;
+	it->ic = ic;
+	it->tofs = iconv_open(ic->from, ic->to);
+	it->fromfs = iconv_open(ic->to, ic->from);
+	if (it->tofs == (iconv_t) -1 || it->fromfs == (iconv_t) -1) {
+		if (it->tofs != (iconv_t) -1)
+			iconv_close(it->tofs);
+		if (it->fromfs != (iconv_t) -1)
+			iconv_close(it->fromfs);
+		free(it);
+		return NULL;
+	}
+	if (pthread_setspecific(ic->thread_key, it) != 0) {
+		it->ic = NULL;
+		iconv_thread_free(it);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ic->lock);
+	it->next = ic->threads.next;
+	it->prev = &ic->threads;
+	ic->threads.next->prev = it;
+	ic->threads.next = it;
+	pthread_mutex_unlock(&ic->lock);
+
+	return it;
+}
+
+/* Checks for bytes with the high bit set a word at a time */
+static int iconv_is_ascii(const char *s, size_t len)
+{
+	const uint64_t high = 0x8080808080808080ULL;
+	uint64_t acc = 0;
+	uint64_t w;
+	size_t i = 0;
+
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		acc |= w;
+	}
+	for (; i < len; i++)
+		acc |= (unsigned char) s[i];
+
+	return !(acc & high);
+}
+
+/* Whether cd leaves all of ASCII (except NUL) as it is */
+static int iconv_keeps_ascii(iconv_t cd)
+{
+	char in[127];
+	char out[127 * 4];
+	char *inp = in;
+	char *outp = out;
+	size_t inlen = sizeof(in);
+	size_t outlen = sizeof(out);
+	size_t res;
+	size_t i;
+
+	for (i = 0; i < sizeof(in); i++)
+		in[i] = i + 1;
+	res = iconv(cd, &inp, &inlen, &outp, &outlen);
+	iconv(cd, NULL, NULL, NULL, NULL);
+
+	return res != (size_t) -1 && inlen == 0 &&
+		outp - out == sizeof(in) && memcmp(in, out, sizeof(in)) == 0;
+}
+
+static char *iconv_dup(const char *s, size_t len)
+{
+	char *res = malloc(len + 1);
+
+	if (res) {
+		memcpy(res, s, len);
+		res[len] = '\0';
+	}
+	return res;
+}
+
+static int iconv_do(iconv_t cd, const char *path, size_t pathlen,
+		    char **newpathp, size_t *newlenp)
 {
-	size_t pathlen;
 	size_t newpathlen;
 	char *newpath;
 	size_t plen;
@@ -50,12 +196,6 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 	size_t res;
 	int err;
 
-	if (path == NULL) {
-		*newpathp = NULL;
-		return 0;
-	}
-
-	pathlen = strlen(path);
 	newpathlen = pathlen * 4;
 	newpath = malloc(newpathlen + 1);
 	if (!newpath)
@@ -63,13 +203,12 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 
 	plen = newpathlen;
 	p = newpath;
-	pthread_mutex_lock(&ic->lock);
 	do {
-		res = iconv(fromfs ? ic->fromfs : ic->tofs, (char **) &path,
-			    &pathlen, &p, &plen);
+		res = iconv(cd, (char **) &path, &pathlen, &p, &plen);
 		if (res == (size_t) -1) {
 			char *tmp;
 			size_t inc;
+			size_t done = p - newpath;
 
 			err = -EILSEQ;
 			if (errno != E2BIG)
@@ -82,23 +221,93 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 			if (!tmp)
 				goto err;
 
-			p = tmp + (p - newpath);
+			p = tmp + done;
 			plen += inc;
 			newpath = tmp;
 		}
 	} while (res == (size_t) -1);
-	pthread_mutex_unlock(&ic->lock);
 	*p = '\0';
 	*newpathp = newpath;
+	*newlenp = p - newpath;
 	return 0;
 
 err:
-	iconv(fromfs ? ic->fromfs : ic->tofs, NULL, NULL, NULL, NULL);
-	pthread_mutex_unlock(&ic->lock);
+	iconv(cd, NULL, NULL, NULL, NULL);
 	free(newpath);
 	return err;
 }
 
+/* FNV-1a */
+static uint64_t iconv_hash(const char *s, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) s[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
+			  int fromfs)
+{
+	struct iconv_thread *it;
+	struct iconv_cache_entry *e;
+	size_t pathlen;
+	size_t newlen;
+	uint64_t hash;
+	char *newpath;
+	char *buf;
+	int err;
+
+	if (path == NULL) {
+		*newpathp = NULL;
+		return 0;
+	}
+
+	pathlen = strlen(path);
+	if (ic->ascii_compat && iconv_is_ascii(path, pathlen)) {
+		*newpathp = iconv_dup(path, pathlen);
+		return *newpathp ? 0 : -ENOMEM;
+	}
+
+	it = iconv_thread_get(ic);
+	if (it == NULL) {
+		pthread_mutex_lock(&ic->lock);
+		err = iconv_do(fromfs ? ic->fromfs : ic->tofs, path, pathlen,
+			       newpathp, &newlen);
+		pthread_mutex_unlock(&ic->lock);
+		return err;
+	}
+
+	hash = iconv_hash(path, pathlen);
+	e = &it->cache[fromfs][hash % ICONV_CACHE_SIZE];
+	if (e->buf && e->hash == hash && e->inlen == pathlen &&
+	    memcmp(e->buf, path, pathlen) == 0) {
+		*newpathp = iconv_dup(e->buf + pathlen + 1, e->outlen);
+		return *newpathp ? 0 : -ENOMEM;
+	}
+
+	err = iconv_do(fromfs ? it->fromfs : it->tofs, path, pathlen,
+		       &newpath, &newlen);
+	if (err)
+		return err;
+
+	buf = malloc(pathlen + newlen + 2);
+	if (buf) {
+		memcpy(buf, path, pathlen + 1);
+		memcpy(buf + pathlen + 1, newpath, newlen + 1);
+		free(e->buf);
+		e->buf = buf;
+		e->hash = hash;
+		e->inlen = pathlen;
+		e->outlen = newlen;
+	}
+	*newpathp = newpath;
+	return 0;
+}
+
 static int iconv_getattr(const char *path, struct stat *stbuf,
 			 struct fuse_file_info *fi)
 {
@@ -581,11 +790,21 @@ static void iconv_destroy(void *data)
 {
 	struct iconv *ic = data;
 	fuse_fs_destroy(ic->next);
+	/* Destructors will no longer run */
+	pthread_key_delete(ic->thread_key);
+	while (ic->threads.next != &ic->threads) {
+		struct iconv_thread *it = ic->threads.next;
+
+		ic->threads.next = it->next;
+		iconv_thread_free(it);
+	}
 	iconv_close(ic->tofs);
 	iconv_close(ic->fromfs);
 	pthread_mutex_destroy(&ic->lock);
 	free(ic->from_code);
 	free(ic->to_code);
+	free(ic->from);
+	free(ic->to);
 	free(ic);
 }
 
@@ -682,6 +901,7 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 		return NULL;
 	}
 
+	pthread_mutex_init(&ic->lock, NULL);
 	if (fuse_opt_parse(args, ic, iconv_opts, iconv_opt_proc) == -1)
 		goto out_free;
 
@@ -693,8 +913,17 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 	from = ic->from_code ? ic->from_code : "UTF-8";
 	to = ic->to_code ? ic->to_code : "";
 	/* FIXME: detect charset equivalence? */
-	if (!to[0])
+	if (!to[0]) {
 		old = setlocale(LC_CTYPE, "");
+		/* Threads open their handles later, under any locale */
+		to = nl_langinfo(CODESET);
+	}
+	ic->from = strdup(from);
+	ic->to = strdup(to);
+	if (!ic->from || !ic->to) {
+		fuse_log(FUSE_LOG_ERR, "fuse-iconv: memory allocation failed\n");
+		goto out_free;
+	}
 	ic->tofs = iconv_open(from, to);
 	if (ic->tofs == (iconv_t) -1) {
 		fuse_log(FUSE_LOG_ERR, "fuse-iconv: cannot convert from %s to %s\n",
@@ -702,7 +931,7 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 		goto out_free;
 	}
 	ic->fromfs = iconv_open(to, from);
-	if (ic->tofs == (iconv_t) -1) {
+	if (ic->fromfs == (iconv_t) -1) {
 		fuse_log(FUSE_LOG_ERR, "fuse-iconv: cannot convert from %s to %s\n",
 			from, to);
 		goto out_iconv_close_to;
@@ -711,21 +940,34 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 		setlocale(LC_CTYPE, old);
 		old = NULL;
 	}
+	ic->ascii_compat = iconv_keeps_ascii(ic->tofs) &&
+		iconv_keeps_ascii(ic->fromfs);
+
+	if (pthread_key_create(&ic->thread_key, iconv_thread_destructor)) {
+		fuse_log(FUSE_LOG_ERR, "fuse-iconv: failed to create thread specific key\n");
+		goto out_iconv_close_from;
+	}
+	ic->threads.next = ic->threads.prev = &ic->threads;
 
 	ic->next = next[0];
 	fs = fuse_fs_new(&iconv_oper, sizeof(iconv_oper), ic);
 	if (!fs)
-		goto out_iconv_close_from;
+		goto out_key_delete;
 
 	return fs;
 
+out_key_delete:
+	pthread_key_delete(ic->thread_key);
 out_iconv_close_from:
 	iconv_close(ic->fromfs);
 out_iconv_close_to:
 	iconv_close(ic->tofs);
 out_free:
+	pthread_mutex_destroy(&ic->lock);
 	free(ic->from_code);
 	free(ic->to_code);
+	free(ic->from);
+	free(ic->to);
 	free(ic);
 	if (old) {
 		setlocale(LC_CTYPE, old);
@@ -18,6 +18,7 @@
 struct subdir {
 	char *base;
 	size_t baselen;
+	int absbase;
 	int rellinks;
 	struct fuse_fs *next;
 };
@@ -31,6 +32,15 @@ static int subdir_addpath(struct subdir *d, const char *path, char **newpathp)
 {
 	char *newpath = NULL;
 
+	/*
+	 * The trailing '/' of the base takes the place of the leading one
+	 * of the path, which lets the library write the rest in front of
+	 * the path without a copy.
+	 */
+	if (path != NULL && path[0] == '/' && d->baselen)
+		return fuse_fs_path_prepend(path, d->base, d->baselen - 1,
+					    newpathp);
+
 	if (path != NULL) {
 		unsigned newlen = d->baselen + strlen(path);
 
@@ -58,7 +68,7 @@ static int subdir_getattr(const char *path, struct stat *stbuf,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_getattr(d->next, newpath, stbuf, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -70,7 +80,7 @@ static int subdir_access(const char *path, int mask)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_access(d->next, newpath, mask);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -110,9 +120,14 @@ static void transform_symlink(struct subdir *d, const char *path,
 	int dotdots;
 	int i;
 
-	if (l[0] != '/' || d->base[0] != '/')
+	if (l[0] != '/' || !d->absbase)
 		return;
 
+	/* The path starts with the base, skip it if the link does too */
+	if (strncmp(l, d->base, d->baselen) == 0) {
+		l += d->baselen;
+		path += d->baselen;
+	}
 	strip_common(&l, &path);
 	if (l - buf < (long) d->baselen)
 		return;
@@ -148,7 +163,7 @@ static int subdir_readlink(const char *path, char *buf, size_t size)
 		err = fuse_fs_readlink(d->next, newpath, buf, size);
 		if (!err && d->rellinks)
 			transform_symlink(d, newpath, buf, size);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -160,7 +175,7 @@ static int subdir_opendir(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_opendir(d->next, newpath, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -176,7 +191,7 @@ static int subdir_readdir(const char *path, void *buf,
 	if (!err) {
 		err = fuse_fs_readdir(d->next, newpath, buf, filler, offset,
 				      fi, flags);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -188,7 +203,7 @@ static int subdir_releasedir(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_releasedir(d->next, newpath, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -200,7 +215,7 @@ static int subdir_mknod(const char *path, mode_t mode, dev_t rdev)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_mknod(d->next, newpath, mode, rdev);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -212,7 +227,7 @@ static int subdir_mkdir(const char *path, mode_t mode)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_mkdir(d->next, newpath, mode);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -224,7 +239,7 @@ static int subdir_unlink(const char *path)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_unlink(d->next, newpath);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -236,7 +251,7 @@ static int subdir_rmdir(const char *path)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_rmdir(d->next, newpath);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -248,7 +263,7 @@ static int subdir_symlink(const char *from, const char *path)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_symlink(d->next, from, newpath);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -263,9 +278,9 @@ static int subdir_rename(const char *from, const char *to, unsigned int flags)
 		err = subdir_addpath(d, to, &newto);
 		if (!err) {
 			err = fuse_fs_rename(d->next, newfrom, newto, flags);
-			free(newto);
+			fuse_fs_path_release(newto);
 		}
-		free(newfrom);
+		fuse_fs_path_release(newfrom);
 	}
 	return err;
 }
@@ -280,9 +295,9 @@ static int subdir_link(const char *from, const char *to)
 		err = subdir_addpath(d, to, &newto);
 		if (!err) {
 			err = fuse_fs_link(d->next, newfrom, newto);
-			free(newto);
+			fuse_fs_path_release(newto);
 		}
-		free(newfrom);
+		fuse_fs_path_release(newfrom);
 	}
 	return err;
 }
@@ -295,7 +310,7 @@ static int subdir_chmod(const char *path, mode_t mode,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_chmod(d->next, newpath, mode, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -308,7 +323,7 @@ static int subdir_chown(const char *path, uid_t uid, gid_t gid,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_chown(d->next, newpath, uid, gid, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -321,7 +336,7 @@ static int subdir_truncate(const char *path, off_t size,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_truncate(d->next, newpath, size, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -334,7 +349,7 @@ static int subdir_utimens(const char *path, const struct timespec ts[2],
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_utimens(d->next, newpath, ts, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -347,7 +362,7 @@ static int subdir_create(const char *path, mode_t mode,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_create(d->next, newpath, mode, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -359,7 +374,7 @@ static int subdir_open(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_open(d->next, newpath, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -372,7 +387,7 @@ static int subdir_read_buf(const char *path, struct fuse_bufvec **bufp,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_read_buf(d->next, newpath, bufp, size, offset, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -385,7 +400,7 @@ static int subdir_write_buf(const char *path, struct fuse_bufvec *buf,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_write_buf(d->next, newpath, buf, offset, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -397,7 +412,7 @@ static int subdir_statfs(const char *path, struct statvfs *stbuf)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_statfs(d->next, newpath, stbuf);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -409,7 +424,7 @@ static int subdir_flush(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_flush(d->next, newpath, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -421,7 +436,7 @@ static int subdir_release(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_release(d->next, newpath, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -434,7 +449,7 @@ static int subdir_fsync(const char *path, int isdatasync,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_fsync(d->next, newpath, isdatasync, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -447,7 +462,7 @@ static int subdir_fsyncdir(const char *path, int isdatasync,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_fsyncdir(d->next, newpath, isdatasync, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -461,7 +476,7 @@ static int subdir_setxattr(const char *path, const char *name,
 	if (!err) {
 		err = fuse_fs_setxattr(d->next, newpath, name, value, size,
 				       flags);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -474,7 +489,7 @@ static int subdir_getxattr(const char *path, const char *name, char *value,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_getxattr(d->next, newpath, name, value, size);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -486,7 +501,7 @@ static int subdir_listxattr(const char *path, char *list, size_t size)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_listxattr(d->next, newpath, list, size);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -498,7 +513,7 @@ static int subdir_removexattr(const char *path, const char *name)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_removexattr(d->next, newpath, name);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -511,7 +526,7 @@ static int subdir_lock(const char *path, struct fuse_file_info *fi, int cmd,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_lock(d->next, newpath, fi, cmd, lock);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -523,7 +538,7 @@ static int subdir_flock(const char *path, struct fuse_file_info *fi, int op)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_flock(d->next, newpath, fi, op);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -535,7 +550,7 @@ static int subdir_bmap(const char *path, size_t blocksize, uint64_t *idx)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_bmap(d->next, newpath, blocksize, idx);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return err;
 }
@@ -548,7 +563,7 @@ static off_t subdir_lseek(const char *path, off_t off, int whence,
 	int res = subdir_addpath(ic, path, &newpath);
 	if (!res) {
 		res = fuse_fs_lseek(ic->next, newpath, off, whence, fi);
-		free(newpath);
+		fuse_fs_path_release(newpath);
 	}
 	return res;
 }
@@ -674,10 +689,13 @@ static struct fuse_fs *subdir_new(struct fuse_args *args,
 		strcat(d->base, "/");
 	}
 	d->baselen = strlen(d->base);
+	d->absbase = d->base[0] == '/';
 	d->next = next[0];
 	fs = fuse_fs_new(&subdir_oper, sizeof(subdir_oper), d);
 	if (!fs)
 		goto out_free;
+	if (d->baselen)
+		fuse_fs_reserve_path(fs, d->baselen - 1);
 	return fs;
 
 out_free:
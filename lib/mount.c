@@ -161,6 +161,11 @@ unsigned get_max_read(struct mount_opts *o)
 	return o->max_read;
 }
 
+int get_auto_unmount(struct mount_opts *o)
+{
+	return o->auto_unmount;
+}
+
 static void set_mount_flag(const char *s, int *flags)
 {
 	int i;
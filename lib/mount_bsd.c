@@ -108,6 +108,12 @@ unsigned get_max_read(struct mount_opts *o)
 	return o->max_read;
 }
 
+int get_auto_unmount(struct mount_opts *o)
+{
+	(void) o;
+	return 0;
+}
+
 static int fuse_mount_opt_proc(void *data, const char *arg, int key,
 			       struct fuse_args *outargs)
 {
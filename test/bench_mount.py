@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+'''
+End-to-end benchmarks: mounts the null and passthrough_hp examples and
+drives small-op and streaming loads through the kernel.
+
+Every result is printed as one line of JSON, in the same format as the
+benchmark program:
+
+  {"benchmark": "e2e_hp_stat", "iterations": 81234, "ns_per_op": 24621.3}
+
+Exits with 77 (skipped) if nothing can be mounted.
+'''
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from os.path import join as pjoin
+
+SKIP = 77
+
+basename = pjoin(os.path.dirname(__file__), '..')
+
+
+def report(name, iterations, ns, nbytes=0):
+    res = { 'benchmark': name, 'iterations': iterations,
+            'ns_per_op': round(ns / iterations, 1) }
+    if nbytes:
+        res['bytes_per_sec'] = round(nbytes * 1e9 / ns)
+    print(json.dumps(res), flush=True)
+
+
+def measure(name, duration, op, bytes_per_op=0):
+    '''Calls op() repeatedly for duration seconds'''
+    n = 0
+    start = time.perf_counter_ns()
+    end = start + duration * 1e9
+    while True:
+        op()
+        n += 1
+        now = time.perf_counter_ns()
+        if now >= end:
+            break
+    report(name, n, now - start, n * bytes_per_op)
+
+
+def fusermount():
+    path = pjoin(basename, 'util', 'fusermount3')
+    if os.path.exists(path):
+        return path
+    return shutil.which('fusermount3')
+
+
+def can_mount():
+    if not os.path.exists('/dev/fuse'):
+        return False
+    return os.getuid() == 0 or fusermount() is not None
+
+
+class Mount:
+    def __init__(self, cmdline, mnt_dir):
+        self.mnt_dir = mnt_dir
+        self.proc = subprocess.Popen(cmdline)
+        elapsed = 0
+        while not os.path.ismount(mnt_dir):
+            if self.proc.poll() is not None or elapsed > 30:
+                raise RuntimeError('%s did not mount' % cmdline[0])
+            time.sleep(0.1)
+            elapsed += 0.1
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        fm = fusermount()
+        if fm is not None:
+            subprocess.call([ fm, '-z', '-u', self.mnt_dir ])
+        else:
+            subprocess.call([ 'umount', '-l', self.mnt_dir ])
+        try:
+            self.proc.wait(10)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+
+
+def bench_null(tmpdir, duration):
+    mnt = pjoin(tmpdir, 'null_mnt')
+    open(mnt, 'w').close()
+    cmdline = [ pjoin(basename, 'example', 'null'), '-f', mnt ]
+    with Mount(cmdline, mnt):
+        fd = os.open(mnt, os.O_RDWR)
+        try:
+            buf = bytes(1024 * 1024)
+            measure('e2e_null_write_1m', duration,
+                    lambda: os.pwrite(fd, buf, 0), len(buf))
+
+            # Drop the page cache so that every read reaches the daemon
+            def read_1m():
+                os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+                os.pread(fd, len(buf), 0)
+            measure('e2e_null_read_1m', duration, read_1m, len(buf))
+
+            rnd = random.Random(0)
+            def read_4k():
+                off = rnd.randrange(1 << 20) * 4096
+                os.posix_fadvise(fd, off, 4096, os.POSIX_FADV_DONTNEED)
+                os.pread(fd, 4096, off)
+            measure('e2e_null_read_4k', duration, read_4k, 4096)
+        finally:
+            os.close(fd)
+
+
+def bench_passthrough_hp(tmpdir, duration, extra_args):
+    src = pjoin(tmpdir, 'hp_src')
+    mnt = pjoin(tmpdir, 'hp_mnt')
+    os.mkdir(src)
+    os.mkdir(mnt)
+    cmdline = [ pjoin(basename, 'example', 'passthrough_hp') ] + \
+              extra_args + [ src, mnt ]
+    with Mount(cmdline, mnt):
+        # Small operations
+        ctr = [0]
+        data = bytes(4096)
+        def create_unlink():
+            name = pjoin(mnt, 'f%d' % ctr[0])
+            ctr[0] += 1
+            fd = os.open(name, os.O_CREAT | os.O_WRONLY)
+            os.write(fd, data)
+            os.close(fd)
+            os.unlink(name)
+        measure('e2e_hp_create_unlink_4k', duration, create_unlink)
+
+        names = []
+        for i in range(1000):
+            names.append(pjoin(mnt, 's%d' % i))
+            open(names[-1], 'w').close()
+        ctr[0] = 0
+        def stat():
+            os.lstat(names[ctr[0] % len(names)])
+            ctr[0] += 1
+        measure('e2e_hp_stat', duration, stat)
+
+        # Streaming, with the page cache dropped for reads
+        size = 64 * 1024 * 1024
+        buf = bytes(1024 * 1024)
+        name = pjoin(mnt, 'stream')
+        fd = os.open(name, os.O_CREAT | os.O_RDWR)
+        try:
+            def seq_write():
+                for off in range(0, size, len(buf)):
+                    os.pwrite(fd, buf, off)
+                os.fsync(fd)
+            measure('e2e_hp_seq_write_1m', duration, seq_write, size)
+
+            def seq_read():
+                os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+                for off in range(0, size, len(buf)):
+                    os.pread(fd, len(buf), off)
+            measure('e2e_hp_seq_read_1m', duration, seq_read, size)
+
+            rnd = random.Random(0)
+            def rand_read():
+                os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+                for i in range(256):
+                    os.pread(fd, 4096, rnd.randrange(size // 4096) * 4096)
+            measure('e2e_hp_rand_read_4k_x256', duration, rand_read,
+                    256 * 4096)
+        finally:
+            os.close(fd)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('-t', '--time', type=float, default=2,
+                        help='seconds per benchmark (default: 2)')
+    parser.add_argument('--hp-args', default='',
+                        help='extra arguments for passthrough_hp')
+    options = parser.parse_args()
+
+    if not can_mount():
+        print('cannot mount FUSE file systems, skipping', file=sys.stderr)
+        return SKIP
+
+    tmpdir = tempfile.mkdtemp(prefix='fuse-bench-')
+    try:
+        bench_null(tmpdir, options.time)
+        bench_passthrough_hp(tmpdir, options.time, options.hp_args.split())
+    finally:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,787 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Microbenchmarks for the hot paths of the library. Requests are built
+  in memory and handed to fuse_session_process_buf(), with the replies
+  going to a pipe that is drained after every request, so nothing is
+  mounted.
+
+  Every result is printed as one line of JSON:
+
+    {"benchmark": "ll_getattr", "iterations": 524288, "ns_per_op": 812.3}
+
+  Benchmarks that move data also report "bytes_per_sec".
+
+  Usage: benchmark [-t seconds] [name-filter]
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 35
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <fuse_kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define REPLY_BUF_SIZE (1024 * 1024)
+#define HL_NODES 100000
+#define HL_DEPTH 16
+#define HL_DIR_ENTRIES 10000
+
+static double min_time = 0.5;
+static const char *filter;
+static int reply_fd = -1;
+static char *reply_buf;
+static uint64_t unique;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int want(const char *name)
+{
+	return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void report(const char *name, uint64_t iterations, uint64_t ns,
+		   uint64_t bytes)
+{
+	printf("{\"benchmark\": \"%s\", \"iterations\": %llu, "
+	       "\"ns_per_op\": %.1f", name, (unsigned long long) iterations,
+	       (double) ns / iterations);
+	if (bytes)
+		printf(", \"bytes_per_sec\": %.0f",
+		       (double) bytes * 1e9 / ns);
+	printf("}\n");
+	fflush(stdout);
+}
+
+/*
+ * Calls fn() with a doubling number of iterations until one round takes
+ * at least min_time, and reports that round.
+ */
+static void run(const char *name, void (*fn)(void *, uint64_t), void *arg,
+		uint64_t bytes_per_op)
+{
+	uint64_t n = 1, start, ns;
+
+	if (!want(name))
+		return;
+	while (1) {
+		start = now_ns();
+		fn(arg, n);
+		ns = now_ns() - start;
+		if (ns >= min_time * 1e9 || n >= (1ULL << 40))
+			break;
+		n *= 2;
+	}
+	report(name, n, ns, bytes_per_op * n);
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static int tmpfile_fd(void)
+{
+	char name[] = "/tmp/fuse_benchmark.XXXXXX";
+	int fd = mkstemp(name);
+
+	if (fd == -1) {
+		perror("mkstemp");
+		exit(1);
+	}
+	unlink(name);
+	return fd;
+}
+
+
+/*
+ * Requests and replies
+ */
+
+struct request {
+	char *mem;
+	size_t size;
+};
+
+/* Builds a request from a fixed size argument and an optional name */
+static void make_req(struct request *r, uint32_t opcode, uint64_t nodeid,
+		     const void *arg, size_t argsize, const char *name)
+{
+	struct fuse_in_header *in;
+	size_t namelen = name ? strlen(name) + 1 : 0;
+
+	r->size = sizeof(*in) + argsize + namelen;
+	r->mem = xmalloc(r->size);
+	in = (struct fuse_in_header *) r->mem;
+	memset(in, 0, sizeof(*in));
+	in->len = r->size;
+	in->opcode = opcode;
+	in->nodeid = nodeid;
+	in->uid = getuid();
+	in->gid = getgid();
+	in->pid = getpid();
+	if (argsize)
+		memcpy(r->mem + sizeof(*in), arg, argsize);
+	if (name)
+		memcpy(r->mem + sizeof(*in) + argsize, name, namelen);
+}
+
+/* Processes a request and returns the reply, or NULL if there is none */
+static struct fuse_out_header *process(struct fuse_session *se,
+				       struct request *r)
+{
+	struct fuse_buf buf = {
+		.mem = r->mem,
+		.size = r->size,
+	};
+	ssize_t res;
+
+	((struct fuse_in_header *) r->mem)->unique = ++unique;
+	fuse_session_process_buf(se, &buf);
+
+	res = read(reply_fd, reply_buf, REPLY_BUF_SIZE);
+	if (res == -1 && errno == EAGAIN)
+		return NULL;
+	if (res < (ssize_t) sizeof(struct fuse_out_header)) {
+		fprintf(stderr, "reading reply failed\n");
+		exit(1);
+	}
+	return (struct fuse_out_header *) reply_buf;
+}
+
+static void *process_ok(struct fuse_session *se, struct request *r)
+{
+	struct fuse_out_header *out = process(se, r);
+
+	if (out == NULL || out->error) {
+		fprintf(stderr, "request %u failed: %d\n",
+			((struct fuse_in_header *) r->mem)->opcode,
+			out ? out->error : 0);
+		exit(1);
+	}
+	return out + 1;
+}
+
+/* Mounts se on a pipe and sends it an INIT request */
+static void start_session(struct fuse_session *se)
+{
+	struct fuse_init_in arg = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+		.max_readahead = 128 * 1024,
+		.flags = FUSE_ASYNC_READ | FUSE_BIG_WRITES,
+	};
+	struct request r;
+	char mnt[32];
+	int pipefd[2];
+
+	if (pipe2(pipefd, O_NONBLOCK) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	/* Large enough for any reply, so that the session never blocks */
+	if (fcntl(pipefd[1], F_SETPIPE_SZ, REPLY_BUF_SIZE) == -1) {
+		perror("growing pipe");
+		exit(1);
+	}
+	reply_fd = pipefd[0];
+	snprintf(mnt, sizeof(mnt), "/dev/fd/%i", pipefd[1]);
+	if (fuse_session_mount(se, mnt) != 0)
+		exit(1);
+
+	make_req(&r, FUSE_INIT, 0, &arg, sizeof(arg), NULL);
+	process_ok(se, &r);
+	free(r.mem);
+}
+
+static void stop_session(struct fuse_session *se)
+{
+	fuse_session_destroy(se);
+	close(reply_fd);
+	reply_fd = -1;
+}
+
+
+/*
+ * Low level dispatch
+ */
+
+static const struct stat ll_attr = {
+	.st_ino = 2,
+	.st_mode = S_IFREG | 0644,
+	.st_nlink = 1,
+	.st_size = 4096,
+};
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e = {
+		.ino = 2,
+		.attr = ll_attr,
+		.attr_timeout = 1.0,
+		.entry_timeout = 1.0,
+	};
+
+	(void) parent;
+	(void) name;
+	fuse_reply_entry(req, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	(void) ino;
+	(void) nlookup;
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) fi;
+	fuse_reply_attr(req, &ll_attr, 1.0);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		    struct fuse_file_info *fi)
+{
+	static char data[128 * 1024];
+
+	(void) ino;
+	(void) off;
+	(void) fi;
+	fuse_reply_buf(req, data, size < sizeof(data) ? size : sizeof(data));
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		     size_t size, off_t off, struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) buf;
+	(void) off;
+	(void) fi;
+	fuse_reply_write(req, size);
+}
+
+static const struct fuse_lowlevel_ops ll_ops = {
+	.lookup		= ll_lookup,
+	.forget		= ll_forget,
+	.getattr	= ll_getattr,
+	.read		= ll_read,
+	.write		= ll_write,
+};
+
+struct ll_bench {
+	struct fuse_session *se;
+	struct request r;
+};
+
+static void bench_ll_request(void *arg, uint64_t n)
+{
+	struct ll_bench *b = arg;
+
+	while (n--)
+		process(b->se, &b->r);
+}
+
+static void run_ll(const char *name, struct fuse_session *se,
+		   uint32_t opcode, const void *arg, size_t argsize,
+		   const char *fname, size_t bytes)
+{
+	struct ll_bench b = { .se = se };
+
+	if (!want(name))
+		return;
+	make_req(&b.r, opcode, 1, arg, argsize, fname);
+	run(name, bench_ll_request, &b, bytes);
+	free(b.r.mem);
+}
+
+static void bench_lowlevel(void)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_getattr_in getattr_in = { 0 };
+	struct fuse_forget_in forget_in = { .nlookup = 1 };
+	struct fuse_read_in read_in = { .size = 128 * 1024 };
+	struct fuse_write_in *write_in;
+	struct fuse_session *se;
+	size_t write_size = sizeof(*write_in) + 4096;
+
+	fuse_opt_add_arg(&args, "benchmark");
+	se = fuse_session_new(&args, &ll_ops, sizeof(ll_ops), NULL);
+	fuse_opt_free_args(&args);
+	if (se == NULL)
+		exit(1);
+	start_session(se);
+
+	run_ll("ll_getattr", se, FUSE_GETATTR, &getattr_in,
+	       sizeof(getattr_in), NULL, 0);
+	run_ll("ll_lookup", se, FUSE_LOOKUP, NULL, 0, "some_file_name", 0);
+	run_ll("ll_forget", se, FUSE_FORGET, &forget_in, sizeof(forget_in),
+	       NULL, 0);
+	run_ll("ll_read_128k", se, FUSE_READ, &read_in, sizeof(read_in),
+	       NULL, read_in.size);
+
+	write_in = xmalloc(write_size);
+	memset(write_in, 0, write_size);
+	write_in->size = 4096;
+	run_ll("ll_write_4k", se, FUSE_WRITE, write_in, write_size, NULL,
+	       write_in->size);
+	free(write_in);
+
+	stop_session(se);
+}
+
+
+/*
+ * fuse_buf_copy()
+ */
+
+struct copy_bench {
+	struct fuse_buf src;
+	struct fuse_buf dst;
+	enum fuse_buf_copy_flags flags;
+	size_t size;
+	int pipefd[2];
+};
+
+static void bench_copy(void *arg, uint64_t n)
+{
+	struct copy_bench *b = arg;
+
+	while (n--) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(b->size);
+		struct fuse_bufvec src = FUSE_BUFVEC_INIT(b->size);
+
+		dst.buf[0] = b->dst;
+		src.buf[0] = b->src;
+		if (fuse_buf_copy(&dst, &src, b->flags) != (ssize_t) b->size) {
+			fprintf(stderr, "fuse_buf_copy failed\n");
+			exit(1);
+		}
+	}
+}
+
+/* File to pipe and back, which is what splice is used for */
+static void bench_copy_pipe(void *arg, uint64_t n)
+{
+	struct copy_bench *b = arg;
+
+	while (n--) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(b->size);
+		struct fuse_bufvec src = FUSE_BUFVEC_INIT(b->size);
+
+		dst.buf[0].flags = FUSE_BUF_IS_FD;
+		dst.buf[0].fd = b->pipefd[1];
+		src.buf[0] = b->src;
+		if (fuse_buf_copy(&dst, &src, b->flags) != (ssize_t) b->size)
+			goto fail;
+
+		dst = (struct fuse_bufvec) FUSE_BUFVEC_INIT(b->size);
+		src = (struct fuse_bufvec) FUSE_BUFVEC_INIT(b->size);
+		dst.buf[0] = b->dst;
+		src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+		src.buf[0].fd = b->pipefd[0];
+		if (fuse_buf_copy(&dst, &src, b->flags) != (ssize_t) b->size)
+			goto fail;
+	}
+	return;
+
+fail:
+	fprintf(stderr, "fuse_buf_copy failed\n");
+	exit(1);
+}
+
+static struct fuse_buf mem_buf(size_t size)
+{
+	struct fuse_buf buf = { .size = size, .mem = xmalloc(size) };
+
+	memset(buf.mem, 0x5a, size);
+	return buf;
+}
+
+static struct fuse_buf file_buf(size_t size)
+{
+	struct fuse_buf buf = {
+		.size = size,
+		.flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+		.fd = tmpfile_fd(),
+	};
+
+	if (ftruncate(buf.fd, size) == -1) {
+		perror("ftruncate");
+		exit(1);
+	}
+	return buf;
+}
+
+static void free_buf(struct fuse_buf *buf)
+{
+	if (buf->flags & FUSE_BUF_IS_FD)
+		close(buf->fd);
+	else
+		free(buf->mem);
+}
+
+static void run_copy(const char *name, int src_fd, int dst_fd, size_t size,
+		     enum fuse_buf_copy_flags flags)
+{
+	struct copy_bench b = { .size = size, .flags = flags };
+
+	if (!want(name))
+		return;
+	b.src = src_fd ? file_buf(size) : mem_buf(size);
+	b.dst = dst_fd ? file_buf(size) : mem_buf(size);
+	run(name, bench_copy, &b, size);
+	free_buf(&b.src);
+	free_buf(&b.dst);
+}
+
+static void bench_buf_copy(void)
+{
+	struct copy_bench b = { .size = 128 * 1024 };
+
+	run_copy("buf_copy_mem_to_mem_4k", 0, 0, 4096, 0);
+	run_copy("buf_copy_mem_to_mem_1m", 0, 0, 1024 * 1024, 0);
+	run_copy("buf_copy_mem_to_file_128k", 0, 1, 128 * 1024, 0);
+	run_copy("buf_copy_file_to_mem_128k", 1, 0, 128 * 1024, 0);
+	run_copy("buf_copy_file_to_file_1m", 1, 1, 1024 * 1024, 0);
+	run_copy("buf_copy_file_to_file_1m_nosplice", 1, 1, 1024 * 1024,
+		 FUSE_BUF_NO_SPLICE);
+
+	if (!want("buf_copy_file_pipe_file"))
+		return;
+	if (pipe(b.pipefd) == -1 ||
+	    fcntl(b.pipefd[1], F_SETPIPE_SZ, b.size) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	b.src = file_buf(b.size);
+	b.dst = file_buf(b.size);
+	run("buf_copy_file_pipe_file_128k", bench_copy_pipe, &b, b.size);
+	b.flags = FUSE_BUF_NO_SPLICE;
+	run("buf_copy_file_pipe_file_128k_nosplice", bench_copy_pipe, &b,
+	    b.size);
+	free_buf(&b.src);
+	free_buf(&b.dst);
+	close(b.pipefd[0]);
+	close(b.pipefd[1]);
+}
+
+
+/*
+ * Directory entry packing
+ */
+
+static void bench_add_direntry(void *arg, uint64_t n)
+{
+	static char buf[128 * 1024];
+	struct stat st = { .st_ino = 2, .st_mode = S_IFREG };
+	struct fuse_entry_param e = { .ino = 2, .attr = st };
+	int plus = *(int *) arg;
+	size_t off = 0;
+	char name[32];
+
+	while (n--) {
+		size_t res;
+
+		snprintf(name, sizeof(name), "file_%08llu",
+			 (unsigned long long) n);
+		if (plus)
+			res = fuse_add_direntry_plus(NULL, buf + off,
+						     sizeof(buf) - off, name,
+						     &e, off + 1);
+		else
+			res = fuse_add_direntry(NULL, buf + off,
+						sizeof(buf) - off, name, &st,
+						off + 1);
+		off += res;
+		if (off + 2 * res > sizeof(buf))
+			off = 0;
+	}
+}
+
+/* A 128 KiB reply filled from an in-memory listing */
+static void bench_add_direntries(void *arg, uint64_t n)
+{
+	static char buf[128 * 1024];
+	static struct fuse_direntry ents[4096];
+	static struct fuse_entry_param e[4096];
+	static char names[4096][16];
+	int plus = *(int *) arg;
+	size_t used;
+	int i;
+
+	if (!ents[0].name) {
+		for (i = 0; i < 4096; i++) {
+			snprintf(names[i], sizeof(names[i]), "file_%08d", i);
+			ents[i].name = names[i];
+			ents[i].namelen = strlen(names[i]);
+			ents[i].ino = 2 + i;
+			ents[i].mode = S_IFREG;
+			ents[i].off = i + 1;
+			e[i].ino = 2 + i;
+			e[i].attr.st_ino = 2 + i;
+			e[i].attr.st_mode = S_IFREG;
+		}
+	}
+
+	while (n) {
+		size_t res;
+
+		if (plus)
+			res = fuse_add_direntries_plus(NULL, buf, sizeof(buf),
+						       ents, e, 4096, &used);
+		else
+			res = fuse_add_direntries(NULL, buf, sizeof(buf), ents,
+						  4096, &used);
+		n = res < n ? n - res : 0;
+	}
+}
+
+static void bench_direntry(void)
+{
+	int plus = 0;
+
+	run("add_direntry", bench_add_direntry, &plus, 0);
+	run("add_direntries", bench_add_direntries, &plus, 0);
+	plus = 1;
+	run("add_direntry_plus", bench_add_direntry, &plus, 0);
+	run("add_direntries_plus", bench_add_direntries, &plus, 0);
+}
+
+
+/*
+ * High level API: node table and path building
+ */
+
+static int hl_getattr(const char *path, struct stat *st,
+		      struct fuse_file_info *fi)
+{
+	(void) fi;
+	memset(st, 0, sizeof(*st));
+	if (strcmp(path, "/") == 0 || strncmp(path, "/d", 2) == 0) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+	} else {
+		st->st_mode = S_IFREG | 0644;
+		st->st_nlink = 1;
+	}
+	return 0;
+}
+
+static int hl_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		      off_t offset, struct fuse_file_info *fi,
+		      enum fuse_readdir_flags flags)
+{
+	char name[32];
+	int i;
+
+	(void) path;
+	(void) offset;
+	(void) fi;
+	(void) flags;
+	for (i = 0; i < HL_DIR_ENTRIES; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		if (filler(buf, name, NULL, 0, 0))
+			break;
+	}
+	return 0;
+}
+
+static const struct fuse_operations hl_ops = {
+	.getattr	= hl_getattr,
+	.readdir	= hl_readdir,
+};
+
+static uint64_t hl_lookup(struct fuse_session *se, uint64_t parent,
+			  const char *name)
+{
+	struct fuse_entry_out *entry;
+	struct request r;
+	uint64_t nodeid;
+
+	make_req(&r, FUSE_LOOKUP, parent, NULL, 0, name);
+	entry = process_ok(se, &r);
+	nodeid = entry->nodeid;
+	free(r.mem);
+	return nodeid;
+}
+
+static void hl_lookups(struct fuse_session *se, const char *bench,
+		       uint64_t *nodeids)
+{
+	uint64_t start = now_ns();
+	char name[32];
+	int i;
+
+	for (i = 0; i < HL_NODES; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		nodeids[i] = hl_lookup(se, FUSE_ROOT_ID, name);
+	}
+	if (want(bench))
+		report(bench, HL_NODES, now_ns() - start, 0);
+}
+
+static void hl_getattrs(struct fuse_session *se, const char *bench,
+			const uint64_t *nodeids, int count)
+{
+	struct fuse_getattr_in arg = { 0 };
+	struct request r;
+	uint64_t start;
+	int i, rounds = 0;
+
+	if (!want(bench))
+		return;
+	make_req(&r, FUSE_GETATTR, 0, &arg, sizeof(arg), NULL);
+	start = now_ns();
+	do {
+		for (i = 0; i < count; i++) {
+			((struct fuse_in_header *) r.mem)->nodeid = nodeids[i];
+			process_ok(se, &r);
+		}
+		rounds++;
+	} while (now_ns() - start < min_time * 1e9);
+	report(bench, (uint64_t) rounds * count, now_ns() - start, 0);
+	free(r.mem);
+}
+
+static void bench_hl_readdir(void *arg, uint64_t n)
+{
+	struct fuse_session *se = arg;
+	struct fuse_open_in open_in = { .flags = O_RDONLY };
+	struct fuse_read_in read_in = { .size = 128 * 1024 };
+	struct fuse_release_in release_in = { 0 };
+	struct fuse_open_out *open_out;
+	struct fuse_out_header *out;
+	struct request r;
+
+	while (n--) {
+		make_req(&r, FUSE_OPENDIR, FUSE_ROOT_ID, &open_in,
+			 sizeof(open_in), NULL);
+		open_out = process_ok(se, &r);
+		read_in.fh = release_in.fh = open_out->fh;
+		free(r.mem);
+
+		read_in.offset = 0;
+		do {
+			struct fuse_dirent *dirent;
+			size_t off;
+
+			make_req(&r, FUSE_READDIR, FUSE_ROOT_ID, &read_in,
+				 sizeof(read_in), NULL);
+			out = process(se, &r);
+			free(r.mem);
+			for (off = sizeof(*out); off < out->len;
+			     off += FUSE_DIRENT_SIZE(dirent)) {
+				dirent = (struct fuse_dirent *)
+					(reply_buf + off);
+				read_in.offset = dirent->off;
+			}
+		} while (out->len > sizeof(*out));
+
+		make_req(&r, FUSE_RELEASEDIR, FUSE_ROOT_ID, &release_in,
+			 sizeof(release_in), NULL);
+		process_ok(se, &r);
+		free(r.mem);
+	}
+}
+
+static void bench_highlevel(void)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	uint64_t *nodeids = xmalloc(HL_NODES * sizeof(nodeids[0]));
+	uint64_t deep[HL_DEPTH];
+	struct fuse_session *se;
+	struct fuse *f;
+	int i;
+
+	fuse_opt_add_arg(&args, "benchmark");
+	f = fuse_new(&args, &hl_ops, sizeof(hl_ops), NULL);
+	fuse_opt_free_args(&args);
+	if (f == NULL)
+		exit(1);
+	se = fuse_get_session(f);
+	start_session(se);
+
+	hl_lookups(se, "hl_lookup_new", nodeids);
+	hl_lookups(se, "hl_lookup_existing", nodeids);
+	hl_getattrs(se, "hl_getattr", nodeids, HL_NODES);
+
+	for (i = 0; i < HL_DEPTH; i++)
+		deep[i] = hl_lookup(se, i ? deep[i - 1] : FUSE_ROOT_ID, "dir");
+	hl_getattrs(se, "hl_getattr_depth16", &deep[HL_DEPTH - 1], 1);
+
+	if (want("hl_readdir_entry")) {
+		uint64_t start = now_ns();
+		uint64_t n = 0;
+
+		do {
+			bench_hl_readdir(se, 1);
+			n += HL_DIR_ENTRIES;
+		} while (now_ns() - start < min_time * 1e9);
+		report("hl_readdir_entry", n, now_ns() - start, 0);
+	}
+
+	/* fuse_destroy() also destroys the session */
+	fuse_destroy(f);
+	close(reply_fd);
+	reply_fd = -1;
+	free(nodeids);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			min_time = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [filter]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	reply_buf = xmalloc(REPLY_BUF_SIZE);
+
+	bench_lowlevel();
+	bench_buf_copy();
+	bench_direntry();
+	bench_highlevel();
+
+	free(reply_buf);
+	return 0;
+}
@@ -0,0 +1,854 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Replays a stream of FUSE requests into a session that runs one of
+  the library's event loops, and reports the cost of each opcode. The
+  session is "mounted" on one end of a SOCK_SEQPACKET socketpair,
+  which keeps message boundaries just like /dev/fuse, so the library
+  is measured without the kernel.
+
+  The stream is either generated (-g meta|read|write|readdir|mixed)
+  or read from a file of raw requests, as written by
+  "stracedecode -r". INIT and DESTROY in a recorded stream are
+  skipped, and every request gets a fresh unique id.
+
+  Requests are answered by a trivial file system that replies at
+  once. Every result is printed as one line of JSON, and requests
+  without a reply (FORGET and friends) are only counted:
+
+    {"benchmark": "replay_GETATTR", "iterations": 81920, "ns_per_op": 4021.7}
+
+  Usage: replay [-m] [-T max_threads] [-w window] [-t seconds]
+		[-g generator | file]
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 35
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <fuse_lowlevel.h>
+#include <fuse_kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#define MAX_OPCODE 64
+#define RING_SIZE 4096
+#define REPLY_BUF_SIZE (1024 * 1024)
+#define REPLY_TIMEOUT_MS 10000
+#define IO_SIZE (128 * 1024)
+#define DIR_ENTRIES 64
+
+static const char *opnames[MAX_OPCODE] = {
+	[FUSE_LOOKUP]		= "LOOKUP",
+	[FUSE_FORGET]		= "FORGET",
+	[FUSE_GETATTR]		= "GETATTR",
+	[FUSE_SETATTR]		= "SETATTR",
+	[FUSE_READLINK]		= "READLINK",
+	[FUSE_SYMLINK]		= "SYMLINK",
+	[FUSE_MKNOD]		= "MKNOD",
+	[FUSE_MKDIR]		= "MKDIR",
+	[FUSE_UNLINK]		= "UNLINK",
+	[FUSE_RMDIR]		= "RMDIR",
+	[FUSE_RENAME]		= "RENAME",
+	[FUSE_LINK]		= "LINK",
+	[FUSE_OPEN]		= "OPEN",
+	[FUSE_READ]		= "READ",
+	[FUSE_WRITE]		= "WRITE",
+	[FUSE_STATFS]		= "STATFS",
+	[FUSE_RELEASE]		= "RELEASE",
+	[FUSE_FSYNC]		= "FSYNC",
+	[FUSE_SETXATTR]		= "SETXATTR",
+	[FUSE_GETXATTR]		= "GETXATTR",
+	[FUSE_LISTXATTR]	= "LISTXATTR",
+	[FUSE_REMOVEXATTR]	= "REMOVEXATTR",
+	[FUSE_FLUSH]		= "FLUSH",
+	[FUSE_INIT]		= "INIT",
+	[FUSE_OPENDIR]		= "OPENDIR",
+	[FUSE_READDIR]		= "READDIR",
+	[FUSE_RELEASEDIR]	= "RELEASEDIR",
+	[FUSE_FSYNCDIR]		= "FSYNCDIR",
+	[FUSE_GETLK]		= "GETLK",
+	[FUSE_SETLK]		= "SETLK",
+	[FUSE_SETLKW]		= "SETLKW",
+	[FUSE_ACCESS]		= "ACCESS",
+	[FUSE_CREATE]		= "CREATE",
+	[FUSE_INTERRUPT]	= "INTERRUPT",
+	[FUSE_BMAP]		= "BMAP",
+	[FUSE_DESTROY]		= "DESTROY",
+	[FUSE_IOCTL]		= "IOCTL",
+	[FUSE_POLL]		= "POLL",
+	[FUSE_NOTIFY_REPLY]	= "NOTIFY_REPLY",
+	[FUSE_BATCH_FORGET]	= "BATCH_FORGET",
+	[FUSE_FALLOCATE]	= "FALLOCATE",
+	[FUSE_READDIRPLUS]	= "READDIRPLUS",
+	[FUSE_RENAME2]		= "RENAME2",
+	[FUSE_LSEEK]		= "LSEEK",
+	[FUSE_COPY_FILE_RANGE]	= "COPY_FILE_RANGE",
+	[FUSE_SETUPMAPPING]	= "SETUPMAPPING",
+	[FUSE_REMOVEMAPPING]	= "REMOVEMAPPING",
+	[FUSE_SYNCFS]		= "SYNCFS",
+};
+
+struct request {
+	char *mem;
+	size_t size;
+};
+
+struct stream {
+	struct request *reqs;
+	size_t count;
+	size_t alloc;
+};
+
+struct op_stats {
+	uint64_t count;
+	uint64_t ns;
+	uint64_t min;
+	uint64_t max;
+};
+
+/* A request that was sent and has not been answered yet */
+struct inflight {
+	uint32_t opcode;
+	uint64_t start;
+};
+
+static struct op_stats stats[MAX_OPCODE];
+static struct inflight ring[RING_SIZE];
+static unsigned int window = 1;
+static unsigned int outstanding;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int sock = -1;
+static uint64_t unique;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static const char *opname(uint32_t opcode)
+{
+	static char buf[16];
+
+	if (opcode < MAX_OPCODE && opnames[opcode])
+		return opnames[opcode];
+	snprintf(buf, sizeof(buf), "OP%u", opcode);
+	return buf;
+}
+
+/* Requests that the library never answers */
+static int no_reply(uint32_t opcode)
+{
+	return opcode == FUSE_FORGET || opcode == FUSE_BATCH_FORGET ||
+		opcode == FUSE_INTERRUPT || opcode == FUSE_NOTIFY_REPLY;
+}
+
+
+/*
+ * The file system
+ */
+
+static const struct stat file_attr = {
+	.st_ino = 2,
+	.st_mode = S_IFREG | 0644,
+	.st_nlink = 1,
+	.st_size = 1024 * 1024 * 1024,
+};
+
+static const struct stat dir_attr = {
+	.st_ino = 1,
+	.st_mode = S_IFDIR | 0755,
+	.st_nlink = 2,
+};
+
+static const struct stat *attr_of(fuse_ino_t ino)
+{
+	return ino == FUSE_ROOT_ID ? &dir_attr : &file_attr;
+}
+
+static void rp_entry(fuse_req_t req)
+{
+	struct fuse_entry_param e = {
+		.ino = 2,
+		.attr = file_attr,
+		.attr_timeout = 1.0,
+		.entry_timeout = 1.0,
+	};
+
+	fuse_reply_entry(req, &e);
+}
+
+static void rp_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	(void) parent;
+	(void) name;
+	rp_entry(req);
+}
+
+static void rp_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	(void) ino;
+	(void) nlookup;
+	fuse_reply_none(req);
+}
+
+static void rp_forget_multi(fuse_req_t req, size_t count,
+			    struct fuse_forget_data *forgets)
+{
+	(void) count;
+	(void) forgets;
+	fuse_reply_none(req);
+}
+
+static void rp_getattr(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	(void) fi;
+	fuse_reply_attr(req, attr_of(ino), 1.0);
+}
+
+static void rp_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		       int to_set, struct fuse_file_info *fi)
+{
+	(void) attr;
+	(void) to_set;
+	(void) fi;
+	fuse_reply_attr(req, attr_of(ino), 1.0);
+}
+
+static void rp_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+		     mode_t mode)
+{
+	(void) parent;
+	(void) name;
+	(void) mode;
+	rp_entry(req);
+}
+
+static void rp_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	(void) parent;
+	(void) name;
+	fuse_reply_err(req, 0);
+}
+
+static void rp_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      fuse_ino_t newparent, const char *newname,
+		      unsigned int flags)
+{
+	(void) parent;
+	(void) name;
+	(void) newparent;
+	(void) newname;
+	(void) flags;
+	fuse_reply_err(req, 0);
+}
+
+static void rp_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	fuse_reply_open(req, fi);
+}
+
+static void rp_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		    struct fuse_file_info *fi)
+{
+	static char data[IO_SIZE];
+
+	(void) ino;
+	(void) off;
+	(void) fi;
+	fuse_reply_buf(req, data, size < sizeof(data) ? size : sizeof(data));
+}
+
+static void rp_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		     size_t size, off_t off, struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) buf;
+	(void) off;
+	(void) fi;
+	fuse_reply_write(req, size);
+}
+
+static void rp_ok(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) fi;
+	fuse_reply_err(req, 0);
+}
+
+static void rp_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		     struct fuse_file_info *fi)
+{
+	(void) datasync;
+	rp_ok(req, ino, fi);
+}
+
+static void do_readdir(fuse_req_t req, size_t size, off_t off, int plus)
+{
+	char *buf = xmalloc(size);
+	size_t pos = 0;
+	char name[32];
+
+	for (; off < DIR_ENTRIES; off++) {
+		struct fuse_entry_param e = {
+			.ino = 2,
+			.attr = file_attr,
+			.attr_timeout = 1.0,
+			.entry_timeout = 1.0,
+		};
+		size_t len;
+
+		snprintf(name, sizeof(name), "file%04u", (unsigned) off);
+		if (plus)
+			len = fuse_add_direntry_plus(req, buf + pos, size - pos,
+						     name, &e, off + 1);
+		else
+			len = fuse_add_direntry(req, buf + pos, size - pos,
+						name, &e.attr, off + 1);
+		if (len > size - pos)
+			break;
+		pos += len;
+	}
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+static void rp_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		       off_t off, struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) fi;
+	do_readdir(req, size, off, 0);
+}
+
+static void rp_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t off, struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) fi;
+	do_readdir(req, size, off, 1);
+}
+
+static void rp_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st = {
+		.f_bsize = 4096,
+		.f_namemax = 255,
+	};
+
+	(void) ino;
+	fuse_reply_statfs(req, &st);
+}
+
+static void rp_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	(void) ino;
+	(void) mask;
+	fuse_reply_err(req, 0);
+}
+
+static void rp_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e = {
+		.ino = 2,
+		.attr = file_attr,
+		.attr_timeout = 1.0,
+		.entry_timeout = 1.0,
+	};
+
+	(void) parent;
+	(void) name;
+	(void) mode;
+	fuse_reply_create(req, &e, fi);
+}
+
+static const struct fuse_lowlevel_ops rp_ops = {
+	.lookup		= rp_lookup,
+	.forget		= rp_forget,
+	.forget_multi	= rp_forget_multi,
+	.getattr	= rp_getattr,
+	.setattr	= rp_setattr,
+	.mkdir		= rp_mkdir,
+	.unlink		= rp_unlink,
+	.rmdir		= rp_unlink,
+	.rename		= rp_rename,
+	.open		= rp_open,
+	.read		= rp_read,
+	.write		= rp_write,
+	.flush		= rp_ok,
+	.release	= rp_ok,
+	.fsync		= rp_fsync,
+	.opendir	= rp_open,
+	.readdir	= rp_readdir,
+	.readdirplus	= rp_readdirplus,
+	.releasedir	= rp_ok,
+	.fsyncdir	= rp_fsync,
+	.statfs		= rp_statfs,
+	.access		= rp_access,
+	.create		= rp_create,
+};
+
+
+/*
+ * Request streams
+ */
+
+static void add_req(struct stream *s, uint32_t opcode, uint64_t nodeid,
+		    const void *arg, size_t argsize, const char *name,
+		    size_t datasize)
+{
+	struct fuse_in_header *in;
+	size_t namelen = name ? strlen(name) + 1 : 0;
+	struct request *r;
+
+	if (s->count == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 64;
+		s->reqs = realloc(s->reqs, s->alloc * sizeof(s->reqs[0]));
+		if (s->reqs == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	r = &s->reqs[s->count++];
+	r->size = sizeof(*in) + argsize + namelen + datasize;
+	r->mem = xmalloc(r->size);
+	memset(r->mem, 0, r->size);
+	in = (struct fuse_in_header *) r->mem;
+	in->len = r->size;
+	in->opcode = opcode;
+	in->nodeid = nodeid;
+	in->uid = getuid();
+	in->gid = getgid();
+	in->pid = getpid();
+	if (argsize)
+		memcpy(r->mem + sizeof(*in), arg, argsize);
+	if (name)
+		memcpy(r->mem + sizeof(*in) + argsize, name, namelen);
+}
+
+static void gen_meta(struct stream *s)
+{
+	struct fuse_forget_in forget = { .nlookup = 1 };
+	struct fuse_getattr_in getattr = { 0 };
+	char name[32];
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		snprintf(name, sizeof(name), "file%04d", i);
+		add_req(s, FUSE_LOOKUP, FUSE_ROOT_ID, NULL, 0, name, 0);
+		add_req(s, FUSE_GETATTR, 2, &getattr, sizeof(getattr),
+			NULL, 0);
+		add_req(s, FUSE_FORGET, 2, &forget, sizeof(forget), NULL, 0);
+	}
+}
+
+static void gen_read(struct stream *s)
+{
+	struct fuse_open_in open = { .flags = O_RDONLY };
+	struct fuse_release_in release = { .fh = 0 };
+	struct fuse_read_in read = { .size = IO_SIZE };
+	int i;
+
+	add_req(s, FUSE_OPEN, 2, &open, sizeof(open), NULL, 0);
+	for (i = 0; i < 16; i++) {
+		read.offset = i * IO_SIZE;
+		add_req(s, FUSE_READ, 2, &read, sizeof(read), NULL, 0);
+	}
+	add_req(s, FUSE_RELEASE, 2, &release, sizeof(release), NULL, 0);
+}
+
+static void gen_write(struct stream *s)
+{
+	struct fuse_open_in open = { .flags = O_WRONLY };
+	struct fuse_release_in release = { .fh = 0 };
+	struct fuse_write_in write = { .size = IO_SIZE };
+	int i;
+
+	add_req(s, FUSE_OPEN, 2, &open, sizeof(open), NULL, 0);
+	for (i = 0; i < 16; i++) {
+		write.offset = i * IO_SIZE;
+		add_req(s, FUSE_WRITE, 2, &write, sizeof(write), NULL,
+			IO_SIZE);
+	}
+	add_req(s, FUSE_FLUSH, 2, &(struct fuse_flush_in) { 0 },
+		sizeof(struct fuse_flush_in), NULL, 0);
+	add_req(s, FUSE_RELEASE, 2, &release, sizeof(release), NULL, 0);
+}
+
+static void gen_readdir(struct stream *s)
+{
+	struct fuse_open_in open = { .flags = O_RDONLY };
+	struct fuse_release_in release = { .fh = 0 };
+	struct fuse_read_in read = { .size = 4096 };
+
+	add_req(s, FUSE_OPENDIR, FUSE_ROOT_ID, &open, sizeof(open), NULL, 0);
+	add_req(s, FUSE_READDIR, FUSE_ROOT_ID, &read, sizeof(read), NULL, 0);
+	add_req(s, FUSE_READDIRPLUS, FUSE_ROOT_ID, &read, sizeof(read),
+		NULL, 0);
+	add_req(s, FUSE_RELEASEDIR, FUSE_ROOT_ID, &release, sizeof(release),
+		NULL, 0);
+}
+
+static void gen_mixed(struct stream *s)
+{
+	gen_meta(s);
+	gen_read(s);
+	gen_write(s);
+	gen_readdir(s);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(struct stream *s);
+} generators[] = {
+	{ "meta",	gen_meta },
+	{ "read",	gen_read },
+	{ "write",	gen_write },
+	{ "readdir",	gen_readdir },
+	{ "mixed",	gen_mixed },
+};
+
+/* Loads a file of raw requests, one fuse_in_header after the other */
+static int load_stream(struct stream *s, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	struct fuse_in_header in;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fread(&in, sizeof(in), 1, f) == 1) {
+		struct request *r;
+
+		if (in.len < sizeof(in) || in.len > REPLY_BUF_SIZE) {
+			fprintf(stderr, "%s: bad request length %u\n", path,
+				in.len);
+			fclose(f);
+			return -1;
+		}
+		add_req(s, in.opcode, in.nodeid, NULL, 0, NULL,
+			in.len - sizeof(in));
+		r = &s->reqs[s->count - 1];
+		memcpy(r->mem, &in, sizeof(in));
+		if (fread(r->mem + sizeof(in), in.len - sizeof(in), 1, f)
+		    != 1 && in.len > sizeof(in)) {
+			fprintf(stderr, "%s: truncated request\n", path);
+			fclose(f);
+			return -1;
+		}
+		/* The harness does its own handshake and teardown */
+		if (in.opcode == FUSE_INIT || in.opcode == FUSE_DESTROY ||
+		    in.opcode == CUSE_INIT) {
+			free(r->mem);
+			s->count--;
+		}
+	}
+	fclose(f);
+	if (s->count == 0) {
+		fprintf(stderr, "%s: no requests\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Sending and receiving
+ */
+
+static void send_req(struct request *r)
+{
+	struct fuse_in_header *in = (struct fuse_in_header *) r->mem;
+	ssize_t res;
+
+	in->unique = ++unique;
+	if (!no_reply(in->opcode)) {
+		pthread_mutex_lock(&lock);
+		while (outstanding >= window)
+			pthread_cond_wait(&cond, &lock);
+		outstanding++;
+		ring[in->unique % RING_SIZE] = (struct inflight) {
+			.opcode = in->opcode,
+			.start = now_ns(),
+		};
+		pthread_mutex_unlock(&lock);
+	} else if (in->opcode < MAX_OPCODE) {
+		stats[in->opcode].count++;
+	}
+
+	res = write(sock, r->mem, r->size);
+	if (res != (ssize_t) r->size) {
+		perror("sending request");
+		exit(1);
+	}
+}
+
+static void *collect(void *arg)
+{
+	char *buf = xmalloc(REPLY_BUF_SIZE);
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+	(void) arg;
+	while (1) {
+		struct fuse_out_header *out = (struct fuse_out_header *) buf;
+		struct inflight *fl;
+		struct op_stats *st;
+		uint64_t ns;
+		ssize_t res;
+
+		res = poll(&pfd, 1, REPLY_TIMEOUT_MS);
+		if (res == 0) {
+			fprintf(stderr, "no reply for %u requests\n",
+				outstanding);
+			exit(1);
+		}
+		res = read(sock, buf, REPLY_BUF_SIZE);
+		/* Shut down by main() */
+		if (res == 0)
+			break;
+		if (res < (ssize_t) sizeof(*out)) {
+			fprintf(stderr, "reading reply failed\n");
+			exit(1);
+		}
+		/* Notifications are not replies */
+		if (out->unique == 0)
+			continue;
+
+		pthread_mutex_lock(&lock);
+		fl = &ring[out->unique % RING_SIZE];
+		ns = now_ns() - fl->start;
+		if (fl->opcode < MAX_OPCODE) {
+			st = &stats[fl->opcode];
+			if (st->count == 0 || ns < st->min)
+				st->min = ns;
+			if (ns > st->max)
+				st->max = ns;
+			st->count++;
+			st->ns += ns;
+		}
+		outstanding--;
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void init_session(void)
+{
+	struct fuse_init_in arg = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+		.max_readahead = IO_SIZE,
+		.flags = FUSE_ASYNC_READ | FUSE_BIG_WRITES | FUSE_DO_READDIRPLUS,
+	};
+	struct stream s = { 0 };
+	char buf[4096];
+	struct fuse_out_header *out = (struct fuse_out_header *) buf;
+
+	add_req(&s, FUSE_INIT, 0, &arg, sizeof(arg), NULL, 0);
+	((struct fuse_in_header *) s.reqs[0].mem)->unique = ++unique;
+	if (write(sock, s.reqs[0].mem, s.reqs[0].size) !=
+	    (ssize_t) s.reqs[0].size ||
+	    read(sock, buf, sizeof(buf)) < (ssize_t) sizeof(*out) ||
+	    out->error != 0) {
+		fprintf(stderr, "INIT failed\n");
+		exit(1);
+	}
+	free(s.reqs[0].mem);
+	free(s.reqs);
+}
+
+
+/*
+ * Running the loop
+ */
+
+struct loop_args {
+	struct fuse_session *se;
+	int mt;
+	struct fuse_loop_config config;
+	int res;
+};
+
+static void *run_loop(void *arg)
+{
+	struct loop_args *la = arg;
+
+	if (la->mt)
+		la->res = fuse_session_loop_mt(la->se, &la->config);
+	else
+		la->res = fuse_session_loop(la->se);
+	return NULL;
+}
+
+static void report(const char *name, uint64_t iterations, uint64_t ns,
+		   const struct op_stats *st)
+{
+	printf("{\"benchmark\": \"%s\", \"iterations\": %llu", name,
+	       (unsigned long long) iterations);
+	if (ns)
+		printf(", \"ns_per_op\": %.1f", (double) ns / iterations);
+	if (st)
+		printf(", \"min_ns\": %llu, \"max_ns\": %llu",
+		       (unsigned long long) st->min,
+		       (unsigned long long) st->max);
+	printf("}\n");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-m] [-T max_threads] [-w window] "
+		"[-t seconds] [-g generator | file]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct loop_args la = {
+		.config = {
+			.max_idle_threads = 10,
+			.max_threads = 10,
+		},
+	};
+	struct stream s = { 0 };
+	const char *gen = "mixed";
+	double duration = 1.0;
+	uint64_t start, end, sent = 0;
+	pthread_t loop_thread, collect_thread;
+	char mnt[32];
+	int sv[2];
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "mT:w:t:g:")) != -1) {
+		switch (opt) {
+		case 'm':
+			la.mt = 1;
+			break;
+		case 'T':
+			la.config.max_threads = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			if (window < 1 || window > RING_SIZE)
+				usage(argv[0]);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 'g':
+			gen = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc) {
+		if (load_stream(&s, argv[optind]) == -1)
+			return 1;
+	} else {
+		for (i = 0; i < sizeof(generators) / sizeof(generators[0]); i++)
+			if (strcmp(gen, generators[i].name) == 0)
+				generators[i].fn(&s);
+		if (s.count == 0)
+			usage(argv[0]);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+	sock = sv[0];
+
+	fuse_opt_add_arg(&args, argv[0]);
+	la.se = fuse_session_new(&args, &rp_ops, sizeof(rp_ops), NULL);
+	fuse_opt_free_args(&args);
+	if (la.se == NULL)
+		return 1;
+	snprintf(mnt, sizeof(mnt), "/dev/fd/%i", sv[1]);
+	if (fuse_session_mount(la.se, mnt) != 0)
+		return 1;
+
+	pthread_create(&loop_thread, NULL, run_loop, &la);
+	init_session();
+	pthread_create(&collect_thread, NULL, collect, NULL);
+
+	start = now_ns();
+	end = start + duration * 1e9;
+	do {
+		for (i = 0; i < s.count; i++)
+			send_req(&s.reqs[i]);
+		sent += s.count;
+	} while (now_ns() < end);
+
+	pthread_mutex_lock(&lock);
+	while (outstanding)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+	end = now_ns();
+
+	/*
+	 * EOF on the socket ends the loop once the session has exited,
+	 * and the collector as well.
+	 */
+	fuse_session_exit(la.se);
+	shutdown(sock, SHUT_RDWR);
+	pthread_join(loop_thread, NULL);
+	pthread_join(collect_thread, NULL);
+
+	for (i = 0; i < MAX_OPCODE; i++) {
+		char name[64];
+
+		if (stats[i].count == 0)
+			continue;
+		snprintf(name, sizeof(name), "replay_%s", opname(i));
+		if (no_reply(i))
+			report(name, stats[i].count, 0, NULL);
+		else
+			report(name, stats[i].count, stats[i].ns, &stats[i]);
+	}
+	report("replay_total", sent, end - start, NULL);
+
+	fuse_session_destroy(la.se);
+	close(sock);
+	for (i = 0; i < s.count; i++)
+		free(s.reqs[i].mem);
+	free(s.reqs);
+	return la.res ? 1 : 0;
+}
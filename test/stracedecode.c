@@ -117,9 +117,14 @@ static void process_buf(int dir, char *buf, int len)
 
 }
 
-int main(void)
+/*
+ * With -r, the requests are written to stdout as they were read from
+ * the device, for feeding to test/replay.
+ */
+int main(int argc, char *argv[])
 {
 	FILE *in = stdin;
+	int raw = argc > 1 && strcmp(argv[1], "-r") == 0;
 	while (1) {
 		int dir;
 		int res;
@@ -191,7 +196,10 @@ int main(void)
 			if (c == '\n')
 				break;
 		}
-		process_buf(dir, buf, len);
+		if (!raw)
+			process_buf(dir, buf, len);
+		else if (!dir)
+			fwrite(buf, 1, len, stdout);
 		memset(buf, 0, len);
 		len = 0;
 	}
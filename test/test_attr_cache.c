@@ -0,0 +1,211 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Checks that with -o attr_cache the link count of a file follows
+  link() and unlink() of its names, while the kernel caches the
+  entries and only asks for the attributes.
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 31
+
+#include "config.h"
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef __linux__
+#include <limits.h>
+#else
+#include <linux/limits.h>
+#endif
+
+#define FILE_INO 2
+#define MAX_NAMES 4
+
+/* The names of the only file, "a" to start with */
+static char names[MAX_NAMES][8] = { "a" };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int failed;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%i: %s failed\n", __func__,		\
+			__LINE__, #cond);				\
+		failed = 1;						\
+	}								\
+} while (0)
+
+/* Called with lock held */
+static int find_name(const char *path)
+{
+	int i;
+
+	for (i = 0; i < MAX_NAMES; i++) {
+		if (names[i][0] && strcmp(names[i], path + 1) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void *tfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void) conn;
+
+	cfg->use_ino = 1;
+	/* Only the library caches the attributes */
+	cfg->entry_timeout = 60;
+	cfg->attr_timeout = 0;
+	return NULL;
+}
+
+static int tfs_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	int i, res = 0;
+
+	(void) fi;
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_ino = 1;
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	if (find_name(path) == -1) {
+		res = -ENOENT;
+	} else {
+		stbuf->st_ino = FILE_INO;
+		stbuf->st_mode = S_IFREG | 0644;
+		for (i = 0; i < MAX_NAMES; i++)
+			stbuf->st_nlink += names[i][0] != '\0';
+	}
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+static int tfs_link(const char *from, const char *to)
+{
+	int i, res = -ENOSPC;
+
+	pthread_mutex_lock(&lock);
+	if (find_name(from) == -1) {
+		res = -ENOENT;
+	} else if (find_name(to) != -1) {
+		res = -EEXIST;
+	} else {
+		for (i = 0; i < MAX_NAMES; i++) {
+			if (!names[i][0]) {
+				snprintf(names[i], sizeof(names[i]), "%s",
+					 to + 1);
+				res = 0;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+static int tfs_unlink(const char *path)
+{
+	int i, res = -ENOENT;
+
+	pthread_mutex_lock(&lock);
+	i = find_name(path);
+	if (i != -1) {
+		names[i][0] = '\0';
+		res = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+static const struct fuse_operations tfs_oper = {
+	.init		= tfs_init,
+	.getattr	= tfs_getattr,
+	.link		= tfs_link,
+	.unlink		= tfs_unlink,
+};
+
+static void *run_loop(void *data)
+{
+	fuse_loop(data);
+	return NULL;
+}
+
+static nlink_t nlink_of(const char *dir, const char *name)
+{
+	char path[PATH_MAX + 8];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (stat(path, &st) == -1) {
+		perror(path);
+		return 0;
+	}
+	return st.st_nlink;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	char from[PATH_MAX + 8], to[PATH_MAX + 8];
+	const char *mnt;
+	struct fuse *fuse;
+	pthread_t thread;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <mountpoint>\n", argv[0]);
+		return 1;
+	}
+	mnt = argv[1];
+
+	fuse_opt_add_arg(&args, argv[0]);
+	fuse_opt_add_arg(&args, "-oattr_cache=60");
+	fuse = fuse_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+	fuse_opt_free_args(&args);
+	if (fuse == NULL || fuse_mount(fuse, mnt) != 0) {
+		fprintf(stderr, "failed to mount %s\n", mnt);
+		return 1;
+	}
+	if (pthread_create(&thread, NULL, run_loop, fuse) != 0) {
+		fprintf(stderr, "pthread_create failed\n");
+		return 1;
+	}
+
+	check(nlink_of(mnt, "a") == 1);
+
+	/* The source of the link is cached with one link */
+	snprintf(from, sizeof(from), "%s/a", mnt);
+	snprintf(to, sizeof(to), "%s/b", mnt);
+	check(link(from, to) == 0);
+	check(nlink_of(mnt, "a") == 2);
+	check(nlink_of(mnt, "b") == 2);
+
+	/* The other name is cached with two */
+	check(unlink(to) == 0);
+	check(nlink_of(mnt, "a") == 1);
+
+	fuse_exit(fuse);
+	fuse_unmount(fuse);
+	pthread_join(thread, NULL);
+	fuse_destroy(fuse);
+
+	if (failed) {
+		fprintf(stderr, "test_attr_cache: FAILED\n");
+		return 1;
+	}
+	printf("test_attr_cache: PASSED\n");
+	return 0;
+}
@@ -0,0 +1,252 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Checks fuse_buf_copy() and fuse_buf_copy_fanout() with memory,
+  file and pipe buffers. Does not mount anything.
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 35
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DATA_SIZE (256 * 1024 + 123)
+#define NDST 3
+
+static char data[DATA_SIZE];
+static int failed;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%i: %s failed\n", __func__,		\
+			__LINE__, #cond);				\
+		failed = 1;						\
+	}								\
+} while (0)
+
+static int tmpfile_fd(void)
+{
+	char name[] = "/tmp/test_buf_copy.XXXXXX";
+	int fd = mkstemp(name);
+
+	if (fd == -1) {
+		perror("mkstemp");
+		exit(1);
+	}
+	unlink(name);
+	return fd;
+}
+
+static void check_fd(int fd, off_t pos, size_t len)
+{
+	char *buf = malloc(len);
+
+	check(buf != NULL && pread(fd, buf, len, pos) == (ssize_t) len &&
+	      memcmp(buf, data, len) == 0);
+	free(buf);
+}
+
+/* A pipe that can take all of the test data */
+static void big_pipe(int pipefd[2])
+{
+	if (pipe(pipefd) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	if (fcntl(pipefd[1], F_SETPIPE_SZ, 2 * DATA_SIZE) == -1) {
+		perror("growing pipe");
+		exit(1);
+	}
+}
+
+/* A pipe holding the test data, read by the caller */
+static int filled_pipe(void)
+{
+	int pipefd[2];
+	size_t done = 0;
+
+	big_pipe(pipefd);
+	while (done < DATA_SIZE) {
+		ssize_t res = write(pipefd[1], data + done, DATA_SIZE - done);
+
+		if (res <= 0) {
+			perror("writing pipe");
+			exit(1);
+		}
+		done += res;
+	}
+	close(pipefd[1]);
+	return pipefd[0];
+}
+
+static struct fuse_bufvec fd_buf(int fd, off_t pos)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(DATA_SIZE);
+
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+	if (pos >= 0) {
+		buf.buf[0].flags |= FUSE_BUF_FD_SEEK;
+		buf.buf[0].pos = pos;
+	}
+	buf.buf[0].fd = fd;
+	return buf;
+}
+
+/* Memory split into uneven pieces is gathered into a single write */
+static void test_gather(void)
+{
+	struct fuse_bufvec *src;
+	struct fuse_bufvec dst;
+	size_t sizes[] = { 1, 4095, 70000, DATA_SIZE - 74096 };
+	size_t i, off = 0;
+	int fd = tmpfile_fd();
+
+	src = malloc(sizeof(*src) + 3 * sizeof(struct fuse_buf));
+	*src = FUSE_BUFVEC_INIT(0);
+	src->count = 4;
+	for (i = 0; i < 4; i++) {
+		src->buf[i] = src->buf[0];
+		src->buf[i].mem = data + off;
+		src->buf[i].size = sizes[i];
+		off += sizes[i];
+	}
+	dst = fd_buf(fd, 10);
+
+	check(fuse_buf_copy(&dst, src, 0) == DATA_SIZE);
+	check(src->idx == src->count);
+	check_fd(fd, 10, DATA_SIZE);
+	free(src);
+	close(fd);
+}
+
+/* Copies between file descriptors without splice */
+static void test_fd_to_fd(void)
+{
+	int src = tmpfile_fd();
+	int dst = tmpfile_fd();
+	struct fuse_bufvec srcv = fd_buf(src, 0);
+	struct fuse_bufvec dstv = fd_buf(dst, 100);
+	char *buf = malloc(DATA_SIZE);
+	int pipefd[2];
+
+	check(pwrite(src, data, DATA_SIZE, 0) == DATA_SIZE);
+
+	/* File to file */
+	check(fuse_buf_copy(&dstv, &srcv, FUSE_BUF_NO_SPLICE) == DATA_SIZE);
+	check_fd(dst, 100, DATA_SIZE);
+
+	/* File to pipe */
+	big_pipe(pipefd);
+	srcv = fd_buf(src, 0);
+	dstv = fd_buf(pipefd[1], -1);
+	check(fuse_buf_copy(&dstv, &srcv, FUSE_BUF_NO_SPLICE) == DATA_SIZE);
+	close(pipefd[1]);
+	check(buf != NULL && read(pipefd[0], buf, DATA_SIZE) == DATA_SIZE &&
+	      memcmp(buf, data, DATA_SIZE) == 0);
+	close(pipefd[0]);
+
+	/* Pipe to file, through memory */
+	srcv = fd_buf(filled_pipe(), -1);
+	dstv = fd_buf(dst, 0);
+	check(fuse_buf_copy(&dstv, &srcv, FUSE_BUF_NO_SPLICE) == DATA_SIZE);
+	check_fd(dst, 0, DATA_SIZE);
+	close(srcv.buf[0].fd);
+
+	free(buf);
+	close(src);
+	close(dst);
+}
+
+static void test_fanout(int src_is_pipe, int mem_dst,
+			enum fuse_buf_copy_flags flags)
+{
+	struct fuse_bufvec src;
+	struct fuse_bufvec dstbuf[NDST];
+	struct fuse_bufvec *dst[NDST];
+	char *mem = malloc(DATA_SIZE);
+	int fds[NDST];
+	int srcfd = -1;
+	int i;
+
+	if (src_is_pipe) {
+		srcfd = filled_pipe();
+		src = fd_buf(srcfd, -1);
+	} else {
+		src = FUSE_BUFVEC_INIT(DATA_SIZE);
+		src.buf[0].mem = data;
+	}
+
+	for (i = 0; i < NDST; i++) {
+		fds[i] = tmpfile_fd();
+		/* One seeking and one streaming destination */
+		dstbuf[i] = fd_buf(fds[i], i == 0 ? 4096 : -1);
+		dst[i] = &dstbuf[i];
+	}
+	if (mem_dst) {
+		dstbuf[NDST - 1] = FUSE_BUFVEC_INIT(DATA_SIZE);
+		dstbuf[NDST - 1].buf[0].mem = mem;
+	}
+
+	check(fuse_buf_copy_fanout(dst, NDST, &src, flags) == DATA_SIZE);
+	check(fuse_buf_copy_fanout(dst, NDST, &src, flags) == 0);
+	check_fd(fds[0], 4096, DATA_SIZE);
+	check_fd(fds[1], 0, DATA_SIZE);
+	if (mem_dst)
+		check(memcmp(mem, data, DATA_SIZE) == 0);
+	else
+		check_fd(fds[2], 0, DATA_SIZE);
+
+	/* A seekable source can be copied from directly each time */
+	if (!src_is_pipe) {
+		struct fuse_bufvec fsrc = fd_buf(fds[1], 0);
+		int fd = tmpfile_fd();
+		struct fuse_bufvec fdst[2] = { fd_buf(fd, 0), fd_buf(fd, 0) };
+		struct fuse_bufvec *fdstp[2] = { &fdst[0], &fdst[1] };
+
+		fdst[1].buf[0].pos = DATA_SIZE;
+		check(fuse_buf_copy_fanout(fdstp, 2, &fsrc, flags) ==
+		      DATA_SIZE);
+		check_fd(fd, 0, DATA_SIZE);
+		check_fd(fd, DATA_SIZE, DATA_SIZE);
+		close(fd);
+	}
+
+	for (i = 0; i < NDST; i++)
+		close(fds[i]);
+	if (srcfd != -1)
+		close(srcfd);
+	free(mem);
+}
+
+int main(void)
+{
+	size_t i;
+
+	for (i = 0; i < DATA_SIZE; i++)
+		data[i] = random();
+
+	test_gather();
+	test_fd_to_fd();
+	test_fanout(0, 0, 0);
+	test_fanout(0, 1, 0);
+	test_fanout(1, 0, 0);
+	test_fanout(1, 0, FUSE_BUF_NO_SPLICE);
+	test_fanout(1, 1, 0);
+
+	if (failed) {
+		fprintf(stderr, "test_buf_copy: FAILED\n");
+		return 1;
+	}
+	printf("test_buf_copy: PASSED\n");
+	return 0;
+}
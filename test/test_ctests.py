@@ -36,6 +36,55 @@ def test_write_cache(tmpdir, writeback, output_checker):
     subprocess.check_call(cmdline, stdout=output_checker.fd, stderr=output_checker.fd)
 
 
+def test_buf_copy(output_checker):
+    cmdline = [ pjoin(basename, 'test', 'test_buf_copy') ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd,
+                          stderr=output_checker.fd)
+
+
+def test_dax(output_checker):
+    cmdline = [ pjoin(basename, 'test', 'test_dax') ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd,
+                          stderr=output_checker.fd)
+
+
+def test_log(output_checker):
+    cmdline = [ pjoin(basename, 'test', 'test_log') ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd,
+                          stderr=output_checker.fd)
+
+
+def test_direntry(output_checker):
+    cmdline = [ pjoin(basename, 'test', 'test_direntry') ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd,
+                          stderr=output_checker.fd)
+
+
+def test_custom_io(output_checker):
+    cmdline = [ pjoin(basename, 'test', 'test_custom_io') ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd,
+                          stderr=output_checker.fd)
+
+
+def test_handoff(tmpdir, output_checker):
+    mnt_dir = str(tmpdir)
+    cmdline = [ pjoin(basename, 'test', 'test_handoff'), mnt_dir ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd,
+                          stderr=output_checker.fd)
+
+
+def test_multi_loop(tmpdir, output_checker):
+    cmdline = [ pjoin(basename, 'test', 'test_multi_loop'), str(tmpdir) ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd,
+                          stderr=output_checker.fd)
+
+
+def test_attr_cache(tmpdir, output_checker):
+    cmdline = [ pjoin(basename, 'test', 'test_attr_cache'), str(tmpdir) ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd,
+                          stderr=output_checker.fd)
+
+
 names = [ 'notify_inval_inode', 'invalidate_path' ]
 if fuse_proto >= (7,15):
     names.append('notify_store_retrieve')
@@ -70,6 +119,30 @@ def test_notify1(tmpdir, name, notify, output_checker):
     else:
         umount(mount_process, mnt_dir)
 
+@pytest.mark.skipif(fuse_proto < (7,15),
+                    reason='not supported by running kernel')
+def test_notify_store_fd(tmpdir, output_checker):
+    mnt_dir = str(tmpdir)
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'notify_store_retrieve'),
+                '-f', '--update-interval=1', '--store-fd', mnt_dir ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        filename = pjoin(mnt_dir, 'current_time')
+        with open(filename, 'r') as fh:
+            read1 = fh.read()
+        safe_sleep(2)
+        with open(filename, 'r') as fh:
+            read2 = fh.read()
+        assert read1 != read2
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
 @pytest.mark.skipif(fuse_proto < (7,12),
                     reason='not supported by running kernel')
 @pytest.mark.parametrize("notify", (True, False))
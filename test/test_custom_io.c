@@ -0,0 +1,386 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Runs a session on a custom transport, a SOCK_SEQPACKET socketpair,
+  and talks to it like the kernel would. With receive_buf(), checks
+  that requests are processed in the transport's memory and that all
+  of it is given back. With -o align_write, checks that the data of
+  WRITE requests is page aligned. Does not mount anything.
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 35
+
+#include "config.h"
+#include <fuse_lowlevel.h>
+#include <fuse_kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define FILE_INO 2
+#define FILE_NAME "data"
+#define DATA_SIZE (64 * 1024)
+/* Larger than any request sent here */
+#define MSG_MAX (DATA_SIZE + 4096)
+
+static char file_data[DATA_SIZE];
+static int failed;
+static int zero_copy;
+static int align_write;
+static int lent;
+static int lends;
+/* The last request received by this thread without copying */
+static __thread char *last_lent;
+
+static uint64_t unique;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%i: %s failed\n", __func__,		\
+			__LINE__, #cond);				\
+		failed = 1;						\
+	}								\
+} while (0)
+
+/*
+ * The transport
+ */
+
+static ssize_t tr_writev(int fd, struct iovec *iov, int count,
+			 void *userdata)
+{
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = count,
+	};
+
+	(void) userdata;
+	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+static ssize_t tr_read(int fd, void *buf, size_t buf_len, void *userdata)
+{
+	(void) userdata;
+	return recv(fd, buf, buf_len, 0);
+}
+
+static ssize_t tr_receive_buf(int fd, struct fuse_buf *buf, void *userdata)
+{
+	char *mem = malloc(MSG_MAX);
+	ssize_t res;
+
+	(void) userdata;
+	if (mem == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	/* The multi-threaded loop cancels workers waiting here */
+	pthread_cleanup_push(free, mem);
+	res = recv(fd, mem, MSG_MAX, 0);
+	pthread_cleanup_pop(0);
+	if (res <= 0) {
+		int err = errno;
+
+		free(mem);
+		errno = err;
+		return res;
+	}
+	buf->mem = mem;
+	buf->size = res;
+	last_lent = mem;
+	__atomic_add_fetch(&lent, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&lends, 1, __ATOMIC_SEQ_CST);
+	return res;
+}
+
+static void tr_release_buf(int fd, struct fuse_buf *buf, void *userdata)
+{
+	(void) fd;
+	(void) userdata;
+	free(buf->mem);
+	__atomic_sub_fetch(&lent, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The file system
+ */
+
+static void tfs_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = ino;
+	stbuf->st_nlink = 1;
+	if (ino == FUSE_ROOT_ID) {
+		stbuf->st_mode = S_IFDIR | 0755;
+	} else {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_size = DATA_SIZE;
+	}
+}
+
+static void tfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+
+	if (parent != FUSE_ROOT_ID || strcmp(name, FILE_NAME) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	memset(&e, 0, sizeof(e));
+	e.ino = FILE_INO;
+	tfs_stat(e.ino, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+static void tfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		      size_t size, off_t off, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	/* The data was not copied out of the transport's buffer */
+	if (zero_copy)
+		check(buf > last_lent && buf < last_lent + MSG_MAX);
+	if (align_write)
+		check(((uintptr_t) buf & (getpagesize() - 1)) == 0);
+	if (ino != FILE_INO || off < 0 || off + size > DATA_SIZE) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	memcpy(file_data + off, buf, size);
+	fuse_reply_write(req, size);
+}
+
+static void tfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		     off_t off, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	if (ino != FILE_INO || off >= DATA_SIZE) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if (size > DATA_SIZE - off)
+		size = DATA_SIZE - off;
+	fuse_reply_buf(req, file_data + off, size);
+}
+
+static const struct fuse_lowlevel_ops tfs_oper = {
+	.lookup		= tfs_lookup,
+	.write		= tfs_write,
+	.read		= tfs_read,
+};
+
+/*
+ * The kernel side
+ */
+
+/* Sends a request and returns the size of the reply's payload */
+static ssize_t request(int sock, uint32_t opcode, uint64_t nodeid,
+		       const void *arg, size_t argsize,
+		       const void *data, size_t datasize,
+		       void *reply, size_t replysize, int *error)
+{
+	static char buf[MSG_MAX];
+	struct fuse_in_header in = {
+		.len = sizeof(in) + argsize + datasize,
+		.opcode = opcode,
+		.unique = ++unique,
+		.nodeid = nodeid,
+	};
+	struct fuse_out_header *out = (struct fuse_out_header *) buf;
+	struct iovec iov[3] = {
+		{ .iov_base = &in, .iov_len = sizeof(in) },
+		{ .iov_base = (void *) arg, .iov_len = argsize },
+		{ .iov_base = (void *) data, .iov_len = datasize },
+	};
+	ssize_t res;
+
+	res = tr_writev(sock, iov, 3, NULL);
+	if (res != (ssize_t) in.len) {
+		perror("sending request");
+		return -1;
+	}
+	res = recv(sock, buf, sizeof(buf), 0);
+	if (res < (ssize_t) sizeof(*out) || out->len != res ||
+	    out->unique != in.unique) {
+		fprintf(stderr, "bad reply to opcode %u\n", opcode);
+		return -1;
+	}
+	*error = out->error;
+	res -= sizeof(*out);
+	if (res > (ssize_t) replysize)
+		res = replysize;
+	memcpy(reply, out + 1, res);
+	return res;
+}
+
+static void talk(int sock)
+{
+	struct fuse_init_in init_in = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+		.max_readahead = DATA_SIZE,
+		.flags = FUSE_BIG_WRITES,
+	};
+	struct fuse_init_out init_out;
+	struct fuse_entry_out entry;
+	struct fuse_write_in write_in = { .size = DATA_SIZE };
+	struct fuse_write_out write_out;
+	struct fuse_read_in read_in = { .size = DATA_SIZE };
+	static char data[DATA_SIZE];
+	static char back[DATA_SIZE];
+	ssize_t res;
+	int error;
+	int i;
+
+	res = request(sock, FUSE_INIT, 0, &init_in, sizeof(init_in),
+		      NULL, 0, &init_out, sizeof(init_out), &error);
+	check(res == sizeof(init_out) && error == 0);
+	check(init_out.major == FUSE_KERNEL_VERSION);
+	check(init_out.max_write >= DATA_SIZE);
+
+	res = request(sock, FUSE_LOOKUP, FUSE_ROOT_ID, FILE_NAME,
+		      sizeof(FILE_NAME), NULL, 0, &entry, sizeof(entry),
+		      &error);
+	check(res == sizeof(entry) && error == 0);
+	check(entry.nodeid == FILE_INO);
+
+	res = request(sock, FUSE_LOOKUP, FUSE_ROOT_ID, "missing",
+		      sizeof("missing"), NULL, 0, &entry, sizeof(entry),
+		      &error);
+	check(res == 0 && error == -ENOENT);
+
+	for (i = 0; i < DATA_SIZE; i++)
+		data[i] = i * 7 + unique;
+	res = request(sock, FUSE_WRITE, FILE_INO, &write_in, sizeof(write_in),
+		      data, DATA_SIZE, &write_out, sizeof(write_out), &error);
+	check(res == sizeof(write_out) && error == 0);
+	check(write_out.size == DATA_SIZE);
+
+	res = request(sock, FUSE_READ, FILE_INO, &read_in, sizeof(read_in),
+		      NULL, 0, back, sizeof(back), &error);
+	check(res == DATA_SIZE && error == 0);
+	check(memcmp(data, back, DATA_SIZE) == 0);
+}
+
+static struct fuse_session *new_session(int aw)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_session *se;
+
+	fuse_opt_add_arg(&args, "test_custom_io");
+	if (aw)
+		fuse_opt_add_arg(&args, "-oalign_write");
+	se = fuse_session_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+	fuse_opt_free_args(&args);
+	if (se == NULL) {
+		fprintf(stderr, "fuse_session_new failed\n");
+		exit(1);
+	}
+	return se;
+}
+
+struct loop_args {
+	struct fuse_session *se;
+	int mt;
+	int res;
+};
+
+static void *run_loop(void *data)
+{
+	struct loop_args *la = data;
+	struct fuse_loop_config config;
+
+	if (la->mt) {
+		memset(&config, 0, sizeof(config));
+		config.max_idle_threads = 10;
+		la->res = fuse_session_loop_mt(la->se, &config);
+	} else {
+		la->res = fuse_session_loop(la->se);
+	}
+	return NULL;
+}
+
+static void run(int mt, int zc, int aw)
+{
+	struct fuse_custom_io io = {
+		.writev = tr_writev,
+		.read = tr_read,
+	};
+	struct loop_args la = { .mt = mt };
+	pthread_t thread;
+	int sv[2];
+
+	zero_copy = zc;
+	align_write = aw;
+	if (zc) {
+		io.receive_buf = tr_receive_buf;
+		io.release_buf = tr_release_buf;
+	}
+	lends = 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+	la.se = new_session(aw);
+	check(fuse_session_custom_io(la.se, &io, sizeof(io), sv[1]) == 0);
+	/* Only once */
+	check(fuse_session_custom_io(la.se, &io, sizeof(io), sv[1]) ==
+	      -EINVAL);
+
+	if (pthread_create(&thread, NULL, run_loop, &la) != 0) {
+		fprintf(stderr, "pthread_create failed\n");
+		exit(1);
+	}
+	talk(sv[0]);
+
+	/* Closing the transport ends the session */
+	close(sv[0]);
+	pthread_join(thread, NULL);
+	check(la.res == 0);
+	fuse_session_destroy(la.se);
+
+	if (zc)
+		check(lends >= 5);
+	check(__atomic_load_n(&lent, __ATOMIC_SEQ_CST) == 0);
+	if (failed)
+		fprintf(stderr, "failed with %s loop%s%s\n",
+			mt ? "multi-threaded" : "single-threaded",
+			zc ? " and receive_buf()" : "",
+			aw ? " and align_write" : "");
+}
+
+int main(void)
+{
+	struct fuse_custom_io io = { .writev = tr_writev };
+	struct fuse_session *se;
+
+	/* read() is required */
+	se = new_session(0);
+	check(fuse_session_custom_io(se, &io, sizeof(io), 0) == -EINVAL);
+	fuse_session_destroy(se);
+
+	run(0, 0, 0);
+	run(0, 1, 0);
+	run(1, 0, 0);
+	run(1, 1, 0);
+	run(0, 0, 1);
+	run(1, 0, 1);
+
+	if (failed) {
+		fprintf(stderr, "test_custom_io: FAILED\n");
+		return 1;
+	}
+	printf("test_custom_io: PASSED\n");
+	return 0;
+}
@@ -0,0 +1,324 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Checks the negotiation of the DAX related INIT flags and the
+  setupmapping, removemapping and syncfs requests. The session is
+  "mounted" on one end of a SOCK_SEQPACKET socketpair and the test
+  plays the kernel on the other end, so nothing is mounted.
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 35
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <fuse_lowlevel.h>
+#include <fuse_kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define MAP_ALIGNMENT 12
+
+static int failed;
+static int sock;
+static uint64_t unique;
+
+/* What the operations were called with */
+static struct {
+	fuse_ino_t ino;
+	uint64_t foffset, len, moffset, flags, fh;
+	struct fuse_dax_range ranges[3];
+	size_t count;
+	int syncfs;
+} got;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%i: %s failed\n", __func__,		\
+			__LINE__, #cond);				\
+		failed = 1;						\
+	}								\
+} while (0)
+
+static void dax_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	conn->want |= conn->capable &
+		(FUSE_CAP_MAP_ALIGNMENT | FUSE_CAP_DAX_INODE);
+	conn->map_alignment = MAP_ALIGNMENT;
+}
+
+static void dax_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+
+	(void) parent;
+	(void) name;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = 2;
+	e.attr.st_ino = 2;
+	e.attr.st_mode = S_IFREG | 0644;
+	e.attr_flags = FUSE_ENTRY_ATTR_DAX;
+	fuse_reply_entry(req, &e);
+}
+
+static void dax_getattr(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+
+	(void) fi;
+
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_ino = ino;
+	stbuf.st_mode = S_IFREG | 0644;
+	fuse_reply_attr_flags(req, &stbuf, 1.0, FUSE_ENTRY_ATTR_DAX);
+}
+
+static void dax_setupmapping(fuse_req_t req, fuse_ino_t ino, uint64_t foffset,
+			     uint64_t len, uint64_t moffset, uint64_t flags,
+			     struct fuse_file_info *fi)
+{
+	got.ino = ino;
+	got.foffset = foffset;
+	got.len = len;
+	got.moffset = moffset;
+	got.flags = flags;
+	got.fh = fi->fh;
+	fuse_reply_err(req, 0);
+}
+
+static void dax_removemapping(fuse_req_t req, fuse_ino_t ino,
+			      const struct fuse_dax_range *ranges,
+			      size_t count)
+{
+	got.ino = ino;
+	got.count = count;
+	if (count <= 3)
+		memcpy(got.ranges, ranges, count * sizeof(ranges[0]));
+	fuse_reply_err(req, 0);
+}
+
+static void dax_syncfs(fuse_req_t req, fuse_ino_t ino)
+{
+	got.ino = ino;
+	got.syncfs = 1;
+	fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops dax_ops = {
+	.init		= dax_init,
+	.lookup		= dax_lookup,
+	.getattr	= dax_getattr,
+	.setupmapping	= dax_setupmapping,
+	.removemapping	= dax_removemapping,
+	.syncfs		= dax_syncfs,
+};
+
+static void *run_loop(void *data)
+{
+	fuse_session_loop(data);
+	return NULL;
+}
+
+/* Sends a request and returns the length of the reply read into out */
+static ssize_t request(uint32_t opcode, uint64_t nodeid, const void *arg,
+		       size_t argsize, void *out, size_t outsize)
+{
+	char buf[4096];
+	struct fuse_in_header *in = (struct fuse_in_header *) buf;
+	ssize_t res;
+
+	memset(in, 0, sizeof(*in));
+	in->len = sizeof(*in) + argsize;
+	in->opcode = opcode;
+	in->unique = ++unique;
+	in->nodeid = nodeid;
+	memcpy(buf + sizeof(*in), arg, argsize);
+
+	if (write(sock, buf, in->len) != (ssize_t) in->len) {
+		perror("writing request");
+		exit(1);
+	}
+	res = read(sock, out, outsize);
+	if (res < (ssize_t) sizeof(struct fuse_out_header)) {
+		perror("reading reply");
+		exit(1);
+	}
+	return res;
+}
+
+static struct fuse_session *start(int *sv, pthread_t *thread)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_session *se;
+	char mnt[32];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+	sock = sv[0];
+
+	fuse_opt_add_arg(&args, "test_dax");
+	se = fuse_session_new(&args, &dax_ops, sizeof(dax_ops), NULL);
+	fuse_opt_free_args(&args);
+	if (se == NULL)
+		exit(1);
+	snprintf(mnt, sizeof(mnt), "/dev/fd/%i", sv[1]);
+	if (fuse_session_mount(se, mnt) != 0)
+		exit(1);
+
+	pthread_create(thread, NULL, run_loop, se);
+	return se;
+}
+
+static void stop(struct fuse_session *se, int *sv, pthread_t thread)
+{
+	fuse_session_exit(se);
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(thread, NULL);
+	fuse_session_unmount(se);
+	fuse_session_destroy(se);
+	close(sv[0]);
+}
+
+static void send_init(uint32_t minor, uint64_t flags,
+		      struct fuse_init_out *outarg)
+{
+	struct fuse_init_in arg = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = minor,
+		.max_readahead = 65536,
+		.flags = flags,
+		.flags2 = flags >> 32,
+	};
+	char buf[4096];
+	struct fuse_out_header *out = (struct fuse_out_header *) buf;
+	/* Kernels before 7.36 only send the first four fields */
+	size_t size = flags & FUSE_INIT_EXT ? sizeof(arg) :
+		offsetof(struct fuse_init_in, flags2);
+
+	request(FUSE_INIT, 0, &arg, size, buf, sizeof(buf));
+	check(out->error == 0);
+	memcpy(outarg, out + 1, sizeof(*outarg));
+}
+
+static void test_dax(void)
+{
+	struct fuse_init_out init;
+	struct fuse_setupmapping_in sm = {
+		.fh = 42,
+		.foffset = 1 << 21,
+		.len = 1 << 21,
+		.flags = FUSE_SETUPMAPPING_FLAG_READ |
+			 FUSE_SETUPMAPPING_FLAG_WRITE,
+		.moffset = 3 << 21,
+	};
+	/* count, then the ranges unaligned, as sent by the kernel */
+	char rm[sizeof(struct fuse_removemapping_in) +
+		3 * sizeof(struct fuse_removemapping_one)];
+	struct fuse_removemapping_in rmin = { .count = 3 };
+	struct fuse_removemapping_one one[3] = {
+		{ 0, 1 << 21 }, { 5 << 21, 1 << 21 }, { 7 << 21, 2 << 21 },
+	};
+	struct fuse_syncfs_in sf = { 0 };
+	struct fuse_getattr_in ga = { 0 };
+	char buf[4096];
+	struct fuse_out_header *out = (struct fuse_out_header *) buf;
+	struct fuse_entry_out *entry = (struct fuse_entry_out *) (out + 1);
+	struct fuse_attr_out *attr = (struct fuse_attr_out *) (out + 1);
+	struct fuse_session *se;
+	pthread_t thread;
+	int sv[2];
+
+	se = start(sv, &thread);
+	send_init(FUSE_KERNEL_MINOR_VERSION, FUSE_INIT_EXT |
+		  FUSE_MAP_ALIGNMENT | FUSE_HAS_INODE_DAX, &init);
+	check(init.flags & FUSE_INIT_EXT);
+	check(init.flags & FUSE_MAP_ALIGNMENT);
+	check(init.map_alignment == MAP_ALIGNMENT);
+	check(init.flags2 == FUSE_HAS_INODE_DAX >> 32);
+
+	request(FUSE_SETUPMAPPING, 2, &sm, sizeof(sm), buf, sizeof(buf));
+	check(out->error == 0);
+	check(got.ino == 2 && got.fh == 42);
+	check(got.foffset == sm.foffset && got.len == sm.len);
+	check(got.moffset == sm.moffset);
+	check(got.flags == (FUSE_DAX_MAP_READ | FUSE_DAX_MAP_WRITE));
+
+	memcpy(rm, &rmin, sizeof(rmin));
+	memcpy(rm + sizeof(rmin), one, sizeof(one));
+	request(FUSE_REMOVEMAPPING, 2, rm, sizeof(rm), buf, sizeof(buf));
+	check(out->error == 0);
+	check(got.count == 3);
+	check(got.ranges[1].moffset == one[1].moffset);
+	check(got.ranges[2].len == one[2].len);
+
+	/* More ranges counted than sent */
+	got.count = 0;
+	rmin.count = 1000;
+	memcpy(rm, &rmin, sizeof(rmin));
+	request(FUSE_REMOVEMAPPING, 2, rm, sizeof(rm), buf, sizeof(buf));
+	check(out->error == -EINVAL);
+	check(got.count == 0);
+
+	request(FUSE_SYNCFS, FUSE_ROOT_ID, &sf, sizeof(sf), buf, sizeof(buf));
+	check(out->error == 0);
+	check(got.syncfs && got.ino == FUSE_ROOT_ID);
+
+	request(FUSE_LOOKUP, FUSE_ROOT_ID, "f", 2, buf, sizeof(buf));
+	check(out->error == 0);
+	check(entry->attr.flags == FUSE_ATTR_DAX);
+
+	request(FUSE_GETATTR, 2, &ga, sizeof(ga), buf, sizeof(buf));
+	check(out->error == 0);
+	check(attr->attr.flags == FUSE_ATTR_DAX);
+	stop(se, sv, thread);
+}
+
+/* A kernel without DAX neither gets the flags nor the attribute */
+static void test_no_dax(void)
+{
+	struct fuse_init_out init;
+	char buf[4096];
+	struct fuse_out_header *out = (struct fuse_out_header *) buf;
+	struct fuse_entry_out *entry = (struct fuse_entry_out *) (out + 1);
+	struct fuse_session *se;
+	pthread_t thread;
+	int sv[2];
+
+	se = start(sv, &thread);
+	send_init(31, FUSE_ASYNC_READ, &init);
+	check(!(init.flags & (FUSE_INIT_EXT | FUSE_MAP_ALIGNMENT)));
+	check(init.flags2 == 0 && init.map_alignment == 0);
+
+	request(FUSE_LOOKUP, FUSE_ROOT_ID, "f", 2, buf, sizeof(buf));
+	check(out->error == 0);
+	check(entry->attr.flags == 0);
+	stop(se, sv, thread);
+}
+
+int main(void)
+{
+	test_dax();
+	test_no_dax();
+
+	if (failed) {
+		fprintf(stderr, "test_dax: FAILED\n");
+		return 1;
+	}
+	printf("test_dax: PASSED\n");
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Checks that fuse_add_direntries() and fuse_add_direntries_plus()
+  pack entries exactly like fuse_add_direntry() and
+  fuse_add_direntry_plus(). Does not mount anything.
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 35
+
+#include "config.h"
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define NENTS 1000
+#define BUFSIZE (128 * 1024)
+
+static struct fuse_direntry ents[NENTS];
+static struct fuse_entry_param params[NENTS];
+static char names[NENTS][64];
+static int failed;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%i: %s failed\n", __func__,		\
+			__LINE__, #cond);				\
+		failed = 1;						\
+	}								\
+} while (0)
+
+static void make_entries(void)
+{
+	static const mode_t types[] = { S_IFREG, S_IFDIR, S_IFLNK, S_IFIFO };
+	int i, j, len;
+
+	for (i = 0; i < NENTS; i++) {
+		/* All name lengths modulo the alignment */
+		len = 1 + random() % 40;
+		for (j = 0; j < len; j++)
+			names[i][j] = 'a' + random() % 26;
+		names[i][len] = '\0';
+
+		ents[i].name = names[i];
+		/* Every other one has its length computed */
+		ents[i].namelen = i % 2 ? len : 0;
+		ents[i].ino = 1000 + i;
+		ents[i].mode = types[i % 4] | 0644;
+		ents[i].off = i + 1;
+
+		params[i].ino = 5000 + i;
+		params[i].generation = i;
+		params[i].attr.st_ino = ents[i].ino;
+		params[i].attr.st_mode = ents[i].mode;
+		params[i].attr.st_size = random();
+		params[i].attr.st_nlink = 1;
+		/* Runs of equal timeouts */
+		params[i].entry_timeout = (i / 100) * 0.5;
+		params[i].attr_timeout = i < 500 ? 1.0 : 2.25;
+	}
+}
+
+static void test_plain(size_t bufsize)
+{
+	char *one = calloc(1, bufsize);
+	char *many = malloc(bufsize);
+	size_t len = 0, used, total, n;
+	int i;
+
+	/* Garbage must not end up in the padding */
+	memset(many, 0x5a, bufsize);
+
+	for (i = 0; i < NENTS; i++) {
+		struct stat st;
+		size_t res;
+
+		memset(&st, 0, sizeof(st));
+		st.st_ino = ents[i].ino;
+		st.st_mode = ents[i].mode;
+		res = fuse_add_direntry(NULL, one + len, bufsize - len,
+					names[i], &st, ents[i].off);
+		if (res > bufsize - len)
+			break;
+		len += res;
+	}
+
+	n = fuse_add_direntries(NULL, many, bufsize, ents, NENTS, &used);
+	check(n == (size_t) i);
+	check(used == len);
+	check(memcmp(one, many, len) == 0);
+
+	n = fuse_add_direntries(NULL, NULL, 0, ents, NENTS, &total);
+	check(n == NENTS);
+	check(total >= used);
+
+	free(one);
+	free(many);
+}
+
+static void test_plus(size_t bufsize)
+{
+	char *one = calloc(1, bufsize);
+	char *many = malloc(bufsize);
+	size_t len = 0, used, n;
+	int i;
+
+	memset(many, 0x5a, bufsize);
+
+	for (i = 0; i < NENTS; i++) {
+		size_t res;
+
+		res = fuse_add_direntry_plus(NULL, one + len, bufsize - len,
+					     names[i], &params[i],
+					     ents[i].off);
+		if (res > bufsize - len)
+			break;
+		len += res;
+	}
+
+	n = fuse_add_direntries_plus(NULL, many, bufsize, ents, params,
+				     NENTS, &used);
+	check(n == (size_t) i);
+	check(used == len);
+	check(memcmp(one, many, len) == 0);
+
+	free(one);
+	free(many);
+}
+
+int main(void)
+{
+	make_entries();
+
+	/* Entries are cut off at the end of both buffers */
+	test_plain(BUFSIZE);
+	test_plain(4096 + 13);
+	test_plus(BUFSIZE);
+	test_plus(4096 + 13);
+
+	if (failed) {
+		fprintf(stderr, "test_direntry: FAILED\n");
+		return 1;
+	}
+	printf("test_direntry: PASSED\n");
+	return 0;
+}
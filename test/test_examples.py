@@ -18,6 +18,9 @@ import time
 import errno
 import sys
 import platform
+import ctypes
+import threading
+import inspect
 from distutils.version import LooseVersion
 from tempfile import NamedTemporaryFile
 from contextlib import contextmanager
@@ -33,6 +36,17 @@ TEST_FILE = __file__
 with open(TEST_FILE, 'rb') as fh:
     TEST_DATA = fh.read()
 
+FALLOC_FL_KEEP_SIZE = 0x01
+FALLOC_FL_PUNCH_HOLE = 0x02
+
+def fallocate(fd, mode, offset, length):
+    libc = ctypes.CDLL(None, use_errno=True)
+    libc.fallocate.argtypes = [ ctypes.c_int, ctypes.c_int,
+                                ctypes.c_int64, ctypes.c_int64 ]
+    if libc.fallocate(fd, mode, offset, length) != 0:
+        err = ctypes.get_errno()
+        raise OSError(err, os.strerror(err))
+
 def name_generator(__ctr=[0]):
     __ctr[0] += 1
     return 'testfile_%d' % __ctr[0]
@@ -110,9 +124,60 @@ def test_hello(tmpdir, name, options, cmdline_builder, output_checker):
     else:
         umount(mount_process, mnt_dir)
 
+@pytest.mark.skipif(not os.path.exists(pjoin(basename, 'example', 'hello_coro')),
+                    reason='hello_coro not built (-Dcoroutines=false)')
+@pytest.mark.parametrize("options", powerset(options))
+def test_hello_coro(tmpdir, options, output_checker):
+    mnt_dir = str(tmpdir)
+    mount_process = subprocess.Popen(
+        invoke_directly(mnt_dir, 'hello_coro', options),
+        stdout=output_checker.fd, stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        assert os.listdir(mnt_dir) == [ 'hello' ]
+        filename = pjoin(mnt_dir, 'hello')
+        for _ in range(10):
+            with open(filename, 'r') as fh:
+                assert fh.read() == 'Hello World!\n'
+        with open(filename, 'rb') as fh:
+            fh.seek(6)
+            assert fh.read() == b'World!\n'
+        with pytest.raises(IOError) as exc_info:
+            open(filename, 'r+')
+        assert exc_info.value.errno == errno.EACCES
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+@pytest.mark.parametrize("pool", (('min_threads=2', 'max_threads=2'),
+                                  ('max_threads=4', 'idle_timeout=100'),
+                                  ('affinity=cpu', 'clone_fd')))
+def test_hello_thread_pool(tmpdir, pool, output_checker):
+    mnt_dir = str(tmpdir)
+    mount_process = subprocess.Popen(
+        invoke_directly(mnt_dir, 'hello', pool),
+        stdout=output_checker.fd, stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        filename = pjoin(mnt_dir, 'hello')
+        for _ in range(10):
+            with open(filename, 'r') as fh:
+                assert fh.read() == 'Hello World!\n'
+        # Let idle workers time out and make sure the survivors still serve
+        safe_sleep(0.3)
+        assert os.listdir(mnt_dir) == [ 'hello' ]
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
 @pytest.mark.parametrize("writeback", (False, True))
 @pytest.mark.parametrize("name", ('passthrough', 'passthrough_plus',
-                           'passthrough_fh', 'passthrough_ll'))
+                           'passthrough_fh', 'passthrough_async',
+                           'passthrough_ll'))
 @pytest.mark.parametrize("debug", (False, True))
 def test_passthrough(short_tmpdir, name, debug, output_checker, writeback):
     # Avoid false positives from libfuse debug messages
@@ -131,6 +196,10 @@ def test_passthrough(short_tmpdir, name, debug, output_checker, writeback):
         cmdline = base_cmdline + \
                   [ pjoin(basename, 'example', 'passthrough'),
                     '--plus', '-f', mnt_dir ]
+    elif name == 'passthrough_async':
+        cmdline = base_cmdline + \
+                  [ pjoin(basename, 'example', 'passthrough_fh'),
+                    '--async', '-f', mnt_dir ]
     else:
         cmdline = base_cmdline + \
                   [ pjoin(basename, 'example', name),
@@ -188,8 +257,162 @@ def test_passthrough(short_tmpdir, name, debug, output_checker, writeback):
     else:
         umount(mount_process, mnt_dir)
 
+@pytest.mark.skipif(sys.platform != 'linux', reason='io_uring is Linux only')
+@pytest.mark.parametrize("options", ('io_uring,uring_depth=4',
+                                     'reply_batch=16', 'mmap',
+                                     'io_uring,uring_depth=4,mmap'))
+def test_passthrough_io_uring(short_tmpdir, options, output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'passthrough_ll'),
+                '-f', '-s', '-o', options, mnt_dir ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        work_dir = mnt_dir + src_dir
+
+        tst_readdir(src_dir, work_dir)
+        tst_readdir_big(src_dir, work_dir)
+        tst_open_read(src_dir, work_dir)
+        tst_open_write(src_dir, work_dir)
+        tst_create(work_dir)
+        tst_passthrough(src_dir, work_dir)
+        tst_mkdir(work_dir)
+        tst_rmdir(work_dir, src_dir)
+        tst_unlink(work_dir, src_dir)
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+# hello compares the paths it gets, so a malformed one is not let through
+def test_hello_path_cache(tmpdir, output_checker):
+    mnt_dir = str(tmpdir)
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'hello'),
+                '-f', '-o', 'path_cache', mnt_dir ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        filename = pjoin(mnt_dir, 'hello')
+        for _ in range(3):
+            assert os.listdir(mnt_dir) == [ 'hello' ]
+            with open(filename, 'r') as fh:
+                assert fh.read() == 'Hello World!\n'
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+@pytest.mark.parametrize("path_cache", (False, True))
+def test_passthrough_subdir(short_tmpdir, path_cache, output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'passthrough_fh'),
+                '-f', '-o', 'modules=subdir,subdir=' + src_dir, mnt_dir ]
+    if path_cache:
+        cmdline += [ '-o', 'path_cache' ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        work_dir = mnt_dir
+
+        tst_readdir(src_dir, work_dir)
+        tst_open_read(src_dir, work_dir)
+        tst_create(work_dir)
+        tst_mkdir(work_dir)
+        tst_rmdir(work_dir, src_dir)
+        tst_unlink(work_dir, src_dir)
+        tst_rename_dir(work_dir)
+        tst_link(work_dir)
+        tst_open_unlink(work_dir)
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+def tst_syscalls(src_dir, mnt_dir):
+    subprocess.check_call([ os.path.join(basename, 'test', 'test_syscalls'),
+                            mnt_dir, ':' + src_dir ])
+
+# Options of the high-level library, and the checks that exercise them
+@pytest.mark.parametrize("args,options,checks", (
+    pytest.param(('passthrough_fh',), 'path_cache',
+                 ('readdir', 'open_read', 'create', 'mkdir',
+                  'rmdir', 'unlink', 'rename_dir', 'open_unlink',
+                  'syscalls'), id='path_cache'),
+    pytest.param(('passthrough',), 'readdir_cache,ac_attr_timeout=0',
+                 ('readdir', 'readdir_big', 'readdir_cached',
+                  'create', 'unlink'), id='readdir_cache'),
+    pytest.param(('passthrough',), 'negative_cache=60',
+                 ('negative_cached', 'create', 'mkdir', 'unlink'),
+                 id='negative_cache'),
+    pytest.param(('passthrough',), 'attr_timeout=0,attr_cache=60',
+                 ('attr_cached', 'chown', 'link', 'truncate_path',
+                  'truncate_fd', 'utimens', 'rename_dir',
+                  'open_unlink'), id='attr_cache'),
+    *(pytest.param(('passthrough',), options,
+                   ('readdir_big', 'create', 'mkdir', 'rmdir',
+                    'unlink', 'rename_dir'), id=options)
+      for options in ('slab_size=65536', 'slab_hugepage',
+                      'remember=30,node_mem_max=1048576')),
+    pytest.param(('passthrough',),
+                 'write_coalesce=65536,write_coalesce_delay=0.1',
+                 ('write_coalesced', 'open_write', 'append', 'seek',
+                  'copy_file_range', 'truncate_path', 'truncate_fd'),
+                 id='write_coalesce'),
+    pytest.param(('passthrough',), 'readahead=65536,readahead_threads=2',
+                 ('read_ahead', 'open_read', 'seek',
+                  'copy_file_range', 'truncate_fd'), id='readahead'),
+    # Requests are held by the I/O threads until they are answered
+    *(pytest.param(('passthrough_fh', '--async'), options,
+                   ('parallel_io', 'open_read', 'open_write',
+                    'passthrough', 'readdir_big', 'truncate_fd'),
+                   id=options)
+      for options in ('max_inflight=1',
+                      'max_inflight=2,max_inflight_bytes=65536'))))
+def test_passthrough_options(short_tmpdir, args, options, checks,
+                             output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', args[0]), *args[1:],
+                '-f', '-o', options, mnt_dir ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        dirs = { 'src_dir': src_dir, 'mnt_dir': mnt_dir + src_dir }
+
+        # Each check is given the directories it takes
+        for name in checks:
+            check = globals()['tst_' + name]
+            params = inspect.signature(check).parameters
+            check(**{ k: v for (k, v) in dirs.items() if k in params })
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
 @pytest.mark.parametrize("cache", (False, True))
-def test_passthrough_hp(short_tmpdir, cache, output_checker):
+@pytest.mark.parametrize("readdirplus_threads", (0, 4))
+@pytest.mark.parametrize("bulk_threads,receivers,fsync_threads",
+                         ((0, 0, 0), (1, 0, 0), (0, 2, 0), (0, 0, 4)))
+def test_passthrough_hp(short_tmpdir, cache, readdirplus_threads,
+                        bulk_threads, receivers, fsync_threads,
+                        output_checker):
     mnt_dir = str(short_tmpdir.mkdir('mnt'))
     src_dir = str(short_tmpdir.mkdir('src'))
 
@@ -199,7 +422,15 @@ def test_passthrough_hp(short_tmpdir, cache, output_checker):
 
     if not cache:
         cmdline.append('--nocache')
-        
+    if readdirplus_threads:
+        cmdline.append('--readdirplus-threads=%d' % readdirplus_threads)
+    if bulk_threads:
+        cmdline.append('--bulk-threads=%d' % bulk_threads)
+    if receivers:
+        cmdline.append('--receivers=%d' % receivers)
+    if fsync_threads:
+        cmdline.append('--fsync-threads=%d' % fsync_threads)
+
     mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
                                      stderr=output_checker.fd)
     try:
@@ -215,6 +446,9 @@ def test_passthrough_hp(short_tmpdir, cache, output_checker):
             tst_passthrough(src_dir, mnt_dir)
         tst_append(src_dir, mnt_dir)
         tst_seek(src_dir, mnt_dir)
+        tst_copy_file_range(mnt_dir)
+        tst_seek_hole(mnt_dir)
+        tst_parallel_fsync(mnt_dir)
         tst_mkdir(mnt_dir)
         if cache:
             # if cache is enabled, no operations should go through
@@ -331,7 +565,7 @@ def test_null(tmpdir, output_checker):
 
 @pytest.mark.skipif(fuse_proto < (7,12),
                     reason='not supported by running kernel')
-@pytest.mark.parametrize("notify", (True, False))
+@pytest.mark.parametrize("notify", (True, False, 'batch', 'queue'))
 def test_notify_inval_entry(tmpdir, notify, output_checker):
     mnt_dir = str(tmpdir)
     cmdline = base_cmdline + \
@@ -340,6 +574,8 @@ def test_notify_inval_entry(tmpdir, notify, output_checker):
                 '--timeout=5', mnt_dir ]
     if not notify:
         cmdline.append('--no-notify')
+    elif notify in ('batch', 'queue'):
+        cmdline.append('--' + notify)
     mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
                                      stderr=output_checker.fd)
     try:
@@ -367,7 +603,8 @@ def test_notify_inval_entry(tmpdir, notify, output_checker):
 
 @pytest.mark.skipif(os.getuid() != 0,
                     reason='needs to run as root')
-def test_cuse(output_checker):
+@pytest.mark.parametrize("splice", (False, True))
+def test_cuse(output_checker, splice):
 
     # Valgrind warns about unknown ioctls, that's ok
     output_checker.register_output(r'^==([0-9]+).+unhandled ioctl.+\n'
@@ -379,6 +616,8 @@ def test_cuse(output_checker):
     cmdline = base_cmdline + \
               [ pjoin(basename, 'example', 'cuse'),
                 '-f', '--name=%s' % devname ]
+    if splice:
+        cmdline.append('--splice')
     mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
                                      stderr=output_checker.fd)
 
@@ -401,6 +640,13 @@ def test_cuse(output_checker):
         out = subprocess.check_output(
             cmdline + [ 'r', str(off + len(data) + 2), '0' ])
         assert out == (b'\0' * off) + data
+
+        # Large enough to be spliced both ways
+        data = os.urandom(4 * os.sysconf('SC_PAGE_SIZE'))
+        with os_open(devpath, os.O_RDWR) as fd:
+            assert os.write(fd, data) == len(data)
+        with os_open(devpath, os.O_RDONLY) as fd:
+            assert os.read(fd, len(data)) == data
     finally:
         mount_process.terminate()
 
@@ -455,6 +701,30 @@ def tst_rmdir(mnt_dir, src_dir=None):
     assert exc_info.value.errno == errno.ENOENT
     assert name not in os.listdir(mnt_dir)
 
+def tst_rename_dir(mnt_dir):
+    top = pjoin(mnt_dir, name_generator())
+    deep = pjoin(top, 'a', 'b', 'c', 'd')
+    os.makedirs(deep)
+    with open(pjoin(deep, 'file'), 'w') as fh:
+        fh.write('contents')
+    assert os.listdir(deep) == [ 'file' ]
+
+    # Paths below the renamed directory must not be resolved to the
+    # old location
+    os.rename(pjoin(top, 'a', 'b'), pjoin(top, 'a', 'B'))
+    deep = pjoin(top, 'a', 'B', 'c', 'd')
+    with open(pjoin(deep, 'file'), 'r') as fh:
+        assert fh.read() == 'contents'
+    assert not os.path.exists(pjoin(top, 'a', 'b'))
+
+    os.rename(pjoin(deep, 'file'), pjoin(top, 'moved'))
+    assert os.listdir(deep) == []
+    with open(pjoin(top, 'moved'), 'r') as fh:
+        assert fh.read() == 'contents'
+
+    os.unlink(pjoin(top, 'moved'))
+    shutil.rmtree(top)
+
 def tst_symlink(mnt_dir):
     linkname = name_generator()
     fullname = mnt_dir + "/" + linkname
@@ -545,6 +815,134 @@ def tst_seek(src_dir, mnt_dir):
     with open(fullname, 'rb') as fh:
         assert fh.read() == b'\0foocom\n'
         
+def tst_write_coalesced(src_dir, mnt_dir):
+    name = name_generator()
+    data = os.urandom(4096 * 24)
+    with os_open(pjoin(mnt_dir, name), os.O_WRONLY | os.O_CREAT) as fd:
+        for i in range(0, len(data), 4096):
+            os.write(fd, data[i:i+4096])
+        # Seen through the mount right away, and underneath once
+        # the buffer has been written out
+        assert os.fstat(fd).st_size == len(data)
+        time.sleep(0.5)
+        with open(pjoin(src_dir, name), 'rb') as fh:
+            assert fh.read() == data
+        os.pwrite(fd, b'x' * 100, 10)
+    with open(pjoin(src_dir, name), 'rb') as fh:
+        assert fh.read() == data[:10] + b'x' * 100 + data[110:]
+
+def tst_read_ahead(src_dir, mnt_dir):
+    name = name_generator()
+    data = bytearray(os.urandom(1024 * 1024 + 17))
+    with open(pjoin(src_dir, name), 'wb') as fh:
+        fh.write(data)
+
+    # Reads that were read ahead see later writes through other handles
+    with os_open(pjoin(mnt_dir, name), os.O_RDONLY) as fd, \
+         os_open(pjoin(mnt_dir, name), os.O_WRONLY) as wfd:
+        pos = 0
+        while pos < len(data):
+            buf = os.pread(fd, 65536, pos)
+            assert buf == data[pos:pos+65536]
+            if pos == 65536 * 4:
+                os.pwrite(wfd, b'x' * 100, pos + 65536)
+                data[pos+65536:pos+65636] = b'x' * 100
+            pos += len(buf)
+
+def tst_parallel_io(src_dir, mnt_dir, count=8):
+    names = [ name_generator() for i in range(count) ]
+    data = [ os.urandom(256 * 1024 + i) for i in range(count) ]
+    for (name, buf) in zip(names, data):
+        with open(pjoin(src_dir, name), 'wb') as fh:
+            fh.write(buf)
+
+    # More requests at once than the daemon takes in
+    read = [ None ] * count
+    def worker(i):
+        with os_open(pjoin(mnt_dir, names[i]), os.O_RDWR) as fd:
+            read[i] = os.pread(fd, len(data[i]), 0)
+            os.pwrite(fd, data[i][::-1], 0)
+    threads = [ threading.Thread(target=worker, args=(i,))
+                for i in range(count) ]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    for (name, buf, got) in zip(names, data, read):
+        assert got == buf
+        with open(pjoin(src_dir, name), 'rb') as fh:
+            assert fh.read() == buf[::-1]
+
+def tst_parallel_fsync(mnt_dir, count=8):
+    names = [ pjoin(mnt_dir, name_generator()) for i in range(count // 2) ]
+    data = os.urandom(4096)
+
+    # Two threads per file
+    def worker(i):
+        with os_open(names[i // 2], os.O_WRONLY | os.O_CREAT) as fd:
+            for j in range(4):
+                os.pwrite(fd, data, j * len(data))
+                if j % 2:
+                    os.fdatasync(fd)
+                else:
+                    os.fsync(fd)
+    threads = [ threading.Thread(target=worker, args=(i,))
+                for i in range(count) ]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    with os_open(mnt_dir, os.O_RDONLY) as fd:
+        os.fsync(fd)
+    for name in names:
+        with open(name, 'rb') as fh:
+            assert fh.read() == data * 4
+
+def tst_copy_file_range(mnt_dir):
+    if not hasattr(os, 'copy_file_range'):
+        return
+    data = os.urandom(3 * 1024 * 1024 + 17)
+    name1 = pjoin(mnt_dir, name_generator())
+    name2 = pjoin(mnt_dir, name_generator())
+    with open(name1, 'wb') as fh:
+        fh.write(data)
+    with os_open(name1, os.O_RDONLY) as fd_in, \
+         os_open(name2, os.O_WRONLY | os.O_CREAT) as fd_out:
+        done = 0
+        while done < len(data):
+            res = os.copy_file_range(fd_in, fd_out, len(data) - done,
+                                     done, done + 10)
+            assert res > 0
+            done += res
+    with open(name2, 'rb') as fh:
+        assert fh.read() == b'\0' * 10 + data
+
+def tst_seek_hole(mnt_dir):
+    name = pjoin(mnt_dir, name_generator())
+    with os_open(name, os.O_RDWR | os.O_CREAT) as fd:
+        os.pwrite(fd, b'x' * 65536, 0)
+        os.ftruncate(fd, 1024 * 1024)
+        # The kernel does not write back cached data before lseek
+        os.fsync(fd)
+        # May land at the end of the file if the backing file system
+        # does not track holes
+        hole = os.lseek(fd, 0, os.SEEK_HOLE)
+        assert 65536 <= hole <= 1024 * 1024
+        assert os.lseek(fd, 0, os.SEEK_DATA) == 0
+
+        try:
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      0, 65536)
+        except OSError as exc:
+            if exc.errno != errno.EOPNOTSUPP:
+                raise
+            return
+        assert os.pread(fd, 16, 0) == b'\0' * 16
+        assert os.fstat(fd).st_size == 1024 * 1024
+        assert os.lseek(fd, 0, os.SEEK_HOLE) == 0
+
 def tst_open_unlink(mnt_dir):
     name = pjoin(mnt_dir, name_generator())
     data1 = b'foo'
@@ -633,6 +1031,97 @@ def tst_readdir(src_dir, mnt_dir):
     os.rmdir(subdir)
     os.rmdir(src_newdir)
 
+def tst_readdir_cached(src_dir, mnt_dir):
+    newdir = name_generator()
+    src_newdir = pjoin(src_dir, newdir)
+    mnt_newdir = pjoin(mnt_dir, newdir)
+    os.mkdir(src_newdir)
+    names = sorted('file%d' % i for i in range(100))
+    for name in names:
+        with open(pjoin(src_newdir, name), 'w'):
+            pass
+
+    # Repeated listings, changes made through the mount point and
+    # changes made behind its back must all be visible
+    assert sorted(os.listdir(mnt_newdir)) == names
+    assert sorted(os.listdir(mnt_newdir)) == names
+
+    os.unlink(pjoin(mnt_newdir, names[0]))
+    os.rename(pjoin(mnt_newdir, names[1]), pjoin(mnt_newdir, 'renamed'))
+    with open(pjoin(mnt_newdir, 'created'), 'w'):
+        pass
+    assert sorted(os.listdir(mnt_newdir)) == sorted(os.listdir(src_newdir))
+
+    with open(pjoin(src_newdir, 'external'), 'w'):
+        pass
+    assert 'external' in os.listdir(mnt_newdir)
+
+    for name in os.listdir(src_newdir):
+        os.unlink(pjoin(src_newdir, name))
+    os.rmdir(src_newdir)
+
+def tst_negative_cached(mnt_dir):
+    names = [ name_generator() for i in range(6) ]
+    target = pjoin(mnt_dir, name_generator())
+    with open(target, 'w'):
+        pass
+
+    # Names that were looked up before must show up once they are
+    # created through the mount point
+    for name in names:
+        assert not os.path.exists(pjoin(mnt_dir, name))
+        assert not os.path.exists(pjoin(mnt_dir, name))
+    paths = [ pjoin(mnt_dir, name) for name in names ]
+    with open(paths[0], 'w'):
+        pass
+    os.mkdir(paths[1])
+    os.symlink(target, paths[2])
+    os.link(target, paths[3])
+    os.mkfifo(paths[4])
+    tmp = pjoin(mnt_dir, name_generator())
+    with open(tmp, 'w'):
+        pass
+    os.rename(tmp, paths[5])
+    for path in paths:
+        assert os.path.lexists(path)
+
+    os.rmdir(paths[1])
+    for path in paths[:1] + paths[2:] + [ target ]:
+        os.unlink(path)
+
+def tst_attr_cached(mnt_dir):
+    name = name_generator()
+    path = pjoin(mnt_dir, name)
+    with open(path, 'wb') as fh:
+        fh.write(b'x' * 100)
+    os.chmod(path, 0o644)
+    assert os.stat(path).st_mode & 0o777 == 0o644
+
+    # Cached attributes follow the changes made through the mount point
+    os.chmod(path, 0o640)
+    assert os.stat(path).st_mode & 0o777 == 0o640
+    with open(path, 'ab') as fh:
+        fh.write(b'y' * 50)
+    assert os.stat(path).st_size == 150
+    os.truncate(path, 10)
+    assert os.stat(path).st_size == 10
+    os.utime(path, (1500000000, 1500000000))
+    assert os.stat(path).st_mtime == 1500000000
+
+    link = pjoin(mnt_dir, name_generator())
+    os.link(path, link)
+    assert os.stat(path).st_nlink == 2
+    os.unlink(link)
+    assert os.stat(path).st_nlink == 1
+
+    subdir = pjoin(mnt_dir, name_generator())
+    nlink = os.stat(mnt_dir).st_nlink
+    os.mkdir(subdir)
+    assert os.stat(mnt_dir).st_nlink == nlink + 1
+    os.rmdir(subdir)
+    assert os.stat(mnt_dir).st_nlink == nlink
+    os.unlink(path)
+
 def tst_readdir_big(src_dir, mnt_dir):
 
     # Add enough entries so that readdir needs to be called
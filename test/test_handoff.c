@@ -0,0 +1,274 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Hands a mounted session over to a second process, and checks that
+  the file opened before is served by that process without a new
+  lookup or INIT.
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+
+#define FUSE_USE_VERSION 35
+
+#include <config.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifndef __linux__
+#include <limits.h>
+#else
+#include <linux/limits.h>
+#endif
+
+#define FILE_INO 2
+#define FILE_NAME "generation"
+
+/* 1 in the process that mounts, 2 in the one that takes over */
+static int generation;
+static int got_init;
+
+static void tfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+
+    got_init++;
+    /* The successor sees what the first process negotiated */
+    assert(conn->proto_major == 7 && conn->max_write > 0);
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+        conn->want |= FUSE_CAP_ASYNC_READ;
+}
+
+static int tfs_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+    stbuf->st_ino = ino;
+    if (ino == FUSE_ROOT_ID) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 1;
+    } else if (ino == FILE_INO) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 2;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void tfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(e));
+    if (parent != FUSE_ROOT_ID || strcmp(name, FILE_NAME) != 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    /* The successor must not be asked again */
+    assert(generation == 1);
+    e.ino = FILE_INO;
+    e.entry_timeout = 3600;
+    e.attr_timeout = 3600;
+    tfs_stat(e.ino, &e.attr);
+    fuse_reply_entry(req, &e);
+}
+
+static void tfs_getattr(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+
+    (void) fi;
+
+    memset(&stbuf, 0, sizeof(stbuf));
+    if (tfs_stat(ino, &stbuf) != 0)
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_attr(req, &stbuf, 0);
+}
+
+static void tfs_open(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi)
+{
+    if (ino == FUSE_ROOT_ID) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+    assert(ino == FILE_INO);
+    /* Every read has to come to the daemon */
+    fi->direct_io = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void tfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                     off_t off, struct fuse_file_info *fi)
+{
+    char buf[3];
+
+    (void) fi;
+
+    assert(ino == FILE_INO);
+    snprintf(buf, sizeof(buf), "%d\n", generation);
+    if (off >= 2)
+        fuse_reply_buf(req, NULL, 0);
+    else
+        fuse_reply_buf(req, buf + off, size < 2 - off ? size : 2 - off);
+}
+
+static struct fuse_lowlevel_ops tfs_oper = {
+    .init       = tfs_init,
+    .lookup     = tfs_lookup,
+    .getattr    = tfs_getattr,
+    .open       = tfs_open,
+    .read       = tfs_read,
+};
+
+static void *run_fs(void *data)
+{
+    struct fuse_session *se = (struct fuse_session *) data;
+    struct fuse_loop_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.max_idle_threads = 10;
+    assert(fuse_session_loop_mt(se, &config) == 0);
+    return NULL;
+}
+
+/* Wakes up the loop, whichever process ends up answering */
+static void *poke_fs(void *data)
+{
+    struct stat st;
+
+    stat((const char *) data, &st);
+    return NULL;
+}
+
+static void check_file(const char *mountpoint, int expected)
+{
+    char fname[PATH_MAX];
+    char buf[16];
+    ssize_t res;
+    int fd;
+
+    assert(snprintf(fname, PATH_MAX, "%s/" FILE_NAME, mountpoint) > 0);
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        perror(fname);
+        assert(0);
+    }
+    res = read(fd, buf, sizeof(buf) - 1);
+    assert(res == 2);
+    buf[res] = '\0';
+    if (atoi(buf) != expected) {
+        fprintf(stderr, "ERROR: read generation %s, expected %d\n",
+                buf, expected);
+        assert(0);
+    }
+    close(fd);
+}
+
+/* Takes over the mount, and serves it until SIGTERM */
+static int successor(struct fuse_args *args, int sock)
+{
+    struct fuse_session *se;
+    struct fuse_loop_config config;
+
+    generation = 2;
+    se = fuse_session_new(args, &tfs_oper, sizeof(tfs_oper), NULL);
+    assert(se != NULL);
+    assert(fuse_set_signal_handlers(se) == 0);
+    assert(fuse_session_takeover(se, sock) == 0);
+    close(sock);
+    assert(got_init == 1);
+
+    memset(&config, 0, sizeof(config));
+    config.clone_fd = 1;
+    config.max_idle_threads = 10;
+    /* Ended by SIGTERM */
+    assert(fuse_session_loop_mt(se, &config) == SIGTERM);
+
+    fuse_session_unmount(se);
+    fuse_remove_signal_handlers(se);
+    fuse_session_destroy(se);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts fuse_opts;
+    struct fuse_session *se;
+    pthread_t fs_thread, poke_thread;
+    int sv[2];
+    int status;
+    pid_t pid;
+
+    assert(fuse_parse_cmdline(&args, &fuse_opts) == 0);
+    assert(fuse_opts.mountpoint != NULL);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        close(sv[0]);
+        free(fuse_opts.mountpoint);
+        exit(successor(&args, sv[1]));
+    }
+    close(sv[1]);
+
+    generation = 1;
+    se = fuse_session_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+    fuse_opt_free_args(&args);
+    assert(se != NULL);
+    assert(fuse_session_mount(se, fuse_opts.mountpoint) == 0);
+    assert(pthread_create(&fs_thread, NULL, run_fs, (void *) se) == 0);
+
+    check_file(fuse_opts.mountpoint, 1);
+
+    /* Stop the loop, a request has to come in to notice */
+    fuse_session_exit(se);
+    assert(pthread_create(&poke_thread, NULL, poke_fs,
+                          fuse_opts.mountpoint) == 0);
+    assert(pthread_join(fs_thread, NULL) == 0);
+
+    assert(fuse_session_handoff(se, sv[0]) == 0);
+    close(sv[0]);
+    assert(pthread_join(poke_thread, NULL) == 0);
+
+    /* Does nothing now */
+    fuse_session_unmount(se);
+    fuse_session_destroy(se);
+    assert(got_init == 1);
+
+    check_file(fuse_opts.mountpoint, 2);
+
+    /* The successor unmounts */
+    assert(kill(pid, SIGTERM) == 0);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    free(fuse_opts.mountpoint);
+
+    printf("Test completed successfully.\n");
+    return 0;
+}
+
+
+/**
+ * Local Variables:
+ * mode: c
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * End:
+ */
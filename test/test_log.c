@@ -0,0 +1,130 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Checks that asynchronous logging passes on every message of every
+  thread, in order, and counts the messages it has to drop.
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 35
+
+#include "config.h"
+#include <fuse_log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define MESSAGES 10000
+
+static pthread_t main_thread;
+static int failed;
+static int next[THREADS];
+static int received;
+static int dropped;
+static int sync_seen;
+
+static void log_handler(enum fuse_log_level level, const char *fmt,
+			va_list ap)
+{
+	char msg[128];
+	int t, n;
+
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	if (pthread_equal(pthread_self(), main_thread)) {
+		/* Only the message logged while not async */
+		sync_seen++;
+		return;
+	}
+	if (sscanf(msg, "fuse: %d log messages dropped", &n) == 1) {
+		if (level != FUSE_LOG_WARNING)
+			failed = 1;
+		dropped += n;
+		return;
+	}
+	if (sscanf(msg, "thread %d message %d", &t, &n) != 2 ||
+	    t < 0 || t >= THREADS || level != FUSE_LOG_DEBUG) {
+		fprintf(stderr, "unexpected message: %s", msg);
+		failed = 1;
+		return;
+	}
+	/* Messages may be dropped, but never reordered */
+	if (n < next[t]) {
+		fprintf(stderr, "thread %d: got %d after %d\n", t, n,
+			next[t] - 1);
+		failed = 1;
+	}
+	next[t] = n + 1;
+	received++;
+}
+
+static void *logger(void *data)
+{
+	int t = (long) data;
+	int i;
+
+	for (i = 0; i < MESSAGES; i++)
+		fuse_log(FUSE_LOG_DEBUG, "thread %d message %d\n", t, i);
+	return NULL;
+}
+
+static int run(size_t size)
+{
+	pthread_t threads[THREADS];
+	long t;
+
+	memset(next, 0, sizeof(next));
+	received = 0;
+	dropped = 0;
+	sync_seen = 0;
+
+	if (fuse_log_start_async(size) != 0) {
+		fprintf(stderr, "fuse_log_start_async failed\n");
+		return -1;
+	}
+	for (t = 0; t < THREADS; t++)
+		pthread_create(&threads[t], NULL, logger, (void *) t);
+	for (t = 0; t < THREADS; t++)
+		pthread_join(threads[t], NULL);
+	fuse_log_stop_async();
+	fuse_log(FUSE_LOG_DEBUG, "synchronous\n");
+
+	if (received + dropped != THREADS * MESSAGES) {
+		fprintf(stderr, "%d messages received, %d dropped\n",
+			received, dropped);
+		failed = 1;
+	}
+	if (sync_seen != 1) {
+		fprintf(stderr, "synchronous message not seen\n");
+		failed = 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	main_thread = pthread_self();
+	fuse_set_log_func(log_handler);
+
+	/* Large enough to keep everything */
+	if (run(MESSAGES * 64) != 0)
+		return 1;
+	if (dropped) {
+		fprintf(stderr, "%d messages dropped\n", dropped);
+		failed = 1;
+	}
+
+	/* Small rings drop messages, but the count is reported */
+	if (run(0) != 0)
+		return 1;
+
+	if (failed) {
+		fprintf(stderr, "test_log: FAILED\n");
+		return 1;
+	}
+	printf("test_log: PASSED\n");
+	return 0;
+}
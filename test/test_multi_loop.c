@@ -0,0 +1,302 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  Serves several mounts with one fuse_multi_loop. Checks that a mount
+  whose requests block does not hold up the others, and that sessions
+  are handed back when they are removed and when the loop ends.
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 35
+
+#include "config.h"
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef __linux__
+#include <limits.h>
+#else
+#include <linux/limits.h>
+#endif
+
+#define NUM_MOUNTS 4
+#define FILE_INO 2
+#define SLOW_INO 3
+/* Time a read of the slow file takes */
+#define SLOW_MS 300
+
+struct mount {
+	int index;
+	char path[PATH_MAX];
+	struct fuse_session *se;
+	int done;
+	int err;
+};
+
+static struct mount mounts[NUM_MOUNTS];
+static struct fuse_multi_loop *loop;
+static int failed;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%i: %s failed\n", __func__,		\
+			__LINE__, #cond);				\
+		failed = 1;						\
+	}								\
+} while (0)
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void tfs_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = ino;
+	stbuf->st_nlink = 1;
+	if (ino == FUSE_ROOT_ID) {
+		stbuf->st_mode = S_IFDIR | 0755;
+	} else {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_size = 2;
+	}
+}
+
+static void tfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(e));
+	if (parent != FUSE_ROOT_ID) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (strcmp(name, "file") == 0)
+		e.ino = FILE_INO;
+	else if (strcmp(name, "slow") == 0)
+		e.ino = SLOW_INO;
+	else {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	tfs_stat(e.ino, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+static void tfs_getattr(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+
+	(void) fi;
+
+	tfs_stat(ino, &stbuf);
+	fuse_reply_attr(req, &stbuf, 0);
+}
+
+static void tfs_open(fuse_req_t req, fuse_ino_t ino,
+		     struct fuse_file_info *fi)
+{
+	if (ino == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	/* Every read has to come to the daemon */
+	fi->direct_io = 1;
+	fuse_reply_open(req, fi);
+}
+
+static void tfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		     off_t off, struct fuse_file_info *fi)
+{
+	struct mount *m = fuse_req_userdata(req);
+	char buf[3];
+
+	(void) fi;
+
+	if (ino == SLOW_INO)
+		usleep(SLOW_MS * 1000);
+	snprintf(buf, sizeof(buf), "%d\n", m->index);
+	if (off >= 2)
+		fuse_reply_buf(req, NULL, 0);
+	else
+		fuse_reply_buf(req, buf + off, size < 2 - off ? size : 2 - off);
+}
+
+static const struct fuse_lowlevel_ops tfs_oper = {
+	.lookup		= tfs_lookup,
+	.getattr	= tfs_getattr,
+	.open		= tfs_open,
+	.read		= tfs_read,
+};
+
+static void session_done(struct fuse_session *se, int err, void *data)
+{
+	struct mount *m = data;
+
+	check(se == m->se);
+	m->done++;
+	m->err = err;
+}
+
+/* Returns the index read from the file, or -1 */
+static int read_file(struct mount *m, const char *name)
+{
+	char path[PATH_MAX + 8];
+	char buf[8];
+	ssize_t res;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", m->path, name);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	res = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (res != 2)
+		return -1;
+	buf[res] = '\0';
+	return atoi(buf);
+}
+
+static void *read_slow(void *data)
+{
+	check(read_file(data, "slow") == 0);
+	return NULL;
+}
+
+static void *run_loop(void *data)
+{
+	int *res = data;
+
+	*res = fuse_multi_loop_run(loop);
+	return NULL;
+}
+
+static void mount_all(const char *base)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct mount *m;
+	int i;
+
+	fuse_opt_add_arg(&args, "test_multi_loop");
+	for (i = 0; i < NUM_MOUNTS; i++) {
+		m = &mounts[i];
+		m->index = i;
+		snprintf(m->path, sizeof(m->path), "%s/m%d", base, i);
+		if (mkdir(m->path, 0755) == -1 && errno != EEXIST) {
+			perror(m->path);
+			exit(1);
+		}
+		m->se = fuse_session_new(&args, &tfs_oper, sizeof(tfs_oper),
+					 m);
+		if (m->se == NULL || fuse_session_mount(m->se, m->path) != 0) {
+			fprintf(stderr, "failed to mount %s\n", m->path);
+			exit(1);
+		}
+		check(fuse_multi_loop_add(loop, m->se, session_done, m) == 0);
+	}
+	fuse_opt_free_args(&args);
+}
+
+static void unmount(struct mount *m)
+{
+	fuse_session_unmount(m->se);
+	fuse_session_destroy(m->se);
+	rmdir(m->path);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_loop_config config;
+	pthread_t loop_thread, slow[3];
+	uint64_t start;
+	int loop_res = -1;
+	int i;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <directory>\n", argv[0]);
+		return 1;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.max_threads = 2;
+	config.session_threads = 1;
+	loop = fuse_multi_loop_new(&config);
+	if (loop == NULL) {
+		fprintf(stderr, "fuse_multi_loop_new failed\n");
+		return 1;
+	}
+	mount_all(argv[1]);
+	/* Only once */
+	check(fuse_multi_loop_add(loop, mounts[0].se, session_done,
+				  &mounts[0]) == -EINVAL);
+
+	if (pthread_create(&loop_thread, NULL, run_loop, &loop_res) != 0) {
+		fprintf(stderr, "pthread_create failed\n");
+		return 1;
+	}
+	for (i = 0; i < NUM_MOUNTS; i++)
+		check(read_file(&mounts[i], "file") == i);
+
+	/* The slow mount gets one of the two workers, not both */
+	for (i = 0; i < 3; i++)
+		pthread_create(&slow[i], NULL, read_slow, &mounts[0]);
+	usleep(SLOW_MS * 1000 / 4);
+	start = now_ms();
+	check(read_file(&mounts[1], "file") == 1);
+	check(now_ms() - start < SLOW_MS / 2);
+	for (i = 0; i < 3; i++)
+		pthread_join(slow[i], NULL);
+
+	/* Handed back right away, as nothing is in flight */
+	fuse_multi_loop_remove(loop, mounts[2].se);
+	check(mounts[2].done == 1 && mounts[2].err == 0);
+	unmount(&mounts[2]);
+	check(read_file(&mounts[3], "file") == 3);
+
+	/*
+	 * Exited while idle, handed back without another request. The
+	 * RELEASE of the file read above comes asynchronously, so wait
+	 * for it first.
+	 */
+	usleep(100000);
+	fuse_session_exit(mounts[3].se);
+	for (i = 0; i < 100 && !__atomic_load_n(&mounts[3].done,
+						__ATOMIC_ACQUIRE); i++)
+		usleep(10000);
+	check(mounts[3].done == 1 && mounts[3].err == 0);
+
+	fuse_multi_loop_exit(loop);
+	pthread_join(loop_thread, NULL);
+	check(loop_res == 0);
+	for (i = 0; i < NUM_MOUNTS; i++) {
+		check(mounts[i].done == 1 && mounts[i].err == 0);
+		if (i != 2)
+			unmount(&mounts[i]);
+	}
+	fuse_multi_loop_destroy(loop);
+
+	if (failed) {
+		fprintf(stderr, "test_multi_loop: FAILED\n");
+		return 1;
+	}
+	printf("test_multi_loop: PASSED\n");
+	return 0;
+}